@@ -59,6 +59,24 @@ void bitmap_sync_file(unsigned long *bitmap, size_t bitmaplen)
 		err("msync bitmap failed");
 }
 
+/* Write out only the pages of a bitmap file covering bits from start to end. */
+void bitmap_sync_file_range(unsigned long *bitmap, size_t bitmaplen, unsigned long start, unsigned long end)
+{
+	const size_t pgsize = (size_t) getpagesize();
+
+	size_t from = (start / BITS_PER_LONG) * sizeof(unsigned long);
+	size_t to   = (end / BITS_PER_LONG + 1) * sizeof(unsigned long);
+
+	from -= from % pgsize;
+	to = MIN(to, bitmaplen);
+	g_assert(from < to);
+
+	dbg("msync bitmap %p from %zu to %zu", bitmap, from, to);
+	int ret = msync((char *) bitmap + from, to - from, MS_SYNC);
+	if (ret < 0)
+		err("msync bitmap failed");
+}
+
 
 void bitmap_close_file(unsigned long *bitmap, size_t bitmaplen)
 {
@@ -266,6 +284,14 @@ void bitmap_on(unsigned long *bitmap_array, unsigned long block_index)
 	//dbg("set_bitmap %08x", *bitmap);
 }
 
+void bitmap_off(unsigned long *bitmap_array, unsigned long block_index)
+{
+	unsigned long bitmap_index = block_index / BITS_PER_LONG;
+	unsigned long *bitmap = &(bitmap_array[bitmap_index]);
+
+	*bitmap &= ~(1UL << (block_index % BITS_PER_LONG));
+}
+
 
 /* we can make it faster. use __builtin_popcountl()? */
 unsigned long bitmap_popcount(unsigned long *bm, unsigned long nbits)
@@ -37,8 +37,10 @@ unsigned long *bitmap_alloc(unsigned long nbits);
 /* bitmap file operations */
 unsigned long *bitmap_open_file(const char *bitmapfile, unsigned long nbits, size_t *bitmaplen, int readonly, int zeroclear);
 void bitmap_sync_file(unsigned long *bitmap, size_t bitmaplen);
+void bitmap_sync_file_range(unsigned long *bitmap, size_t bitmaplen, unsigned long start, unsigned long end);
 void bitmap_close_file(unsigned long *bitmap, size_t bitmaplen);
 
 int bitmap_test(unsigned long *bitmap, unsigned long block_index);
 void bitmap_on(unsigned long *bitmap, unsigned long block_index);
+void bitmap_off(unsigned long *bitmap, unsigned long block_index);
 unsigned long bitmap_popcount(unsigned long *bitmap, unsigned long bits);
@@ -22,6 +22,7 @@
  */
 
 #include "io.h"
+#include "zero.h"
 
 static void io_all(int fd, void *buf, size_t len, int read_ops)
 {
@@ -374,20 +375,27 @@ void mmap_region_free(struct mmap_region *mr)
 	g_slice_free(struct mmap_region, mr);
 }
 
-void mmap_region_msync(struct mmap_region *mr)
+/* Write out the data of the region. On Linux, this also flushes the disk
+ * cache of the range, like fdatasync(). */
+int mmap_region_msync(struct mmap_region *mr)
 {
 	if (mr->mmap_len) {
 		int ret = msync(mr->mmap_buf, mr->mmap_len, MS_SYNC);
-		if (ret < 0)
+		if (ret < 0) {
 			warn("msync failed, %m");
+			return -1;
+		}
 	}
+
+	return 0;
 }
 
 
 /* We should not enable punch hole in the default settings.  In some use-cases,
  * all the disk blocks may be pre-allocated when created. Punch hole operations
- * will incur fragmentation of allocated disk blocks. */
-void punch_hole(int fd, off_t iofrom, off_t iolen)
+ * will incur fragmentation of allocated disk blocks.
+ * Returning -1 if the file system does not support punch hole. */
+int punch_hole(int fd, off_t iofrom, off_t iolen)
 {
 #ifdef FALLOC_FL_PUNCH_HOLE
 	/* TODO:
@@ -403,9 +411,148 @@ void punch_hole(int fd, off_t iofrom, off_t iolen)
 	int ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, iofrom, iolen);
 	if (ret < 0)
 		warn("fallocate %m");
+
+	return ret;
 #else
 	(void)fd;
 	(void)iofrom;
 	(void)iolen;
+
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+
+static int fallocate_zero(int fd, off_t iofrom, off_t iolen, int punch)
+{
+	int mode;
+
+	if (punch) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+		mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+#else
+		errno = EOPNOTSUPP;
+		return -1;
+#endif
+	} else {
+#ifdef FALLOC_FL_ZERO_RANGE
+		mode = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+#else
+		errno = EOPNOTSUPP;
+		return -1;
 #endif
+	}
+
+	return fallocate(fd, mode, iofrom, iolen);
+}
+
+/*
+ * Zero a range of a file without writing zero data; only the metadata of the
+ * file system is updated. Returning -1 if the file system does not support
+ * it. The caller should then write zero data.
+ */
+int zero_range(int fd, off_t iofrom, off_t iolen, enum zero_range_mode mode)
+{
+	int ret;
+
+	/* fallocate() complains about EINVAL */
+	if (iolen == 0)
+		return 0;
+
+	if (mode == ZERO_RANGE_PUNCH) {
+		ret = fallocate_zero(fd, iofrom, iolen, 1);
+		if (ret == 0)
+			return 0;
+	}
+
+	ret = fallocate_zero(fd, iofrom, iolen, 0);
+	if (ret == 0)
+		return 0;
+
+	if (mode == ZERO_RANGE_MAY_PUNCH) {
+		ret = fallocate_zero(fd, iofrom, iolen, 1);
+		if (ret == 0)
+			return 0;
+	}
+
+	dbg("zeroing offset %jd length %jd by fallocate() failed, %m", iofrom, iolen);
+
+	return -1;
+}
+
+
+/*
+ * Zero the blocks of a file range whose data is all zero, so that they are
+ * not written out; buf holds the data of the range, usually through mmap()
+ * of the file. Only the blocks of blocksize fully in the range are checked.
+ * Their pages in the page cache are dropped. Returns the number of bytes
+ * zeroed, or -1 if the file system does not support zeroing.
+ */
+ssize_t zero_range_of_zero_blocks(int fd, const char *buf, off_t iofrom, size_t iolen, unsigned int blocksize)
+{
+	off_t ioend = iofrom + (off_t) iolen;
+	off_t block_iofrom = (iofrom + blocksize - 1) / blocksize * blocksize;
+	off_t block_ioend  = ioend / blocksize * blocksize;
+	ssize_t zeroed = 0;
+
+	for (off_t pos = block_iofrom; pos < block_ioend; ) {
+		if (!buffer_is_zero(buf + (pos - iofrom), blocksize)) {
+			pos += blocksize;
+			continue;
+		}
+
+		off_t run_ioend = pos + blocksize;
+		while (run_ioend < block_ioend && buffer_is_zero(buf + (run_ioend - iofrom), blocksize))
+			run_ioend += blocksize;
+
+		if (zero_range(fd, pos, run_ioend - pos, ZERO_RANGE_PUNCH) < 0)
+			return -1;
+
+		zeroed += run_ioend - pos;
+		pos = run_ioend;
+	}
+
+	return zeroed;
+}
+
+
+/*
+ * Check whether the region starting at iofrom is a hole or data. The end of
+ * the hole (or data) region, not exceeding ioend, is set to extent_end.
+ * Returns 1 for a hole, and 0 for data. If the file system does not support
+ * SEEK_DATA/SEEK_HOLE, the whole region is considered as data.
+ */
+int get_file_extent(int fd, off_t iofrom, off_t ioend, off_t *extent_end)
+{
+	*extent_end = ioend;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	/*
+	 * lseek() moves the file offset shared with the other threads. I/O
+	 * must be done with pread()/pwrite() or mmap().
+	 */
+	off_t data = lseek(fd, iofrom, SEEK_DATA);
+	if (data < 0) {
+		/* no data after iofrom */
+		if (errno == ENXIO)
+			return 1;
+
+		return 0;
+	}
+
+	if (data > iofrom) {
+		*extent_end = MIN(data, ioend);
+		return 1;
+	}
+
+	off_t hole = lseek(fd, iofrom, SEEK_HOLE);
+	if (hole > iofrom)
+		*extent_end = MIN(hole, ioend);
+#else
+	(void) fd;
+	(void) iofrom;
+#endif
+
+	return 0;
 }
@@ -88,7 +88,18 @@ struct mmap_region {
 
 struct mmap_region *mmap_region_create(int fd, off_t iofrom, size_t iolen, int readonly);
 void mmap_region_free(struct mmap_region *mpinfo);
-void mmap_region_msync(struct mmap_region *mr);
-void punch_hole(int fd, off_t iofrom, off_t iolen);
+int mmap_region_msync(struct mmap_region *mr);
+int punch_hole(int fd, off_t iofrom, off_t iolen);
+
+/* how zero_range() zeroes a range */
+enum zero_range_mode {
+	ZERO_RANGE_ALLOCATED,   /* keep the range allocated */
+	ZERO_RANGE_MAY_PUNCH,   /* punch a hole if zeroing in place is not supported */
+	ZERO_RANGE_PUNCH,       /* punch a hole if supported */
+};
+
+int zero_range(int fd, off_t iofrom, off_t iolen, enum zero_range_mode mode);
+ssize_t zero_range_of_zero_blocks(int fd, const char *buf, off_t iofrom, size_t iolen, unsigned int blocksize);
+int get_file_extent(int fd, off_t iofrom, off_t ioend, off_t *extent_end);
 
 #endif
@@ -0,0 +1,265 @@
+/*
+ * xNBD - an enhanced Network Block Device program
+ *
+ * Copyright (C) 2008-2014 National Institute of Advanced Industrial Science
+ * and Technology
+ *
+ * Author: Takahiro Hirofuchi <t.hirofuchi _at_ aist.go.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "lfqueue.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+/*
+ * The ring buffer is based on the bounded MPMC queue of Dmitry Vyukov. Each
+ * cell has a sequence number telling whether the cell is ready for the next
+ * push or pop at a given position, so that producers and consumers only
+ * contend on their own position counter.
+ */
+
+#define LFQUEUE_SPIN_MIN 16
+#define LFQUEUE_SPIN_MAX 4096
+
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static void futex_wait(uint32_t *addr, uint32_t val)
+{
+	int ret = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+	if (ret < 0 && errno != EAGAIN && errno != EINTR)
+		err("futex wait, %m");
+}
+
+static void futex_wake(uint32_t *addr)
+{
+	int ret = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	if (ret < 0)
+		err("futex wake, %m");
+}
+
+
+static void wake_up(struct lfqueue_waiter *w)
+{
+	/* pairs with the fence in wait_for() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&w->nwaiters, __ATOMIC_RELAXED) == 0)
+		return;
+
+	__atomic_fetch_add(&w->epoch, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&w->epoch);
+}
+
+/* returning 1 if an element was pushed or popped */
+typedef int (*lfqueue_try_func)(struct lfqueue *q, void **data);
+
+static void wait_for(struct lfqueue *q, struct lfqueue_waiter *w, lfqueue_try_func try, void **data)
+{
+	unsigned int spin = __atomic_load_n(&w->spin, __ATOMIC_RELAXED);
+
+	/*
+	 * Spin first. If the other side catches up during spinning, allow
+	 * longer spinning next time. Otherwise, go to sleep sooner.
+	 */
+	for (unsigned int i = 0; i < spin; i++) {
+		if (try(q, data)) {
+			if (spin < LFQUEUE_SPIN_MAX)
+				__atomic_store_n(&w->spin, spin * 2, __ATOMIC_RELAXED);
+			return;
+		}
+		cpu_relax();
+	}
+
+	if (spin > LFQUEUE_SPIN_MIN)
+		__atomic_store_n(&w->spin, spin / 2, __ATOMIC_RELAXED);
+
+	for (;;) {
+		__atomic_fetch_add(&w->nwaiters, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		/*
+		 * Read the epoch before the last try. If the other side
+		 * makes progress after the try, it sees nwaiters > 0 and
+		 * changes the epoch; futex_wait() then returns immediately.
+		 */
+		uint32_t epoch = __atomic_load_n(&w->epoch, __ATOMIC_SEQ_CST);
+
+		int done = try(q, data);
+		if (!done)
+			futex_wait(&w->epoch, epoch);
+
+		__atomic_fetch_sub(&w->nwaiters, 1, __ATOMIC_SEQ_CST);
+
+		if (done || try(q, data))
+			return;
+	}
+}
+
+
+struct lfqueue *lfqueue_new(size_t size)
+{
+	size_t ncells = 2;
+	while (ncells < size)
+		ncells <<= 1;
+
+	struct lfqueue *q;
+	int ret = posix_memalign((void **) &q, LFQUEUE_CACHELINE, sizeof(*q));
+	if (ret)
+		err("posix_memalign, %s", strerror(ret));
+
+	memset(q, 0, sizeof(*q));
+
+	q->cells = g_new(struct lfqueue_cell, ncells);
+	for (size_t i = 0; i < ncells; i++) {
+		q->cells[i].seq  = i;
+		q->cells[i].data = NULL;
+	}
+
+	q->mask = ncells - 1;
+	q->pop_waiter.spin  = LFQUEUE_SPIN_MIN;
+	q->push_waiter.spin = LFQUEUE_SPIN_MIN;
+
+	return q;
+}
+
+void lfqueue_destroy(struct lfqueue *q)
+{
+	g_return_if_fail(q);
+
+	if (lfqueue_length(q))
+		warn("destroy a queue with data");
+
+	g_free(q->cells);
+	free(q);
+}
+
+
+int lfqueue_try_push(struct lfqueue *q, void *data)
+{
+	g_assert(data);
+
+	struct lfqueue_cell *cell;
+	uint64_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t dif = (int64_t) (seq - pos);
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return -1; /* full */
+		else
+			pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+	}
+
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	wake_up(&q->pop_waiter);
+
+	return 0;
+}
+
+void *lfqueue_try_pop(struct lfqueue *q)
+{
+	struct lfqueue_cell *cell;
+	uint64_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t dif = (int64_t) (seq - (pos + 1));
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL; /* empty */
+		else
+			pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	}
+
+	void *data = cell->data;
+	__atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+	wake_up(&q->push_waiter);
+
+	return data;
+}
+
+
+static int try_push_func(struct lfqueue *q, void **data)
+{
+	return lfqueue_try_push(q, *data) == 0;
+}
+
+static int try_pop_func(struct lfqueue *q, void **data)
+{
+	*data = lfqueue_try_pop(q);
+	return *data != NULL;
+}
+
+void lfqueue_push(struct lfqueue *q, void *data)
+{
+	if (lfqueue_try_push(q, data) == 0)
+		return;
+
+	wait_for(q, &q->push_waiter, try_push_func, &data);
+}
+
+void *lfqueue_pop(struct lfqueue *q)
+{
+	void *data = lfqueue_try_pop(q);
+	if (data)
+		return data;
+
+	wait_for(q, &q->pop_waiter, try_pop_func, &data);
+
+	return data;
+}
+
+size_t lfqueue_length(struct lfqueue *q)
+{
+	uint64_t dequeue_pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	uint64_t enqueue_pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+	if (enqueue_pos < dequeue_pos)
+		return 0;
+
+	return (size_t) (enqueue_pos - dequeue_pos);
+}
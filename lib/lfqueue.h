@@ -0,0 +1,83 @@
+/*
+ * xNBD - an enhanced Network Block Device program
+ *
+ * Copyright (C) 2008-2014 National Institute of Advanced Industrial Science
+ * and Technology
+ *
+ * Author: Takahiro Hirofuchi <t.hirofuchi _at_ aist.go.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef LIB_XNBD_LFQUEUE_H
+#define LIB_XNBD_LFQUEUE_H
+
+#include "common.h"
+#include <stdint.h>
+
+
+/*
+ * Lock-free bounded queue of pointers (multiple producers and multiple
+ * consumers). A push blocks while the queue is full, and a pop blocks while
+ * the queue is empty. A waiting thread spins for a while and then sleeps on
+ * a futex; a push (or pop) issues a wakeup syscall only if there is a
+ * sleeping thread on the other side.
+ *
+ * NULL cannot be pushed; it means an empty queue.
+ */
+
+#define LFQUEUE_CACHELINE 64
+
+struct lfqueue_cell {
+	uint64_t seq;
+	void *data;
+};
+
+struct lfqueue_waiter {
+	/* futex word, incremented on each wakeup */
+	uint32_t epoch;
+	uint32_t nwaiters;
+
+	/* spin count before sleeping, adjusted adaptively */
+	unsigned int spin;
+} __attribute__((aligned(LFQUEUE_CACHELINE)));
+
+struct lfqueue {
+	uint64_t enqueue_pos __attribute__((aligned(LFQUEUE_CACHELINE)));
+	uint64_t dequeue_pos __attribute__((aligned(LFQUEUE_CACHELINE)));
+
+	/* threads waiting for a non-empty (pop) or non-full (push) queue */
+	struct lfqueue_waiter pop_waiter;
+	struct lfqueue_waiter push_waiter;
+
+	uint64_t mask;
+	struct lfqueue_cell *cells;
+};
+
+/* size is rounded up to a power of two */
+struct lfqueue *lfqueue_new(size_t size);
+void lfqueue_destroy(struct lfqueue *q);
+
+void lfqueue_push(struct lfqueue *q, void *data);
+void *lfqueue_pop(struct lfqueue *q);
+
+/* never block. return -1 (push) or NULL (pop) if the queue is full or empty */
+int lfqueue_try_push(struct lfqueue *q, void *data);
+void *lfqueue_try_pop(struct lfqueue *q);
+
+/* only an estimate if other threads are using the queue */
+size_t lfqueue_length(struct lfqueue *q);
+
+#endif
@@ -22,27 +22,49 @@
  */
 
 #include "nbd.h"
+#include "zero.h"
+#include <limits.h> /* IOV_MAX */
 
 
 const char *nbd_get_iotype_string(uint32_t iotype)
 {
-	const char *nbd_iotype_string_table[] = {
-		"NBD_CMD_READ",
-		"NBD_CMD_WRITE",
-		"NBD_CMD_DISC",
-		"NBD_CMD_FLUSH",
-		"NBD_CMD_TRIM",
-		"NBD_CMD_CACHE",
-		"NBD_CMD_READ_COMPRESS",
-		"NBD_CMD_READ_COMPRESS_LZO",
-		"NBD_CMD_UNDEFINED"
-	};
-
-	/* UNDEFINED is one of the known commands. The others are unknown. */
-	if (iotype >= sizeof(nbd_iotype_string_table) / sizeof(nbd_iotype_string_table[0]))
-		return "NBD_CMD_(unknown)";
-
-	return nbd_iotype_string_table[iotype];
+	switch (iotype) {
+		case NBD_CMD_READ:
+			return "NBD_CMD_READ";
+		case NBD_CMD_WRITE:
+			return "NBD_CMD_WRITE";
+		case NBD_CMD_DISC:
+			return "NBD_CMD_DISC";
+		case NBD_CMD_FLUSH:
+			return "NBD_CMD_FLUSH";
+		case NBD_CMD_TRIM:
+			return "NBD_CMD_TRIM";
+		case NBD_CMD_CACHE:
+			return "NBD_CMD_CACHE";
+		case NBD_CMD_WRITE_ZEROES:
+			return "NBD_CMD_WRITE_ZEROES";
+		case NBD_CMD_BLOCK_STATUS:
+			return "NBD_CMD_BLOCK_STATUS";
+		case NBD_CMD_READ_COMPRESS:
+			return "NBD_CMD_READ_COMPRESS";
+		case NBD_CMD_READ_COMPRESS_LZO:
+			return "NBD_CMD_READ_COMPRESS_LZO";
+		case NBD_CMD_CACHE_FILL:
+			return "NBD_CMD_CACHE_FILL";
+		case NBD_CMD_CACHE_ZERO:
+			return "NBD_CMD_CACHE_ZERO";
+		case NBD_CMD_READ_COMPRESS_LZ4:
+			return "NBD_CMD_READ_COMPRESS_LZ4";
+		case NBD_CMD_READ_COMPRESS_ZSTD:
+			return "NBD_CMD_READ_COMPRESS_ZSTD";
+		case NBD_CMD_CHECKSUM:
+			return "NBD_CMD_CHECKSUM";
+		case NBD_CMD_UNDEFINED:
+			/* UNDEFINED is one of the known commands. */
+			return "NBD_CMD_UNDEFINED";
+		default:
+			return "NBD_CMD_(unknown)";
+	}
 }
 
 
@@ -160,6 +182,21 @@ int nbd_client_send_read_request(int remotefd, off_t iofrom, size_t len)
 	return nbd_client_send_request_header(remotefd, NBD_CMD_READ, iofrom, len, myhandle);
 }
 
+/* a read-like request of another type (e.g., a compressed read), including its flags */
+int nbd_client_send_read_request_type(int remotefd, uint32_t iotype, off_t iofrom, size_t len)
+{
+	dbg("sending request of iotype %s iofrom %ju len %zu",
+			nbd_get_iotype_string(iotype & NBD_CMD_MASK_COMMAND), iofrom, len);
+
+	return nbd_client_send_request_header(remotefd, iotype, iofrom, len, myhandle);
+}
+
+/* The reply header of nbd_client_send_read_request_type(). The caller receives the data. */
+int nbd_client_recv_read_reply_header(int remotefd)
+{
+	return nbd_client_recv_reply_header(remotefd, myhandle);
+}
+
 int nbd_client_recv_read_reply(int remotefd, char *buf, size_t len)
 {
 	dbg("now receiving read reply");
@@ -198,42 +235,30 @@ void nbd_client_send_disc_request(int remotefd)
 
 
 
-/**
- * Returning 0:  request is good.
- * Returning NBD_SERVER_RECV__BAD_REQUEST: bad request.
- * 		An error is notified the client by using reply.errcode.
- * Returning NBD_SERVER_RECV__MAGIC_MISMATCH: protocol violation.
- * 	 	The connection is going to be discarded.
- * Returning NBD_SERVER_RECV__TERMINATE: terminate request.
+/*
+ * Check a request header received from a client. See
+ * nbd_server_recv_request() for return values.
  */
-int nbd_server_recv_request(int clientfd, off_t disksize, uint32_t *iotype_arg, off_t *iofrom_arg,
-		size_t *iolen_arg, struct nbd_reply *reply)
+static int nbd_server_parse_request(struct nbd_request *request, off_t disksize, uint32_t *iotype_arg, uint32_t *ioflags_arg,
+		off_t *iofrom_arg, size_t *iolen_arg, struct nbd_reply *reply)
 {
-	struct nbd_request request;
 	uint32_t magic  = 0;
 	uint32_t iotype = 0;
+	uint32_t ioflags = 0;
 	uint64_t iofrom = 0;
 	uint32_t iolen  = 0;
-	int ret;
-
-	memset(&request, 0, sizeof(request));
-
-	ret = net_recv_all_or_error(clientfd, &request, sizeof(request));
-	if (ret < 0) {
-		warn("recv_request: peer closed or error");
-		return NBD_SERVER_RECV__TERMINATE;
-	}
 
-	magic  = ntohl(request.magic);
-	iotype = ntohl(request.type);
-	iofrom = ntohll(request.from);
-	iolen  = ntohl(request.len);
+	magic  = ntohl(request->magic);
+	iotype = ntohl(request->type) & NBD_CMD_MASK_COMMAND;
+	ioflags = ntohl(request->type) >> NBD_CMD_SHIFT_FLAGS;
+	iofrom = ntohll(request->from);
+	iolen  = ntohl(request->len);
 
 	/* protocol violation */
 	if (magic != NBD_REQUEST_MAGIC) {
 		warn("recv_request: magic mismatch, %u %u", magic, NBD_REQUEST_MAGIC);
-		nbd_request_dump(&request);
-		dump_buffer((char *) &request, sizeof(request));
+		nbd_request_dump(request);
+		dump_buffer((char *) request, sizeof(*request));
 		return NBD_SERVER_RECV__MAGIC_MISMATCH;
 	}
 
@@ -246,7 +271,7 @@ int nbd_server_recv_request(int clientfd, off_t disksize, uint32_t *iotype_arg,
 
 
 	/* do not touch the handle value at the server side */
-	reply->handle = request.handle;
+	reply->handle = request->handle;
 
 
 	/*
@@ -273,6 +298,7 @@ int nbd_server_recv_request(int clientfd, off_t disksize, uint32_t *iotype_arg,
 
 
 	*iotype_arg = iotype;
+	*ioflags_arg = ioflags;
 	*iofrom_arg = iofrom;  /* disksize is off_t, so checked already */
 	*iolen_arg  = iolen;
 
@@ -282,246 +308,1764 @@ int nbd_server_recv_request(int clientfd, off_t disksize, uint32_t *iotype_arg,
 	return 0;
 }
 
+/**
+ * Returning 0:  request is good.
+ * Returning NBD_SERVER_RECV__BAD_REQUEST: bad request.
+ * 		An error is notified the client by using reply.errcode.
+ * Returning NBD_SERVER_RECV__MAGIC_MISMATCH: protocol violation.
+ * 	 	The connection is going to be discarded.
+ * Returning NBD_SERVER_RECV__TERMINATE: terminate request.
+ */
+int nbd_server_recv_request(int clientfd, off_t disksize, uint32_t *iotype_arg, uint32_t *ioflags_arg,
+		off_t *iofrom_arg, size_t *iolen_arg, struct nbd_reply *reply)
+{
+	struct nbd_request request;
+	int ret;
 
+	memset(&request, 0, sizeof(request));
 
+	ret = net_recv_all_or_error(clientfd, &request, sizeof(request));
+	if (ret < 0) {
+		warn("recv_request: peer closed or error");
+		return NBD_SERVER_RECV__TERMINATE;
+	}
 
+	return nbd_server_parse_request(&request, disksize, iotype_arg, ioflags_arg, iofrom_arg, iolen_arg, reply);
+}
 
 
-/* 8 chars */
-// const char nbd_password[8] = {'N', 'B', 'D', 'M', 'A', 'G', 'I', 'C'};
-const uint64_t NBD_PASSWD = 0x4e42444d41474943LL;
-
-const uint64_t NBD_NEGOTIATE_VERSION1_MAGIC = 0x0000420281861253LL;
-const uint64_t NBD_NEGOTIATE_VERSION2_MAGIC = 0x49484156454F5054LL;
-const uint32_t NBD_NEGOTIATE_VERSION2_OPT_EXPORT_NAME = 1;
-#define XNBD_EXPORT_NAME_MAXLEN (256)
 
 
 /*
- * For the new negotination protocol.
- * We name it VERSION 2.
- **/
+ * A buffered reader of requests. One recv() may bring many request headers
+ * (and write data following them) from a client sending requests
+ * back-to-back; they are parsed out of the buffer without any system call.
+ *
+ * A worker may be asked to stop (e.g., to take a snapshot or to switch from
+ * the proxy mode to the target mode), and then another process resumes the
+ * session with the same socket. Requests already in the buffer must not be
+ * lost in that case. After a stop is notified, the reader serves the
+ * requests in the buffer, and reads only the exact bytes of the last
+ * partially-received request so that the socket is left at a request
+ * boundary.
+ *
+ * buflen must be able to hold at least one request header.
+ */
+struct nbd_request_reader *nbd_request_reader_create_sized(int fd, size_t buflen)
+{
+	g_assert(buflen >= sizeof(struct nbd_request));
 
-struct nbd_negotiate_v2_pdu_type0 {
-	uint64_t passwd;
-	uint64_t magic;
-	uint16_t hs_flags16; // handshake flags
-} __attribute__((__packed__));
+	struct nbd_request_reader *reader = g_malloc0(sizeof(struct nbd_request_reader));
 
-struct nbd_negotiate_v2_pdu_type1 {
-	uint32_t reserved;
-	uint64_t opt_magic;
-	uint32_t opt;
-	uint32_t namesize;
-} __attribute__((__packed__));
+	reader->fd     = fd;
+	reader->buflen = buflen;
+	reader->buf    = g_malloc(reader->buflen);
 
-struct nbd_negotiate_v2_pdu_type2 {
-	uint64_t size;
-	uint16_t tm_flags16;  // trasmission flags
-	char padding[124];
-} __attribute__((__packed__));
+	return reader;
+}
+
+struct nbd_request_reader *nbd_request_reader_create(int fd)
+{
+	return nbd_request_reader_create_sized(fd, NBD_REQUEST_READER_BUFSIZE);
+}
+
+void nbd_request_reader_destroy(struct nbd_request_reader *reader)
+{
+	if (reader->head != reader->tail)
+		warn("discard %zu buffered bytes (fd %d)", reader->tail - reader->head, reader->fd);
+
+	g_free(reader->buf);
+	g_free(reader);
+}
+
+static size_t reader_buffered(struct nbd_request_reader *reader)
+{
+	return reader->tail - reader->head;
+}
 
+/* the number of received bytes not consumed yet */
+size_t nbd_request_reader_buffered(struct nbd_request_reader *reader)
+{
+	return reader_buffered(reader);
+}
 
 /*
- * The option NBD_NEGOTIATE_VERSION2_OPT_EXPORT_NAME is introduced in the recent version of the
- * original NBD. It allows a client to specify a target image name.
- *
- * I feel the negotiation phase of the NBD protocol is not so smart; it
- * should be changed to be reasonable. But, for the compatibility with the
- * original NBD and qemu, here the option is implemented.
- *
- * From the viewpoint of the client, the new protocol is summarized as follows:
- *
- *    recv pdu_new_0
- *    send pdu_new_1
- *    send target_name (any size ok!?)
- *    recv pdu_new_2
- *
+ * Read more data into the buffer. Until stopped, read as much as possible
+ * with one recv(). Otherwise, read only the rest of a request header.
  */
+static int reader_fill(struct nbd_request_reader *reader)
+{
+	if (reader->head > 0) {
+		memmove(reader->buf, reader->buf + reader->head, reader_buffered(reader));
+		reader->tail -= reader->head;
+		reader->head  = 0;
+	}
+
+	if (reader->stopped) {
+		size_t rest = sizeof(struct nbd_request) - reader_buffered(reader);
+		int ret = net_recv_all_or_error(reader->fd, reader->buf + reader->tail, rest);
+		if (ret < 0)
+			return -1;
+
+		reader->tail += rest;
+		return 0;
+	}
 
+	for (;;) {
+		ssize_t ret = recv(reader->fd, reader->buf + reader->tail, reader->buflen - reader->tail, 0);
+		if (ret > 0) {
+			reader->tail += ret;
+			return 0;
+		} else if (ret == 0)
+			return -1;
+		else if (errno != EINTR)
+			return -1;
+	}
+}
 
 /*
- * get a target name from a client.
- * Note: must free a returned buffer.
- **/
-char *nbd_negotiate_v2_server_phase0(int sockfd)
+ * Wait for the next request. Returning -1 if unblock_fd is notified and no
+ * request is in the buffer.
+ */
+int nbd_request_reader_wait(struct nbd_request_reader *reader, int unblock_fd)
 {
-	{
-		struct nbd_negotiate_v2_pdu_type0 pdu0;
+	if (reader_buffered(reader) >= sizeof(struct nbd_request))
+		return 0;
 
-		pdu0.passwd = htonll(NBD_PASSWD);
-		pdu0.magic  = htonll(NBD_NEGOTIATE_VERSION2_MAGIC);
-		pdu0.hs_flags16 = 0;
+	if (reader->stopped)
+		return reader_buffered(reader) ? 0 : -1;
 
-		int ret = net_send_all_or_error(sockfd, &pdu0, sizeof(pdu0));
-		if (ret < 0)
-			return NULL;
+	int ret = wait_until_readable(reader->fd, unblock_fd);
+	if (ret < 0) {
+		if (reader_buffered(reader) == 0)
+			return -1;
+
+		/* complete the partially-received request first */
+		reader->stopped = 1;
 	}
 
+	return 0;
+}
 
-	{
-		struct nbd_negotiate_v2_pdu_type1 pdu1;
+/* The same as nbd_server_recv_request(), but through a reader. */
+int nbd_server_recv_request_buffered(struct nbd_request_reader *reader, off_t disksize, uint32_t *iotype_arg,
+		uint32_t *ioflags_arg, off_t *iofrom_arg, size_t *iolen_arg, struct nbd_reply *reply)
+{
+	struct nbd_request request;
 
-		int ret = net_recv_all_or_error(sockfd, &pdu1, sizeof(pdu1));
-		if (ntohll(pdu1.opt_magic) != NBD_NEGOTIATE_VERSION2_MAGIC ||
-				ntohl(pdu1.opt) != NBD_NEGOTIATE_VERSION2_OPT_EXPORT_NAME) {
-			warn("header mismatch");
-			return NULL;
+	while (reader_buffered(reader) < sizeof(request)) {
+		int ret = reader_fill(reader);
+		if (ret < 0) {
+			warn("recv_request: peer closed or error");
+			return NBD_SERVER_RECV__TERMINATE;
 		}
+	}
 
-		uint32_t namesize = ntohl(pdu1.namesize);
-		if (namesize > XNBD_EXPORT_NAME_MAXLEN) {
-			warn("namesize error");
-			return NULL;
-		}
+	memcpy(&request, reader->buf + reader->head, sizeof(request));
+	reader->head += sizeof(request);
 
-		char *target_name = g_malloc0(namesize + 1);
+	return nbd_server_parse_request(&request, disksize, iotype_arg, ioflags_arg, iofrom_arg, iolen_arg, reply);
+}
 
-		ret = net_recv_all_or_error(sockfd, target_name, namesize);
-		if (ret < 0)
-			return NULL;
+/*
+ * Receive data following a request (i.e., write data). Buffered bytes are
+ * copied first, and the rest is received directly into iov. Like
+ * net_readv_all(), iov is modified. Returning 0, or -1 in the same way as
+ * net_readv_all_or_error().
+ */
+int nbd_request_reader_recv_payload_iov(struct nbd_request_reader *reader, struct iovec *iov, unsigned int count)
+{
+	unsigned int index = 0;
+	while (index < count && reader_buffered(reader) > 0) {
+		size_t copied = MIN(iov[index].iov_len, reader_buffered(reader));
+
+		memcpy(iov[index].iov_base, reader->buf + reader->head, copied);
+		reader->head += copied;
 
-		info("requested target_name %s", target_name);
+		iov[index].iov_base = (char *) iov[index].iov_base + copied;
+		iov[index].iov_len -= copied;
 
-		return target_name;
+		if (iov[index].iov_len == 0)
+			index += 1;
 	}
+
+	if (index < count) {
+		int ret = net_readv_all_or_error(reader->fd, &iov[index], count - index);
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int nbd_request_reader_recv_payload(struct nbd_request_reader *reader, void *buf, size_t len)
+{
+	struct iovec iov[1];
+	iov[0].iov_base = buf;
+	iov[0].iov_len  = len;
+
+	return nbd_request_reader_recv_payload_iov(reader, iov, 1);
 }
 
 
-/* return the size and readonly of the target image */
-int nbd_negotiate_v2_server_phase1(int sockfd, off_t exportsize, int readonly)
+
+
+/*
+ * Structured replies of NBD_CMD_READ.
+ *
+ * The reply consists of NBD_REPLY_TYPE_OFFSET_DATA chunks carrying data and
+ * NBD_REPLY_TYPE_OFFSET_HOLE chunks carrying only the range of a hole. The
+ * last chunk has NBD_REPLY_FLAG_DONE.
+ */
+
+/* returns the number of bytes to be sent (i.e., chunk header and its fixed payload) */
+size_t nbd_structured_reply_setup_read_chunk(union nbd_structured_reply_chunk *chunk, struct nbd_reply *reply,
+		off_t iofrom, size_t iolen, int hole, int done)
 {
-	g_assert(exportsize >= 0);
+	memset(chunk, 0, sizeof(*chunk));
 
-	struct nbd_negotiate_v2_pdu_type2 pdu2;
-	/* clear the padding field with zero */
-	memset(&pdu2, 0, sizeof(pdu2));
+	chunk->header.magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	chunk->header.flags  = htons(done ? NBD_REPLY_FLAG_DONE : 0);
+	chunk->header.handle = reply->handle;
+	chunk->ofs.offset    = htonll(iofrom);
 
-	uint16_t tm_flags16 = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH;
-	if (readonly) {
-		info("nbd_negotiate: readonly");
-		tm_flags16 |= NBD_FLAG_READ_ONLY;
-	}
+	if (hole) {
+		g_assert(iolen <= UINT32_MAX);
 
-	pdu2.size       = htonll(exportsize);
-	pdu2.tm_flags16 = htons(tm_flags16);
+		chunk->header.type   = htons(NBD_REPLY_TYPE_OFFSET_HOLE);
+		chunk->header.length = htonl(sizeof(chunk->ofs.offset) + sizeof(chunk->ofs.hole_size));
+		chunk->ofs.hole_size = htonl(iolen);
 
-	int ret = net_send_all_or_error(sockfd, &pdu2, sizeof(pdu2));
-	if (ret < 0) {
-		warn("negotiation failed");
-		return -1;
+		return sizeof(chunk->ofs);
 	}
 
-	dbg("negotiate done");
+	g_assert(iolen <= UINT32_MAX - sizeof(chunk->ofs.offset));
 
-	return 0;
-}
+	chunk->header.type   = htons(NBD_REPLY_TYPE_OFFSET_DATA);
+	chunk->header.length = htonl(sizeof(chunk->ofs.offset) + iolen);
 
+	return sizeof(chunk->ofs) - sizeof(chunk->ofs.hole_size);
+}
 
-int nbd_negotiate_v2_client_side(int sockfd, off_t *exportsize, uint32_t *exportflags, size_t namesize, const char *target_name)
+/* an error chunk without a message, completing the reply */
+size_t nbd_structured_reply_setup_error_chunk(union nbd_structured_reply_chunk *chunk, struct nbd_reply *reply)
 {
-	int ret;
+	memset(chunk, 0, sizeof(*chunk));
 
-	{
-		struct nbd_negotiate_v2_pdu_type0 pdu0;
+	chunk->header.magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	chunk->header.flags  = htons(NBD_REPLY_FLAG_DONE);
+	chunk->header.type   = htons(NBD_REPLY_TYPE_ERROR);
+	chunk->header.handle = reply->handle;
+	chunk->header.length = htonl(sizeof(chunk->err.error) + sizeof(chunk->err.msglen));
+	chunk->err.error     = reply->error;  /* already in network byte order */
+	chunk->err.msglen    = 0;
 
-		ret = net_recv_all_or_error(sockfd, &pdu0, sizeof(pdu0));
-		if (ret < 0)
-			goto err_out;
+	return sizeof(chunk->err);
+}
 
-		if (ntohll(pdu0.passwd) != NBD_PASSWD) {
-			warn("password mismatch");
-			goto err_out;
-		}
+static int read_chunk_mergeable(struct nbd_read_chunk *prev, struct nbd_read_chunk *next)
+{
+	if ((prev->buf == NULL) != (next->buf == NULL))
+		return 0;
 
-		if (ntohll(pdu0.magic) == NBD_NEGOTIATE_VERSION1_MAGIC) {
-			warn("A wrapped server was expected, but a plain server is found");
-			goto err_out;
-		}
+	return (prev->iofrom + (off_t) prev->iolen == next->iofrom);
+}
 
-		if (ntohll(pdu0.magic) != NBD_NEGOTIATE_VERSION2_MAGIC) {
-			warn("negotiate magic does not match VERSION 1");
-			goto err_out;
+/*
+ * Split the data chunks at the boundaries of blocksize, and turn the blocks
+ * all zero into holes. Returns a new array of the chunks.
+ */
+static struct nbd_read_chunk *read_chunks_find_zero(struct nbd_read_chunk *chunks, unsigned int *nchunks,
+		unsigned int blocksize)
+{
+	unsigned int nfound = 0;
+	unsigned int maxfound = *nchunks + 16;
+	struct nbd_read_chunk *found = g_new(struct nbd_read_chunk, maxfound);
+
+	for (unsigned int i = 0; i < *nchunks; i++) {
+		off_t ioend = chunks[i].iofrom + (off_t) chunks[i].iolen;
+
+		for (off_t pos = chunks[i].iofrom; pos < ioend; ) {
+			off_t next = MIN(ioend, (pos / blocksize + 1) * blocksize);
+			char *buf = chunks[i].buf;
+
+			if (buf) {
+				buf += pos - chunks[i].iofrom;
+				if (next - pos == blocksize && buffer_is_zero(buf, blocksize))
+					buf = NULL;
+			}
+
+			struct nbd_read_chunk *last = nfound ? &found[nfound - 1] : NULL;
+
+			if (last && (last->buf == NULL) == (buf == NULL)
+					&& (buf == NULL || last->buf + last->iolen == buf)) {
+				last->iolen += next - pos;
+			} else {
+				if (nfound == maxfound) {
+					maxfound *= 2;
+					found = g_renew(struct nbd_read_chunk, found, maxfound);
+				}
+
+				found[nfound].iofrom = pos;
+				found[nfound].iolen  = next - pos;
+				found[nfound].buf    = buf;
+				nfound += 1;
+			}
+
+			pos = next;
 		}
 	}
 
+	*nchunks = nfound;
 
-	{
-		struct nbd_negotiate_v2_pdu_type1 pdu1;
-		pdu1.reserved  = 0;
-		pdu1.opt_magic = htonll(NBD_NEGOTIATE_VERSION2_MAGIC);
-		pdu1.opt       = htonl(NBD_NEGOTIATE_VERSION2_OPT_EXPORT_NAME);
-		pdu1.namesize  = htonl(namesize);
+	return found;
+}
 
-		ret = net_send_all_or_error(sockfd, &pdu1, sizeof(pdu1));
-		if (ret < 0)
-			goto err_out;
+/*
+ * Send the reply of NBD_CMD_READ. If reply->error is set, an error chunk is
+ * sent instead. Adjacent chunks of the same type are merged into one. If
+ * hole_blocksize is not 0, the blocks of data chunks which are all zero are
+ * also sent as holes.
+ */
+int nbd_server_send_read_reply_structured(int clientfd, struct nbd_reply *reply,
+		struct nbd_read_chunk *chunks, unsigned int nchunks, unsigned int hole_blocksize)
+{
+	union nbd_structured_reply_chunk chunk;
+	struct nbd_read_chunk *found = NULL;
 
-		ret = net_send_all_or_error(sockfd, target_name, namesize);
-		if (ret < 0)
-			goto err_out;
+	if (reply->error) {
+		size_t len = nbd_structured_reply_setup_error_chunk(&chunk, reply);
+		return net_send_all_or_error(clientfd, &chunk, len);
 	}
 
+	if (nchunks == 0) {
+		/* zero-length read */
+		nbd_structured_reply_setup_read_chunk(&chunk, reply, 0, 0, 0, 1);
+		chunk.header.type   = htons(NBD_REPLY_TYPE_NONE);
+		chunk.header.length = 0;
+		return net_send_all_or_error(clientfd, &chunk.header, sizeof(chunk.header));
+	}
 
-	{
-		struct nbd_negotiate_v2_pdu_type2 pdu2;
+	if (hole_blocksize) {
+		found = read_chunks_find_zero(chunks, &nchunks, hole_blocksize);
+		chunks = found;
+	}
 
-		ret = net_recv_all_or_error(sockfd, &pdu2, sizeof(pdu2));
-		if (ret < 0)
-			goto err_out;
+	unsigned int ngroups = 1;
+	for (unsigned int i = 1; i < nchunks; i++)
+		if (!read_chunk_mergeable(&chunks[i - 1], &chunks[i]))
+			ngroups += 1;
 
-		uint64_t size       = ntohll(pdu2.size);
-		uint16_t tm_flags16 = ntohs(pdu2.tm_flags16);
+	union nbd_structured_reply_chunk *headers = g_new(union nbd_structured_reply_chunk, ngroups);
+	struct iovec *iov = g_new(struct iovec, ngroups + nchunks);
+	unsigned int iov_size = 0;
+	unsigned int group = 0;
 
-		info("remote size: %ju bytes (%ju MBytes)", size, size /1024 /1024);
+	for (unsigned int i = 0; i < nchunks; ) {
+		int hole = (chunks[i].buf == NULL);
+		size_t group_iolen = chunks[i].iolen;
+		unsigned int next = i + 1;
 
+		while (next < nchunks && read_chunk_mergeable(&chunks[next - 1], &chunks[next])) {
+			group_iolen += chunks[next].iolen;
+			next += 1;
+		}
 
-		if (size > OFF_MAX) {
-			warn("remote size exceeds a local off_t(%zd bytes) value", sizeof(off_t));
-			return -1;
+		iov[iov_size].iov_base = &headers[group];
+		iov[iov_size].iov_len  = nbd_structured_reply_setup_read_chunk(&headers[group], reply,
+				chunks[i].iofrom, group_iolen, hole, (next == nchunks));
+		iov_size += 1;
+
+		if (!hole) {
+			for (unsigned int j = i; j < next; j++) {
+				iov[iov_size].iov_base = chunks[j].buf;
+				iov[iov_size].iov_len  = chunks[j].iolen;
+				iov_size += 1;
+			}
 		}
 
-		if (exportsize)
-			*exportsize  = (off_t) size;
-		if (exportflags)
-			*exportflags = tm_flags16;
+		group += 1;
+		i = next;
 	}
 
+	dbg("read reply: %u chunks in %u groups", nchunks, ngroups);
 
-	return 0;
-
-err_out:
-	return -1;
-}
+	int ret = 0;
+	for (unsigned int done = 0; done < iov_size; ) {
+		unsigned int count = MIN(iov_size - done, (unsigned int) IOV_MAX);
 
+		ret = net_writev_all_or_error(clientfd, iov + done, count);
+		if (ret < 0)
+			break;
 
+		done += count;
+	}
 
-/*
- * For the old negotination protocol.
- * We name it VERSION 1.
- **/
+	g_free(iov);
+	g_free(headers);
+	g_free(found);
 
-struct nbd_negotiate_v1_pdu {
-	uint64_t passwd;
-	uint64_t magic;
-	uint64_t size;
-	uint32_t flags;
-	char padding[124];
-} __attribute__((__packed__));
+	return ret;
+}
 
 
-static int nbd_negotiate_v1_server_side_main(int sockfd, off_t exportsize, int readonly)
+static int recv_and_discard(int remotefd, size_t len)
 {
-	g_assert(exportsize >= 0);
+	char buf[512];
 
-	struct nbd_negotiate_v1_pdu pdu;
-	memset(&pdu, 0, sizeof(pdu));
+	while (len > 0) {
+		size_t count = MIN(len, sizeof(buf));
 
-	uint32_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH;
-	if (readonly) {
-		info("nbd_negotiate: readonly");
-		flags |= NBD_FLAG_READ_ONLY;
-	}
+		int ret = net_recv_all_or_error(remotefd, buf, count);
+		if (ret < 0)
+			return -1;
+
+		len -= count;
+	}
+
+	return 0;
+}
+
+/* point the range [offset, offset + len) of an iovec array; out must have count elements */
+static unsigned int iov_slice(struct iovec *iov, unsigned int count, size_t offset, size_t len, struct iovec *out)
+{
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < count && len > 0; i++) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+
+		size_t partial = MIN(iov[i].iov_len - offset, len);
+		out[n].iov_base = (char *) iov[i].iov_base + offset;
+		out[n].iov_len  = partial;
+		n += 1;
+
+		offset = 0;
+		len -= partial;
+	}
+
+	return n;
+}
+
+/*
+ * Receive a structured reply of NBD_CMD_READ for the range starting at
+ * iofrom. Holes are filled with zero. A simple reply is also accepted.
+ */
+int nbd_client_recv_read_reply_structured_iov(int remotefd, struct iovec *iov, unsigned int count,
+		uint64_t handle, off_t iofrom)
+{
+	size_t total = 0;
+	for (unsigned int i = 0; i < count; i++)
+		total += iov[i].iov_len;
+
+	size_t received = 0;
+	uint32_t error = 0;
+	int ret;
+
+	struct iovec *sub_iov = g_new(struct iovec, count ? count : 1);
+
+	for (;;) {
+		struct nbd_structured_reply header;
+
+		ret = net_recv_all_or_error(remotefd, &header.magic, sizeof(header.magic));
+		if (ret < 0) {
+			warn("recv header");
+			goto err_out;
+		}
+
+		if (ntohl(header.magic) == NBD_REPLY_MAGIC) {
+			/* the rest of the simple reply is the same size as .flags, .type and .handle */
+			struct nbd_reply reply;
+			ret = net_recv_all_or_error(remotefd, &reply.error, sizeof(reply) - sizeof(reply.magic));
+			if (ret < 0 || reply.handle != htonll(handle)) {
+				warn("recv simple reply");
+				goto err_out;
+			}
+
+			g_free(sub_iov);
+
+			if (reply.error) {
+				warn("error in remote internal, reply state %d", ntohl(reply.error));
+				return -ntohl(reply.error);
+			}
+
+			ret = net_readv_all_or_error(remotefd, iov, count);
+			return (ret < 0) ? -EPIPE : 0;
+		}
+
+		if (ntohl(header.magic) != NBD_STRUCTURED_REPLY_MAGIC) {
+			warn("unknown reply magic, %x", ntohl(header.magic));
+			goto err_out;
+		}
+
+		ret = net_recv_all_or_error(remotefd, &header.flags, sizeof(header) - sizeof(header.magic));
+		if (ret < 0) {
+			warn("recv header");
+			goto err_out;
+		}
+
+		if (header.handle != htonll(handle)) {
+			warn("unknown reply handle, %ju %ju", header.handle, htonll(handle));
+			goto err_out;
+		}
+
+		uint16_t flags  = ntohs(header.flags);
+		uint16_t type   = ntohs(header.type);
+		uint32_t length = ntohl(header.length);
+
+		if (type == NBD_REPLY_TYPE_NONE) {
+			if (length != 0)
+				goto err_proto;
+
+		} else if (type == NBD_REPLY_TYPE_OFFSET_DATA || type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+			uint64_t offset;
+			uint64_t iolen;
+
+			if (length < sizeof(offset))
+				goto err_proto;
+
+			ret = net_recv_all_or_error(remotefd, &offset, sizeof(offset));
+			if (ret < 0)
+				goto err_out;
+			offset = ntohll(offset);
+
+			if (type == NBD_REPLY_TYPE_OFFSET_DATA) {
+				iolen = length - sizeof(offset);
+			} else {
+				uint32_t hole_size;
+				if (length != sizeof(offset) + sizeof(hole_size))
+					goto err_proto;
+
+				ret = net_recv_all_or_error(remotefd, &hole_size, sizeof(hole_size));
+				if (ret < 0)
+					goto err_out;
+				iolen = ntohl(hole_size);
+			}
+
+			if (offset < (uint64_t) iofrom || offset - iofrom > total || iolen > total - (offset - iofrom))
+				goto err_proto;
+
+			unsigned int sub_count = iov_slice(iov, count, offset - iofrom, iolen, sub_iov);
+
+			if (type == NBD_REPLY_TYPE_OFFSET_DATA) {
+				ret = net_readv_all_or_error(remotefd, sub_iov, sub_count);
+				if (ret < 0) {
+					warn("recv data");
+					goto err_out;
+				}
+			} else {
+				for (unsigned int i = 0; i < sub_count; i++)
+					memset(sub_iov[i].iov_base, 0, sub_iov[i].iov_len);
+			}
+
+			received += iolen;
+
+		} else if (NBD_REPLY_TYPE_IS_ERR(type)) {
+			uint32_t chunk_error;
+			uint16_t msglen;
+
+			if (length < sizeof(chunk_error) + sizeof(msglen))
+				goto err_proto;
+
+			ret = net_recv_all_or_error(remotefd, &chunk_error, sizeof(chunk_error));
+			if (ret < 0)
+				goto err_out;
+
+			ret = net_recv_all_or_error(remotefd, &msglen, sizeof(msglen));
+			if (ret < 0)
+				goto err_out;
+
+			/* discard a message and an offset */
+			ret = recv_and_discard(remotefd, length - sizeof(chunk_error) - sizeof(msglen));
+			if (ret < 0)
+				goto err_out;
+
+			error = ntohl(chunk_error) ? ntohl(chunk_error) : EIO;
+			warn("error in remote internal, reply chunk error %u", error);
+
+		} else {
+			warn("unknown reply chunk type %u", type);
+			goto err_out;
+		}
+
+		if (flags & NBD_REPLY_FLAG_DONE)
+			break;
+	}
+
+	g_free(sub_iov);
+
+	if (error)
+		return -error;
+
+	/* chunks never overlap */
+	if (received != total) {
+		warn("read reply covers %zu bytes of %zu bytes", received, total);
+		return -EPIPE;
+	}
+
+	return 0;
+
+err_proto:
+	warn("protocol violation in a structured reply");
+err_out:
+	g_free(sub_iov);
+	return -EPIPE;
+}
+
+int nbd_client_recv_read_reply_structured(int remotefd, char *buf, size_t len, off_t iofrom)
+{
+	g_assert(buf);
+	g_assert(len <= UINT32_MAX);
+
+	struct iovec iov[1];
+	iov[0].iov_base = buf;
+	iov[0].iov_len  = len;
+
+	return nbd_client_recv_read_reply_structured_iov(remotefd, iov, 1, myhandle, iofrom);
+}
+
+
+
+void nbd_block_status_init(struct nbd_block_status *bs)
+{
+	memset(bs, 0, sizeof(*bs));
+}
+
+void nbd_block_status_free(struct nbd_block_status *bs)
+{
+	g_free(bs->descs);
+	nbd_block_status_init(bs);
+}
+
+/* a descriptor length is 32 bits; keep it aligned to any block size */
+#define NBD_BLOCK_DESCRIPTOR_MAXLEN (1U << 31)
+
+/*
+ * Append a range to the end of a block status, merging it with the last
+ * descriptor if the flags are the same. Returning -1 if the maximum number of
+ * descriptors is reached; bs is then left unchanged.
+ */
+int nbd_block_status_add(struct nbd_block_status *bs, size_t len, uint32_t status_flags)
+{
+	while (len > 0) {
+		struct nbd_block_descriptor *last = bs->ndescs ? &bs->descs[bs->ndescs - 1] : NULL;
+
+		if (last && last->status_flags == status_flags && last->length < NBD_BLOCK_DESCRIPTOR_MAXLEN) {
+			size_t added = MIN(len, NBD_BLOCK_DESCRIPTOR_MAXLEN - last->length);
+			last->length += added;
+			bs->length   += added;
+			len -= added;
+			continue;
+		}
+
+		if (bs->ndescs >= NBD_BLOCK_STATUS_MAXDESCS)
+			return -1;
+
+		if (bs->ndescs == bs->maxdescs) {
+			bs->maxdescs = bs->maxdescs ? bs->maxdescs * 2 : 16;
+			bs->descs = g_renew(struct nbd_block_descriptor, bs->descs, bs->maxdescs);
+		}
+
+		size_t added = MIN(len, NBD_BLOCK_DESCRIPTOR_MAXLEN);
+		bs->descs[bs->ndescs].length       = added;
+		bs->descs[bs->ndescs].status_flags = status_flags;
+		bs->ndescs += 1;
+		bs->length += added;
+		len -= added;
+	}
+
+	return 0;
+}
+
+size_t nbd_structured_reply_setup_block_status_chunk(union nbd_structured_reply_chunk *chunk, struct nbd_reply *reply,
+		uint32_t context_id, unsigned int ndescs)
+{
+	memset(chunk, 0, sizeof(*chunk));
+
+	chunk->header.magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	chunk->header.flags  = htons(NBD_REPLY_FLAG_DONE);
+	chunk->header.type   = htons(NBD_REPLY_TYPE_BLOCK_STATUS);
+	chunk->header.handle = reply->handle;
+	chunk->header.length = htonl(sizeof(chunk->bs.context_id) + ndescs * sizeof(struct nbd_block_descriptor));
+	chunk->bs.context_id = htonl(context_id);
+
+	return sizeof(chunk->bs);
+}
+
+/*
+ * Send the reply of NBD_CMD_BLOCK_STATUS. If reply->error is set, an error
+ * chunk is sent instead.
+ */
+int nbd_server_send_block_status_reply(int clientfd, struct nbd_reply *reply, uint32_t context_id,
+		struct nbd_block_status *bs)
+{
+	union nbd_structured_reply_chunk chunk;
+
+	if (reply->error) {
+		size_t len = nbd_structured_reply_setup_error_chunk(&chunk, reply);
+		return net_send_all_or_error(clientfd, &chunk, len);
+	}
+
+	g_assert(bs->ndescs > 0);
+
+	struct nbd_block_descriptor *descs = g_new(struct nbd_block_descriptor, bs->ndescs);
+	for (unsigned int i = 0; i < bs->ndescs; i++) {
+		descs[i].length       = htonl(bs->descs[i].length);
+		descs[i].status_flags = htonl(bs->descs[i].status_flags);
+	}
+
+	struct iovec iov[2];
+	iov[0].iov_base = &chunk;
+	iov[0].iov_len  = nbd_structured_reply_setup_block_status_chunk(&chunk, reply, context_id, bs->ndescs);
+	iov[1].iov_base = descs;
+	iov[1].iov_len  = bs->ndescs * sizeof(struct nbd_block_descriptor);
+
+	int ret = net_writev_all_or_error(clientfd, iov, 2);
+
+	g_free(descs);
+
+	return ret;
+}
+
+/*
+ * Receive the reply of NBD_CMD_BLOCK_STATUS. The descriptors of context_id
+ * are appended to bs, which is initialized by the caller. Returning 0 on
+ * success, -errno for an error reply, and -EPIPE on a failure of the
+ * connection or the protocol.
+ */
+int nbd_client_recv_block_status_reply(int remotefd, uint64_t handle, uint32_t context_id,
+		struct nbd_block_status *bs)
+{
+	uint32_t error = 0;
+	int ret;
+
+	for (;;) {
+		struct nbd_structured_reply header;
+
+		ret = net_recv_all_or_error(remotefd, &header.magic, sizeof(header.magic));
+		if (ret < 0) {
+			warn("recv header");
+			return -EPIPE;
+		}
+
+		if (ntohl(header.magic) == NBD_REPLY_MAGIC) {
+			/* only an error is replied in a simple reply */
+			struct nbd_reply reply;
+			ret = net_recv_all_or_error(remotefd, &reply.error, sizeof(reply) - sizeof(reply.magic));
+			if (ret < 0 || reply.handle != htonll(handle) || reply.error == 0) {
+				warn("recv simple reply");
+				return -EPIPE;
+			}
+
+			warn("error in remote internal, reply state %d", ntohl(reply.error));
+			return -ntohl(reply.error);
+		}
+
+		if (ntohl(header.magic) != NBD_STRUCTURED_REPLY_MAGIC) {
+			warn("unknown reply magic, %x", ntohl(header.magic));
+			return -EPIPE;
+		}
+
+		ret = net_recv_all_or_error(remotefd, &header.flags, sizeof(header) - sizeof(header.magic));
+		if (ret < 0) {
+			warn("recv header");
+			return -EPIPE;
+		}
+
+		if (header.handle != htonll(handle)) {
+			warn("unknown reply handle, %ju %ju", header.handle, htonll(handle));
+			return -EPIPE;
+		}
+
+		uint16_t flags  = ntohs(header.flags);
+		uint16_t type   = ntohs(header.type);
+		uint32_t length = ntohl(header.length);
+
+		if (type == NBD_REPLY_TYPE_BLOCK_STATUS) {
+			uint32_t id;
+
+			if (length < sizeof(id) || (length - sizeof(id)) % sizeof(struct nbd_block_descriptor))
+				goto err_proto;
+
+			ret = net_recv_all_or_error(remotefd, &id, sizeof(id));
+			if (ret < 0)
+				return -EPIPE;
+
+			unsigned int ndescs = (length - sizeof(id)) / sizeof(struct nbd_block_descriptor);
+
+			for (unsigned int i = 0; i < ndescs; i++) {
+				struct nbd_block_descriptor desc;
+
+				ret = net_recv_all_or_error(remotefd, &desc, sizeof(desc));
+				if (ret < 0)
+					return -EPIPE;
+
+				if (ntohl(id) != context_id)
+					continue;
+
+				/* ignore the rest if too many */
+				nbd_block_status_add(bs, ntohl(desc.length), ntohl(desc.status_flags));
+			}
+
+		} else if (NBD_REPLY_TYPE_IS_ERR(type)) {
+			uint32_t chunk_error;
+
+			if (length < sizeof(chunk_error) + sizeof(uint16_t))
+				goto err_proto;
+
+			ret = net_recv_all_or_error(remotefd, &chunk_error, sizeof(chunk_error));
+			if (ret < 0)
+				return -EPIPE;
+
+			/* discard a message length, a message and an offset */
+			ret = recv_and_discard(remotefd, length - sizeof(chunk_error));
+			if (ret < 0)
+				return -EPIPE;
+
+			error = ntohl(chunk_error) ? ntohl(chunk_error) : EIO;
+			warn("error in remote internal, reply chunk error %u", error);
+
+		} else if (type == NBD_REPLY_TYPE_NONE && length == 0) {
+			;
+		} else {
+			warn("unknown reply chunk type %u", type);
+			return -EPIPE;
+		}
+
+		if (flags & NBD_REPLY_FLAG_DONE)
+			break;
+	}
+
+	if (error)
+		return -error;
+
+	if (bs->ndescs == 0)
+		goto err_proto;
+
+	return 0;
+
+err_proto:
+	warn("protocol violation in a block status reply");
+	return -EPIPE;
+}
+
+
+
+
+
+/* 8 chars */
+// const char nbd_password[8] = {'N', 'B', 'D', 'M', 'A', 'G', 'I', 'C'};
+const uint64_t NBD_PASSWD = 0x4e42444d41474943LL;
+
+const uint64_t NBD_NEGOTIATE_VERSION1_MAGIC = 0x0000420281861253LL;
+const uint64_t NBD_NEGOTIATE_VERSION2_MAGIC = 0x49484156454F5054LL;
+const uint32_t NBD_NEGOTIATE_VERSION2_OPT_EXPORT_NAME = 1;
+#define XNBD_EXPORT_NAME_MAXLEN (256)
+
+
+/*
+ * For the new negotination protocol.
+ * We name it VERSION 2.
+ **/
+
+struct nbd_negotiate_v2_pdu_type0 {
+	uint64_t passwd;
+	uint64_t magic;
+	uint16_t hs_flags16; // handshake flags
+} __attribute__((__packed__));
+
+/* an option header sent by a client, following the client flags (32 bits) */
+struct nbd_negotiate_v2_opt {
+	uint64_t opt_magic;
+	uint32_t opt;
+	uint32_t len;
+} __attribute__((__packed__));
+
+/* the reply to an option other than NBD_OPT_EXPORT_NAME */
+struct nbd_negotiate_v2_opt_reply {
+	uint64_t magic;
+	uint32_t opt;
+	uint32_t type;
+	uint32_t len;
+} __attribute__((__packed__));
+
+struct nbd_negotiate_v2_pdu_type2 {
+	uint64_t size;
+	uint16_t tm_flags16;  // trasmission flags
+	char padding[124];
+} __attribute__((__packed__));
+
+
+/*
+ * The option NBD_NEGOTIATE_VERSION2_OPT_EXPORT_NAME is introduced in the recent version of the
+ * original NBD. It allows a client to specify a target image name.
+ *
+ * I feel the negotiation phase of the NBD protocol is not so smart; it
+ * should be changed to be reasonable. But, for the compatibility with the
+ * original NBD and qemu, here the option is implemented.
+ *
+ * From the viewpoint of the client, the new protocol is summarized as follows:
+ *
+ *    recv pdu_new_0
+ *    send client_flags
+ *    (send opt, recv opt_reply) * N
+ *    send opt (NBD_OPT_EXPORT_NAME)
+ *    send target_name (any size ok!?)
+ *    recv pdu_new_2
+ *
+ * The server sets NBD_FLAG_FIXED_NEWSTYLE, so a client may send options
+ * before NBD_OPT_EXPORT_NAME. NBD_OPT_STRUCTURED_REPLY is supported; an
+ * unknown option is refused with NBD_REP_ERR_UNSUP.
+ *
+ * If the server can look up its exports (struct nbd_export_ops), a client
+ * may also list the exports (NBD_OPT_LIST), ask about one of them
+ * (NBD_OPT_INFO), and select one with NBD_OPT_GO instead of
+ * NBD_OPT_EXPORT_NAME:
+ *
+ *    send opt (NBD_OPT_GO, target_name)
+ *    recv opt_reply (NBD_REP_INFO) * N
+ *    recv opt_reply (NBD_REP_ACK)
+ */
+
+/* an option (or its data) longer than this is considered as a broken one */
+#define XNBD_OPTION_MAXLEN (4096)
+
+static int negotiate_send_opt_reply_data(int sockfd, uint32_t opt, uint32_t type, const void *data, uint32_t len)
+{
+	struct nbd_negotiate_v2_opt_reply opt_reply;
+
+	opt_reply.magic = htonll(NBD_REP_MAGIC);
+	opt_reply.opt   = htonl(opt);
+	opt_reply.type  = htonl(type);
+	opt_reply.len   = htonl(len);
+
+	int ret = net_send_all_or_error(sockfd, &opt_reply, sizeof(opt_reply));
+	if (ret < 0)
+		return -1;
+
+	if (len > 0)
+		return net_send_all_or_error(sockfd, data, len);
+
+	return 0;
+}
+
+static int negotiate_send_opt_reply(int sockfd, uint32_t opt, uint32_t type)
+{
+	return negotiate_send_opt_reply_data(sockfd, opt, type, NULL, 0);
+}
+
+static int negotiate_discard_opt_data(int sockfd, uint32_t len)
+{
+	if (len > XNBD_OPTION_MAXLEN) {
+		warn("option data too long, %u bytes", len);
+		return -1;
+	}
+
+	return recv_and_discard(sockfd, len);
+}
+
+
+/* take a 32-bit value from option data; returning -1 if data is short */
+static int opt_data_get_u32(const char *data, uint32_t datalen, uint32_t *pos, uint32_t *val)
+{
+	if (datalen - *pos < sizeof(*val))
+		return -1;
+
+	memcpy(val, data + *pos, sizeof(*val));
+	*val = ntohl(*val);
+	*pos += sizeof(*val);
+
+	return 0;
+}
+
+/*
+ * NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT. The only context
+ * is "base:allocation". The export name in the option is not checked; all
+ * our exports support the context.
+ */
+static int negotiate_meta_context(int sockfd, uint32_t optnum, uint32_t optlen,
+		struct nbd_negotiate_options *supported, struct nbd_negotiate_options *opts)
+{
+	if (optlen > XNBD_OPTION_MAXLEN) {
+		warn("option data too long, %u bytes", optlen);
+		return -1;
+	}
+
+	char *data = g_malloc(optlen + 1);
+
+	int ret = net_recv_all_or_error(sockfd, data, optlen);
+	if (ret < 0) {
+		g_free(data);
+		return -1;
+	}
+
+	uint32_t type = NBD_REP_ACK;
+	uint32_t pos = 0;
+	uint32_t namelen, nqueries;
+	int matched = 0;
+
+	if (opt_data_get_u32(data, optlen, &pos, &namelen) < 0 || namelen > optlen - pos) {
+		type = NBD_REP_ERR_INVALID;
+		goto reply;
+	}
+
+	pos += namelen;
+
+	if (opt_data_get_u32(data, optlen, &pos, &nqueries) < 0) {
+		type = NBD_REP_ERR_INVALID;
+		goto reply;
+	}
+
+	/* listing all the contexts */
+	if (optnum == NBD_OPT_LIST_META_CONTEXT && nqueries == 0)
+		matched = 1;
+
+	for (uint32_t i = 0; i < nqueries; i++) {
+		uint32_t querylen;
+
+		if (opt_data_get_u32(data, optlen, &pos, &querylen) < 0 || querylen > optlen - pos) {
+			type = NBD_REP_ERR_INVALID;
+			goto reply;
+		}
+
+		const char *query = data + pos;
+		pos += querylen;
+
+		if (querylen == strlen(NBD_META_BASE_ALLOCATION) &&
+				memcmp(query, NBD_META_BASE_ALLOCATION, querylen) == 0)
+			matched = 1;
+
+		/* a namespace without a leaf name lists all the contexts in it */
+		if (optnum == NBD_OPT_LIST_META_CONTEXT && querylen == strlen("base:") &&
+				memcmp(query, "base:", querylen) == 0)
+			matched = 1;
+	}
+
+	if (pos != optlen) {
+		type = NBD_REP_ERR_INVALID;
+		goto reply;
+	}
+
+	/* a metadata context is used only through structured replies */
+	if (optnum == NBD_OPT_SET_META_CONTEXT && !opts->structured_reply) {
+		type = NBD_REP_ERR_INVALID;
+		goto reply;
+	}
+
+	if (!supported->base_allocation)
+		matched = 0;
+
+	if (matched) {
+		/* the ID is meaningless for listing */
+		uint32_t context_id = (optnum == NBD_OPT_SET_META_CONTEXT) ? NBD_META_ID_BASE_ALLOCATION : 0;
+		size_t replylen = sizeof(context_id) + strlen(NBD_META_BASE_ALLOCATION);
+		char *replydata = g_malloc(replylen);
+
+		context_id = htonl(context_id);
+		memcpy(replydata, &context_id, sizeof(context_id));
+		memcpy(replydata + sizeof(context_id), NBD_META_BASE_ALLOCATION, strlen(NBD_META_BASE_ALLOCATION));
+
+		ret = negotiate_send_opt_reply_data(sockfd, optnum, NBD_REP_META_CONTEXT, replydata, replylen);
+		g_free(replydata);
+		if (ret < 0) {
+			g_free(data);
+			return -1;
+		}
+	}
+
+	/* SET_META_CONTEXT replaces the previous selection */
+	if (optnum == NBD_OPT_SET_META_CONTEXT) {
+		opts->base_allocation = matched;
+		opts->base_allocation_id = matched ? NBD_META_ID_BASE_ALLOCATION : 0;
+
+		if (matched)
+			info("nbd_negotiate: metadata context %s", NBD_META_BASE_ALLOCATION);
+	}
+
+reply:
+	g_free(data);
+
+	return negotiate_send_opt_reply(sockfd, optnum, type);
+}
+
+
+struct nbd_info_export {
+	uint16_t type;
+	uint64_t size;
+	uint16_t tm_flags16;
+} __attribute__((__packed__));
+
+struct nbd_info_block_size {
+	uint16_t type;
+	uint32_t min_block;
+	uint32_t pref_block;
+	uint32_t max_block;
+} __attribute__((__packed__));
+
+static uint16_t negotiate_tm_flags16(uint32_t flags)
+{
+	return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | flags;
+}
+
+/*
+ * NBD_OPT_INFO and NBD_OPT_GO. NBD_INFO_EXPORT and NBD_INFO_BLOCK_SIZE are
+ * sent whatever information the client requests; a client ignores the ones
+ * it did not request. When NBD_OPT_GO is acknowledged, the name of the export
+ * is set to *name, and the transmission phase begins.
+ */
+static int negotiate_export_info(int sockfd, uint32_t optnum, uint32_t optlen,
+		const struct nbd_export_ops *ops, char **name)
+{
+	if (optlen > XNBD_OPTION_MAXLEN) {
+		warn("option data too long, %u bytes", optlen);
+		return -1;
+	}
+
+	char *data = g_malloc(optlen + 1);
+	char *export_name = NULL;
+
+	int ret = net_recv_all_or_error(sockfd, data, optlen);
+	if (ret < 0)
+		goto err_out;
+
+	uint32_t type = NBD_REP_ACK;
+	uint32_t pos = 0;
+	uint32_t namelen;
+	uint16_t nrequests;
+
+	if (opt_data_get_u32(data, optlen, &pos, &namelen) < 0 || namelen > optlen - pos ||
+			namelen > XNBD_EXPORT_NAME_MAXLEN) {
+		type = NBD_REP_ERR_INVALID;
+		goto reply;
+	}
+
+	export_name = g_strndup(data + pos, namelen);
+	pos += namelen;
+
+	/* the requested information types follow; not examined */
+	if (optlen - pos < sizeof(nrequests)) {
+		type = NBD_REP_ERR_INVALID;
+		goto reply;
+	}
+
+	memcpy(&nrequests, data + pos, sizeof(nrequests));
+	pos += sizeof(nrequests);
+
+	if (optlen - pos != ntohs(nrequests) * sizeof(uint16_t)) {
+		type = NBD_REP_ERR_INVALID;
+		goto reply;
+	}
+
+	struct nbd_export_info einfo;
+	memset(&einfo, 0, sizeof(einfo));
+
+	if (ops->lookup(export_name, &einfo, ops->arg) < 0) {
+		info("unknown export name %s", export_name);
+		type = NBD_REP_ERR_UNKNOWN;
+		goto reply;
+	}
+
+	{
+		struct nbd_info_export ie;
+		ie.type = htons(NBD_INFO_EXPORT);
+		ie.size = htonll(einfo.size);
+		ie.tm_flags16 = htons(negotiate_tm_flags16(einfo.flags));
+
+		ret = negotiate_send_opt_reply_data(sockfd, optnum, NBD_REP_INFO, &ie, sizeof(ie));
+		if (ret < 0)
+			goto err_out;
+	}
+
+	if (einfo.min_block) {
+		struct nbd_info_block_size ib;
+		ib.type = htons(NBD_INFO_BLOCK_SIZE);
+		ib.min_block  = htonl(einfo.min_block);
+		ib.pref_block = htonl(einfo.pref_block);
+		ib.max_block  = htonl(einfo.max_block);
+
+		ret = negotiate_send_opt_reply_data(sockfd, optnum, NBD_REP_INFO, &ib, sizeof(ib));
+		if (ret < 0)
+			goto err_out;
+	}
+
+reply:
+	ret = negotiate_send_opt_reply(sockfd, optnum, type);
+	if (ret < 0)
+		goto err_out;
+
+	if (optnum == NBD_OPT_GO && type == NBD_REP_ACK) {
+		info("requested target_name %s", export_name);
+		*name = export_name;
+		export_name = NULL;
+	}
+
+	g_free(export_name);
+	g_free(data);
+
+	return 0;
+
+err_out:
+	g_free(export_name);
+	g_free(data);
+
+	return -1;
+}
+
+/* NBD_OPT_LIST. Each export name is sent in NBD_REP_SERVER. */
+static int negotiate_list(int sockfd, uint32_t optlen, const struct nbd_export_ops *ops)
+{
+	if (negotiate_discard_opt_data(sockfd, optlen) < 0)
+		return -1;
+
+	if (optlen > 0)
+		return negotiate_send_opt_reply(sockfd, NBD_OPT_LIST, NBD_REP_ERR_INVALID);
+
+	char **names = ops->list ? ops->list(ops->arg) : NULL;
+	if (!names)
+		return negotiate_send_opt_reply(sockfd, NBD_OPT_LIST, NBD_REP_ERR_POLICY);
+
+	for (char **name = names; *name; name++) {
+		uint32_t namelen = strlen(*name);
+		char *replydata = g_malloc(sizeof(namelen) + namelen);
+
+		uint32_t namelen_be = htonl(namelen);
+		memcpy(replydata, &namelen_be, sizeof(namelen_be));
+		memcpy(replydata + sizeof(namelen_be), *name, namelen);
+
+		int ret = negotiate_send_opt_reply_data(sockfd, NBD_OPT_LIST, NBD_REP_SERVER, replydata, sizeof(namelen) + namelen);
+		g_free(replydata);
+		if (ret < 0) {
+			g_strfreev(names);
+			return -1;
+		}
+	}
+
+	g_strfreev(names);
+
+	return negotiate_send_opt_reply(sockfd, NBD_OPT_LIST, NBD_REP_ACK);
+}
+
+
+/*
+ * Negotiate options with a client, and get the name of the export it
+ * selected. If ops is given, the export is looked up, and the negotiation is
+ * completed; the transmission phase begins on return. Otherwise, the caller
+ * sends the size and the flags of the export with
+ * nbd_negotiate_v2_server_phase1_with_flags().
+ *
+ * Returning NULL if the negotiation failed, or the export is not found.
+ * Note: must free a returned buffer.
+ **/
+char *nbd_negotiate_v2_server_side(int sockfd, struct nbd_negotiate_options *opts, const struct nbd_export_ops *ops)
+{
+	struct nbd_negotiate_options supported;
+	memset(&supported, 0, sizeof(supported));
+
+	if (opts) {
+		supported = *opts;
+		memset(opts, 0, sizeof(*opts));
+	}
+
+	{
+		struct nbd_negotiate_v2_pdu_type0 pdu0;
+
+		pdu0.passwd = htonll(NBD_PASSWD);
+		pdu0.magic  = htonll(NBD_NEGOTIATE_VERSION2_MAGIC);
+		pdu0.hs_flags16 = htons(NBD_FLAG_FIXED_NEWSTYLE);
+
+		int ret = net_send_all_or_error(sockfd, &pdu0, sizeof(pdu0));
+		if (ret < 0)
+			return NULL;
+	}
+
+
+	uint32_t client_flags;
+
+	int ret = net_recv_all_or_error(sockfd, &client_flags, sizeof(client_flags));
+	if (ret < 0)
+		return NULL;
+
+	int fixed_newstyle = ntohl(client_flags) & NBD_FLAG_C_FIXED_NEWSTYLE;
+
+
+	for (;;) {
+		struct nbd_negotiate_v2_opt opt;
+
+		ret = net_recv_all_or_error(sockfd, &opt, sizeof(opt));
+		if (ret < 0)
+			return NULL;
+
+		if (ntohll(opt.opt_magic) != NBD_NEGOTIATE_VERSION2_MAGIC) {
+			warn("header mismatch");
+			return NULL;
+		}
+
+		uint32_t optnum = ntohl(opt.opt);
+		uint32_t optlen = ntohl(opt.len);
+
+		switch (optnum) {
+			case NBD_OPT_EXPORT_NAME:
+				{
+					if (optlen > XNBD_EXPORT_NAME_MAXLEN) {
+						warn("namesize error");
+						return NULL;
+					}
+
+					char *target_name = g_malloc0(optlen + 1);
+
+					ret = net_recv_all_or_error(sockfd, target_name, optlen);
+					if (ret < 0) {
+						g_free(target_name);
+						return NULL;
+					}
+
+					info("requested target_name %s", target_name);
+
+					if (ops) {
+						struct nbd_export_info einfo;
+						memset(&einfo, 0, sizeof(einfo));
+
+						/* no way to tell an error to the client */
+						if (ops->lookup(target_name, &einfo, ops->arg) < 0) {
+							warn("unknown export name %s", target_name);
+							g_free(target_name);
+							return NULL;
+						}
+
+						if (nbd_negotiate_v2_server_phase1_with_flags(sockfd, einfo.size, einfo.flags) < 0) {
+							g_free(target_name);
+							return NULL;
+						}
+					}
+
+					return target_name;
+				}
+
+			case NBD_OPT_ABORT:
+				info("negotiation aborted by the client");
+				if (negotiate_discard_opt_data(sockfd, optlen) == 0)
+					negotiate_send_opt_reply(sockfd, optnum, NBD_REP_ACK);
+				return NULL;
+
+			case NBD_OPT_STRUCTURED_REPLY:
+				{
+					uint32_t type;
+
+					if (optlen > 0)
+						type = NBD_REP_ERR_INVALID;
+					else if (supported.structured_reply)
+						type = NBD_REP_ACK;
+					else
+						type = NBD_REP_ERR_UNSUP;
+
+					if (negotiate_discard_opt_data(sockfd, optlen) < 0)
+						return NULL;
+
+					if (negotiate_send_opt_reply(sockfd, optnum, type) < 0)
+						return NULL;
+
+					if (type == NBD_REP_ACK) {
+						info("nbd_negotiate: structured replies");
+						opts->structured_reply = 1;
+					}
+				}
+				break;
+
+			case NBD_OPT_LIST_META_CONTEXT:
+			case NBD_OPT_SET_META_CONTEXT:
+				if (negotiate_meta_context(sockfd, optnum, optlen, &supported, opts ? opts : &supported) < 0)
+					return NULL;
+				break;
+
+			case NBD_OPT_LIST:
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+				if (ops) {
+					char *target_name = NULL;
+
+					if (optnum == NBD_OPT_LIST)
+						ret = negotiate_list(sockfd, optlen, ops);
+					else
+						ret = negotiate_export_info(sockfd, optnum, optlen, ops, &target_name);
+					if (ret < 0)
+						return NULL;
+
+					if (target_name)
+						return target_name;
+
+					break;
+				}
+				/* without ops, exports are not known here */
+				/* fall through */
+
+			default:
+				if (!fixed_newstyle) {
+					warn("unknown option %u", optnum);
+					return NULL;
+				}
+
+				info("unsupported option %u", optnum);
+
+				if (negotiate_discard_opt_data(sockfd, optlen) < 0)
+					return NULL;
+
+				if (negotiate_send_opt_reply(sockfd, optnum, NBD_REP_ERR_UNSUP) < 0)
+					return NULL;
+		}
+	}
+}
+
+/*
+ * get a target name from a client.
+ * Note: must free a returned buffer.
+ **/
+char *nbd_negotiate_v2_server_phase0_with_options(int sockfd, struct nbd_negotiate_options *opts)
+{
+	return nbd_negotiate_v2_server_side(sockfd, opts, NULL);
+}
+
+char *nbd_negotiate_v2_server_phase0(int sockfd)
+{
+	return nbd_negotiate_v2_server_phase0_with_options(sockfd, NULL);
+}
+
+
+/* return the size and transmission flags of the target image */
+int nbd_negotiate_v2_server_phase1_with_flags(int sockfd, off_t exportsize, uint32_t flags)
+{
+	g_assert(exportsize >= 0);
+
+	struct nbd_negotiate_v2_pdu_type2 pdu2;
+	/* clear the padding field with zero */
+	memset(&pdu2, 0, sizeof(pdu2));
+
+	uint16_t tm_flags16 = negotiate_tm_flags16(flags);
+	if (flags & NBD_FLAG_READ_ONLY)
+		info("nbd_negotiate: readonly");
+	if (flags & NBD_FLAG_CAN_MULTI_CONN)
+		info("nbd_negotiate: multiple connections allowed");
+
+	pdu2.size       = htonll(exportsize);
+	pdu2.tm_flags16 = htons(tm_flags16);
+
+	int ret = net_send_all_or_error(sockfd, &pdu2, sizeof(pdu2));
+	if (ret < 0) {
+		warn("negotiation failed");
+		return -1;
+	}
+
+	dbg("negotiate done");
+
+	return 0;
+}
+
+
+int nbd_negotiate_v2_server_phase1(int sockfd, off_t exportsize, int readonly)
+{
+	return nbd_negotiate_v2_server_phase1_with_flags(sockfd, exportsize, readonly ? NBD_FLAG_READ_ONLY : 0);
+}
+
+
+static int negotiate_send_option(int sockfd, uint32_t optnum, const void *data, uint32_t len)
+{
+	struct nbd_negotiate_v2_opt opt;
+	opt.opt_magic = htonll(NBD_NEGOTIATE_VERSION2_MAGIC);
+	opt.opt       = htonl(optnum);
+	opt.len       = htonl(len);
+
+	int ret = net_send_all_or_error(sockfd, &opt, sizeof(opt));
+	if (ret < 0)
+		return -1;
+
+	if (len > 0)
+		return net_send_all_or_error(sockfd, data, len);
+
+	return 0;
+}
+
+static int negotiate_recv_opt_reply(int sockfd, uint32_t optnum, uint32_t *type, uint32_t *len)
+{
+	struct nbd_negotiate_v2_opt_reply opt_reply;
+
+	int ret = net_recv_all_or_error(sockfd, &opt_reply, sizeof(opt_reply));
+	if (ret < 0)
+		return -1;
+
+	if (ntohll(opt_reply.magic) != NBD_REP_MAGIC || ntohl(opt_reply.opt) != optnum) {
+		warn("option reply mismatch");
+		return -1;
+	}
+
+	*type = ntohl(opt_reply.type);
+	*len  = ntohl(opt_reply.len);
+
+	return 0;
+}
+
+/* returns 1 if the server accepts the option, 0 if not, and -1 on error */
+static int negotiate_request_option(int sockfd, uint32_t optnum)
+{
+	uint32_t type, len;
+
+	if (negotiate_send_option(sockfd, optnum, NULL, 0) < 0)
+		return -1;
+
+	if (negotiate_recv_opt_reply(sockfd, optnum, &type, &len) < 0)
+		return -1;
+
+	if (negotiate_discard_opt_data(sockfd, len) < 0)
+		return -1;
+
+	if (type == NBD_REP_ACK)
+		return 1;
+
+	if (type & NBD_REP_FLAG_ERROR) {
+		info("option %u refused by the server (%x)", optnum, type);
+		return 0;
+	}
+
+	warn("unexpected option reply type %x", type);
+	return -1;
+}
+
+/*
+ * Select "base:allocation" for the export. Returning 1 with the context ID if
+ * the server supports it, 0 if not, and -1 on error.
+ */
+static int negotiate_request_base_allocation(int sockfd, size_t namesize, const char *target_name, uint32_t *context_id)
+{
+	const size_t querylen = strlen(NBD_META_BASE_ALLOCATION);
+	size_t len = sizeof(uint32_t) + namesize + sizeof(uint32_t) + sizeof(uint32_t) + querylen;
+	char *data = g_malloc(len);
+	char *p = data;
+	uint32_t val;
+
+	val = htonl(namesize);
+	memcpy(p, &val, sizeof(val));
+	p += sizeof(val);
+	memcpy(p, target_name, namesize);
+	p += namesize;
+
+	val = htonl(1);  /* the number of queries */
+	memcpy(p, &val, sizeof(val));
+	p += sizeof(val);
+
+	val = htonl(querylen);
+	memcpy(p, &val, sizeof(val));
+	p += sizeof(val);
+	memcpy(p, NBD_META_BASE_ALLOCATION, querylen);
+
+	int ret = negotiate_send_option(sockfd, NBD_OPT_SET_META_CONTEXT, data, len);
+	g_free(data);
+	if (ret < 0)
+		return -1;
+
+	int selected = 0;
+
+	for (;;) {
+		uint32_t type, replylen;
+
+		if (negotiate_recv_opt_reply(sockfd, NBD_OPT_SET_META_CONTEXT, &type, &replylen) < 0)
+			return -1;
+
+		if (type == NBD_REP_META_CONTEXT) {
+			if (replylen < sizeof(uint32_t) || replylen > XNBD_OPTION_MAXLEN)
+				return -1;
+
+			char *reply = g_malloc0(replylen + 1);
+			if (net_recv_all_or_error(sockfd, reply, replylen) < 0) {
+				g_free(reply);
+				return -1;
+			}
+
+			if (strcmp(reply + sizeof(uint32_t), NBD_META_BASE_ALLOCATION) == 0) {
+				memcpy(&val, reply, sizeof(val));
+				*context_id = ntohl(val);
+				selected = 1;
+			}
+
+			g_free(reply);
+			continue;
+		}
+
+		if (negotiate_discard_opt_data(sockfd, replylen) < 0)
+			return -1;
+
+		if (type == NBD_REP_ACK)
+			return selected;
+
+		if (type & NBD_REP_FLAG_ERROR) {
+			info("metadata context refused by the server (%x)", type);
+			return 0;
+		}
+
+		warn("unexpected option reply type %x", type);
+		return -1;
+	}
+}
+
+int nbd_negotiate_v2_client_side_with_options(int sockfd, off_t *exportsize, uint32_t *exportflags,
+		size_t namesize, const char *target_name, struct nbd_negotiate_options *opts)
+{
+	int ret;
+	uint16_t hs_flags16;
+
+	struct nbd_negotiate_options wanted;
+	memset(&wanted, 0, sizeof(wanted));
+
+	if (opts) {
+		wanted = *opts;
+		memset(opts, 0, sizeof(*opts));
+	}
+
+	{
+		struct nbd_negotiate_v2_pdu_type0 pdu0;
+
+		ret = net_recv_all_or_error(sockfd, &pdu0, sizeof(pdu0));
+		if (ret < 0)
+			goto err_out;
+
+		if (ntohll(pdu0.passwd) != NBD_PASSWD) {
+			warn("password mismatch");
+			goto err_out;
+		}
+
+		if (ntohll(pdu0.magic) == NBD_NEGOTIATE_VERSION1_MAGIC) {
+			warn("A wrapped server was expected, but a plain server is found");
+			goto err_out;
+		}
+
+		if (ntohll(pdu0.magic) != NBD_NEGOTIATE_VERSION2_MAGIC) {
+			warn("negotiate magic does not match VERSION 1");
+			goto err_out;
+		}
+
+		hs_flags16 = ntohs(pdu0.hs_flags16);
+	}
+
+
+	{
+		uint32_t client_flags = 0;
+		if (hs_flags16 & NBD_FLAG_FIXED_NEWSTYLE)
+			client_flags |= NBD_FLAG_C_FIXED_NEWSTYLE;
+
+		client_flags = htonl(client_flags);
+
+		ret = net_send_all_or_error(sockfd, &client_flags, sizeof(client_flags));
+		if (ret < 0)
+			goto err_out;
+	}
+
+
+	if (wanted.structured_reply) {
+		if (hs_flags16 & NBD_FLAG_FIXED_NEWSTYLE) {
+			ret = negotiate_request_option(sockfd, NBD_OPT_STRUCTURED_REPLY);
+			if (ret < 0)
+				goto err_out;
+
+			opts->structured_reply = ret;
+		}
+
+		info("structured replies %s", opts->structured_reply ? "enabled" : "not supported by the server");
+	}
+
+	if (wanted.base_allocation && opts->structured_reply) {
+		ret = negotiate_request_base_allocation(sockfd, namesize, target_name, &opts->base_allocation_id);
+		if (ret < 0)
+			goto err_out;
+
+		opts->base_allocation = ret;
+
+		info("metadata context %s %s", NBD_META_BASE_ALLOCATION, ret ? "enabled" : "not supported by the server");
+	}
+
+
+	{
+		struct nbd_negotiate_v2_opt opt;
+		opt.opt_magic = htonll(NBD_NEGOTIATE_VERSION2_MAGIC);
+		opt.opt       = htonl(NBD_NEGOTIATE_VERSION2_OPT_EXPORT_NAME);
+		opt.len       = htonl(namesize);
+
+		ret = net_send_all_or_error(sockfd, &opt, sizeof(opt));
+		if (ret < 0)
+			goto err_out;
+
+		ret = net_send_all_or_error(sockfd, target_name, namesize);
+		if (ret < 0)
+			goto err_out;
+	}
+
+
+	{
+		struct nbd_negotiate_v2_pdu_type2 pdu2;
+
+		ret = net_recv_all_or_error(sockfd, &pdu2, sizeof(pdu2));
+		if (ret < 0)
+			goto err_out;
+
+		uint64_t size       = ntohll(pdu2.size);
+		uint16_t tm_flags16 = ntohs(pdu2.tm_flags16);
+
+		info("remote size: %ju bytes (%ju MBytes)", size, size /1024 /1024);
+
+
+		if (size > OFF_MAX) {
+			warn("remote size exceeds a local off_t(%zd bytes) value", sizeof(off_t));
+			return -1;
+		}
+
+		if (exportsize)
+			*exportsize  = (off_t) size;
+		if (exportflags)
+			*exportflags = tm_flags16;
+	}
+
+
+	return 0;
+
+err_out:
+	return -1;
+}
+
+int nbd_negotiate_v2_client_side(int sockfd, off_t *exportsize, uint32_t *exportflags, size_t namesize, const char *target_name)
+{
+	return nbd_negotiate_v2_client_side_with_options(sockfd, exportsize, exportflags, namesize, target_name, NULL);
+}
+
+
+
+/*
+ * For the old negotination protocol.
+ * We name it VERSION 1.
+ **/
+
+struct nbd_negotiate_v1_pdu {
+	uint64_t passwd;
+	uint64_t magic;
+	uint64_t size;
+	uint32_t flags;
+	char padding[124];
+} __attribute__((__packed__));
+
+
+/*
+ * flags are transmission flags of the export. NBD_FLAG_HAS_FLAGS and
+ * NBD_FLAG_SEND_FLUSH are always set.
+ */
+int nbd_negotiate_v1_server_side_with_flags(int sockfd, off_t exportsize, uint32_t flags)
+{
+	g_assert(exportsize >= 0);
+
+	struct nbd_negotiate_v1_pdu pdu;
+	memset(&pdu, 0, sizeof(pdu));
+
+	flags |= NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH;
+	if (flags & NBD_FLAG_READ_ONLY)
+		info("nbd_negotiate: readonly");
+	if (flags & NBD_FLAG_CAN_MULTI_CONN)
+		info("nbd_negotiate: multiple connections allowed");
 
 	pdu.passwd = htonll(NBD_PASSWD);
 	pdu.magic  = htonll(NBD_NEGOTIATE_VERSION1_MAGIC);
@@ -543,12 +2087,12 @@ err_out:
 
 int nbd_negotiate_v1_server_side_readonly(int sockfd, off_t exportsize)
 {
-	return nbd_negotiate_v1_server_side_main(sockfd, exportsize, 1);
+	return nbd_negotiate_v1_server_side_with_flags(sockfd, exportsize, NBD_FLAG_READ_ONLY);
 }
 
 int nbd_negotiate_v1_server_side(int sockfd, off_t exportsize)
 {
-	return nbd_negotiate_v1_server_side_main(sockfd, exportsize, 0);
+	return nbd_negotiate_v1_server_side_with_flags(sockfd, exportsize, 0);
 }
 
 int nbd_negotiate_v1_client_side(int sockfd, off_t *exportsize, uint32_t *exportflags)
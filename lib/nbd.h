@@ -65,28 +65,149 @@ enum {
 
 	NBD_CMD_CACHE = 5,
 
-	NBD_CMD_READ_COMPRESS = 6,
-	NBD_CMD_READ_COMPRESS_LZO = 7,
+	NBD_CMD_WRITE_ZEROES = 6,
 
-	NBD_CMD_UNDEFINED = 8
+	NBD_CMD_BLOCK_STATUS = 7,
+
+	/*
+	 * xNBD extensions. They are numbered apart from the commands of the
+	 * NBD protocol, so that they never collide with new ones.
+	 */
+	NBD_CMD_READ_COMPRESS = 0x4000,
+	NBD_CMD_READ_COMPRESS_LZO,
+
+	/* xnbd-bgctl pushes block data to the proxy server */
+	NBD_CMD_CACHE_FILL,
+
+	/* xnbd-bgctl tells the proxy server that blocks are zero in the remote server */
+	NBD_CMD_CACHE_ZERO,
+
+	/* compressed reads with the other codecs; see xnbd_codec.c */
+	NBD_CMD_READ_COMPRESS_LZ4,
+	NBD_CMD_READ_COMPRESS_ZSTD,
+
+	/* fingerprints of blocks, for the delta sync of the proxy server; see xnbd_checksum.c */
+	NBD_CMD_CHECKSUM,
+
+	NBD_CMD_UNDEFINED
 };
 
+/* the upper 16 bits of the type field of a request */
+#define NBD_CMD_MASK_COMMAND 0x0000ffff
+#define NBD_CMD_SHIFT_FLAGS  16
+
+#define NBD_CMD_FLAG_FUA       (1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE   (1 << 1)
+#define NBD_CMD_FLAG_REQ_ONE   (1 << 3)
+#define NBD_CMD_FLAG_FAST_ZERO (1 << 4)
+
+/* xNBD: the level of a compressed read, in the upper byte of the flags (0: default) */
+#define NBD_CMD_FLAG_LEVEL_SHIFT 8
+#define NBD_CMD_FLAG_LEVEL_MASK  (0xff << NBD_CMD_FLAG_LEVEL_SHIFT)
+
 const char *nbd_get_iotype_string(uint32_t iotype);
 
 
 int nbd_negotiate_v1_server_side(int sockfd, off_t exportsize);
 int nbd_negotiate_v1_server_side_readonly(int sockfd, off_t exportsize);
+int nbd_negotiate_v1_server_side_with_flags(int sockfd, off_t exportsize, uint32_t flags);
 int nbd_negotiate_v1_client_side(int sockfd, off_t *exportsize, uint32_t *exportflags);
 
 char *nbd_negotiate_v2_server_phase0(int sockfd);
 int   nbd_negotiate_v2_server_phase1(int sockfd, off_t exportsize, int readonly);
+int   nbd_negotiate_v2_server_phase1_with_flags(int sockfd, off_t exportsize, uint32_t flags);
 int   nbd_negotiate_v2_client_side(int sockfd, off_t *exportsize, uint32_t *exportflags, size_t namesize, const char *target_name);
 
+/*
+ * Options haggled in the negotiation of VERSION 2. A server sets the options
+ * it supports, and a client sets the options it wants. On return, only the
+ * options agreed with the other side are left set.
+ */
+struct nbd_negotiate_options {
+	int structured_reply;
+
+	/* the metadata context "base:allocation" for NBD_CMD_BLOCK_STATUS */
+	int base_allocation;
+	uint32_t base_allocation_id;
+};
+
+/* the metadata context ID of "base:allocation" in our servers */
+#define NBD_META_ID_BASE_ALLOCATION 1
+#define NBD_META_BASE_ALLOCATION "base:allocation"
+
+char *nbd_negotiate_v2_server_phase0_with_options(int sockfd, struct nbd_negotiate_options *opts);
+
+/*
+ * An export of a server, told to a client in the reply to NBD_OPT_INFO and
+ * NBD_OPT_GO. The size and the flags are also sent after NBD_OPT_EXPORT_NAME.
+ */
+struct nbd_export_info {
+	off_t size;
+	/* the same as given to nbd_negotiate_v2_server_phase1_with_flags() */
+	uint32_t flags;
+
+	/* NBD_INFO_BLOCK_SIZE; not sent if min_block is 0 */
+	uint32_t min_block;
+	uint32_t pref_block;
+	uint32_t max_block;
+};
+
+/* the exports of a server, looked up during the negotiation */
+struct nbd_export_ops {
+	/* fill in info of an export; returning -1 if no such export */
+	int (*lookup)(const char *name, struct nbd_export_info *info, void *arg);
+
+	/* a NULL-terminated array of export names, freed with g_strfreev().
+	 * NULL if listing is not allowed. */
+	char **(*list)(void *arg);
+
+	void *arg;
+};
+
+char *nbd_negotiate_v2_server_side(int sockfd, struct nbd_negotiate_options *opts, const struct nbd_export_ops *ops);
+int   nbd_negotiate_v2_client_side_with_options(int sockfd, off_t *exportsize, uint32_t *exportflags,
+		size_t namesize, const char *target_name, struct nbd_negotiate_options *opts);
+
+/* handshake flags */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+/* client flags */
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
+
+#define NBD_OPT_EXPORT_NAME      1
+#define NBD_OPT_ABORT            2
+#define NBD_OPT_LIST             3
+#define NBD_OPT_INFO             6
+#define NBD_OPT_GO               7
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT 10
+
+#define NBD_REP_MAGIC 0x3e889045565a9ULL
+#define NBD_REP_ACK   1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO  3
+#define NBD_REP_META_CONTEXT 4
+#define NBD_REP_FLAG_ERROR   (1U << 31)
+#define NBD_REP_ERR_UNSUP    (NBD_REP_FLAG_ERROR | 1)
+#define NBD_REP_ERR_POLICY   (NBD_REP_FLAG_ERROR | 2)
+#define NBD_REP_ERR_INVALID  (NBD_REP_FLAG_ERROR | 3)
+#define NBD_REP_ERR_UNKNOWN  (NBD_REP_FLAG_ERROR | 6)
+
+/* information types in NBD_REP_INFO */
+#define NBD_INFO_EXPORT      0
+#define NBD_INFO_BLOCK_SIZE  3
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)
 #define NBD_FLAG_READ_ONLY      (1 << 1)
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)
-/* skip _SEND_FUA and _ROTATIONAL */
+#define NBD_FLAG_SEND_FUA       (1 << 3)
+/* skip _ROTATIONAL */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+/* skip _SEND_DF */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+/* skip _SEND_RESIZE and _SEND_CACHE */
+#define NBD_FLAG_SEND_FAST_ZERO (1 << 11)
 
 
 
@@ -101,8 +222,35 @@ void nbd_reply_dump(struct nbd_reply *reply);
 #define NBD_SERVER_RECV__MAGIC_MISMATCH  (-2)
 #define NBD_SERVER_RECV__TERMINATE       (-3)
 
-int  nbd_server_recv_request(int clientfd, off_t disksize, uint32_t *iotype_arg, off_t *iofrom_arg,
-		size_t *iolen_arg, struct nbd_reply *reply);
+int  nbd_server_recv_request(int clientfd, off_t disksize, uint32_t *iotype_arg, uint32_t *ioflags_arg,
+		off_t *iofrom_arg, size_t *iolen_arg, struct nbd_reply *reply);
+
+/* buffered request reader */
+#define NBD_REQUEST_READER_BUFSIZE (64 * 1024)
+
+struct nbd_request_reader {
+	int fd;
+
+	char *buf;
+	size_t buflen;
+
+	/* unparsed data is between head and tail */
+	size_t head;
+	size_t tail;
+
+	/* a stop was notified; do not read ahead anymore */
+	int stopped;
+};
+
+struct nbd_request_reader *nbd_request_reader_create(int fd);
+struct nbd_request_reader *nbd_request_reader_create_sized(int fd, size_t buflen);
+size_t nbd_request_reader_buffered(struct nbd_request_reader *reader);
+void nbd_request_reader_destroy(struct nbd_request_reader *reader);
+int  nbd_request_reader_wait(struct nbd_request_reader *reader, int unblock_fd);
+int  nbd_server_recv_request_buffered(struct nbd_request_reader *reader, off_t disksize, uint32_t *iotype_arg,
+		uint32_t *ioflags_arg, off_t *iofrom_arg, size_t *iolen_arg, struct nbd_reply *reply);
+int  nbd_request_reader_recv_payload(struct nbd_request_reader *reader, void *buf, size_t len);
+int  nbd_request_reader_recv_payload_iov(struct nbd_request_reader *reader, struct iovec *iov, unsigned int count);
 
 int nbd_client_send_request_header(int remotefd, uint32_t iotype, off_t iofrom, size_t len, uint64_t handle);
 int nbd_client_recv_reply_header(int remotefd, uint64_t handle);
@@ -111,7 +259,111 @@ int nbd_client_recv_read_reply_iov(int remotefd, struct iovec *iov, unsigned int
 
 int nbd_client_send_read_request(int remotefd, off_t iofrom, size_t len);
 int nbd_client_recv_read_reply(int remotefd, char *buf, size_t len);
+int nbd_client_send_read_request_type(int remotefd, uint32_t iotype, off_t iofrom, size_t len);
+int nbd_client_recv_read_reply_header(int remotefd);
 
 void nbd_client_send_disc_request(int remotefd);
 
+
+
+/*
+ * Structured replies. Once negotiated, the reply of NBD_CMD_READ consists of
+ * chunks; unallocated ranges are sent as hole chunks without any payload.
+ */
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) + 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1 << 15) + 2)
+#define NBD_REPLY_TYPE_IS_ERR(type) ((type) & (1 << 15))
+
+struct nbd_structured_reply {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint32_t length;
+} __attribute__((__packed__));
+
+/* the header of a chunk, and the fixed-size part of its payload */
+union nbd_structured_reply_chunk {
+	struct nbd_structured_reply header;
+
+	struct {
+		struct nbd_structured_reply header;
+		uint64_t offset;
+		uint32_t hole_size; /* NBD_REPLY_TYPE_OFFSET_HOLE only */
+	} __attribute__((__packed__)) ofs;
+
+	struct {
+		struct nbd_structured_reply header;
+		uint32_t error;
+		uint16_t msglen;
+	} __attribute__((__packed__)) err;
+
+	struct {
+		struct nbd_structured_reply header;
+		uint32_t context_id;
+	} __attribute__((__packed__)) bs;
+};
+
+size_t nbd_structured_reply_setup_read_chunk(union nbd_structured_reply_chunk *chunk, struct nbd_reply *reply,
+		off_t iofrom, size_t iolen, int hole, int done);
+size_t nbd_structured_reply_setup_error_chunk(union nbd_structured_reply_chunk *chunk, struct nbd_reply *reply);
+
+/* a range of a read reply; buf is NULL for a hole */
+struct nbd_read_chunk {
+	off_t iofrom;
+	size_t iolen;
+	char *buf;
+};
+
+int nbd_server_send_read_reply_structured(int clientfd, struct nbd_reply *reply,
+		struct nbd_read_chunk *chunks, unsigned int nchunks, unsigned int hole_blocksize);
+
+int nbd_client_recv_read_reply_structured_iov(int remotefd, struct iovec *iov, unsigned int count,
+		uint64_t handle, off_t iofrom);
+int nbd_client_recv_read_reply_structured(int remotefd, char *buf, size_t len, off_t iofrom);
+
+
+
+/* NBD_CMD_BLOCK_STATUS with the metadata context "base:allocation" */
+#define NBD_STATE_HOLE (1 << 0)
+#define NBD_STATE_ZERO (1 << 1)
+
+struct nbd_block_descriptor {
+	uint32_t length;
+	uint32_t status_flags;
+} __attribute__((__packed__));
+
+/* descriptors in host byte order */
+struct nbd_block_status {
+	struct nbd_block_descriptor *descs;
+	unsigned int ndescs;
+	unsigned int maxdescs;
+
+	/* the total length of descs */
+	size_t length;
+};
+
+/* a server may describe only the beginning of a requested range */
+#define NBD_BLOCK_STATUS_MAXDESCS 4096
+
+void nbd_block_status_init(struct nbd_block_status *bs);
+void nbd_block_status_free(struct nbd_block_status *bs);
+int  nbd_block_status_add(struct nbd_block_status *bs, size_t len, uint32_t status_flags);
+
+size_t nbd_structured_reply_setup_block_status_chunk(union nbd_structured_reply_chunk *chunk, struct nbd_reply *reply,
+		uint32_t context_id, unsigned int ndescs);
+int nbd_server_send_block_status_reply(int clientfd, struct nbd_reply *reply, uint32_t context_id,
+		struct nbd_block_status *bs);
+
+int nbd_client_recv_block_status_reply(int remotefd, uint64_t handle, uint32_t context_id,
+		struct nbd_block_status *bs);
+
 #endif
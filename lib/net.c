@@ -653,14 +653,14 @@ int unix_connect(const char *path)
 	return fd;
 }
 
-int unix_send_fd(int socket, int fd)
+int unix_send_fd_with_data(int socket, int fd, const void *buf, size_t len, int flags)
 {
 	struct msghdr msg;
 	memset(&msg, 0, sizeof(msg));
 
 	struct iovec iov[1];
-	iov[0].iov_base = (char *) "";
-	iov[0].iov_len = 1;
+	iov[0].iov_base = (void *) buf;
+	iov[0].iov_len = len;
 	msg.msg_iov = iov;
 	msg.msg_iovlen = 1;
 
@@ -680,7 +680,7 @@ int unix_send_fd(int socket, int fd)
 	msg.msg_controllen = cmsg->cmsg_len;
 
 
-	int ret = sendmsg(socket, &msg, 0);
+	int ret = sendmsg(socket, &msg, flags);
 	if (ret == -1)
 		warn("send_fd, %m");
 	else if (ret == 0)
@@ -688,9 +688,68 @@ int unix_send_fd(int socket, int fd)
 
 
 	return ret;
+}
+
+int unix_send_fd(int socket, int fd)
+{
+	return unix_send_fd_with_data(socket, fd, "", 1, 0);
 };
 
 
+/*
+ * Receive a descriptor sent with unix_send_fd_with_data(), together with
+ * exactly len bytes of data. Unlike unix_recv_fd(), return -1 if the peer
+ * has closed the socket or the message is malformed.
+ **/
+int unix_recv_fd_with_data(int socket, void *buf, size_t len)
+{
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+
+	int fd = -1;
+
+	struct iovec iov[1];
+	iov[0].iov_base = buf;
+	iov[0].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+	char data_buf[CMSG_SPACE(sizeof(fd))];
+
+	msg.msg_control = data_buf;
+	msg.msg_controllen = sizeof(data_buf);
+
+	ssize_t ret = recvmsg(socket, &msg, 0);
+	if (ret == -1) {
+		warn("recv_fd, %m");
+		return -1;
+	} else if (ret == 0) {
+		dbg("recv_fd, peer closed");
+		return -1;
+	}
+
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(fd))
+		&& cmsg->cmsg_level == SOL_SOCKET
+		&& cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	if ((size_t) ret != len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || fd < 0) {
+		warn("recv_fd, malformed message");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+
+	info("fd %d received", fd);
+
+
+	return fd;
+}
+
+
 int unix_recv_fd(int socket)
 {
 	struct msghdr msg;
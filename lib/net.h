@@ -81,5 +81,7 @@ int check_fin(int ret, int errcode, size_t len);
 int unix_connect(const char *path);
 int unix_send_fd(int socket, int fd);
 int unix_recv_fd(int socket);
+int unix_send_fd_with_data(int socket, int fd, const void *buf, size_t len, int flags);
+int unix_recv_fd_with_data(int socket, void *buf, size_t len);
 
 #endif
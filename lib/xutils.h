@@ -26,3 +26,5 @@
 #include "net.h"
 #include "nbd.h"
 #include "bitmap.h"
+#include "lfqueue.h"
+#include "zero.h"
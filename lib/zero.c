@@ -0,0 +1,174 @@
+/*
+ * xNBD - an enhanced Network Block Device program
+ *
+ * Copyright (C) 2008-2014 National Institute of Advanced Industrial Science
+ * and Technology
+ *
+ * Author: Takahiro Hirofuchi <t.hirofuchi _at_ aist.go.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "zero.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZERO_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+/*
+ * All the functions check whether the buffer is filled with the 4-byte
+ * pattern of color (as stored in memory); zero is just a color. The SIMD
+ * loops consume 128 bytes per iteration and leave the rest to the scalar
+ * one. Since they stop at a multiple of 8 bytes, the rest starts at the
+ * first byte of the pattern.
+ */
+typedef bool (*buffer_check_fn)(const unsigned char *buf, size_t len, uint32_t color);
+
+static bool buffer_is_filled_scalar(const unsigned char *buf, size_t len, uint32_t color)
+{
+	uint64_t pattern;
+	memcpy(&pattern, &color, sizeof(color));
+	memcpy((char *) &pattern + sizeof(color), &color, sizeof(color));
+
+	size_t i = 0;
+
+	for (; i + 4 * sizeof(uint64_t) <= len; i += 4 * sizeof(uint64_t)) {
+		uint64_t w[4];
+		memcpy(w, buf + i, sizeof(w));
+
+		if (((w[0] ^ pattern) | (w[1] ^ pattern) | (w[2] ^ pattern) | (w[3] ^ pattern)) != 0)
+			return false;
+	}
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t w;
+		memcpy(&w, buf + i, sizeof(w));
+
+		if (w != pattern)
+			return false;
+	}
+
+	const unsigned char *bytes = (const unsigned char *) &pattern;
+	for (unsigned int j = 0; i < len; i++, j++)
+		if (buf[i] != bytes[j])
+			return false;
+
+	return true;
+}
+
+#ifdef ZERO_X86_SIMD
+__attribute__((target("sse2")))
+static bool buffer_is_filled_sse2(const unsigned char *buf, size_t len, uint32_t color)
+{
+	const __m128i pattern = _mm_set1_epi32((int) color);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 8 * sizeof(__m128i) <= len; i += 8 * sizeof(__m128i)) {
+		const __m128i *p = (const __m128i *) (buf + i);
+		__m128i acc = _mm_xor_si128(_mm_loadu_si128(p + 0), pattern);
+
+		for (int k = 1; k < 8; k++)
+			acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128(p + k), pattern));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return false;
+	}
+
+	return buffer_is_filled_scalar(buf + i, len - i, color);
+}
+
+__attribute__((target("avx2")))
+static bool buffer_is_filled_avx2(const unsigned char *buf, size_t len, uint32_t color)
+{
+	const __m256i pattern = _mm256_set1_epi32((int) color);
+	size_t i = 0;
+
+	for (; i + 4 * sizeof(__m256i) <= len; i += 4 * sizeof(__m256i)) {
+		const __m256i *p = (const __m256i *) (buf + i);
+		__m256i a = _mm256_xor_si256(_mm256_loadu_si256(p + 0), pattern);
+		__m256i b = _mm256_xor_si256(_mm256_loadu_si256(p + 1), pattern);
+		__m256i c = _mm256_xor_si256(_mm256_loadu_si256(p + 2), pattern);
+		__m256i d = _mm256_xor_si256(_mm256_loadu_si256(p + 3), pattern);
+		__m256i acc = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+
+		if (!_mm256_testz_si256(acc, acc))
+			return false;
+	}
+
+	return buffer_is_filled_scalar(buf + i, len - i, color);
+}
+#endif
+
+struct buffer_check_impl {
+	const char *name;
+	buffer_check_fn fn;
+};
+
+static const struct buffer_check_impl impls[] = {
+#ifdef ZERO_X86_SIMD
+	{ "avx2",   buffer_is_filled_avx2 },
+	{ "sse2",   buffer_is_filled_sse2 },
+#endif
+	{ "scalar", buffer_is_filled_scalar },
+};
+
+static const struct buffer_check_impl *buffer_check_impl;
+
+static const struct buffer_check_impl *buffer_check_select(void)
+{
+	const struct buffer_check_impl *impl = __atomic_load_n(&buffer_check_impl, __ATOMIC_ACQUIRE);
+	if (impl)
+		return impl;
+
+	impl = &impls[G_N_ELEMENTS(impls) - 1];
+
+#ifdef ZERO_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = &impls[0];
+	else if (__builtin_cpu_supports("sse2"))
+		impl = &impls[1];
+#endif
+
+	/* every thread selects the same one; no need to serialize */
+	__atomic_store_n(&buffer_check_impl, impl, __ATOMIC_RELEASE);
+	dbg("buffer check: %s", impl->name);
+
+	return impl;
+}
+
+const char *buffer_check_impl_name(void)
+{
+	return buffer_check_select()->name;
+}
+
+bool buffer_is_zero(const void *buf, size_t len)
+{
+	return buffer_check_select()->fn(buf, len, 0);
+}
+
+bool buffer_is_unicolor(const void *buf, size_t len, uint32_t *color)
+{
+	if (len == 0 || len % sizeof(uint32_t))
+		return false;
+
+	memcpy(color, buf, sizeof(uint32_t));
+
+	return buffer_check_select()->fn(buf, len, *color);
+}
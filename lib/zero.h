@@ -0,0 +1,50 @@
+/*
+ * xNBD - an enhanced Network Block Device program
+ *
+ * Copyright (C) 2008-2014 National Institute of Advanced Industrial Science
+ * and Technology
+ *
+ * Author: Takahiro Hirofuchi <t.hirofuchi _at_ aist.go.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef LIB_XNBD_ZERO_H
+#define LIB_XNBD_ZERO_H
+
+#include "common.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/*
+ * Detection of zero (or unicolor) buffers. This runs on every written block,
+ * so the buffer is scanned with SIMD instructions (AVX2 or SSE2, chosen at
+ * runtime) if the CPU has them.
+ */
+
+/* true if all the bytes of the buffer are zero */
+bool buffer_is_zero(const void *buf, size_t len);
+
+/*
+ * true if the buffer is a repetition of its first uint32_t value, which is
+ * set to *color. len must be a non-zero multiple of sizeof(uint32_t).
+ */
+bool buffer_is_unicolor(const void *buf, size_t len, uint32_t *color);
+
+/* the name of the implementation in use, e.g., "avx2" */
+const char *buffer_check_impl_name(void);
+
+#endif
@@ -67,12 +67,6 @@
 #include <poll.h>
 
 
-#ifdef XNBD_LZO
-#include <lzo/lzoconf.h>
-#include <lzo/lzo1x.h>
-#endif
-
-
 struct disk_image {
 	char *path;
 	int diskfd;
@@ -82,14 +76,30 @@ struct disk_image {
 	size_t bmlen;
 
 	bool persistent;
+
+	/* mapped read/write; only the top layer can be */
+	bool writable;
+
+	/* the file system cannot zero a range; zero blocks are written out */
+	bool no_zero_range;
 };
 
-#define MAX_DISKIMAGESTACK 10
+/* bounded only by the type of the owner index */
+#define MAX_DISKIMAGESTACK G_MAXUINT16
 struct disk_stack {
 	int nlayers;
-	struct disk_image *image[MAX_DISKIMAGESTACK];
+	int nallocated;
+	struct disk_image **image;
 
 	off_t disksize;
+
+	/*
+	 * The layer having each block, among the layers below the top one
+	 * (i.e., two bytes per block, 512 MiB for a disk of 1 TiB). The bitmap
+	 * of the top layer, which is still written, is tested before it. NULL
+	 * if only the base image is below the top layer.
+	 */
+	guint16 *owner;
 };
 
 struct disk_stack_io {
@@ -99,7 +109,15 @@ struct disk_stack_io {
 	struct iovec *iov;
 	unsigned int iov_size;
 
-	struct mmap_block_region *mbrs[MAX_DISKIMAGESTACK];
+	/* reading: the layer where the block of each iovec is found */
+	int *iov_layer;
+
+	/* the blocks of the region */
+	unsigned long index_sta;
+	unsigned long index_end;
+
+	/* one for each layer, NULL if not needed by the request */
+	struct mmap_block_region **mbrs;
 };
 
 
@@ -117,6 +135,19 @@ enum xnbd_cmd_type {
 };
 
 
+/* codecs of compressed reads (NBD_CMD_READ_COMPRESS*) */
+enum xnbd_codec {
+	XNBD_CODEC_NONE,  /* only unicolor blocks are compressed */
+	XNBD_CODEC_LZO,
+	XNBD_CODEC_LZ4,
+	XNBD_CODEC_ZSTD,
+	XNBD_CODEC_UNDEFINED
+};
+
+/* the largest chunk compressed at once */
+#define XNBD_CODEC_CHUNKSIZE  (64 * 1024)
+
+
 /* common with all sessions for a particular disk */
 struct xnbd_info {
 	enum xnbd_cmd_type cmd;
@@ -125,15 +156,35 @@ struct xnbd_info {
 	unsigned long nblocks;
 	int readonly;
 
+	/* share identical blocks of written data (--dedup) */
+	bool dedup;
+	/* the fingerprint index shared by the sessions of a disk stack */
+	struct xnbd_dedup_table *dedup_table;
+
+	/* negotiated by the client of --connected-fd */
+	struct nbd_negotiate_options connected_opts;
+
 	GList *sessions;
 
 	/* xnbd_cmd_target mode */
 	char *target_diskpath;
 	int target_diskfd;
 
-	/* xnbd_cmd_cow_target mode */
+	/* xnbd_cmd_target mode with the reactor (0: fork a worker per client) */
+	unsigned int target_nthreads;
+	char **target_diskpaths;  /* NULL-terminated, including target_diskpath */
+
+	/* xnbd_cmd_target mode with online snapshots (--online-snapshot) */
+	bool target_online_snapshot;
+	/* merge layers above this number of frozen ones (0: never), at most merge_rate bytes/s */
+	int target_merge_layers;
+	size_t target_merge_rate;
+	pid_t target_merge_pid;
+
+	/* xnbd_cmd_cow_target mode, or the target mode after an online snapshot */
 	char *cow_diskpath;
 	struct disk_stack *cow_ds;
+	int cow_id;  /* persistent layers of --cowid, or -1 for a volatile one */
 
 	/* xnbd_cmd_proxy mode */
 	int proxy_pid;
@@ -151,6 +202,12 @@ struct xnbd_info {
 	char *proxy_unixpath;
 	char *proxy_target_exportname;  /* export name to request from a xnbd-wrapper target */
 	bool proxy_clear_bitmap;
+	/* uncache the blocks changed in the remote disk on startup (--delta-sync) */
+	bool proxy_delta_sync;
+	/* read from the remote server with compressed reads (--compressed-read) */
+	bool proxy_compressed_read;
+	enum xnbd_codec proxy_codec;
+	int proxy_codec_level;
 
 	size_t proxy_max_buf_size;
 	size_t proxy_max_que_size;
@@ -163,6 +220,9 @@ struct xnbd_session {
 	struct xnbd_info *xnbd;
 
 	int pipe_worker_fd; /* worker */
+	struct nbd_request_reader *reader; /* worker */
+	struct nbd_negotiate_options opts; /* worker */
+	struct xnbd_dedup *dedup; /* worker of a disk stack with --dedup */
 	int pipe_master_fd; /* master */
 	pid_t pid;          /* master */
 	int notifying;      /* master */
@@ -187,6 +247,17 @@ extern const int XNBD_PORT;
  **/
 #define CBLOCKSIZE  4096
 
+/*
+ * The largest request a client is asked to send (NBD_INFO_BLOCK_SIZE). The
+ * proxy server forwards a read request as at most MAXNBLOCK remote requests,
+ * one for each run of uncached blocks; a request of 32 blocks never exceeds it.
+ **/
+#define XNBD_MAX_REQUEST_SIZE        (32 * 1024 * 1024)
+#define XNBD_PROXY_MAX_REQUEST_SIZE  (32 * CBLOCKSIZE)
+
+/* the largest range of a checksum request (NBD_CMD_CHECKSUM) */
+#define XNBD_CHECKSUM_MAX_LENGTH     (32 * 1024 * 1024)
+
 
 static inline size_t confine_iolen_within_disk(off_t disksize, off_t iofrom, size_t iolen)
 {
@@ -236,19 +307,90 @@ void mmap_block_region_free(struct mmap_block_region *);
 
 int poll_request_arrival(struct xnbd_session *ses);
 unsigned long get_disk_nblocks(off_t disksize);
+uint32_t xnbd_get_export_flags(struct xnbd_info *xnbd);
+void xnbd_get_export_info(struct xnbd_info *xnbd, struct nbd_export_info *info);
 
 
 /* xnbd_cmd_target mode */
 void xnbd_target_open_disk(char *diskpath, struct xnbd_info *xnbd);
 void xnbd_target_make_snapshot(struct xnbd_info *xnbd);
+void xnbd_target_merge_layers(struct xnbd_info *xnbd);
+void xnbd_target_merge_done(struct xnbd_info *xnbd);
 int xnbd_target_session_server(struct xnbd_session *);
 
+/* a request of the target mode, received before being served */
+struct xnbd_target_request {
+	uint32_t iotype;
+	uint32_t ioflags;
+	off_t iofrom;
+	size_t iolen;
+	struct nbd_reply reply;
+
+	/* the data of NBD_CMD_WRITE, if received ahead of serving */
+	char *write_buf;
+};
+
+int xnbd_target_recv_request(struct xnbd_info *xnbd, struct nbd_request_reader *reader, int csock,
+		struct xnbd_target_request *req, bool recv_write_data);
+int xnbd_target_serve_received_request(struct xnbd_info *xnbd, int csock, struct nbd_request_reader *reader,
+		struct nbd_negotiate_options *opts, struct xnbd_target_request *req);
+
+struct xnbd_reactor;
+struct xnbd_reactor *xnbd_reactor_create(struct xnbd_info *xnbd);
+void xnbd_reactor_add_listen_socket(struct xnbd_reactor *reactor, int lsock);
+int xnbd_reactor_poll(struct xnbd_reactor *reactor, const sigset_t *sigmask);
+void xnbd_reactor_make_snapshot(struct xnbd_reactor *reactor);
+void xnbd_reactor_destroy(struct xnbd_reactor *reactor);
+
+/* xnbd_cmd_target mode with online snapshots */
+struct disk_stack *xnbd_target_open_disk_stack(char *diskpath);
+bool xnbd_target_has_layers(char *diskpath);
+int xnbd_target_push_layer(struct disk_stack **pds, char *diskpath);
+pid_t xnbd_target_start_merge(struct disk_stack *ds, size_t rate);
+void xnbd_target_finish_merge(struct disk_stack *ds, char *diskpath);
+
 /* xnbd_cmd_cow_target mode */
 struct disk_stack *xnbd_cow_target_open_disk_stack_readonly(char *diskpath, int cowid);
+struct disk_stack *xnbd_cow_target_open_disk_stack(char *diskpath, int cowid);
 struct disk_stack *xnbd_cow_target_create_disk_stack(char *diskpath);
 void xnbd_cow_target_close_disk_stack(struct disk_stack *ds);
 int xnbd_cow_target_session_server(struct xnbd_session *);
 
+/* compressed reads */
+const char *xnbd_codec_name(enum xnbd_codec codec);
+bool xnbd_codec_supported(enum xnbd_codec codec);
+uint32_t xnbd_codec_get_iotype(enum xnbd_codec codec, int level);
+int xnbd_codec_from_iotype(uint32_t iotype);
+int xnbd_codec_parse(const char *str, enum xnbd_codec *codec, int *level);
+int compress_iovec_and_send(int csock, const struct iovec *iov, const unsigned int count,
+		enum xnbd_codec codec, int level);
+ssize_t recv_and_decompress(int remotefd, char *buf, size_t len, enum xnbd_codec codec);
+int xnbd_codec_send_read_request(int remotefd, off_t iofrom, size_t len, enum xnbd_codec codec, int level);
+ssize_t xnbd_codec_recv_read_reply(int remotefd, char *buf, size_t len, enum xnbd_codec codec);
+bool xnbd_codec_probe_remote(int remotefd, off_t disksize, enum xnbd_codec codec, int level);
+
+/* checksums of blocks (NBD_CMD_CHECKSUM) */
+uint64_t xnbd_block_fingerprint(const char *buf, size_t len);
+int xnbd_checksum_check_request(off_t disksize, off_t iofrom, size_t iolen);
+int xnbd_checksum_send_reply(int csock, struct nbd_reply *reply, const struct iovec *iov, unsigned int count,
+		size_t iolen);
+int xnbd_checksum_send_request(int remotefd, off_t iofrom, size_t len);
+int xnbd_checksum_recv_reply(int remotefd, uint64_t *sums, size_t len);
+
+/* deduplication of blocks (--dedup) */
+struct xnbd_dedup_table;
+struct xnbd_dedup_table *xnbd_dedup_table_create(off_t disksize);
+void xnbd_dedup_table_clear(struct xnbd_dedup_table *table);
+void xnbd_dedup_table_destroy(struct xnbd_dedup_table *table);
+struct xnbd_dedup;
+struct xnbd_dedup *xnbd_dedup_create(struct xnbd_dedup_table *table);
+int xnbd_dedup_add_file(struct xnbd_dedup *dd, int fd, bool writable);
+void xnbd_dedup_start(struct xnbd_dedup *dd);
+void xnbd_dedup_index(struct xnbd_dedup *dd, int file, off_t iofrom, size_t iolen);
+void xnbd_dedup_share(struct xnbd_dedup *dd, int file, off_t iofrom, size_t iolen);
+uint64_t xnbd_dedup_shared_bytes(struct xnbd_dedup *dd);
+void xnbd_dedup_destroy(struct xnbd_dedup *dd);
+
 /* xnbd_cmd_proxy mode */
 void xnbd_proxy_start(struct xnbd_info *xnbd);
 void xnbd_proxy_stop(struct xnbd_info *xnbd);
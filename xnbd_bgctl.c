@@ -28,98 +28,6 @@
 
 
 
-struct _SizedAsyncQueue {
-	GMutex mutex;
-	GCond  cond_pop;  // pop-able
-	GCond  cond_push; // push-able
-	GQueue queue;
-
-	size_t max_size;
-	size_t size;
-};
-
-typedef struct _SizedAsyncQueue SizedAsyncQueue;
-
-SizedAsyncQueue *sized_async_queue_new(size_t max_size)
-{
-	SizedAsyncQueue* q = g_new(SizedAsyncQueue, 1);
-
-	g_mutex_init(&q->mutex);
-	g_cond_init(&q->cond_pop);
-	g_cond_init(&q->cond_push);
-	g_queue_init(&q->queue);
-
-	q->max_size = max_size;
-	q->size = 0;
-
-	return q;
-}
-
-void sized_async_queue_push(SizedAsyncQueue *q, void *data)
-{
-	g_return_if_fail(q);
-	g_return_if_fail(data);
-
-	g_mutex_lock(&q->mutex);
-	{
-		while (!(q->size < q->max_size)) {
-			g_cond_wait(&q->cond_push, &q->mutex);
-		}
-
-		// g_message("%zu < %zu", q->size, q->max_size);
-
-		g_queue_push_head(&q->queue, data);
-		q->size += 1;
-
-		g_cond_signal(&q->cond_pop);
-	}
-	g_mutex_unlock(&q->mutex);
-}
-
-void *sized_async_queue_pop(SizedAsyncQueue *q)
-{
-	void *data;
-
-	g_return_val_if_fail(q, NULL);
-
-	g_mutex_lock(&q->mutex);
-	{
-		/* must check queue is poppable */
-		while (!g_queue_peek_tail_link(&q->queue)) {
-			g_cond_wait(&q->cond_pop, &q->mutex);
-		}
-
-		data = g_queue_pop_tail(&q->queue);
-		g_assert(data);
-
-		q->size -= 1;
-		if (q->size < q->max_size) {
-			g_cond_signal(&q->cond_push);
-		}
-	}
-	g_mutex_unlock(&q->mutex);
-
-	return data;
-}
-
-void sized_async_queue_destroy(SizedAsyncQueue *q)
-{
-	g_return_if_fail(q);
-
-	if (q->size)
-		warn("destroy a queue with data");
-
-	g_mutex_clear(&q->mutex);
-	g_cond_clear(&q->cond_pop);
-	g_cond_clear(&q->cond_push);
-	g_queue_clear(&q->queue);
-
-	g_free(q);
-}
-
-
-
-
 struct progress_info {
 	bool enabled;
 
@@ -155,16 +63,22 @@ void reconnect(char *unix_path, char *rhost, char *rport, const char *exportname
 	int fwd_fd = net_connect(rhost, rport, SOCK_STREAM, IPPROTO_TCP);
 
 	int ret;
+	struct nbd_negotiate_options opts = { .structured_reply = 1 };
+
 	if (exportname)
-		ret = nbd_negotiate_v2_client_side(fwd_fd, NULL, NULL, strlen(exportname), exportname);
-	else
+		ret = nbd_negotiate_v2_client_side_with_options(fwd_fd, NULL, NULL, strlen(exportname), exportname, &opts);
+	else {
 		ret = nbd_negotiate_v1_client_side(fwd_fd, NULL, NULL);
+		opts.structured_reply = 0;
+	}
 
 	if (ret)
 		err("negotiation failed");
 
 
 	enum xnbd_proxy_cmd_type cmd = XNBD_PROXY_CMD_REGISTER_FORWARDER_FD;
+	if (opts.structured_reply)
+		cmd = XNBD_PROXY_CMD_REGISTER_FORWARDER_STRUCTURED_FD;
 	net_send_all_or_abort(fd, &cmd, sizeof(cmd));
 	unix_send_fd(fd, fwd_fd);
 
@@ -172,14 +86,13 @@ void reconnect(char *unix_path, char *rhost, char *rport, const char *exportname
 }
 
 
-void start_register_fd(char *unix_path, int *fd_ret, int *ctl_fd_ret)
+static void register_session_fd(char *unix_path, enum xnbd_proxy_cmd_type cmd, int *fd_ret, int *ctl_fd_ret)
 {
 	int fd = unix_connect(unix_path);
 
 	int ctl_fd, proxy_fd;
 	make_sockpair(&ctl_fd, &proxy_fd);
 
-	enum xnbd_proxy_cmd_type cmd = XNBD_PROXY_CMD_REGISTER_FD;
 	net_send_all_or_abort(fd, &cmd, sizeof(cmd));
 	unix_send_fd(fd, proxy_fd);
 	close(proxy_fd);
@@ -188,6 +101,17 @@ void start_register_fd(char *unix_path, int *fd_ret, int *ctl_fd_ret)
 	*ctl_fd_ret = ctl_fd;
 }
 
+void start_register_fd(char *unix_path, int *fd_ret, int *ctl_fd_ret)
+{
+	register_session_fd(unix_path, XNBD_PROXY_CMD_REGISTER_FD, fd_ret, ctl_fd_ret);
+}
+
+/* a session allowed to send NBD_CMD_CACHE_FILL */
+void start_register_fill_fd(char *unix_path, int *fd_ret, int *ctl_fd_ret)
+{
+	register_session_fd(unix_path, XNBD_PROXY_CMD_REGISTER_FILL_FD, fd_ret, ctl_fd_ret);
+}
+
 void end_register_fd(int fd, int ctl_fd)
 {
 	nbd_client_send_disc_request(ctl_fd);
@@ -200,117 +124,283 @@ void end_register_fd(int fd, int ctl_fd)
 	close(fd);
 }
 
-void *setup_shared_buffer(char *unix_path)
-{
-	char tmppath[] = "/tmp/xnbd-proxy-shared-buffer.XXXXXX";
-	size_t len = XNBD_SHARED_BUFF_SIZE;
 
-	int buf_fd = mkstemp(tmppath);
-	if (buf_fd < 0)
-		err("mkstemp, %m");
 
-	unlink(tmppath);
 
-	int ret = ftruncate(buf_fd, len);
-	if (ret < 0)
-		err("ftruncate, %m");
+/*
+ * --cache-all2 fetches blocks from the remote server over its own
+ * connections (streams), and pushes them to the proxy server with
+ * NBD_CMD_CACHE_FILL. The proxy server copies only the blocks not yet cached,
+ * so this never overwrites blocks updated by clients in the meantime.
+ *
+ * The disk is split into stripes of XNBD_BGCTL_STRIPE_NBLOCKS blocks. Each
+ * stream takes the next stripe not yet cached, so that all the streams keep
+ * busy even if the cache is partially filled. Each stream keeps up to
+ * XNBD_BGCTL_STREAM_DEPTH read requests in flight to hide the round-trip
+ * time of a long-haul link; a single stream is limited to one window of
+ * TCP, and multiple streams are necessary to fill the pipe.
+ */
+#define XNBD_BGCTL_DEFAULT_STREAMS 1
+#define XNBD_BGCTL_MAX_STREAMS 64
+#define XNBD_BGCTL_STRIPE_NBLOCKS 256
+#define XNBD_BGCTL_STREAM_DEPTH 16
 
-	void *shared_buff = mmap(NULL, len, PROT_WRITE, MAP_SHARED, buf_fd, 0);
-	if (shared_buff == MAP_FAILED)
-		err("mmap, %m");
 
-	info("shared buffer allocated, %p (len %zu)", shared_buff, len);
+struct cache_stripes {
+	unsigned long *bm;
+	off_t disksize;
+	unsigned long nblocks;
 
-	/* send buf_fd */
-	int unix_fd = unix_connect(unix_path);
-	enum xnbd_proxy_cmd_type cmd = XNBD_PROXY_CMD_REGISTER_SHARED_BUFFER_FD;
-	net_send_all_or_abort(unix_fd, &cmd, sizeof(cmd));
-	unix_send_fd(unix_fd, buf_fd);
-	close(unix_fd);
+	GMutex mutex;
+	unsigned long next_index;
+};
 
+struct cache_stream {
+	struct cache_stripes *stripes;
 
-	close(buf_fd);
+	int remote_fd;
+	int unix_fd;
+	int ctl_fd;
 
-	return shared_buff;
-}
+	/* fetch blocks with compressed reads of the codec of the proxy server */
+	bool compressed_read;
+	enum xnbd_codec codec;
+	int codec_level;
+
+	/* read requests in flight */
+	struct lfqueue *q;
+
+	pthread_t tid_tx;
+	pthread_t tid_rx;
+
+	unsigned long nblocks_fetched;
+	uint64_t wire_bytes;
+};
 
-void close_shared_buffer(void *shared_buff)
+struct cache_stream_req {
+	off_t iofrom;
+	size_t iolen;
+};
+
+struct cache_stream_req cache_stream_req_eof;
+
+
+/* Returning -1 if all the stripes were taken. */
+static int get_next_stripe(struct cache_stripes *stripes, off_t *iofrom, size_t *iolen)
 {
-	size_t len = XNBD_SHARED_BUFF_SIZE;
-	munmap_or_abort(shared_buff, len);
-	info("shared buffer deallocated, %p (len %zu)", shared_buff, len);
+	for (;;) {
+		unsigned long index;
+
+		g_mutex_lock(&stripes->mutex);
+		index = stripes->next_index;
+		if (index < stripes->nblocks)
+			stripes->next_index += XNBD_BGCTL_STRIPE_NBLOCKS;
+		g_mutex_unlock(&stripes->mutex);
+
+		if (index >= stripes->nblocks)
+			return -1;
+
+		unsigned long after_last = MIN(index + XNBD_BGCTL_STRIPE_NBLOCKS, stripes->nblocks);
+
+		/* skip cached blocks at both the ends */
+		while (index < after_last && bitmap_test(stripes->bm, index))
+			index++;
+		while (after_last > index && bitmap_test(stripes->bm, after_last - 1))
+			after_last--;
+
+		if (index == after_last)
+			continue;
+
+		*iofrom = (off_t) index * CBLOCKSIZE;
+		*iolen  = (size_t) (after_last - index) * CBLOCKSIZE;
+		*iolen  = confine_iolen_within_disk(stripes->disksize, *iofrom, *iolen);
+
+		return 0;
+	}
 }
 
-void cache_block_range(char *unix_path, unsigned long *bm, off_t disksize, int remote_fd, char *shared_buff)
+static void *cache_stream_tx_main(void *arg)
 {
-	int ctl_fd, unix_fd;
-	unsigned long disk_nblocks = get_disk_nblocks(disksize);
-	start_register_fd(unix_path, &unix_fd, &ctl_fd);
+	struct cache_stream *stream = (struct cache_stream *) arg;
 
+	set_process_name("stream_tx");
+	block_all_signals();
 
-	for (unsigned long index = 0; index < disk_nblocks; index += XNBD_SHARED_BUFF_NBLOCKS) {
-		unsigned long nblocks = XNBD_SHARED_BUFF_NBLOCKS;
-		if (disk_nblocks - index < XNBD_SHARED_BUFF_NBLOCKS)
-			nblocks = disk_nblocks - index;
+	for (;;) {
+		struct cache_stream_req *req = g_slice_new(struct cache_stream_req);
 
-		int all_cached = 1;
-		for (unsigned long i = index; i < index + nblocks; i++) {
-			if (!bitmap_test(bm, i)) {
-				all_cached = 0;
-				break;
-			}
+		int ret = get_next_stripe(stream->stripes, &req->iofrom, &req->iolen);
+		if (ret < 0) {
+			g_slice_free(struct cache_stream_req, req);
+			break;
 		}
 
-		if (all_cached)
-			continue;
+		/* blocks if XNBD_BGCTL_STREAM_DEPTH requests are in flight */
+		lfqueue_push(stream->q, req);
 
-		off_t iofrom = (off_t) index * CBLOCKSIZE;
-		size_t iolen = (size_t) nblocks * CBLOCKSIZE;
-		iolen = confine_iolen_within_disk(disksize, iofrom, iolen);
-
-		int ret = nbd_client_send_read_request(remote_fd, iofrom, iolen);
+		if (stream->compressed_read)
+			ret = xnbd_codec_send_read_request(stream->remote_fd, req->iofrom, req->iolen,
+					stream->codec, stream->codec_level);
+		else
+			ret = nbd_client_send_read_request(stream->remote_fd, req->iofrom, req->iolen);
 		if (ret < 0)
 			err("send_read_request, %m");
+	}
+
+	lfqueue_push(stream->q, &cache_stream_req_eof);
+
+	return NULL;
+}
+
+static void *cache_stream_rx_main(void *arg)
+{
+	struct cache_stream *stream = (struct cache_stream *) arg;
+	char *buf = g_malloc(XNBD_BGCTL_STRIPE_NBLOCKS * CBLOCKSIZE);
+
+	set_process_name("stream_rx");
+	block_all_signals();
+
+	for (;;) {
+		struct cache_stream_req *req = lfqueue_pop(stream->q);
+		if (req == &cache_stream_req_eof)
+			break;
+
+		int ret;
+		if (stream->compressed_read) {
+			ssize_t wirelen = xnbd_codec_recv_read_reply(stream->remote_fd, buf, req->iolen, stream->codec);
+			if (wirelen < 0)
+				err("recv compressed read reply");
+			stream->wire_bytes += wirelen;
+		} else {
+			ret = nbd_client_recv_read_reply(stream->remote_fd, buf, req->iolen);
+			if (ret < 0)
+				err("recv_read_reply, %m");
+		}
 
-		ret = nbd_client_recv_read_reply(remote_fd, shared_buff, iolen);
+		ret = nbd_client_send_request_header(stream->ctl_fd, NBD_CMD_CACHE_FILL, req->iofrom, req->iolen, UINT64_MAX);
 		if (ret < 0)
-			err("recv_read_reply, %m");
+			err("send fill request, %m");
 
-		xnbd_proxy_control_cache_block(ctl_fd, disksize, index, nblocks);
+		net_send_all_or_abort(stream->ctl_fd, buf, req->iolen);
+
+		ret = nbd_client_recv_reply_header(stream->ctl_fd, UINT64_MAX);
+		if (ret < 0)
+			err("recv header, %m");
+
+		stream->nblocks_fetched += get_disk_nblocks(req->iolen);
+
+		g_slice_free(struct cache_stream_req, req);
 	}
 
+	g_free(buf);
 
-	end_register_fd(unix_fd, ctl_fd);
+	return NULL;
 }
 
-void cache_all_blocks_with_dedicated_connection(char *unix_path, unsigned long *bm, struct xnbd_proxy_query *query)
+static int connect_to_remote_with_options(struct xnbd_proxy_query *query, const char *exportname,
+		struct nbd_negotiate_options *opts)
 {
 	int remote_fd = net_connect(query->rhost, query->rport, SOCK_STREAM, IPPROTO_TCP);
 	if (remote_fd < 0)
 		err("connect, %m");
 
 	off_t remote_disksize;
-	int ret = nbd_negotiate_v1_client_side(remote_fd, &remote_disksize, NULL);
+	int ret;
+	if (exportname)
+		ret = nbd_negotiate_v2_client_side_with_options(remote_fd, &remote_disksize, NULL,
+				strlen(exportname), exportname, opts);
+	else {
+		ret = nbd_negotiate_v1_client_side(remote_fd, &remote_disksize, NULL);
+		if (opts)
+			memset(opts, 0, sizeof(*opts));
+	}
+
 	if (ret < 0)
 		err("negotiation failed");
 	if (remote_disksize != query->disksize)
 		err("disksize mismatch");
 
+	return remote_fd;
+}
+
+static int connect_to_remote(struct xnbd_proxy_query *query, const char *exportname)
+{
+	return connect_to_remote_with_options(query, exportname, NULL);
+}
+
+void cache_all_blocks_with_dedicated_connection(char *unix_path, unsigned long *bm, struct xnbd_proxy_query *query,
+		const char *exportname, unsigned int nstreams)
+{
+	struct cache_stripes stripes;
+	stripes.bm         = bm;
+	stripes.disksize   = query->disksize;
+	stripes.nblocks    = get_disk_nblocks(query->disksize);
+	stripes.next_index = 0;
+	g_mutex_init(&stripes.mutex);
+
+	struct cache_stream *streams = g_new0(struct cache_stream, nstreams);
+
+	info("fetching blocks with %u stream(s)", nstreams);
+
+	for (unsigned int i = 0; i < nstreams; i++) {
+		struct cache_stream *stream = &streams[i];
+
+		stream->stripes   = &stripes;
+		stream->remote_fd = connect_to_remote(query, exportname);
+		stream->q         = lfqueue_new(XNBD_BGCTL_STREAM_DEPTH);
+
+		/* the same codec as the proxy server, if the remote server has it */
+		if (query->compressed_read) {
+			stream->codec       = query->codec;
+			stream->codec_level = query->codec_level;
+			stream->compressed_read = xnbd_codec_probe_remote(stream->remote_fd, query->disksize,
+					query->codec, query->codec_level);
+			if (!stream->compressed_read) {
+				/* the connection may be broken by the probe */
+				close(stream->remote_fd);
+				stream->remote_fd = connect_to_remote(query, exportname);
+			}
+		}
+
+		start_register_fill_fd(unix_path, &stream->unix_fd, &stream->ctl_fd);
+
+		stream->tid_rx = pthread_create_or_abort(cache_stream_rx_main, stream);
+		stream->tid_tx = pthread_create_or_abort(cache_stream_tx_main, stream);
+	}
+
+	unsigned long nblocks_fetched = 0;
+	uint64_t wire_bytes = 0;
+	bool compressed_read = false;
+
+	for (unsigned int i = 0; i < nstreams; i++) {
+		struct cache_stream *stream = &streams[i];
 
-	char *shared_buff = setup_shared_buffer(unix_path);
+		pthread_join(stream->tid_tx, NULL);
+		pthread_join(stream->tid_rx, NULL);
+		lfqueue_destroy(stream->q);
 
-	cache_block_range(unix_path, bm, query->disksize, remote_fd, shared_buff);
+		end_register_fd(stream->unix_fd, stream->ctl_fd);
 
-	close_shared_buffer(shared_buff);
+		nbd_client_send_disc_request(stream->remote_fd);
+		close(stream->remote_fd);
 
-	nbd_client_send_disc_request(remote_fd);
-	close(remote_fd);
+		nblocks_fetched += stream->nblocks_fetched;
+		wire_bytes += stream->wire_bytes;
+		compressed_read |= stream->compressed_read;
+	}
+
+	info("%lu blocks fetched from the remote server", nblocks_fetched);
+	if (compressed_read)
+		info("%ju bytes received for them with compressed reads", (uintmax_t) wire_bytes);
+
+	g_free(streams);
+	g_mutex_clear(&stripes.mutex);
 }
 
 
 struct cache_rx_ctl {
 	int ctl_fd;
-	SizedAsyncQueue *q;
+	struct lfqueue *q;
 
 	unsigned long nblocks;
 	bool progress_enabled;
@@ -337,7 +427,7 @@ void *cache_all_blocks_receiver_main(void *arg)
 	progress_refresh_draw(progress);
 
 	for (;;) {
-		char *data = sized_async_queue_pop(cache_rx->q);
+		char *data = lfqueue_pop(cache_rx->q);
 
 		if (data == &cache_rx_req_eof)
 			break;
@@ -522,15 +612,136 @@ void progress_refresh_draw(struct progress_info *p)
 #define XNBD_BGCTL_DEFAULT_ASYNC_DEPTH 1000
 
 
-void cache_all_blocks_async(char *unix_path, unsigned long *bm, off_t disksize, bool progress_enabled, unsigned long blocks_at_once)
+/*
+ * With --exportname, --cache-all asks the remote server which blocks are
+ * unallocated and read as zero (NBD_CMD_BLOCK_STATUS), and lets the proxy
+ * server cache them with NBD_CMD_CACHE_ZERO; no data is transferred for them.
+ * The status of XNBD_BGCTL_STATUS_NBLOCKS blocks is queried at once.
+ */
+#define XNBD_BGCTL_STATUS_NBLOCKS (64 * 1024)
+
+struct zero_map {
+	/* -1 if the remote server does not support block status */
+	int remote_fd;
+	uint32_t context_id;
+	off_t disksize;
+
+	/* zero blocks in the window starting at index_sta */
+	unsigned long *bm;
+	unsigned long index_sta;
+	unsigned long nblocks;
+};
+
+static void zero_map_open(struct zero_map *zm, struct xnbd_proxy_query *query, const char *exportname)
 {
+	memset(zm, 0, sizeof(*zm));
+	zm->remote_fd = -1;
+	zm->disksize  = query->disksize;
+
+	if (!exportname)
+		return;
+
+	struct nbd_negotiate_options opts = { .structured_reply = 1, .base_allocation = 1 };
+	int remote_fd = connect_to_remote_with_options(query, exportname, &opts);
+
+	if (!opts.base_allocation) {
+		info("the remote server does not support block status; all the blocks are transferred");
+		nbd_client_send_disc_request(remote_fd);
+		close(remote_fd);
+		return;
+	}
+
+	zm->remote_fd  = remote_fd;
+	zm->context_id = opts.base_allocation_id;
+	zm->bm         = bitmap_alloc(XNBD_BGCTL_STATUS_NBLOCKS);
+}
+
+static void zero_map_close(struct zero_map *zm)
+{
+	if (zm->remote_fd < 0)
+		return;
+
+	nbd_client_send_disc_request(zm->remote_fd);
+	close(zm->remote_fd);
+	g_free(zm->bm);
+}
+
+static void zero_map_fetch(struct zero_map *zm, unsigned long index_sta)
+{
+	unsigned long disk_nblocks = get_disk_nblocks(zm->disksize);
+
+	zm->index_sta = index_sta;
+	zm->nblocks   = MIN(XNBD_BGCTL_STATUS_NBLOCKS, disk_nblocks - index_sta);
+	memset(zm->bm, 0, bitmap_size(XNBD_BGCTL_STATUS_NBLOCKS));
+
+	off_t pos = (off_t) index_sta * CBLOCKSIZE;
+	off_t end = pos + confine_iolen_within_disk(zm->disksize, pos, zm->nblocks * CBLOCKSIZE);
+
+	/* the server may describe only the beginning of a range */
+	while (pos < end) {
+		int ret = nbd_client_send_request_header(zm->remote_fd, NBD_CMD_BLOCK_STATUS, pos, end - pos, UINT64_MAX);
+		if (ret < 0)
+			err("send block status request, %m");
+
+		struct nbd_block_status bs;
+		nbd_block_status_init(&bs);
+
+		ret = nbd_client_recv_block_status_reply(zm->remote_fd, UINT64_MAX, zm->context_id, &bs);
+		if (ret == -EPIPE)
+			err("recv block status reply");
+		if (ret < 0) {
+			/* the rest of the window is transferred */
+			warn("block status from offset %ju failed", pos);
+			return;
+		}
+
+		for (unsigned int i = 0; i < bs.ndescs && pos < end; i++) {
+			off_t desc_end = MIN(end, pos + (off_t) bs.descs[i].length);
+
+			if (bs.descs[i].status_flags & NBD_STATE_ZERO) {
+				/* only the blocks fully covered; the last block of the disk may be partial */
+				unsigned long first = (pos + CBLOCKSIZE - 1) / CBLOCKSIZE;
+				unsigned long after_last = (desc_end == zm->disksize) ? disk_nblocks : (unsigned long) (desc_end / CBLOCKSIZE);
+
+				for (unsigned long index = first; index < after_last; index++)
+					bitmap_on(zm->bm, index - index_sta);
+			}
+
+			pos = desc_end;
+		}
+
+		nbd_block_status_free(&bs);
+	}
+}
+
+static bool zero_map_test(struct zero_map *zm, unsigned long index)
+{
+	if (zm->remote_fd < 0)
+		return false;
+
+	if (index < zm->index_sta || index >= zm->index_sta + zm->nblocks)
+		zero_map_fetch(zm, index - index % XNBD_BGCTL_STATUS_NBLOCKS);
+
+	return bitmap_test(zm->bm, index - zm->index_sta);
+}
+
+
+void cache_all_blocks_async(char *unix_path, unsigned long *bm, struct xnbd_proxy_query *query, const char *exportname,
+		bool progress_enabled, unsigned long blocks_at_once)
+{
+	off_t disksize = query->disksize;
+
+	struct zero_map zm;
+	zero_map_open(&zm, query, exportname);
+
 	int unix_fd, ctl_fd;
-	start_register_fd(unix_path, &unix_fd, &ctl_fd);
+	/* a session allowed to send NBD_CMD_CACHE_ZERO */
+	start_register_fill_fd(unix_path, &unix_fd, &ctl_fd);
 	unsigned long nblocks = get_disk_nblocks(disksize);
 
 	struct cache_rx_ctl cache_rx;
 	cache_rx.ctl_fd  = ctl_fd;
-	cache_rx.q       = sized_async_queue_new(XNBD_BGCTL_DEFAULT_ASYNC_DEPTH);
+	cache_rx.q       = lfqueue_new(XNBD_BGCTL_DEFAULT_ASYNC_DEPTH);
 	cache_rx.nblocks = nblocks;
 	cache_rx.progress_enabled = progress_enabled;
 
@@ -548,27 +759,36 @@ void cache_all_blocks_async(char *unix_path, unsigned long *bm, off_t disksize,
 			/* Make <after_last> point after last uncached block (with no cached blocks in between) */
 			for (after_last = first; !bitmap_test(bm, after_last) && (after_last < AFTER_LAST_MAX); after_last++);
 
-			/* At least a single block to fetch? */
-			if (after_last > first) {
-				dbg("blocks %lu to %lu (%lu in total): requesting transfer", first, after_last, after_last - first);
+			/* At least a single block to fetch? Zero blocks are requested separately. */
+			for (unsigned long sub_first = first; sub_first < after_last; ) {
+				bool zero = zero_map_test(&zm, sub_first);
+				unsigned long sub_after_last = sub_first + 1;
+				while (sub_after_last < after_last && zero_map_test(&zm, sub_after_last) == zero)
+					sub_after_last++;
+
+				dbg("blocks %lu to %lu (%lu in total): requesting %s", sub_first, sub_after_last,
+						sub_after_last - sub_first, zero ? "zero-fill" : "transfer");
 
-				off_t iofrom = (off_t) first * CBLOCKSIZE;
-				size_t iolen = (off_t)(after_last - first) * CBLOCKSIZE;
+				off_t iofrom = (off_t) sub_first * CBLOCKSIZE;
+				size_t iolen = (off_t)(sub_after_last - sub_first) * CBLOCKSIZE;
 				iolen = confine_iolen_within_disk(disksize, iofrom, iolen);
 
-				int ret = nbd_client_send_request_header(ctl_fd, NBD_CMD_CACHE, iofrom, iolen, (UINT64_MAX));
+				int ret = nbd_client_send_request_header(ctl_fd, zero ? NBD_CMD_CACHE_ZERO : NBD_CMD_CACHE,
+						iofrom, iolen, (UINT64_MAX));
 				if (ret < 0) {
 					err("send_read_request, %m");
 				}
 
 				/* Account for requested blocks */
-				for (unsigned long i = first; i < after_last; i++) {
-					if (i == first) {
-						sized_async_queue_push(cache_rx.q, &cache_rx_req_remote_first);
+				for (unsigned long i = sub_first; i < sub_after_last; i++) {
+					if (i == sub_first) {
+						lfqueue_push(cache_rx.q, &cache_rx_req_remote_first);
 					} else {
-						sized_async_queue_push(cache_rx.q, &cache_rx_req_remote_later);
+						lfqueue_push(cache_rx.q, &cache_rx_req_remote_later);
 					}
 				}
+
+				sub_first = sub_after_last;
 			}
 
 			/* Make <first> point after last cached block (with no uncached blocks in between) */
@@ -579,18 +799,20 @@ void cache_all_blocks_async(char *unix_path, unsigned long *bm, off_t disksize,
 				dbg("blocks %lu to %lu (%lu in total): skipping, already cached", after_last, first, first - after_last);
 
 				for (unsigned long i = after_last; i < first; i++) {
-					sized_async_queue_push(cache_rx.q, &cache_rx_req_cached);
+					lfqueue_push(cache_rx.q, &cache_rx_req_cached);
 				}
 			}
 		}
 	}
 
 
-	sized_async_queue_push(cache_rx.q, &cache_rx_req_eof);
+	lfqueue_push(cache_rx.q, &cache_rx_req_eof);
 	pthread_join(cache_rx_tid, NULL);
-	sized_async_queue_destroy(cache_rx.q);
+	lfqueue_destroy(cache_rx.q);
 
 	end_register_fd(unix_fd, ctl_fd);
+
+	zero_map_close(&zm);
 }
 
 
@@ -623,6 +845,7 @@ static struct option longopts[] = {
 	{"blocks-per-request",  required_argument, NULL, 'k'},
 	{"progress",            no_argument, NULL, 'p'},
 	{"force",               no_argument, NULL, 'f'},
+	{"streams",             required_argument, NULL, 'N'},
 	{NULL, 0, NULL, 0},
 };
 
@@ -630,24 +853,26 @@ static struct option longopts[] = {
 Usage:\n\
   xnbd-bgctl                     --query      CONTROL_UNIX_SOCKET\n\
   xnbd-bgctl [--force]           --switch     CONTROL_UNIX_SOCKET\n\
-  xnbd-bgctl [--progress] [--blocks-per-request COUNT]\n\
+  xnbd-bgctl [--exportname NAME] [--progress] [--blocks-per-request COUNT]\n\
                                  --cache-all  CONTROL_UNIX_SOCKET\n\
-  xnbd-bgctl                     --cache-all2 CONTROL_UNIX_SOCKET\n\
+  xnbd-bgctl [--exportname NAME] [--streams COUNT]\n\
+                                 --cache-all2 CONTROL_UNIX_SOCKET\n\
   xnbd-bgctl [--exportname NAME] --reconnect  CONTROL_UNIX_SOCKET REMOTE_HOST REMOTE_PORT\n\
 \n\
 Commands:\n\
   --query       query current status of the proxy mode\n\
   --cache-all   cache all blocks\n\
-  --cache-all2  cache all blocks with the background connection (not yet implemented)\n\
+  --cache-all2  cache all blocks over dedicated connections to the remote server\n\
   --switch      stop the proxy mode and restart the target mode\n\
   --reconnect   reconnect the forwarding session\n\
  (--shutdown)   alias to --switch, deprecated\n\
 \n\
 Options:\n\
-  --exportname NAME           reconnect to a given image\n\
+  --exportname NAME           reconnect (or connect with --cache-all[2]) to a given image\n\
   --progress                  show a progress bar on stderr (default: disabled)\n\
   --blocks-per-request COUNT  request up to COUNT blocks at once (default: %d blocks)\n\
   --force                     force switch even if all blocks are not cached (default: disabled)\n\
+  --streams COUNT             fetch blocks over COUNT parallel connections (default: %d)\n\
 \n\
 "
 
@@ -657,7 +882,7 @@ void show_help_and_exit(const char *msg)
 	if (msg)
 		info("%s\n", msg);
 
-	fprintf(stderr, HELP_STRING_FORMAT, XNBD_BGCTL_DEFAULT_BLOCKS_AT_ONCE);
+	fprintf(stderr, HELP_STRING_FORMAT, XNBD_BGCTL_DEFAULT_BLOCKS_AT_ONCE, XNBD_BGCTL_DEFAULT_STREAMS);
 	exit(msg ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
@@ -700,6 +925,7 @@ int main(int argc, char **argv)
 	bool progress_enabled = false;
 	bool force_enabled = false;
 	unsigned long blocks_at_once = XNBD_BGCTL_DEFAULT_BLOCKS_AT_ONCE;
+	unsigned int nstreams = XNBD_BGCTL_DEFAULT_STREAMS;
 
 	for (;;) {
 		int c;
@@ -771,6 +997,15 @@ int main(int argc, char **argv)
 				force_enabled = true;
 				break;
 
+			case 'N':
+				{
+					long val = atol(optarg);
+					if (val <= 0 || val > XNBD_BGCTL_MAX_STREAMS)
+						show_help_and_exit("stream count must be between 1 and 64");
+					nstreams = (unsigned int) val;
+				}
+				break;
+
 			default:
 				err("getopt");
 		}
@@ -804,8 +1039,10 @@ int main(int argc, char **argv)
 	}
 
 
-	if (exportname && cmd != xnbd_bgctl_cmd_reconnect)
+	if (exportname && cmd != xnbd_bgctl_cmd_reconnect && cmd != xnbd_bgctl_cmd_cache_all && cmd != xnbd_bgctl_cmd_cache_all2)
 		warn("ignore --exportname");
+	if (nstreams != XNBD_BGCTL_DEFAULT_STREAMS && cmd != xnbd_bgctl_cmd_cache_all2)
+		warn("ignore --streams");
 	if (force_enabled && cmd != xnbd_bgctl_cmd_switch)
 		warn("ignore --force");
 	if (progress_enabled)
@@ -829,6 +1066,14 @@ int main(int argc, char **argv)
 	info("cached blocks %lu / %lu (%.1f%%)", cached, nblocks, percent_cached);
 	info("internal buffer usage: %zu bytes / %zu bytes (%.1f%%)", query->cur_use_buf, query->max_use_buf, query->max_use_buf ? (query->cur_use_buf * 100.0 / query->max_use_buf) : 0.0);
 	info("pending request count: %zu / %zu (%.1f%%)", query->cur_use_que, query->max_use_que, query->max_use_que ? (query->cur_use_que * 100.0 / query->max_use_que) : 0.0);
+	if (query->compressed_read)
+		info("compressed reads of %s (level %d): %s, %ju bytes fetched in %ju bytes",
+				xnbd_codec_name(query->codec), query->codec_level,
+				query->remote_compressed_read ? "in use" : "not supported by the remote server",
+				(uintmax_t) query->fetched_bytes, (uintmax_t) query->fetched_wire_bytes);
+	info("zero blocks not written to the cache image: %ju bytes", (uintmax_t) query->zeroed_bytes);
+	if (query->dedup)
+		info("blocks of the cache image shared by dedup: %ju bytes", (uintmax_t) query->shared_bytes);
 
 	switch (cmd) {
 		case xnbd_bgctl_cmd_unknown:
@@ -863,11 +1108,11 @@ int main(int argc, char **argv)
 
 		case xnbd_bgctl_cmd_cache_all:
 			// cache_all_blocks(unix_path, bm, nblocks);
-			cache_all_blocks_async(unix_path, bm, query->disksize, progress_enabled, blocks_at_once);
+			cache_all_blocks_async(unix_path, bm, query, exportname, progress_enabled, blocks_at_once);
 			break;
 
 		case xnbd_bgctl_cmd_cache_all2:
-			cache_all_blocks_with_dedicated_connection(unix_path, bm, query);
+			cache_all_blocks_with_dedicated_connection(unix_path, bm, query, exportname, nstreams);
 			break;
 
 		case xnbd_bgctl_cmd_reconnect:
@@ -0,0 +1,215 @@
+/*
+ * xNBD - an enhanced Network Block Device program
+ *
+ * Copyright (C) 2008-2014 National Institute of Advanced Industrial Science
+ * and Technology
+ *
+ * Author: Takahiro Hirofuchi <t.hirofuchi _at_ aist.go.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+#include "xnbd.h"
+
+
+/*
+ * Checksums of blocks (NBD_CMD_CHECKSUM), an xNBD extension for the delta
+ * sync of the proxy server (--delta-sync).
+ *
+ * A request covers whole blocks of CBLOCKSIZE, up to XNBD_CHECKSUM_MAX_LENGTH
+ * bytes; the last block of the disk may be a partial one. The reply is a
+ * normal reply header, followed by the fingerprint of each block as a
+ * uint64_t in network byte order. A partial block is fingerprinted as if
+ * it were padded with zeros. The fingerprint is the same one as the dedup
+ * index uses, so it does not depend on the byte order of the hosts.
+ */
+
+
+/*
+ * The stripes and the avalanche of XXH64 (seed 0). len must be a multiple
+ * of 32 bytes, which any block is.
+ */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xnbd_block_fingerprint(const char *buf, size_t len)
+{
+	uint64_t v1 = PRIME64_1 + PRIME64_2;
+	uint64_t v2 = PRIME64_2;
+	uint64_t v3 = 0;
+	uint64_t v4 = -PRIME64_1;
+
+	g_assert(len % 32 == 0);
+
+	for (size_t i = 0; i < len; i += 32) {
+		uint64_t w[4];
+		memcpy(w, buf + i, sizeof(w));
+
+		v1 = xxh64_round(v1, GUINT64_FROM_LE(w[0]));
+		v2 = xxh64_round(v2, GUINT64_FROM_LE(w[1]));
+		v3 = xxh64_round(v3, GUINT64_FROM_LE(w[2]));
+		v4 = xxh64_round(v4, GUINT64_FROM_LE(w[3]));
+	}
+
+	uint64_t h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+	h = xxh64_merge_round(h, v1);
+	h = xxh64_merge_round(h, v2);
+	h = xxh64_merge_round(h, v3);
+	h = xxh64_merge_round(h, v4);
+	h += len;
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+
+static unsigned long checksum_nblocks(size_t iolen)
+{
+	return (iolen + CBLOCKSIZE - 1) / CBLOCKSIZE;
+}
+
+/* Return 0 if the server can serve the checksum request, or EINVAL. */
+int xnbd_checksum_check_request(off_t disksize, off_t iofrom, size_t iolen)
+{
+	if (iolen == 0 || iolen > XNBD_CHECKSUM_MAX_LENGTH || iofrom % CBLOCKSIZE ||
+			(iolen % CBLOCKSIZE && iofrom + (off_t) iolen != disksize)) {
+		warn("CMD_CHECKSUM: not block-aligned, or too large, iofrom %ju iolen %zu", iofrom, iolen);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the reply of a checksum request for the data in iov. If reply->error
+ * is set, only the header is sent. Returning -1 if the connection is broken.
+ */
+int xnbd_checksum_send_reply(int csock, struct nbd_reply *reply, const struct iovec *iov, unsigned int count,
+		size_t iolen)
+{
+	if (reply->error)
+		return net_send_all_or_error(csock, reply, sizeof(*reply));
+
+	unsigned long nblocks = checksum_nblocks(iolen);
+	uint64_t *sums = g_new(uint64_t, nblocks);
+	char *block = g_malloc0(CBLOCKSIZE);
+
+	/* the blocks may straddle the buffers of iov */
+	unsigned long index = 0;
+	size_t filled = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		const char *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left > 0) {
+			if (filled == 0 && left >= CBLOCKSIZE) {
+				sums[index++] = GUINT64_TO_BE(xnbd_block_fingerprint(p, CBLOCKSIZE));
+				p += CBLOCKSIZE;
+				left -= CBLOCKSIZE;
+				continue;
+			}
+
+			size_t len = MIN(left, (size_t) CBLOCKSIZE - filled);
+			memcpy(block + filled, p, len);
+			filled += len;
+			p += len;
+			left -= len;
+
+			if (filled == CBLOCKSIZE) {
+				sums[index++] = GUINT64_TO_BE(xnbd_block_fingerprint(block, CBLOCKSIZE));
+				filled = 0;
+			}
+		}
+	}
+
+	/* the partial block at the end of the disk */
+	if (filled > 0) {
+		memset(block + filled, 0, CBLOCKSIZE - filled);
+		sums[index++] = GUINT64_TO_BE(xnbd_block_fingerprint(block, CBLOCKSIZE));
+	}
+
+	g_assert(index == nblocks);
+
+	struct iovec reply_iov[2];
+	reply_iov[0].iov_base = reply;
+	reply_iov[0].iov_len  = sizeof(*reply);
+	reply_iov[1].iov_base = sums;
+	reply_iov[1].iov_len  = nblocks * sizeof(uint64_t);
+
+	int ret = net_writev_all_or_error(csock, reply_iov, 2);
+
+	g_free(block);
+	g_free(sums);
+
+	return ret;
+}
+
+int xnbd_checksum_send_request(int remotefd, off_t iofrom, size_t len)
+{
+	return nbd_client_send_read_request_type(remotefd, NBD_CMD_CHECKSUM, iofrom, len);
+}
+
+/*
+ * Receive the fingerprints of the blocks of xnbd_checksum_send_request()
+ * into sums, in host byte order. Return 0, or a negative value as
+ * nbd_client_recv_reply_header() does.
+ */
+int xnbd_checksum_recv_reply(int remotefd, uint64_t *sums, size_t len)
+{
+	int ret = nbd_client_recv_read_reply_header(remotefd);
+	if (ret < 0)
+		return ret;
+
+	unsigned long nblocks = checksum_nblocks(len);
+
+	ret = net_recv_all_or_error(remotefd, sums, nblocks * sizeof(uint64_t));
+	if (ret < 0) {
+		warn("recv checksums");
+		return -EPIPE;
+	}
+
+	for (unsigned long i = 0; i < nblocks; i++)
+		sums[i] = GUINT64_FROM_BE(sums[i]);
+
+	return 0;
+}
@@ -51,6 +51,8 @@
 
 #define EXIT_XNBD_DEVICE_UNUSED  2
 
+#define XNBD_CLIENT_MAX_CONNECTIONS  16
+
 #if (EXIT_XNBD_DEVICE_UNUSED == EXIT_SUCCESS)
 # error "Exit code EXIT_XNBD_DEVICE_UNUSED collides with EXIT_SUCCESS on this platform"
 #elif (EXIT_XNBD_DEVICE_UNUSED == EXIT_FAILURE)
@@ -317,8 +319,9 @@ const char *recovery_command_internal_reboot_call = "reboot now";
 
 
 static void xnbd_connect_to_remote(GList *dst_list, int max_retry, const char *exportname,
-		int * p_sockfd, off_t * p_disksize, uint32_t * p_flags)
+		int * p_sockfd, off_t * p_disksize, uint32_t * p_flags, struct dst_info ** p_dst)
 {
+	struct dst_info *dst = NULL;
 	int sockfd;
 	off_t disksize;
 	uint32_t flags;
@@ -328,7 +331,7 @@ static void xnbd_connect_to_remote(GList *dst_list, int max_retry, const char *e
 		int connected = 0;
 
 		for (GList *list = g_list_first(dst_list); list != NULL; list = g_list_next(list)) {
-			struct dst_info *dst = (struct dst_info *) list->data;
+			dst = (struct dst_info *) list->data;
 			const char *host = dst->host;
 			const char *port = dst->port;
 
@@ -381,13 +384,54 @@ static void xnbd_connect_to_remote(GList *dst_list, int max_retry, const char *e
 	if (p_flags) {
 		*p_flags = flags;
 	}
+
+	if (p_dst) {
+		*p_dst = dst;
+	}
+}
+
+
+/*
+ * Open one more connection to the server that accepted the first one.
+ * Returning -1 if failed, or the server exports a different disk.
+ */
+static int xnbd_connect_additional(const struct dst_info *dst, const char *exportname, off_t disksize, uint32_t flags)
+{
+	off_t disksize2;
+	uint32_t flags2;
+
+	int sockfd = net_connect(dst->host, dst->port, SOCK_STREAM, IPPROTO_TCP);
+	if (sockfd < 0) {
+		warn("cannot connect to %s(%s)", dst->host, dst->port);
+		return -1;
+	}
+
+	int ret;
+	if (exportname)
+		ret = nbd_negotiate_v2_client_side(sockfd, &disksize2, &flags2, strlen(exportname), exportname);
+	else
+		ret = nbd_negotiate_v1_client_side(sockfd, &disksize2, &flags2);
+
+	if (ret < 0) {
+		warn("negotiation with %s:%s failed", dst->host, dst->port);
+		close(sockfd);
+		return -1;
+	}
+
+	if (disksize2 != disksize || flags2 != flags) {
+		warn("%s:%s exports a different disk on another connection", dst->host, dst->port);
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
 }
 
 
 static void xnbd_report_target_size(GList *dst_list, int max_retry, const char *exportname)
 {
 	off_t disksize = -1;
-	xnbd_connect_to_remote(dst_list, max_retry, exportname, NULL, &disksize, NULL);
+	xnbd_connect_to_remote(dst_list, max_retry, exportname, NULL, &disksize, NULL, NULL);
 
 	assert(disksize >= 0);
 	printf("%jd\n", disksize);
@@ -395,11 +439,19 @@ static void xnbd_report_target_size(GList *dst_list, int max_retry, const char *
 }
 
 
-static int xnbd_setup_client(const char *devpath, unsigned long blocksize, unsigned int timeout, GList *dst_list, int max_retry, const char *recovery_command, const char *exportname)
+static void close_sockfds(int *sockfds, unsigned int nsockfds)
 {
-	int sockfd;
+	for (unsigned int i = 0; i < nsockfds; i++)
+		close(sockfds[i]);
+}
+
+static int xnbd_setup_client(const char *devpath, unsigned long blocksize, unsigned int timeout, GList *dst_list, int max_retry, const char *recovery_command, const char *exportname, unsigned int nconnections)
+{
+	int sockfds[XNBD_CLIENT_MAX_CONNECTIONS];
+	unsigned int nsockfds = 0;
 	off_t disksize;
 	uint32_t flags;
+	struct dst_info *dst;
 
 	{
 		pid_t nbd_pid;
@@ -408,7 +460,25 @@ static int xnbd_setup_client(const char *devpath, unsigned long blocksize, unsig
 			err_ue("%s is in use", devpath);
 	}
 
-	xnbd_connect_to_remote(dst_list, max_retry, exportname, &sockfd, &disksize, &flags);
+	xnbd_connect_to_remote(dst_list, max_retry, exportname, &sockfds[0], &disksize, &flags, &dst);
+	nsockfds = 1;
+
+	if (nconnections > 1) {
+		if (!(flags & NBD_FLAG_CAN_MULTI_CONN))
+			warn("the server does not allow multiple connections, use one connection");
+		else {
+			while (nsockfds < nconnections) {
+				int sockfd = xnbd_connect_additional(dst, exportname, disksize, flags);
+				if (sockfd < 0)
+					break;
+
+				sockfds[nsockfds] = sockfd;
+				nsockfds += 1;
+			}
+		}
+
+		info("use %u connection(s)", nsockfds);
+	}
 
 	int retcode = -3;
 
@@ -416,7 +486,9 @@ static int xnbd_setup_client(const char *devpath, unsigned long blocksize, unsig
 	if (nbd < 0)
 		err_ue("open %s, %m", devpath);
 
-	nbddev_set_sockfd(nbd, sockfd);
+	/* Linux 4.10 or later adds a connection for each call */
+	for (unsigned int i = 0; i < nsockfds; i++)
+		nbddev_set_sockfd(nbd, sockfds[i]);
 
 	nbddev_set_sizes(nbd, (uint64_t) disksize, blocksize);
 
@@ -469,7 +541,7 @@ static int xnbd_setup_client(const char *devpath, unsigned long blocksize, unsig
 		 **/
 		ioctl(nbd, BLKRRPART);
 
-		close(sockfd);
+		close_sockfds(sockfds, nsockfds);
 		close(nbd);
 
 		exit(EXIT_SUCCESS);
@@ -515,7 +587,7 @@ static int xnbd_setup_client(const char *devpath, unsigned long blocksize, unsig
 
 	ioctl(nbd, NBD_CLEAR_QUE);
 	ioctl(nbd, NBD_CLEAR_SOCK);
-	close(sockfd);
+	close_sockfds(sockfds, nsockfds);
 	close(nbd);
 
 	/*
@@ -564,6 +636,7 @@ static struct option longopts[] = {
 	{"recovery-command", required_argument, NULL, 'R'},
 	{"recovery-command-reboot", no_argument, NULL, 'H'},
 	{"exportname",	required_argument, NULL, 'n'},
+	{"connections",	required_argument, NULL, 'N'},
 	{NULL, 0, NULL, 0},
 };
 
@@ -605,6 +678,7 @@ Options: \n\
   --recovery-command		invoke a specified command on unexpected disconnection \n\
   --recovery-command-reboot	invoke the reboot system call on unexpected disconnection \n\
   --exportname	specify a target disk image \n\
+  --connections	set the number of connections to a server (default 1) \n\
 \n\
 Example: \n\
   xnbd-client fe80::250:45ff:fe00:ab8f%%eth0 8998 /dev/nbd0 \n\
@@ -633,13 +707,14 @@ int main(int argc, char *argv[]) {
 	const char *recovery_command = NULL;
 	GList *dst_list = NULL;
 	const char *exportname = NULL;
+	unsigned int nconnections = 1;
 
 
 	for (;;) {
 		int c;
 		int index = 0;
 
-		c = getopt_long(argc, argv, "Cd:c:ht:b:r:R:Hn:", longopts, &index);
+		c = getopt_long(argc, argv, "Cd:c:ht:b:r:R:Hn:N:", longopts, &index);
 		if (c == -1) /* all options were parsed */
 			break;
 
@@ -729,6 +804,12 @@ int main(int argc, char *argv[]) {
 				exportname = optarg;
 				break;
 
+			case 'N':
+				nconnections = (unsigned int) atoi(optarg);
+				if (nconnections < 1 || nconnections > XNBD_CLIENT_MAX_CONNECTIONS)
+					err_ue("the number of connections must be between 1 and %d", XNBD_CLIENT_MAX_CONNECTIONS);
+				break;
+
 			default:
 				err("getopt");
 		}
@@ -769,7 +850,7 @@ int main(int argc, char *argv[]) {
 		info("bs=%lu timeout=%d %s %s %s", blocksize, timeout, host, port, devpath);
 		dst_add(&dst_list, host, port);
 
-		xnbd_setup_client(devpath, blocksize, timeout, dst_list, max_retry, recovery_command, exportname);
+		xnbd_setup_client(devpath, blocksize, timeout, dst_list, max_retry, recovery_command, exportname, nconnections);
 
 		exit(EXIT_SUCCESS);
 	}
@@ -845,7 +926,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (cmd == cmd_connect) {
-		xnbd_setup_client(devpath, blocksize, timeout, dst_list, max_retry, recovery_command, exportname);
+		xnbd_setup_client(devpath, blocksize, timeout, dst_list, max_retry, recovery_command, exportname, nconnections);
 	} else {
 		assert(cmd == cmd_getsize64);
 		xnbd_report_target_size(dst_list, max_retry, exportname);
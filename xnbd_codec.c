@@ -0,0 +1,940 @@
+/*
+ * xNBD - an enhanced Network Block Device program
+ *
+ * Copyright (C) 2008-2014 National Institute of Advanced Industrial Science
+ * and Technology
+ *
+ * Author: Takahiro Hirofuchi <t.hirofuchi _at_ aist.go.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "xnbd.h"
+#include "config.h"
+
+#ifdef XNBD_LZO
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+#endif
+
+#ifdef XNBD_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef XNBD_ZSTD
+#include <zstd.h>
+#endif
+
+
+/*
+ * Compressed reads (NBD_CMD_READ_COMPRESS*), an xNBD extension.
+ *
+ * The reply to a compressed read is a normal reply header, followed by the
+ * requested range split into chunks. Each chunk is framed as:
+ *
+ *   uint32_t cmplen;   (network byte order)
+ *   uint32_t rawlen;   (network byte order)
+ *   payload
+ *
+ * cmplen == 0: the chunk is unicolor; the payload is a uint32_t value to
+ *              fill rawlen bytes with.
+ * cmplen == UINT32_MAX: the payload is rawlen bytes of raw data.
+ * otherwise: the payload is cmplen bytes compressed by the codec of the
+ *            request.
+ *
+ * The command selects the codec, and the upper byte of the flags the level
+ * of it (0 for the default). A server not having the codec replies ENOTSUP.
+ */
+
+static const struct {
+	const char *name;
+	uint32_t iotype;
+	bool supported;
+	int max_level;
+} codecs[] = {
+	[XNBD_CODEC_NONE] = { "none", NBD_CMD_READ_COMPRESS,      true,  0 },
+#ifdef XNBD_LZO
+	[XNBD_CODEC_LZO]  = { "lzo",  NBD_CMD_READ_COMPRESS_LZO,  true,  0 },
+#else
+	[XNBD_CODEC_LZO]  = { "lzo",  NBD_CMD_READ_COMPRESS_LZO,  false, 0 },
+#endif
+#ifdef XNBD_LZ4
+	[XNBD_CODEC_LZ4]  = { "lz4",  NBD_CMD_READ_COMPRESS_LZ4,  true,  0 },
+#else
+	[XNBD_CODEC_LZ4]  = { "lz4",  NBD_CMD_READ_COMPRESS_LZ4,  false, 0 },
+#endif
+#ifdef XNBD_ZSTD
+	[XNBD_CODEC_ZSTD] = { "zstd", NBD_CMD_READ_COMPRESS_ZSTD, true,  22 },
+#else
+	[XNBD_CODEC_ZSTD] = { "zstd", NBD_CMD_READ_COMPRESS_ZSTD, false, 22 },
+#endif
+};
+
+const char *xnbd_codec_name(enum xnbd_codec codec)
+{
+	g_assert(codec < XNBD_CODEC_UNDEFINED);
+
+	return codecs[codec].name;
+}
+
+bool xnbd_codec_supported(enum xnbd_codec codec)
+{
+	g_assert(codec < XNBD_CODEC_UNDEFINED);
+
+	return codecs[codec].supported;
+}
+
+/* the command of a compressed read with the codec and the level, including the flags */
+uint32_t xnbd_codec_get_iotype(enum xnbd_codec codec, int level)
+{
+	g_assert(codec < XNBD_CODEC_UNDEFINED);
+
+	uint32_t ioflags = (uint32_t) level << NBD_CMD_FLAG_LEVEL_SHIFT;
+
+	return codecs[codec].iotype | (ioflags << NBD_CMD_SHIFT_FLAGS);
+}
+
+/* Return the codec of a compressed read, or -1 if iotype is not a compressed read. */
+int xnbd_codec_from_iotype(uint32_t iotype)
+{
+	for (int i = 0; i < XNBD_CODEC_UNDEFINED; i++) {
+		if (codecs[i].iotype == iotype)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Parse "CODEC" or "CODEC:LEVEL". Return -1 if it is invalid. */
+int xnbd_codec_parse(const char *str, enum xnbd_codec *codec, int *level)
+{
+	gchar **tokens = g_strsplit(str, ":", 2);
+	int ret = -1;
+
+	for (int i = 0; i < XNBD_CODEC_UNDEFINED; i++) {
+		if (g_strcmp0(tokens[0], codecs[i].name) != 0)
+			continue;
+
+		*codec = i;
+		*level = 0;
+
+		if (tokens[1] == NULL) {
+			ret = 0;
+			break;
+		}
+
+		char *endptr;
+		long value = strtol(tokens[1], &endptr, 10);
+		if (*tokens[1] == '\0' || *endptr != '\0' || value < 1 || value > codecs[i].max_level) {
+			if (codecs[i].max_level == 0)
+				warn("no level can be given to %s", codecs[i].name);
+			else
+				warn("the level of %s must be between 1 and %d", codecs[i].name, codecs[i].max_level);
+			break;
+		}
+
+		*level = (int) value;
+		ret = 0;
+		break;
+	}
+
+	g_strfreev(tokens);
+
+	return ret;
+}
+
+
+static void codec_init(void)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter(&initialized)) {
+#ifdef XNBD_LZO
+		if (lzo_init() != LZO_E_OK)
+			err("lzo_init() failed");
+#endif
+		g_once_init_leave(&initialized, 1);
+	}
+}
+
+/* the largest compressed data of a chunk */
+static size_t get_max_outlen(enum xnbd_codec codec, size_t rawlen)
+{
+	switch (codec) {
+		case XNBD_CODEC_LZO:
+			/* See LZO.FAQ */
+			return rawlen + (rawlen / 16) + 64 + 3;
+
+		case XNBD_CODEC_LZ4:
+			/* LZ4_COMPRESSBOUND() */
+			return rawlen + (rawlen / 255) + 16;
+
+		case XNBD_CODEC_ZSTD:
+#ifdef XNBD_ZSTD
+			return ZSTD_compressBound(rawlen);
+#else
+			return 0;
+#endif
+
+		case XNBD_CODEC_NONE:
+		case XNBD_CODEC_UNDEFINED:
+		default:
+			return 0;
+	}
+}
+
+/* compression state of a thread */
+struct codec_ctx {
+	void *lzo_wrkmem;
+#ifdef XNBD_ZSTD
+	ZSTD_CCtx *zstd_cctx;
+#endif
+};
+
+static void codec_ctx_free(struct codec_ctx *ctx)
+{
+	g_free(ctx->lzo_wrkmem);
+#ifdef XNBD_ZSTD
+	if (ctx->zstd_cctx)
+		ZSTD_freeCCtx(ctx->zstd_cctx);
+#endif
+}
+
+/* Compress a chunk into cmpbuf, having room of get_max_outlen(). Return the compressed length. */
+static size_t codec_compress(enum xnbd_codec codec, int level __attribute__((unused)),
+		struct codec_ctx *ctx __attribute__((unused)),
+		unsigned char *rawbuf __attribute__((unused)), size_t rawlen __attribute__((unused)),
+		unsigned char *cmpbuf __attribute__((unused)))
+{
+	switch (codec) {
+		case XNBD_CODEC_LZO:
+#ifdef XNBD_LZO
+			{
+				lzo_uint cmplen;
+
+				if (!ctx->lzo_wrkmem)
+					ctx->lzo_wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+
+				int ret = lzo1x_1_compress(rawbuf, rawlen, cmpbuf, &cmplen, ctx->lzo_wrkmem);
+				if (ret != LZO_E_OK)
+					err("lzo compression failed, %d", ret);
+
+				return cmplen;
+			}
+#endif
+			break;
+
+		case XNBD_CODEC_LZ4:
+#ifdef XNBD_LZ4
+			{
+				int ret = LZ4_compress_default((const char *) rawbuf, (char *) cmpbuf,
+						(int) rawlen, (int) get_max_outlen(codec, rawlen));
+				if (ret <= 0)
+					err("lz4 compression failed, %d", ret);
+
+				return ret;
+			}
+#endif
+			break;
+
+		case XNBD_CODEC_ZSTD:
+#ifdef XNBD_ZSTD
+			{
+				if (!ctx->zstd_cctx)
+					ctx->zstd_cctx = ZSTD_createCCtx();
+				if (!ctx->zstd_cctx)
+					err("ZSTD_createCCtx() failed");
+
+				/* level 0 is the default one of zstd */
+				size_t ret = ZSTD_compressCCtx(ctx->zstd_cctx, cmpbuf, get_max_outlen(codec, rawlen),
+						rawbuf, rawlen, level);
+				if (ZSTD_isError(ret))
+					err("zstd compression failed, %s", ZSTD_getErrorName(ret));
+
+				return ret;
+			}
+#endif
+			break;
+
+		case XNBD_CODEC_NONE:
+		case XNBD_CODEC_UNDEFINED:
+		default:
+			break;
+	}
+
+	err("codec %s is not compiled", xnbd_codec_name(codec));
+
+	return 0;
+}
+
+/* Decompress a chunk into rawbuf. Return -1 if the data is broken. */
+static int codec_decompress(enum xnbd_codec codec,
+		unsigned char *cmpbuf __attribute__((unused)), size_t cmplen __attribute__((unused)),
+		unsigned char *rawbuf __attribute__((unused)), size_t rawlen __attribute__((unused)))
+{
+	switch (codec) {
+		case XNBD_CODEC_LZO:
+#ifdef XNBD_LZO
+			{
+				lzo_uint outlen = rawlen;
+
+				int ret = lzo1x_decompress_safe(cmpbuf, cmplen, rawbuf, &outlen, NULL);
+				if (ret != LZO_E_OK || outlen != rawlen) {
+					warn("lzo decompression failed, %d (%lu/%zu)", ret, (unsigned long) outlen, rawlen);
+					return -1;
+				}
+
+				return 0;
+			}
+#endif
+			break;
+
+		case XNBD_CODEC_LZ4:
+#ifdef XNBD_LZ4
+			{
+				int ret = LZ4_decompress_safe((const char *) cmpbuf, (char *) rawbuf, (int) cmplen, (int) rawlen);
+				if (ret < 0 || (size_t) ret != rawlen) {
+					warn("lz4 decompression failed, %d (%zu)", ret, rawlen);
+					return -1;
+				}
+
+				return 0;
+			}
+#endif
+			break;
+
+		case XNBD_CODEC_ZSTD:
+#ifdef XNBD_ZSTD
+			{
+				size_t ret = ZSTD_decompress(rawbuf, rawlen, cmpbuf, cmplen);
+				if (ZSTD_isError(ret) || ret != rawlen) {
+					warn("zstd decompression failed, %s (%zu)",
+							ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "short", rawlen);
+					return -1;
+				}
+
+				return 0;
+			}
+#endif
+			break;
+
+		case XNBD_CODEC_NONE:
+		case XNBD_CODEC_UNDEFINED:
+		default:
+			break;
+	}
+
+	warn("codec %s is not compiled", xnbd_codec_name(codec));
+
+	return -1;
+}
+
+
+/*
+ * A compressed read reply is built in an output buffer reused by each
+ * thread, and sent by a writev() per batch of chunks. The headers and the
+ * compressed data are put in the buffer; uncompressed data is referred to
+ * where it is mapped. Once sending fails, the rest of the reply is dropped.
+ */
+#define CMPOUT_BUFSIZE	(256 * 1024)
+#define CMPOUT_MAXIOV	256
+
+struct cmpout {
+	int csock;
+	bool failed;
+
+	char *buf;
+	size_t len;
+	struct iovec iov[CMPOUT_MAXIOV];
+	unsigned int iovcnt;
+};
+
+static void cmpout_flush(struct cmpout *out)
+{
+	if (out->iovcnt == 0)
+		return;
+
+	if (!out->failed) {
+		int ret = net_writev_all_or_error(out->csock, out->iov, out->iovcnt);
+		if (ret < 0) {
+			warn("sending a compressed read reply failed");
+			out->failed = true;
+		}
+	}
+
+	out->len = 0;
+	out->iovcnt = 0;
+}
+
+/* Return room for len bytes in the buffer. Flush it if full. */
+static char *cmpout_reserve(struct cmpout *out, size_t len)
+{
+	g_assert(len <= CMPOUT_BUFSIZE);
+
+	if (!out->buf)
+		out->buf = g_malloc(CMPOUT_BUFSIZE);
+
+	if (out->len + len > CMPOUT_BUFSIZE || out->iovcnt == CMPOUT_MAXIOV)
+		cmpout_flush(out);
+
+	return out->buf + out->len;
+}
+
+/* Append len bytes written at the room of cmpout_reserve(). */
+static void cmpout_commit(struct cmpout *out, size_t len)
+{
+	char *ptr = out->buf + out->len;
+	struct iovec *last = out->iovcnt ? &out->iov[out->iovcnt - 1] : NULL;
+
+	if (last && (char *) last->iov_base + last->iov_len == ptr)
+		last->iov_len += len;
+	else {
+		out->iov[out->iovcnt].iov_base = ptr;
+		out->iov[out->iovcnt].iov_len  = len;
+		out->iovcnt += 1;
+	}
+
+	out->len += len;
+}
+
+/* Append data outside the buffer. It must be valid until cmpout_flush(). */
+static void cmpout_add_external(struct cmpout *out, void *buf, size_t len)
+{
+	if (out->iovcnt == CMPOUT_MAXIOV)
+		cmpout_flush(out);
+
+	out->iov[out->iovcnt].iov_base = buf;
+	out->iov[out->iovcnt].iov_len  = len;
+	out->iovcnt += 1;
+}
+
+static void put_frame_header(char *ptr, uint32_t cmplen, uint32_t rawlen)
+{
+	uint32_t cmplen_n = htonl(cmplen);
+	uint32_t rawlen_n = htonl(rawlen);
+
+	memcpy(ptr, &cmplen_n, sizeof(cmplen_n));
+	memcpy(ptr + sizeof(cmplen_n), &rawlen_n, sizeof(rawlen_n));
+}
+
+#define FRAME_HDRLEN	(sizeof(uint32_t) * 2)
+#define FRAME_UNICOLOR	0
+#define FRAME_PLAIN	UINT32_MAX
+
+/* the room for a chunk framed by compress_chunk() */
+static inline size_t get_max_framelen(enum xnbd_codec codec, size_t rawlen)
+{
+	return FRAME_HDRLEN + MAX(sizeof(uint32_t), get_max_outlen(codec, rawlen));
+}
+
+/*
+ * Frame a chunk into out: the header, and the compressed data or the value of
+ * a unicolor chunk. If *plain is set, the raw data must follow the frame. It
+ * is also set if the codec does not make the chunk smaller. Return the length
+ * of the frame.
+ */
+static size_t compress_chunk(char *out, unsigned char *rawbuf, size_t rawlen, enum xnbd_codec codec, int level,
+		struct codec_ctx *ctx, bool *plain)
+{
+	g_assert(rawlen <= UINT32_MAX);
+	*plain = false;
+
+	uint32_t color;
+	if (buffer_is_unicolor(rawbuf, rawlen, &color)) {
+		uint32_t value = htonl(color);
+
+		put_frame_header(out, FRAME_UNICOLOR, (uint32_t) rawlen);
+		memcpy(out + FRAME_HDRLEN, &value, sizeof(value));
+
+		return FRAME_HDRLEN + sizeof(value);
+	}
+
+	if (codec != XNBD_CODEC_NONE) {
+		size_t cmplen = codec_compress(codec, level, ctx, rawbuf, rawlen, (unsigned char *) out + FRAME_HDRLEN);
+		dbg("compressed: %zu -> %zu", rawlen, cmplen);
+
+		if (cmplen < rawlen) {
+			put_frame_header(out, (uint32_t) cmplen, (uint32_t) rawlen);
+			return FRAME_HDRLEN + cmplen;
+		}
+	}
+
+	put_frame_header(out, FRAME_PLAIN, (uint32_t) rawlen);
+	*plain = true;
+
+	return FRAME_HDRLEN;
+}
+
+
+
+/*
+ * The chunks of a large read are compressed by a pool of threads in the
+ * process, each with its own codec state. Each chunk is framed into its own
+ * slot, and the sending thread sends the slots in order as they are
+ * completed. The pool is started at the first large read, and compresses one
+ * read at a time; a read arriving while it is busy (i.e., from another I/O
+ * thread) is compressed by its own thread.
+ */
+#define CMPPOOL_MAX_THREADS	8
+/* a smaller read is compressed by the sending thread */
+#define CMPPOOL_MIN_CHUNKS	16
+
+struct cmp_slot {
+	char *buf;
+	size_t len;
+	bool plain;
+	bool done;
+};
+
+static struct {
+	/* -1 if only one CPU is available */
+	int nthreads;
+	bool busy;
+
+	GMutex mutex;
+	GCond work_cond;
+	GCond done_cond;
+
+	/* the read being compressed */
+	const struct iovec *iov;
+	unsigned int count;
+	unsigned int next;
+	enum xnbd_codec codec;
+	int level;
+
+	struct cmp_slot *slots;
+	unsigned int nslots;
+	char *slotbuf;
+	size_t slotbuf_len;
+} cmppool;
+
+static void *cmppool_thread_main(void *arg __attribute__((unused)))
+{
+	struct codec_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+
+	g_mutex_lock(&cmppool.mutex);
+
+	for (;;) {
+		while (cmppool.next >= cmppool.count)
+			g_cond_wait(&cmppool.work_cond, &cmppool.mutex);
+
+		unsigned int i = cmppool.next;
+		cmppool.next += 1;
+		struct cmp_slot *slot = &cmppool.slots[i];
+		const struct iovec *chunk = &cmppool.iov[i];
+		enum xnbd_codec codec = cmppool.codec;
+		int level = cmppool.level;
+
+		g_mutex_unlock(&cmppool.mutex);
+
+		slot->len = compress_chunk(slot->buf, chunk->iov_base, chunk->iov_len, codec, level,
+				&ctx, &slot->plain);
+
+		g_mutex_lock(&cmppool.mutex);
+		slot->done = true;
+		g_cond_broadcast(&cmppool.done_cond);
+	}
+
+	return NULL;
+}
+
+static void cmppool_start(void)
+{
+	static gsize started = 0;
+
+	if (!g_once_init_enter(&started))
+		return;
+
+	g_mutex_init(&cmppool.mutex);
+	g_cond_init(&cmppool.work_cond);
+	g_cond_init(&cmppool.done_cond);
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 2)
+		cmppool.nthreads = -1;
+	else {
+		cmppool.nthreads = MIN(ncpus, CMPPOOL_MAX_THREADS);
+		for (int i = 0; i < cmppool.nthreads; i++)
+			pthread_create_or_abort(cmppool_thread_main, NULL);
+
+		info("started %d compression threads", cmppool.nthreads);
+	}
+
+	g_once_init_leave(&started, 1);
+}
+
+/* Return true if the pool is available for a read. cmppool_release() it after the read. */
+static bool cmppool_acquire(void)
+{
+	cmppool_start();
+
+	if (cmppool.nthreads < 0)
+		return false;
+
+	g_mutex_lock(&cmppool.mutex);
+	bool acquired = !cmppool.busy;
+	cmppool.busy = true;
+	g_mutex_unlock(&cmppool.mutex);
+
+	return acquired;
+}
+
+static void cmppool_release(void)
+{
+	g_mutex_lock(&cmppool.mutex);
+	cmppool.busy = false;
+	g_mutex_unlock(&cmppool.mutex);
+}
+
+static void compress_iovec_parallel(struct cmpout *out, const struct iovec *iov, const unsigned int count,
+		enum xnbd_codec codec, int level)
+{
+	size_t maxrawlen = 0;
+	for (unsigned int i = 0; i < count; i++)
+		maxrawlen = MAX(maxrawlen, iov[i].iov_len);
+
+	size_t stride = get_max_framelen(codec, maxrawlen);
+
+	/* no thread touches the slots between reads */
+	if (count > cmppool.nslots) {
+		cmppool.slots = g_renew(struct cmp_slot, cmppool.slots, count);
+		cmppool.nslots = count;
+	}
+
+	if (stride * count > cmppool.slotbuf_len) {
+		g_free(cmppool.slotbuf);
+		cmppool.slotbuf_len = stride * count;
+		cmppool.slotbuf = g_malloc(cmppool.slotbuf_len);
+	}
+
+	g_mutex_lock(&cmppool.mutex);
+
+	for (unsigned int i = 0; i < count; i++) {
+		cmppool.slots[i].buf = cmppool.slotbuf + stride * i;
+		cmppool.slots[i].done = false;
+	}
+
+	cmppool.iov = iov;
+	cmppool.codec = codec;
+	cmppool.level = level;
+	cmppool.next = 0;
+	cmppool.count = count;
+	g_cond_broadcast(&cmppool.work_cond);
+
+	for (unsigned int i = 0; i < count; i++) {
+		struct cmp_slot *slot = &cmppool.slots[i];
+
+		while (!slot->done)
+			g_cond_wait(&cmppool.done_cond, &cmppool.mutex);
+
+		g_mutex_unlock(&cmppool.mutex);
+
+		/* the slots are valid until the next read */
+		cmpout_add_external(out, slot->buf, slot->len);
+		if (slot->plain)
+			cmpout_add_external(out, iov[i].iov_base, iov[i].iov_len);
+
+		g_mutex_lock(&cmppool.mutex);
+	}
+
+	cmppool.count = 0;
+	cmppool.next = 0;
+
+	g_mutex_unlock(&cmppool.mutex);
+
+	cmpout_flush(out);
+}
+
+
+
+/* the state of a thread sending compressed read replies */
+struct codec_thread {
+	struct cmpout out;
+	struct codec_ctx ctx;
+
+	struct iovec *chunks;
+	unsigned int nchunks_allocated;
+};
+
+static void codec_thread_free(gpointer data)
+{
+	struct codec_thread *thr = data;
+
+	codec_ctx_free(&thr->ctx);
+	g_free(thr->out.buf);
+	g_free(thr->chunks);
+	g_free(thr);
+}
+
+static GPrivate codec_thread_key = G_PRIVATE_INIT(codec_thread_free);
+
+static struct codec_thread *get_codec_thread(void)
+{
+	struct codec_thread *thr = g_private_get(&codec_thread_key);
+
+	if (!thr) {
+		thr = g_malloc0(sizeof(struct codec_thread));
+		g_private_set(&codec_thread_key, thr);
+	}
+
+	return thr;
+}
+
+/*
+ * The data of a compressed read is split into chunks of at most chunksize
+ * bytes. Contiguous iovecs (e.g., blocks mapped from the same layer) are
+ * joined so that a codec sees large chunks.
+ */
+static unsigned int split_into_chunks(struct codec_thread *thr, const struct iovec *iov, unsigned int count,
+		size_t chunksize)
+{
+	unsigned int nchunks = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		char *base = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		while (len > 0) {
+			struct iovec *last = nchunks ? &thr->chunks[nchunks - 1] : NULL;
+
+			if (last && (char *) last->iov_base + last->iov_len == base && last->iov_len < chunksize) {
+				size_t n = MIN(len, chunksize - last->iov_len);
+				last->iov_len += n;
+				base += n;
+				len -= n;
+				continue;
+			}
+
+			if (nchunks == thr->nchunks_allocated) {
+				thr->nchunks_allocated = MAX(64, thr->nchunks_allocated * 2);
+				thr->chunks = g_renew(struct iovec, thr->chunks, thr->nchunks_allocated);
+			}
+
+			size_t n = MIN(len, chunksize);
+			thr->chunks[nchunks].iov_base = base;
+			thr->chunks[nchunks].iov_len  = n;
+			nchunks += 1;
+			base += n;
+			len -= n;
+		}
+	}
+
+	return nchunks;
+}
+
+/*
+ * Send the data of a compressed read, after the reply header. Return -1 if
+ * sending failed.
+ */
+int compress_iovec_and_send(int csock, const struct iovec *iov, const unsigned int count,
+		enum xnbd_codec codec, int level)
+{
+	g_assert(xnbd_codec_supported(codec));
+	codec_init();
+
+	struct codec_thread *thr = get_codec_thread();
+	struct cmpout *out = &thr->out;
+
+	out->csock = csock;
+	out->failed = false;
+
+	/* without a codec, only unicolor blocks are found */
+	size_t chunksize = (codec == XNBD_CODEC_NONE) ? CBLOCKSIZE : XNBD_CODEC_CHUNKSIZE;
+	unsigned int nchunks = split_into_chunks(thr, iov, count, chunksize);
+	struct iovec *chunks = thr->chunks;
+
+	dbg("nchunks %u", nchunks);
+
+	if (codec != XNBD_CODEC_NONE && nchunks >= CMPPOOL_MIN_CHUNKS && cmppool_acquire()) {
+		compress_iovec_parallel(out, chunks, nchunks, codec, level);
+		cmppool_release();
+
+		return out->failed ? -1 : 0;
+	}
+
+	for (unsigned int i = 0; i < nchunks; i++) {
+		unsigned char *rawbuf = chunks[i].iov_base;
+		size_t rawlen         = chunks[i].iov_len;
+		bool plain;
+
+		char *ptr = cmpout_reserve(out, get_max_framelen(codec, rawlen));
+		size_t framelen = compress_chunk(ptr, rawbuf, rawlen, codec, level, &thr->ctx, &plain);
+		cmpout_commit(out, framelen);
+
+		if (plain)
+			cmpout_add_external(out, rawbuf, rawlen);
+	}
+
+	cmpout_flush(out);
+
+	return out->failed ? -1 : 0;
+}
+
+
+
+/*
+ * Receive the data of a compressed read into buf, after the reply header.
+ * Return the number of bytes received, or -1 if receiving failed or the data
+ * is broken.
+ */
+ssize_t recv_and_decompress(int remotefd, char *buf, size_t len, enum xnbd_codec codec)
+{
+	size_t done = 0;
+	size_t wirelen = 0;
+	unsigned char *cmpbuf = NULL;
+	size_t cmpbuf_len = 0;
+	ssize_t ret = -1;
+
+	codec_init();
+
+	while (done < len) {
+		char hdr[FRAME_HDRLEN];
+		uint32_t cmplen, rawlen;
+
+		if (net_recv_all_or_error(remotefd, hdr, sizeof(hdr)) < 0) {
+			warn("recv frame header");
+			goto out;
+		}
+
+		memcpy(&cmplen, hdr, sizeof(cmplen));
+		memcpy(&rawlen, hdr + sizeof(cmplen), sizeof(rawlen));
+		cmplen = ntohl(cmplen);
+		rawlen = ntohl(rawlen);
+		wirelen += sizeof(hdr);
+
+		if (rawlen == 0 || rawlen > len - done) {
+			warn("invalid frame, rawlen %u (%zu/%zu)", rawlen, done, len);
+			goto out;
+		}
+
+		char *rawbuf = buf + done;
+
+		if (cmplen == FRAME_UNICOLOR) {
+			uint32_t value;
+
+			if (rawlen % sizeof(value)) {
+				warn("invalid unicolor frame, rawlen %u", rawlen);
+				goto out;
+			}
+
+			if (net_recv_all_or_error(remotefd, &value, sizeof(value)) < 0) {
+				warn("recv unicolor value");
+				goto out;
+			}
+
+			wirelen += sizeof(value);
+			value = ntohl(value);
+			for (size_t off = 0; off < rawlen; off += sizeof(value))
+				memcpy(rawbuf + off, &value, sizeof(value));
+
+		} else if (cmplen == FRAME_PLAIN) {
+			if (net_recv_all_or_error(remotefd, rawbuf, rawlen) < 0) {
+				warn("recv plain frame");
+				goto out;
+			}
+			wirelen += rawlen;
+
+		} else {
+			if (cmplen > get_max_outlen(codec, rawlen)) {
+				warn("invalid frame of %s, cmplen %u rawlen %u", xnbd_codec_name(codec), cmplen, rawlen);
+				goto out;
+			}
+
+			if (cmplen > cmpbuf_len) {
+				g_free(cmpbuf);
+				cmpbuf_len = cmplen;
+				cmpbuf = g_malloc(cmpbuf_len);
+			}
+
+			if (net_recv_all_or_error(remotefd, cmpbuf, cmplen) < 0) {
+				warn("recv compressed frame");
+				goto out;
+			}
+			wirelen += cmplen;
+
+			if (codec_decompress(codec, cmpbuf, cmplen, (unsigned char *) rawbuf, rawlen) < 0)
+				goto out;
+		}
+
+		done += rawlen;
+	}
+
+	ret = wirelen;
+
+out:
+	g_free(cmpbuf);
+
+	return ret;
+}
+
+
+/* Send a compressed read with the codec, like nbd_client_send_read_request(). */
+int xnbd_codec_send_read_request(int remotefd, off_t iofrom, size_t len, enum xnbd_codec codec, int level)
+{
+	return nbd_client_send_read_request_type(remotefd, xnbd_codec_get_iotype(codec, level), iofrom, len);
+}
+
+/*
+ * Receive the reply of xnbd_codec_send_read_request() into buf. The reply
+ * is never structured. Return the number of bytes received after the
+ * header, or a negative value as nbd_client_recv_reply_header() does.
+ */
+ssize_t xnbd_codec_recv_read_reply(int remotefd, char *buf, size_t len, enum xnbd_codec codec)
+{
+	int ret = nbd_client_recv_read_reply_header(remotefd);
+	if (ret < 0)
+		return ret;
+
+	ssize_t wirelen = recv_and_decompress(remotefd, buf, len, codec);
+	if (wirelen < 0)
+		return -EPIPE;
+
+	return wirelen;
+}
+
+/*
+ * Read the first block of the remote disk with a compressed read. Return
+ * true if the remote server serves compressed reads of the codec. A server
+ * without the codec replies ENOTSUP. The connection is broken if it returns
+ * false for other reasons.
+ */
+bool xnbd_codec_probe_remote(int remotefd, off_t disksize, enum xnbd_codec codec, int level)
+{
+	const char *name = xnbd_codec_name(codec);
+	size_t len = confine_iolen_within_disk(disksize, 0, CBLOCKSIZE);
+
+	int ret = xnbd_codec_send_read_request(remotefd, 0, len, codec, level);
+	if (ret < 0) {
+		warn("sending a compressed read request failed");
+		return false;
+	}
+
+	char *buf = g_malloc(len);
+	ssize_t wirelen = xnbd_codec_recv_read_reply(remotefd, buf, len, codec);
+	g_free(buf);
+
+	if (wirelen == -ENOTSUP || wirelen == -EINVAL) {
+		warn("the remote server does not support compressed reads of %s; use normal reads", name);
+		return false;
+	} else if (wirelen < 0) {
+		warn("receiving a compressed read reply failed");
+		return false;
+	}
+
+	info("compressed reads of %s (level %d) with the remote server", name, level);
+
+	return true;
+}
@@ -72,7 +72,78 @@ void mmap_block_region_free(struct mmap_block_region *mbr)
 
 int poll_request_arrival(struct xnbd_session *ses)
 {
-	return wait_until_readable(ses->clientfd, ses->pipe_worker_fd);
+	return nbd_request_reader_wait(ses->reader, ses->pipe_worker_fd);
+}
+
+
+/*
+ * Transmission flags to advertise to a client of this server.
+ *
+ * NBD_FLAG_CAN_MULTI_CONN allows a client to spread requests over several
+ * connections. It is safe only if all the sessions see the same data, and a
+ * FLUSH on one session covers the writes completed on the others.
+ **/
+uint32_t xnbd_get_export_flags(struct xnbd_info *xnbd)
+{
+	uint32_t flags = 0;
+
+	if (xnbd->readonly)
+		flags |= NBD_FLAG_READ_ONLY;
+	else
+		flags |= NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_SEND_FUA;
+
+	switch (xnbd->cmd) {
+		case xnbd_cmd_target:
+			/* sessions share the disk image; fsync() writes out all dirty pages of it */
+			flags |= NBD_FLAG_CAN_MULTI_CONN;
+
+			/*
+			 * fallocate() zeroes a range, or fails without touching
+			 * it. The other modes mark the range in bitmaps first, and
+			 * cannot back out of a slow zeroing. So does the target
+			 * mode after an online snapshot.
+			 */
+			if (!xnbd->readonly && !xnbd->cow_ds)
+				flags |= NBD_FLAG_SEND_FAST_ZERO;
+			break;
+
+		case xnbd_cmd_proxy:
+			/* one proxy server updates the cache image for all sessions */
+			flags |= NBD_FLAG_CAN_MULTI_CONN;
+			break;
+
+		case xnbd_cmd_cow_target:
+			/*
+			 * Sessions share the top layer. Copying a block to it is
+			 * serialized among session processes by a record lock.
+			 */
+			flags |= NBD_FLAG_CAN_MULTI_CONN;
+			break;
+
+		case xnbd_cmd_version:
+		case xnbd_cmd_help:
+		case xnbd_cmd_unknown:
+		default:
+			break;
+	}
+
+	return flags;
+}
+
+
+/*
+ * The size, flags and block sizes of the export, told to a client in
+ * NBD_OPT_INFO and NBD_OPT_GO. Any alignment works, but the disk image is
+ * mapped (and cached) in blocks of CBLOCKSIZE.
+ **/
+void xnbd_get_export_info(struct xnbd_info *xnbd, struct nbd_export_info *info)
+{
+	info->size  = xnbd->disksize;
+	info->flags = xnbd_get_export_flags(xnbd);
+
+	info->min_block  = 1;
+	info->pref_block = CBLOCKSIZE;
+	info->max_block  = (xnbd->cmd == xnbd_cmd_proxy) ? XNBD_PROXY_MAX_REQUEST_SIZE : XNBD_MAX_REQUEST_SIZE;
 }
 
 
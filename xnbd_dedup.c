@@ -0,0 +1,351 @@
+/*
+ * xNBD - an enhanced Network Block Device program
+ *
+ * Copyright (C) 2008-2014 National Institute of Advanced Industrial Science
+ * and Technology
+ *
+ * Author: Takahiro Hirofuchi <t.hirofuchi _at_ aist.go.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "xnbd.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>  /* FIDEDUPERANGE (Linux 4.5) */
+#endif
+
+
+/*
+ * Deduplication of blocks (--dedup). Blocks written to the files of a store
+ * (the top layer of a disk stack, or the cache disk of the proxy) are
+ * fingerprinted in the background. If the fingerprint index has a block of
+ * the same fingerprint, the file system is asked to share the extent of the
+ * block (FIDEDUPERANGE). It compares the data under a lock, so a stale
+ * entry or a collision of fingerprints only fails the request. Blocks read
+ * from the other files (e.g., the base image of clones) are fingerprinted,
+ * but not shared.
+ *
+ * The index is a table of a fixed size. A new entry replaces an old one of
+ * the same slot, so the memory usage does not grow with the disk. Requests
+ * are dropped if the thread falls behind.
+ *
+ * The table is made once in the master process, in a shared mapping, and
+ * the sessions forked later update it together; a block written by a client
+ * can share the copy written by another. A file has the same id in all the
+ * sessions (i.e., the layer of the disk stack). The sessions do not lock the
+ * table. An entry torn by a race is just a stale one.
+ */
+#define DEDUP_MAX_ENTRIES	(1UL << 21)
+#define DEDUP_MAX_PENDING	4096
+#define DEDUP_LOC_FILE_SHIFT	48
+
+struct dedup_entry {
+	uint64_t fingerprint;  /* 0 for an empty slot */
+	uint64_t loc;          /* file << DEDUP_LOC_FILE_SHIFT | block index */
+};
+
+struct dedup_file {
+	int fd;
+	bool writable;
+};
+
+struct dedup_job {
+	int file;
+	bool share;
+	off_t iofrom;
+	size_t iolen;
+};
+
+struct xnbd_dedup_table {
+	off_t disksize;
+
+	/* shared by the processes forked after it is made */
+	struct dedup_entry *entries;
+	unsigned long mask;
+};
+
+struct xnbd_dedup {
+	off_t disksize;
+
+	struct dedup_file *files;
+	int nfiles;
+
+	struct xnbd_dedup_table *table;
+
+	GAsyncQueue *jobs;
+	pthread_t tid;
+	bool started;
+
+	/* the file system cannot share extents; set by the thread */
+	bool unsupported;
+
+	uint64_t shared_bytes;
+	uint64_t dropped_jobs;
+};
+
+static struct dedup_job dedup_stop;
+
+
+/*
+ * Share the block of srcfd with the one of dstfd. Returns 1 if shared, 0 if
+ * the data differs, and -1 with errno on an error.
+ */
+static int share_block(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t len)
+{
+#ifdef FIDEDUPERANGE
+	union {
+		struct file_dedupe_range range;
+		char buf[sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info)];
+	} arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.range.src_offset = srcoff;
+	arg.range.src_length = len;
+	arg.range.dest_count = 1;
+	arg.range.info[0].dest_fd = dstfd;
+	arg.range.info[0].dest_offset = dstoff;
+
+	if (ioctl(srcfd, FIDEDUPERANGE, &arg) < 0)
+		return -1;
+
+	if (arg.range.info[0].status < 0) {
+		errno = -arg.range.info[0].status;
+		return -1;
+	}
+
+	if (arg.range.info[0].status == FILE_DEDUPE_RANGE_DIFFERS)
+		return 0;
+
+	return (arg.range.info[0].bytes_deduped == len);
+#else
+	(void) srcfd;
+	(void) srcoff;
+	(void) dstfd;
+	(void) dstoff;
+	(void) len;
+
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+static void dedup_do_job(struct xnbd_dedup *dd, struct dedup_job *job, char *buf)
+{
+	struct dedup_file *file = &dd->files[job->file];
+	unsigned long index_sta = get_bindex_sta(CBLOCKSIZE, job->iofrom);
+	unsigned long index_end = get_bindex_end(CBLOCKSIZE, job->iofrom + job->iolen);
+
+	for (unsigned long index = index_sta; index <= index_end; index++) {
+		off_t iofrom = (off_t) index * CBLOCKSIZE;
+
+		/* the partial block at the end of the disk is not shared */
+		if (iofrom + CBLOCKSIZE > dd->disksize)
+			break;
+
+		ssize_t ret = pread(file->fd, buf, CBLOCKSIZE, iofrom);
+		if (ret != CBLOCKSIZE) {
+			warn("dedup: pread %m");
+			return;
+		}
+
+		/* zero blocks are holes */
+		if (buffer_is_zero(buf, CBLOCKSIZE))
+			continue;
+
+		uint64_t fingerprint = xnbd_block_fingerprint(buf, CBLOCKSIZE) | 1;
+		uint64_t loc = ((uint64_t) job->file << DEDUP_LOC_FILE_SHIFT) | index;
+		struct dedup_entry *entry = &dd->table->entries[fingerprint & dd->table->mask];
+
+		if (__atomic_load_n(&entry->fingerprint, __ATOMIC_RELAXED) != fingerprint) {
+			__atomic_store_n(&entry->fingerprint, fingerprint, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry->loc, loc, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		uint64_t entry_loc = __atomic_load_n(&entry->loc, __ATOMIC_RELAXED);
+		if (entry_loc == loc || !job->share || !file->writable)
+			continue;
+
+		/* a torn entry may have any id */
+		if ((int) (entry_loc >> DEDUP_LOC_FILE_SHIFT) >= dd->nfiles) {
+			__atomic_store_n(&entry->loc, loc, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		struct dedup_file *src = &dd->files[entry_loc >> DEDUP_LOC_FILE_SHIFT];
+		off_t src_iofrom = (off_t) (entry_loc & ((1ULL << DEDUP_LOC_FILE_SHIFT) - 1)) * CBLOCKSIZE;
+
+		int shared = share_block(src->fd, src_iofrom, file->fd, iofrom, CBLOCKSIZE);
+		if (shared > 0) {
+			dbg("dedup: block %lu of file %d shares %ju of file %d", index, job->file,
+					(uintmax_t) src_iofrom, (int) (entry_loc >> DEDUP_LOC_FILE_SHIFT));
+			__atomic_fetch_add(&dd->shared_bytes, CBLOCKSIZE, __ATOMIC_RELAXED);
+
+		} else if (shared == 0) {
+			/* the block of the entry was overwritten */
+			__atomic_store_n(&entry->loc, loc, __ATOMIC_RELAXED);
+
+		} else if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == ENOSYS) {
+			info("dedup: the file system cannot share blocks (%m); dedup disabled");
+			__atomic_store_n(&dd->unsupported, true, __ATOMIC_RELAXED);
+			return;
+
+		} else
+			dbg("dedup: sharing block %lu failed, %m", index);
+	}
+}
+
+static void *dedup_thread_main(void *arg)
+{
+	struct xnbd_dedup *dd = arg;
+	char *buf = g_malloc(CBLOCKSIZE);
+
+	for (;;) {
+		struct dedup_job *job = g_async_queue_pop(dd->jobs);
+		if (job == &dedup_stop)
+			break;
+
+		if (!dd->unsupported)
+			dedup_do_job(dd, job, buf);
+
+		g_free(job);
+	}
+
+	g_free(buf);
+
+	return NULL;
+}
+
+
+/*
+ * Make the fingerprint index for a disk, in the master process. It takes 16
+ * bytes per block, up to 32 MiB.
+ */
+struct xnbd_dedup_table *xnbd_dedup_table_create(off_t disksize)
+{
+	struct xnbd_dedup_table *table = g_malloc0(sizeof(struct xnbd_dedup_table));
+	unsigned long nblocks = get_disk_nblocks(disksize);
+	unsigned long nentries = 1;
+
+	while (nentries < nblocks && nentries < DEDUP_MAX_ENTRIES)
+		nentries *= 2;
+
+	table->disksize = disksize;
+	/* zero-filled, i.e., all the slots are empty */
+	table->entries = mmap_or_abort(NULL, sizeof(struct dedup_entry) * nentries, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	table->mask = nentries - 1;
+
+	return table;
+}
+
+/* Drop all the entries, e.g., after the ids of files are changed. No session may use it. */
+void xnbd_dedup_table_clear(struct xnbd_dedup_table *table)
+{
+	memset(table->entries, 0, sizeof(struct dedup_entry) * (table->mask + 1));
+}
+
+void xnbd_dedup_table_destroy(struct xnbd_dedup_table *table)
+{
+	munmap_or_abort(table->entries, sizeof(struct dedup_entry) * (table->mask + 1));
+	g_free(table);
+}
+
+
+struct xnbd_dedup *xnbd_dedup_create(struct xnbd_dedup_table *table)
+{
+	struct xnbd_dedup *dd = g_malloc0(sizeof(struct xnbd_dedup));
+
+	dd->disksize = table->disksize;
+	dd->table = table;
+	dd->jobs = g_async_queue_new();
+
+	return dd;
+}
+
+/* Add a file to the store, and return its id. Only a writable file has shared blocks. */
+int xnbd_dedup_add_file(struct xnbd_dedup *dd, int fd, bool writable)
+{
+	g_assert(!dd->started);
+	g_assert(dd->nfiles < (1 << (64 - DEDUP_LOC_FILE_SHIFT)));
+
+	dd->files = g_renew(struct dedup_file, dd->files, dd->nfiles + 1);
+	dd->files[dd->nfiles].fd = fd;
+	dd->files[dd->nfiles].writable = writable;
+
+	return dd->nfiles++;
+}
+
+void xnbd_dedup_start(struct xnbd_dedup *dd)
+{
+	info("dedup: %d files, %lu entries of the fingerprint index", dd->nfiles, dd->table->mask + 1);
+
+	dd->tid = pthread_create_or_abort(dedup_thread_main, dd);
+	dd->started = true;
+}
+
+static void dedup_submit(struct xnbd_dedup *dd, int file, off_t iofrom, size_t iolen, bool share)
+{
+	if (__atomic_load_n(&dd->unsupported, __ATOMIC_RELAXED))
+		return;
+
+	if (g_async_queue_length(dd->jobs) >= DEDUP_MAX_PENDING) {
+		__atomic_fetch_add(&dd->dropped_jobs, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct dedup_job *job = g_new(struct dedup_job, 1);
+	job->file = file;
+	job->share = share;
+	job->iofrom = iofrom;
+	job->iolen = iolen;
+
+	g_async_queue_push(dd->jobs, job);
+}
+
+/* Fingerprint the blocks of a range read from the file. */
+void xnbd_dedup_index(struct xnbd_dedup *dd, int file, off_t iofrom, size_t iolen)
+{
+	dedup_submit(dd, file, iofrom, iolen, false);
+}
+
+/* Fingerprint the blocks of a range written to the file, and share them with copies if any. */
+void xnbd_dedup_share(struct xnbd_dedup *dd, int file, off_t iofrom, size_t iolen)
+{
+	dedup_submit(dd, file, iofrom, iolen, true);
+}
+
+uint64_t xnbd_dedup_shared_bytes(struct xnbd_dedup *dd)
+{
+	return __atomic_load_n(&dd->shared_bytes, __ATOMIC_RELAXED);
+}
+
+/* Stop the thread after the pending requests. The files and the table are not freed. */
+void xnbd_dedup_destroy(struct xnbd_dedup *dd)
+{
+	if (dd->started) {
+		g_async_queue_push(dd->jobs, &dedup_stop);
+		pthread_join(dd->tid, NULL);
+	}
+
+	info("dedup: %ju bytes shared, %ju requests dropped",
+			(uintmax_t) dd->shared_bytes, (uintmax_t) dd->dropped_jobs);
+
+	g_async_queue_unref(dd->jobs);
+	g_free(dd->files);
+	g_free(dd);
+}
@@ -23,6 +23,7 @@
 
 
 #include "xnbd_proxy.h"
+#include <limits.h> /* IOV_MAX */
 
 
 /* special entry to let threads exit */
@@ -45,6 +46,15 @@ struct proxy_session {
 
 	int pipe_write_fd; /* tx thread & rx thread */
 	int pipe_read_fd;  /* main thread */
+
+	/* only xnbd-bgctl sessions may send NBD_CMD_CACHE_FILL */
+	int fill_allowed;
+
+	/* structured replies and metadata contexts */
+	struct nbd_negotiate_options opts;
+
+	/* used only by rx_thread */
+	struct nbd_request_reader *reader;
 };
 
 
@@ -180,6 +190,7 @@ int recv_request(struct proxy_session *ps)
 
 
 	uint32_t iotype = 0;
+	uint32_t ioflags = 0;
 	off_t iofrom = 0;
 	size_t iolen  = 0;
 	int ret = 0;
@@ -191,11 +202,11 @@ int recv_request(struct proxy_session *ps)
 	priv->reply.magic = htonl(NBD_REPLY_MAGIC);
 	priv->reply.error = 0;
 
-	ret = wait_until_readable(nbd_client_fd, ps->wrk_fd);
+	ret = nbd_request_reader_wait(ps->reader, ps->wrk_fd);
 	if (ret < 0)
 		goto err_handle;
 
-	ret = nbd_server_recv_request(nbd_client_fd, proxy->xnbd->disksize, &iotype, &iofrom, &iolen, &priv->reply);
+	ret = nbd_server_recv_request_buffered(ps->reader, proxy->xnbd->disksize, &iotype, &ioflags, &iofrom, &iolen, &priv->reply);
 	if (ret == NBD_SERVER_RECV__BAD_REQUEST) {
 		/*
 		 * A request with an invalid offset was received. The proxy
@@ -213,7 +224,7 @@ int recv_request(struct proxy_session *ps)
 	dbg("++++ a new %s request received", nbd_get_iotype_string(iotype));
 
 	if (proxy->xnbd->readonly) {
-		if (iotype == NBD_CMD_WRITE || iotype == NBD_CMD_TRIM) {
+		if (iotype == NBD_CMD_WRITE || iotype == NBD_CMD_TRIM || iotype == NBD_CMD_WRITE_ZEROES) {
 			warn("NBD_CMD_WRITE to a readonly server. disconnect.");
 			goto err_handle;
 		}
@@ -225,6 +236,7 @@ int recv_request(struct proxy_session *ps)
 	dbg("block_index_sta %lu stop %lu", block_index_sta, block_index_end);
 
 	priv->iotype = iotype;
+	priv->ioflags = ioflags;
 	priv->iofrom = iofrom;
 	priv->iolen  = iolen;
 	priv->block_index_start = block_index_sta;
@@ -244,7 +256,7 @@ int recv_request(struct proxy_session *ps)
 		 * the preceding requests might read/write the same range of
 		 * the cache disk in the tx_thread after this writing.
 		 **/
-		ret = net_recv_all_or_error(priv->clientfd, priv->write_buff, priv->iolen);
+		ret = nbd_request_reader_recv_payload(ps->reader, priv->write_buff, priv->iolen);
 		if (ret < 0) {
 			warn("recv write data");
 			goto err_handle;
@@ -254,6 +266,55 @@ int recv_request(struct proxy_session *ps)
 	} else if (iotype == NBD_CMD_READ) {
 		priv->read_buff = g_malloc(iolen);
 
+	} else if (iotype == NBD_CMD_WRITE_ZEROES) {
+		/*
+		 * Not advertised; see xnbd_get_export_flags(). Fail only
+		 * this request. It has nothing to forward, so the reply is
+		 * queued straight to tx_thread; NBD allows replies out of
+		 * order.
+		 **/
+		if (ioflags & NBD_CMD_FLAG_FAST_ZERO) {
+			warn("NBD_CMD_WRITE_ZEROES: fast zero is not supported");
+			priv->reply.error = htonl(ENOTSUP);
+
+			mem_usage_add(proxy, priv);
+			g_async_queue_push(priv->tx_queue, priv);
+
+			return 0;
+		}
+
+	} else if (iotype == NBD_CMD_CACHE_FILL || iotype == NBD_CMD_CACHE_ZERO) {
+		if (!ps->fill_allowed) {
+			warn("%s from a client session. disconnect.", nbd_get_iotype_string(iotype));
+			goto err_handle;
+		}
+
+		/* The last block of the disk may be a partial one. */
+		if (iolen == 0 || iofrom % CBLOCKSIZE ||
+				(iolen % CBLOCKSIZE && iofrom + (off_t) iolen != proxy->xnbd->disksize)) {
+			warn("%s is not block-aligned, iofrom %ju iolen %zu", nbd_get_iotype_string(iotype), iofrom, iolen);
+			goto err_handle;
+		}
+
+		/* Blocks found to be zero by xnbd-bgctl have no data. */
+		if (iotype == NBD_CMD_CACHE_FILL) {
+			/* Block data fetched by xnbd-bgctl. Copy it to the cache
+			 * disk later in the completion thread, like write data. */
+			priv->write_buff = g_malloc(iolen);
+
+			ret = nbd_request_reader_recv_payload(ps->reader, priv->write_buff, priv->iolen);
+			if (ret < 0) {
+				warn("recv fill data");
+				goto err_handle;
+			}
+		}
+
+	} else if (iotype == NBD_CMD_BLOCK_STATUS) {
+		if (!ps->opts.base_allocation || iolen == 0) {
+			warn("NBD_CMD_BLOCK_STATUS without the metadata context, or zero length. disconnect.");
+			goto err_handle;
+		}
+
 	} else if (iotype == NBD_CMD_CACHE || iotype == NBD_CMD_FLUSH || iotype == NBD_CMD_TRIM) {
 		/* do nothing here, but do something later */
 		;
@@ -267,7 +328,7 @@ int recv_request(struct proxy_session *ps)
 	mem_usage_wait(proxy);
 
 	mem_usage_add(proxy, priv);
-	g_async_queue_push(proxy->fwd_tx_queue, priv);
+	lfqueue_push(proxy->fwd_tx_queue, priv);
 
 
 	return 0;
@@ -279,7 +340,7 @@ err_handle:
 	priv->iotype = NBD_CMD_UNDEFINED;
 
 	mem_usage_add(proxy, priv);
-	g_async_queue_push(proxy->fwd_tx_queue, priv);
+	lfqueue_push(proxy->fwd_tx_queue, priv);
 
 	return -1;
 }
@@ -292,6 +353,12 @@ err_handle:
 void proxy_initialize_forwarder(struct xnbd_proxy *proxy, int remotefd)
 {
 	proxy->remotefd   = remotefd;
+
+	/* try the codec with each connection; the remote server may be replaced */
+	proxy->remote_compressed_read = false;
+	if (proxy->xnbd->proxy_compressed_read)
+		proxy->remote_compressed_read = xnbd_codec_probe_remote(remotefd, proxy->xnbd->disksize,
+				proxy->xnbd->proxy_codec, proxy->xnbd->proxy_codec_level);
 	proxy->tid_fwd_rx = pthread_create_or_abort(forwarder_rx_thread_main, proxy);
 	proxy->tid_fwd_tx = pthread_create_or_abort(forwarder_tx_thread_main, proxy);
 }
@@ -311,7 +378,7 @@ void proxy_shutdown_forwarder(struct xnbd_proxy *proxy)
 	 * Actually, the current code does not have mem_usage_del() for
 	 * priv_stop_forwarder. See forwader_rx_thread_mainloop().
 	 */
-	g_async_queue_push(proxy->fwd_tx_queue, &priv_stop_forwarder);
+	lfqueue_push(proxy->fwd_tx_queue, &priv_stop_forwarder);
 
 	pthread_join(proxy->tid_fwd_tx, NULL);
 	info("forwarder_tx exited");
@@ -319,19 +386,142 @@ void proxy_shutdown_forwarder(struct xnbd_proxy *proxy)
 	info("forwarder_rx exited");
 }
 
+/*
+ * Compare the cached blocks with the remote disk (--delta-sync), and
+ * uncache the blocks changed there. They are retrieved again on demand, or
+ * by xnbd-bgctl --cache-all. Blocks written by clients differ from the
+ * remote disk, and are kept. Fingerprints are requested for each run of
+ * cached blocks, and the cached data is fingerprinted while the remote
+ * server reads its disk. Called before the forwarder threads start.
+ */
+static void proxy_delta_sync(struct xnbd_proxy *proxy, int remotefd)
+{
+	struct xnbd_info *xnbd = proxy->xnbd;
+	const unsigned long chunk_nblocks = XNBD_CHECKSUM_MAX_LENGTH / CBLOCKSIZE;
+	uint64_t *local_sums = g_new(uint64_t, chunk_nblocks);
+	uint64_t *remote_sums = g_new(uint64_t, chunk_nblocks);
+	char *block = g_malloc0(CBLOCKSIZE);
+	unsigned long ncached = 0;
+	unsigned long nstale = 0;
+	unsigned long nwritten = 0;
+
+	for (unsigned long chunk_sta = 0; chunk_sta < xnbd->nblocks; chunk_sta += chunk_nblocks) {
+		unsigned long chunk_end = MIN(chunk_sta + chunk_nblocks, xnbd->nblocks) - 1;
+
+		/* narrow the chunk to its cached blocks */
+		unsigned long index_sta = chunk_sta;
+		while (index_sta <= chunk_end && !bitmap_test(proxy->cbitmap, index_sta))
+			index_sta += 1;
+
+		if (index_sta > chunk_end)
+			continue;
+
+		unsigned long index_end = chunk_end;
+		while (!bitmap_test(proxy->cbitmap, index_end))
+			index_end -= 1;
+
+		off_t iofrom = (off_t) index_sta * CBLOCKSIZE;
+		size_t iolen = confine_iolen_within_disk(xnbd->disksize, iofrom, (index_end - index_sta + 1) * CBLOCKSIZE);
+
+		int ret = xnbd_checksum_send_request(remotefd, iofrom, iolen);
+		if (ret < 0)
+			err("delta sync: sending a checksum request failed");
+
+		struct mmap_region *mr = mmap_region_create(proxy->cachefd, iofrom, iolen, 1);
+
+		for (unsigned long index = index_sta; index <= index_end; index++) {
+			if (!bitmap_test(proxy->cbitmap, index))
+				continue;
+
+			const char *buf = (const char *) mr->iobuf + (index - index_sta) * CBLOCKSIZE;
+			size_t len = MIN((size_t) CBLOCKSIZE, iolen - (index - index_sta) * CBLOCKSIZE);
+
+			/* the partial block at the end of the disk is padded with zeros */
+			if (len < CBLOCKSIZE) {
+				memcpy(block, buf, len);
+				buf = block;
+			}
+
+			local_sums[index - index_sta] = xnbd_block_fingerprint(buf, CBLOCKSIZE);
+		}
+
+		mmap_region_free(mr);
+
+		ret = xnbd_checksum_recv_reply(remotefd, remote_sums, iolen);
+		if (ret == -EINVAL || ret == -ENOTSUP)
+			err("delta sync: the remote server does not serve checksums of blocks; use --clear-bitmap instead");
+		else if (ret < 0)
+			err("delta sync: receiving checksums failed; the remote server may not serve them (e.g., an older one, or a proxy server)");
+
+		for (unsigned long index = index_sta; index <= index_end; index++) {
+			if (!bitmap_test(proxy->cbitmap, index))
+				continue;
+
+			ncached += 1;
+
+			if (local_sums[index - index_sta] == remote_sums[index - index_sta])
+				continue;
+
+			/* never roll back the data of clients */
+			if (bitmap_test(proxy->wbitmap, index)) {
+				nwritten += 1;
+				continue;
+			}
+
+			dbg("delta sync: block %lu is stale", index);
+			bitmap_off(proxy->cbitmap, index);
+			nstale += 1;
+		}
+	}
+
+	if (nstale > 0)
+		bitmap_sync_file(proxy->cbitmap, proxy->cbitmaplen);
+
+	info("delta sync: %lu of %lu cached blocks changed in the remote disk, and are uncached", nstale, ncached);
+	if (nwritten > 0)
+		info("delta sync: %lu cached blocks written by clients differ from the remote disk, and are kept", nwritten);
+
+	g_free(block);
+	g_free(remote_sums);
+	g_free(local_sums);
+}
+
 /* called in a proxy process */
 void proxy_initialize(struct xnbd_info *xnbd, struct xnbd_proxy *proxy)
 {
 	proxy->xnbd  = xnbd;
 
-	/* keep reference count! */
-	proxy->fwd_tx_queue = g_async_queue_new();
-	proxy->fwd_rx_queue = g_async_queue_new();
+	size_t queue_size = MAX((size_t) XNBD_PROXY_QUEUE_SIZE, xnbd->proxy_max_que_size);
+	proxy->fwd_tx_queue = lfqueue_new(queue_size);
+	proxy->fwd_rx_queue = lfqueue_new(queue_size);
 	proxy->fwd_retry_queue = g_async_queue_new();
 
 
 	/* set up a bitmap and a cache disk */
 	proxy->cbitmap = bitmap_open_file(xnbd->proxy_bmpath, xnbd->nblocks, &proxy->cbitmaplen, 0, xnbd->proxy_clear_bitmap ? 1 : 0);
+	proxy->cbitmap_npages = (proxy->cbitmaplen + getpagesize() - 1) / getpagesize();
+	proxy->cbitmap_dirty = g_new0(unsigned char, proxy->cbitmap_npages);
+
+	char *wbmpath = g_strdup_printf("%s.written", xnbd->proxy_bmpath);
+	bool wbitmap_found = (access(wbmpath, F_OK) == 0);
+	proxy->wbitmap = bitmap_open_file(wbmpath, xnbd->nblocks, &proxy->wbitmaplen, 0, xnbd->proxy_clear_bitmap ? 1 : 0);
+
+	/*
+	 * Without the record (e.g., made by an older xnbd-server), any cached
+	 * block may have been written by clients. Take all of them as written,
+	 * so that --delta-sync never rolls them back.
+	 */
+	if (!wbitmap_found && !xnbd->proxy_clear_bitmap) {
+		unsigned long ncached = bitmap_popcount(proxy->cbitmap, xnbd->nblocks);
+		if (ncached > 0) {
+			g_assert(proxy->wbitmaplen == proxy->cbitmaplen);
+			memcpy(proxy->wbitmap, proxy->cbitmap, proxy->cbitmaplen);
+			bitmap_sync_file(proxy->wbitmap, proxy->wbitmaplen);
+			info("%s did not exist; all the %lu cached blocks are taken as written by clients", wbmpath, ncached);
+		}
+	}
+
+	g_free(wbmpath);
 
 	int cachefd = open(xnbd->proxy_diskpath, O_RDWR | O_CREAT | O_NOATIME, S_IRUSR | S_IWUSR);
 	if (cachefd < 0)
@@ -362,6 +552,15 @@ void proxy_initialize(struct xnbd_info *xnbd, struct xnbd_proxy *proxy)
 	}
 
 	proxy->cachefd = cachefd;
+
+	if (xnbd->dedup) {
+		/* the proxy server is one process */
+		proxy->dedup_table = xnbd_dedup_table_create(xnbd->disksize);
+		proxy->dedup = xnbd_dedup_create(proxy->dedup_table);
+		xnbd_dedup_add_file(proxy->dedup, cachefd, true);
+		xnbd_dedup_start(proxy->dedup);
+	}
+
 	g_mutex_init(&proxy->curr_use_mutex);
 	proxy->cur_use_buf = 0;
 	proxy->cur_use_que = 0;
@@ -376,14 +575,18 @@ void proxy_shutdown(struct xnbd_proxy *proxy)
 		warn("cur_use_buf %zu cur_use_que %zu", proxy->cur_use_buf, proxy->cur_use_que);
 
 	g_async_queue_unref(proxy->fwd_retry_queue);
-	g_async_queue_unref(proxy->fwd_tx_queue);
-	g_async_queue_unref(proxy->fwd_rx_queue);
+	lfqueue_destroy(proxy->fwd_tx_queue);
+	lfqueue_destroy(proxy->fwd_rx_queue);
 
-	if (proxy->shared_buff)
-		munmap_or_abort(proxy->shared_buff, XNBD_SHARED_BUFF_SIZE);
+	if (proxy->dedup) {
+		xnbd_dedup_destroy(proxy->dedup);
+		xnbd_dedup_table_destroy(proxy->dedup_table);
+	}
 
 	close(proxy->cachefd);
 	bitmap_close_file(proxy->cbitmap, proxy->cbitmaplen);
+	bitmap_close_file(proxy->wbitmap, proxy->wbitmaplen);
+	g_free(proxy->cbitmap_dirty);
 }
 
 
@@ -428,12 +631,22 @@ void *rx_thread_main(void *arg)
 }
 
 
+/*
+ * tx_thread sends the replies of all the completed requests with one
+ * writev(), instead of one system call per reply. A reply takes at most two
+ * iovecs.
+ */
+#define XNBD_PROXY_TX_BATCH (IOV_MAX / 2)
+
 void *tx_thread_main(void *arg)
 {
 	struct proxy_session *ps = (struct proxy_session *) arg;
 	int need_exit = 0;
 	int need_skip = 0;
 
+	struct proxy_priv *privs[XNBD_PROXY_TX_BATCH];
+	struct iovec iov[XNBD_PROXY_TX_BATCH * 2];
+
 	set_process_name("proxy_tx");
 
 	block_all_signals();
@@ -441,29 +654,85 @@ void *tx_thread_main(void *arg)
 	info("tx_thread %lu starts", pthread_self());
 
 	for (;;) {
-		struct proxy_priv *priv = g_async_queue_pop(ps->tx_queue);
-		proxy_priv_dump(priv);
+		/* wait for a reply, and then take the ones ready */
+		unsigned int npriv = 0;
+		privs[npriv++] = g_async_queue_pop(ps->tx_queue);
+		while (npriv < XNBD_PROXY_TX_BATCH) {
+			struct proxy_priv *priv = g_async_queue_try_pop(ps->tx_queue);
+			if (!priv)
+				break;
+			privs[npriv++] = priv;
+		}
+
+		unsigned int iov_size = 0;
+
+		/* setup iovec */
+		for (unsigned int i = 0; i < npriv; i++) {
+			struct proxy_priv *priv = privs[i];
+			proxy_priv_dump(priv);
+
+			if (priv->need_exit) {
+				/* rx_thread enqueues nothing after this */
+				need_exit = 1;
+				continue;
+			}
+
+			if (priv->iotype == NBD_CMD_BLOCK_STATUS) {
+				/* one block status chunk (or an error chunk) */
+				iov[iov_size].iov_base = &priv->sreply;
+
+				if (priv->reply.error) {
+					iov[iov_size].iov_len = nbd_structured_reply_setup_error_chunk(&priv->sreply, &priv->reply);
+					iov_size += 1;
+					continue;
+				}
+
+				iov[iov_size].iov_len = nbd_structured_reply_setup_block_status_chunk(&priv->sreply, &priv->reply,
+						ps->opts.base_allocation_id, priv->bs.ndescs);
+				iov_size += 1;
+
+				/* the descriptors are sent and freed in this thread; convert them in place */
+				for (unsigned int j = 0; j < priv->bs.ndescs; j++) {
+					priv->bs.descs[j].length       = htonl(priv->bs.descs[j].length);
+					priv->bs.descs[j].status_flags = htonl(priv->bs.descs[j].status_flags);
+				}
+
+				iov[iov_size].iov_base = priv->bs.descs;
+				iov[iov_size].iov_len  = priv->bs.ndescs * sizeof(struct nbd_block_descriptor);
+				iov_size += 1;
+				continue;
+			}
 
-		if (priv->need_exit)
-			need_exit = 1;
-		else if (!need_skip) {
-			/* setup iovec */
-			struct iovec iov[2];
-			unsigned int iov_size = 0;
+			if (priv->iotype == NBD_CMD_READ && ps->opts.structured_reply) {
+				/* one data chunk (or an error chunk) instead of the simple reply */
+				iov[iov_size].iov_base = &priv->sreply;
 
-			iov[iov_size].iov_base = &priv->reply;
-			iov[iov_size].iov_len  = sizeof(struct nbd_reply);
-			iov_size += 1;
+				if (priv->reply.error) {
+					iov[iov_size].iov_len = nbd_structured_reply_setup_error_chunk(&priv->sreply, &priv->reply);
+					iov_size += 1;
+					continue;
+				}
+
+				iov[iov_size].iov_len = nbd_structured_reply_setup_read_chunk(&priv->sreply, &priv->reply,
+						priv->iofrom, priv->iolen, 0, 1);
+				iov_size += 1;
+			} else {
+				iov[iov_size].iov_base = &priv->reply;
+				iov[iov_size].iov_len  = sizeof(struct nbd_reply);
+				iov_size += 1;
+			}
 
 			if (priv->iotype == NBD_CMD_READ) {
 				iov[iov_size].iov_base = priv->read_buff;
 				iov[iov_size].iov_len  = priv->iolen;
 				iov_size += 1;
 			}
+		}
 
-			int ret = net_writev_all_or_error(priv->clientfd, iov, iov_size);
+		if (iov_size > 0 && !need_skip) {
+			int ret = net_writev_all_or_error(ps->nbd_fd, iov, iov_size);
 			if (ret < 0) {
-				warn("clientfd %d is dead", priv->clientfd);
+				warn("clientfd %d is dead", ps->nbd_fd);
 				/*
 				 * tx_thread has detected that clientfd is unusable.
 				 * tx_thread may dequeue requests from ps->tx_queue,
@@ -478,16 +747,25 @@ void *tx_thread_main(void *arg)
 			}
 		}
 
-		/* check the buffer pointer. Even if iotype is
-		 * NBD_CMD_UNDEFINED, the buffer may be allocated. */
-		if (priv->read_buff)
-			g_free(priv->read_buff);
+		for (unsigned int i = 0; i < npriv; i++) {
+			struct proxy_priv *priv = privs[i];
+
+			/* check the buffer pointer. Even if iotype is
+			 * NBD_CMD_UNDEFINED, the buffer may be allocated. */
+			if (priv->read_buff)
+				g_free(priv->read_buff);
 
-		if (priv->write_buff)
-			g_free(priv->write_buff);
+			if (priv->write_buff)
+				g_free(priv->write_buff);
 
-		mem_usage_del(ps->proxy, priv);
-		g_slice_free(struct proxy_priv, priv);
+			if (priv->fill_bm)
+				g_free(priv->fill_bm);
+
+			nbd_block_status_free(&priv->bs);
+
+			mem_usage_del(ps->proxy, priv);
+			g_slice_free(struct proxy_priv, priv);
+		}
 
 		if (need_exit)
 			break;
@@ -502,18 +780,6 @@ void *tx_thread_main(void *arg)
 }
 
 
-static gint unshift_func(gconstpointer a __attribute__((unused)),
-		       gconstpointer b __attribute__((unused)),
-			       gpointer user_data __attribute__((unused)))
-{
-	return -1;
-}
-
-static void g_async_queue_push_unshift(GAsyncQueue *queue, gpointer data)
-{
-	g_async_queue_push_sorted(queue, data, &unshift_func, NULL);
-}
-
 int main_loop(struct xnbd_proxy *proxy, int unix_listen_fd, int master_fd)
 {
 	int ret;
@@ -578,12 +844,24 @@ int main_loop(struct xnbd_proxy *proxy, int unix_listen_fd, int master_fd)
 					query.max_use_que = proxy->xnbd->proxy_max_que_size;
 					query.cur_use_que = proxy->cur_use_que;
 
+					query.compressed_read = proxy->xnbd->proxy_compressed_read;
+					query.remote_compressed_read = proxy->remote_compressed_read;
+					query.codec = proxy->xnbd->proxy_codec;
+					query.codec_level = proxy->xnbd->proxy_codec_level;
+					query.fetched_bytes = proxy->fetched_bytes;
+					query.fetched_wire_bytes = proxy->fetched_wire_bytes;
+					query.zeroed_bytes = proxy->zeroed_bytes;
+					query.dedup = proxy->xnbd->dedup;
+					query.shared_bytes = proxy->dedup ? xnbd_dedup_shared_bytes(proxy->dedup) : 0;
+
 					info("send current status (wrk_fd %d)", wrk_fd);
 					net_send_all_or_error(wrk_fd, &query, sizeof(query));
 				}
 				break;
 
 			case XNBD_PROXY_CMD_REGISTER_FD:
+			case XNBD_PROXY_CMD_REGISTER_FILL_FD:
+			case XNBD_PROXY_CMD_REGISTER_STRUCTURED_FD:
 				{
 					int nbd_fd = unix_recv_fd(wrk_fd);
 					info("create proxy_session (nbd_fd %d wrk_fd %d)", nbd_fd, wrk_fd);
@@ -593,6 +871,13 @@ int main_loop(struct xnbd_proxy *proxy, int unix_listen_fd, int master_fd)
 					ps->wrk_fd = wrk_fd;
 					ps->tx_queue = g_async_queue_new();
 					ps->proxy = proxy;
+					ps->fill_allowed = (cmd == XNBD_PROXY_CMD_REGISTER_FILL_FD);
+					if (cmd == XNBD_PROXY_CMD_REGISTER_STRUCTURED_FD) {
+						ret = net_recv_all_or_error(wrk_fd, &ps->opts, sizeof(ps->opts));
+						if (ret < 0)
+							warn("recv negotiate options (wrk_fd %d)", wrk_fd);
+					}
+					ps->reader = nbd_request_reader_create(nbd_fd);
 
 					ps->tid_tx = pthread_create_or_abort(tx_thread_main, ps);
 					ps->tid_rx = pthread_create_or_abort(rx_thread_main, ps);
@@ -604,6 +889,7 @@ int main_loop(struct xnbd_proxy *proxy, int unix_listen_fd, int master_fd)
 				break;
 
 			case XNBD_PROXY_CMD_REGISTER_FORWARDER_FD:
+			case XNBD_PROXY_CMD_REGISTER_FORWARDER_STRUCTURED_FD:
 				{
 					int fwd_fd = unix_recv_fd(wrk_fd);
 					info("register forwarder fd (nbd_fd %d wrk_fd %d)", fwd_fd, wrk_fd);
@@ -611,38 +897,13 @@ int main_loop(struct xnbd_proxy *proxy, int unix_listen_fd, int master_fd)
 					nbd_client_send_disc_request(proxy->remotefd);
 					close(proxy->remotefd);
 
-					for (;;) {
-						struct proxy_priv *priv = g_async_queue_try_pop(proxy->fwd_retry_queue);
-						if (!priv)
-							break;
-
-						priv->need_retry = 0;
-
-						g_async_queue_push_unshift(proxy->fwd_tx_queue, priv);
-					}
-
+					/* the new forwarder_tx thread resubmits the
+					 * requests in fwd_retry_queue first */
+					proxy->remote_structured_reply = (cmd == XNBD_PROXY_CMD_REGISTER_FORWARDER_STRUCTURED_FD);
 					proxy_initialize_forwarder(proxy, fwd_fd);
 				}
 				break;
 
-			case XNBD_PROXY_CMD_REGISTER_SHARED_BUFFER_FD:
-				{
-					/* TODO use this */
-					if (proxy->shared_buff)
-						warn("shared_buff was already assigned; do nothing");
-					else {
-						int buf_fd = unix_recv_fd(wrk_fd);
-						info("register shared buffer fd (buf_fd %d wrk_fd %d)", buf_fd, wrk_fd);
-
-						proxy->shared_buff = mmap(NULL, XNBD_SHARED_BUFF_SIZE, PROT_READ, MAP_SHARED, buf_fd, 0);
-						if (proxy->shared_buff == MAP_FAILED)
-							err("mmap, %m");
-
-						close(buf_fd);
-					}
-				}
-				break;
-
 			case XNBD_PROXY_CMD_DETECT_SWITCH:
 				/*
 				 * This command is used to detect the completion of the mode switch
@@ -714,6 +975,7 @@ int main_loop(struct xnbd_proxy *proxy, int unix_listen_fd, int master_fd)
 			g_async_queue_unref(ps->tx_queue);
 			close(ps->pipe_read_fd);
 			close(ps->pipe_write_fd);
+			nbd_request_reader_destroy(ps->reader);
 			close(ps->nbd_fd);
 
 			ret = write(ps->wrk_fd, "", 1);
@@ -769,10 +1031,16 @@ void xnbd_proxy_start(struct xnbd_info *xnbd)
 
 	/* check the remote server and get a disksize */
 
+	/* holes of the remote disk are transferred without data */
+	struct nbd_negotiate_options opts = { .structured_reply = 1 };
+
 	if (xnbd->proxy_target_exportname)
-		ret = nbd_negotiate_v2_client_side(remotefd, &xnbd->disksize, NULL, strlen(xnbd->proxy_target_exportname), xnbd->proxy_target_exportname);
-	else
+		ret = nbd_negotiate_v2_client_side_with_options(remotefd, &xnbd->disksize, NULL,
+				strlen(xnbd->proxy_target_exportname), xnbd->proxy_target_exportname, &opts);
+	else {
 		ret = nbd_negotiate_v1_client_side(remotefd, &xnbd->disksize, NULL);
+		opts.structured_reply = 0;
+	}
 
 	if (ret < 0)
 		err("negotiation with %s:%s failed", xnbd->proxy_rhost, xnbd->proxy_rport);
@@ -797,6 +1065,9 @@ void xnbd_proxy_start(struct xnbd_info *xnbd)
 
 		struct xnbd_proxy *proxy = g_malloc0(sizeof(struct xnbd_proxy));
 		proxy_initialize(xnbd, proxy);
+		proxy->remote_structured_reply = opts.structured_reply;
+		if (xnbd->proxy_delta_sync)
+			proxy_delta_sync(proxy, remotefd);
 		proxy_initialize_forwarder(proxy, remotefd);
 
 
@@ -876,10 +1147,15 @@ int xnbd_proxy_session_server(struct xnbd_session *ses)
 	int unix_fd = unix_connect(xnbd->proxy_unixpath);
 
 	enum xnbd_proxy_cmd_type cmd = XNBD_PROXY_CMD_REGISTER_FD;
+	if (ses->opts.structured_reply)
+		cmd = XNBD_PROXY_CMD_REGISTER_STRUCTURED_FD;
 	net_send_all_or_abort(unix_fd, &cmd, sizeof(cmd));
 
 	unix_send_fd(unix_fd, ses->clientfd);
 
+	if (ses->opts.structured_reply)
+		net_send_all_or_abort(unix_fd, &ses->opts, sizeof(ses->opts));
+
 	info("proxy worker: send fd %d via unix_fd %d",
 			ses->clientfd, unix_fd);
 
@@ -32,6 +32,7 @@ struct remote_read_request {
 	size_t bindex_iolen;
 };
 
+/* see XNBD_PROXY_MAX_REQUEST_SIZE */
 #define MAXNBLOCK 32
 
 struct proxy_priv {
@@ -40,6 +41,7 @@ struct proxy_priv {
 
 
 	uint32_t iotype;
+	uint32_t ioflags;
 
 	/* number of remote read requests */
 	int nreq;
@@ -52,11 +54,27 @@ struct proxy_priv {
 	unsigned long block_index_end;
 
 	struct nbd_reply reply;
+	/* the header of a structured read reply */
+	union nbd_structured_reply_chunk sreply;
 
 	char *write_buff;
 	char *read_buff;
 
+	/*
+	 * The blocks not cached before this request. NBD_CMD_CACHE_FILL and
+	 * NBD_CMD_CACHE_ZERO fill them; NBD_CMD_BLOCK_STATUS reports them as
+	 * allocated.
+	 */
+	unsigned long *fill_bm;
 
+	/* NBD_CMD_BLOCK_STATUS: the reply, made in the forwarder_rx thread */
+	struct nbd_block_status bs;
+
+
+	/*
+	 * replies to the session. Unbounded, so that a client not reading its
+	 * socket never blocks forwarder_rx, which serves all the sessions.
+	 */
 	GAsyncQueue *tx_queue;
 
 
@@ -68,8 +86,13 @@ struct proxy_priv {
 };
 
 
-#define XNBD_SHARED_BUFF_NBLOCKS  1000
-#define XNBD_SHARED_BUFF_SIZE (CBLOCKSIZE * XNBD_SHARED_BUFF_NBLOCKS)
+/*
+ * The number of requests each forwarder queue of the proxy server can hold.
+ * A thread pushing to a full queue waits for the other side. The queues are
+ * enlarged if max-queue-size is larger. The reply queue of each session is
+ * not bounded; see struct proxy_priv.
+ */
+#define XNBD_PROXY_QUEUE_SIZE 4096
 
 
 struct xnbd_proxy {
@@ -77,26 +100,57 @@ struct xnbd_proxy {
 
 
 	/* queue between rx threads and forwarder_tx thread */
-	GAsyncQueue *fwd_tx_queue;
+	struct lfqueue *fwd_tx_queue;
 
 	/* queue between forwarder_tx and forwarder_rx */
-	GAsyncQueue *fwd_rx_queue;
+	struct lfqueue *fwd_rx_queue;
 
-	/* queue between forwarder_tx and forwarder_rx */
+	/*
+	 * requests failed in forwarding. They are resubmitted by the
+	 * forwarder_tx thread of the next forwarding session, before any
+	 * request in fwd_tx_queue.
+	 */
 	GAsyncQueue *fwd_retry_queue;
 
 	struct xnbd_info *xnbd;
 
 	int remotefd;
+	/* read replies from the remote server are structured */
+	int remote_structured_reply;
+	/* the remote server accepted a compressed read of xnbd->proxy_codec */
+	bool remote_compressed_read;
+	/* bytes of blocks fetched with compressed reads, and bytes received for them */
+	uint64_t fetched_bytes;
+	uint64_t fetched_wire_bytes;
 
 	int cachefd;
+	/* the file system cannot zero a range of cachefd */
+	bool cache_no_zero_range;
+	/* bytes of zero blocks zeroed by fallocate() instead of being written */
+	uint64_t zeroed_bytes;
+	/* the cache disk is the file 0 of it (--dedup) */
+	struct xnbd_dedup *dedup;
+	struct xnbd_dedup_table *dedup_table;
 
 	/* cached bitmap array (mmaped) */
 	unsigned long *cbitmap;
 	size_t cbitmaplen;
 
+	/*
+	 * blocks written by clients (WRITE and WRITE_ZEROES), kept in
+	 * CACHE_BITMAP_IMAGE.written over restarts. --delta-sync never
+	 * uncaches them; their data exists only in the cache disk.
+	 */
+	unsigned long *wbitmap;
+	size_t wbitmaplen;
 
-	char *shared_buff;
+	/*
+	 * one flag for each page of cbitmap (and of wbitmap), set if the page
+	 * is updated after the last FLUSH. Set by forwarder_tx, and cleared by
+	 * forwarder_rx.
+	 */
+	unsigned char *cbitmap_dirty;
+	size_t cbitmap_npages;
 
 
 	GMutex curr_use_mutex;
@@ -111,8 +165,14 @@ enum xnbd_proxy_cmd_type {
 	XNBD_PROXY_CMD_QUERY_STATUS,
 	XNBD_PROXY_CMD_REGISTER_FD,
 	XNBD_PROXY_CMD_REGISTER_FORWARDER_FD,
-	XNBD_PROXY_CMD_REGISTER_SHARED_BUFFER_FD,
-	XNBD_PROXY_CMD_DETECT_SWITCH
+	XNBD_PROXY_CMD_DETECT_SWITCH,
+	XNBD_PROXY_CMD_REGISTER_FILL_FD,
+	/*
+	 * the session (or the forwarder) negotiated structured replies. A
+	 * session sends struct nbd_negotiate_options after the fd.
+	 */
+	XNBD_PROXY_CMD_REGISTER_STRUCTURED_FD,
+	XNBD_PROXY_CMD_REGISTER_FORWARDER_STRUCTURED_FD
 };
 
 /* query about current status via a unix socket */
@@ -129,6 +189,20 @@ struct xnbd_proxy_query {
 	size_t max_use_que;
 	size_t cur_use_buf;
 	size_t cur_use_que;
+
+	/* --compressed-read */
+	bool compressed_read;
+	bool remote_compressed_read;
+	enum xnbd_codec codec;
+	int codec_level;
+	uint64_t fetched_bytes;
+	uint64_t fetched_wire_bytes;
+
+	uint64_t zeroed_bytes;
+
+	/* --dedup */
+	bool dedup;
+	uint64_t shared_bytes;
 };
 
 
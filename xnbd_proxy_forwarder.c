@@ -52,6 +52,56 @@ void proxy_priv_dump(struct proxy_priv *priv)
 }
 
 
+/* the number of bits in one page of the bitmap file */
+static unsigned long cbitmap_page_nbits(void)
+{
+	return (unsigned long) getpagesize() * 8;
+}
+
+/*
+ * Mark a block as cached. This is done only in the forwarder_tx thread. The
+ * page of the bitmap file is remembered, so that FLUSH writes out only the
+ * updated pages.
+ **/
+static void cbitmap_on(struct xnbd_proxy *proxy, unsigned long index)
+{
+	bitmap_on(proxy->cbitmap, index);
+
+	unsigned long page = index / cbitmap_page_nbits();
+	__atomic_store_n(&proxy->cbitmap_dirty[page], 1, __ATOMIC_RELEASE);
+}
+
+/* Mark a block as written by a client, as cbitmap_on() does. */
+static void wbitmap_on(struct xnbd_proxy *proxy, unsigned long index)
+{
+	bitmap_on(proxy->wbitmap, index);
+
+	unsigned long page = index / cbitmap_page_nbits();
+	__atomic_store_n(&proxy->cbitmap_dirty[page], 1, __ATOMIC_RELEASE);
+}
+
+/* Write out the pages of the bitmap files updated after the last call. */
+static void cbitmap_sync_dirty(struct xnbd_proxy *proxy)
+{
+	const unsigned long nbits = cbitmap_page_nbits();
+	size_t npages = proxy->cbitmap_npages;
+
+	for (size_t i = 0; i < npages; i++) {
+		if (!__atomic_exchange_n(&proxy->cbitmap_dirty[i], 0, __ATOMIC_ACQUIRE))
+			continue;
+
+		/* one msync() for contiguous dirty pages */
+		size_t j = i + 1;
+		while (j < npages && __atomic_exchange_n(&proxy->cbitmap_dirty[j], 0, __ATOMIC_ACQUIRE))
+			j++;
+
+		bitmap_sync_file_range(proxy->cbitmap, proxy->cbitmaplen, i * nbits, j * nbits - 1);
+		bitmap_sync_file_range(proxy->wbitmap, proxy->wbitmaplen, i * nbits, j * nbits - 1);
+		i = j;
+	}
+}
+
+
 
 void add_read_block_to_tail(struct proxy_priv *priv, unsigned long i)
 {
@@ -89,7 +139,7 @@ void prepare_read_priv(struct xnbd_proxy *proxy, struct proxy_priv *priv)
 
 		if (!bitmap_test(proxy->cbitmap, i)) {
 			/* this block will be cached later in the completion thread */
-			bitmap_on(proxy->cbitmap, i);
+			cbitmap_on(proxy, i);
 
 			/* counter */
 			//monitor_cached_by_ondemand(i);
@@ -153,8 +203,11 @@ void prepare_write_priv(struct xnbd_proxy *proxy, struct proxy_priv *priv)
 			/* counter */
 			cachestat_write_block();
 
+			if (!bitmap_test(proxy->wbitmap, i))
+				wbitmap_on(proxy, i);
+
 			if (!bitmap_test(proxy->cbitmap, i)) {
-				bitmap_on(proxy->cbitmap, i);
+				cbitmap_on(proxy, i);
 
 				/* counter */
 				//monitor_cached_by_ondemand(i);
@@ -216,82 +269,287 @@ void prepare_write_priv(struct xnbd_proxy *proxy, struct proxy_priv *priv)
 }
 
 
+/*
+ * NBD_CMD_CACHE_FILL carries block data that xnbd-bgctl fetched from the
+ * remote server over its own connection. Only the blocks not yet cached are
+ * copied to the cache disk. The others may have been updated by clients after
+ * xnbd-bgctl read them, so they must be left untouched.
+ *
+ * Like other requests, the cached bitmap is updated only in the forwarder_tx
+ * thread. The forwarder_rx thread later copies the marked blocks.
+ *
+ * NBD_CMD_CACHE_ZERO is the same except that the blocks are zero-filled.
+ **/
+void prepare_fill_priv(struct xnbd_proxy *proxy, struct proxy_priv *priv)
+{
+	unsigned long block_index_start = priv->block_index_start;
+	unsigned long block_index_end   = priv->block_index_end;
+
+	priv->fill_bm = bitmap_alloc(block_index_end - block_index_start + 1);
+
+	for (unsigned long i = block_index_start; i <= block_index_end; i++) {
+		if (!bitmap_test(proxy->cbitmap, i)) {
+			cbitmap_on(proxy, i);
+			bitmap_on(priv->fill_bm, i - block_index_start);
+		}
+	}
+}
+
+
+/*
+ * NBD_CMD_BLOCK_STATUS does not change the cached bitmap. A block marked in
+ * the bitmap at this time is in the cache disk when the forwarder_rx thread
+ * handles this request, but the forwarder_tx thread may mark the following
+ * requests before that. Remember the blocks not cached now.
+ **/
+void prepare_block_status_priv(struct xnbd_proxy *proxy, struct proxy_priv *priv)
+{
+	unsigned long block_index_start = priv->block_index_start;
+	unsigned long block_index_end   = priv->block_index_end;
+
+	priv->fill_bm = bitmap_alloc(block_index_end - block_index_start + 1);
+
+	for (unsigned long i = block_index_start; i <= block_index_end; i++) {
+		if (!bitmap_test(proxy->cbitmap, i))
+			bitmap_on(priv->fill_bm, i - block_index_start);
+	}
+}
+
+
 static unsigned long fwd_counter = 0;
 
+static int sending_failed = 0;
+
+static void forward_request(struct xnbd_proxy *proxy, struct proxy_priv *priv)
+{
+	if (!priv->prepare_done) {
+		if (priv->iotype == NBD_CMD_WRITE || priv->iotype == NBD_CMD_WRITE_ZEROES)
+			prepare_write_priv(proxy, priv);
+		else if (priv->iotype == NBD_CMD_READ || priv->iotype == NBD_CMD_CACHE)
+			prepare_read_priv(proxy, priv);
+		else if (priv->iotype == NBD_CMD_CACHE_FILL || priv->iotype == NBD_CMD_CACHE_ZERO)
+			prepare_fill_priv(proxy, priv);
+		else if (priv->iotype == NBD_CMD_BLOCK_STATUS)
+			prepare_block_status_priv(proxy, priv);
+
+		priv->seqnum = fwd_counter;
+		fwd_counter += 1;
+
+		/* in retry, skip setting up forward requests */
+		priv->prepare_done = 1;
+	}
+
+
+	/* send read request as soon as possible */
+	for (int i = 0; i < priv->nreq; i++) {
+		off_t iofrom = (off_t) priv->req[i].bindex_iofrom * CBLOCKSIZE;
+		size_t length = priv->req[i].bindex_iolen * CBLOCKSIZE;
+
+		length = confine_iolen_within_disk(proxy->xnbd->disksize, iofrom, length);
+
+		int ret;
+		if (proxy->remote_compressed_read)
+			ret = xnbd_codec_send_read_request(proxy->remotefd, iofrom, length,
+					proxy->xnbd->proxy_codec, proxy->xnbd->proxy_codec_level);
+		else
+			ret = nbd_client_send_read_request(proxy->remotefd, iofrom, length);
+		if (ret < 0) {
+			warn("sending read request failed, seqnum %lu", priv->seqnum);
+			sending_failed = 1;
+			break;
+		}
+	}
+
+	/* Once sending failed, this marking works if nreq == 0. All
+	 * the following requests are enqueued to the retry queue. */
+	if (sending_failed)
+		priv->need_retry = 1;
+
+	lfqueue_push(proxy->fwd_rx_queue, priv);
+}
+
 void *forwarder_tx_thread_main(void *arg)
 {
 	struct xnbd_proxy *proxy = (struct xnbd_proxy *) arg;
-	int sending_failed = 0;
 
 	set_process_name("proxy_fwd_tx");
 
+	sending_failed = 0;
+
 	block_all_signals();
 
 	info("create forwarder_tx thread %lu", pthread_self());
 
 
+	/*
+	 * Resubmit the requests failed in the previous forwarding session.
+	 * They are older than any request in fwd_tx_queue, so they must be
+	 * forwarded first.
+	 **/
+	for (;;) {
+		struct proxy_priv *priv = g_async_queue_try_pop(proxy->fwd_retry_queue);
+		if (!priv)
+			break;
+
+		dbg("%lu --- resubmit seqnum %lu", pthread_self(), priv->seqnum);
+		priv->need_retry = 0;
+		forward_request(proxy, priv);
+	}
+
+
 	for (;;) {
 		struct proxy_priv *priv;
 
-		priv = (struct proxy_priv *) g_async_queue_pop(proxy->fwd_tx_queue);
+		priv = (struct proxy_priv *) lfqueue_pop(proxy->fwd_tx_queue);
 		dbg("%lu --- process new queue element", pthread_self());
 
 		if (priv == &priv_stop_forwarder) {
-			g_async_queue_push(proxy->fwd_rx_queue, (gpointer) priv);
-			goto out_of_loop;
+			lfqueue_push(proxy->fwd_rx_queue, priv);
+			break;
 		}
 
 		if (priv->need_exit) {
-			g_async_queue_push(proxy->fwd_rx_queue, (gpointer) priv);
+			lfqueue_push(proxy->fwd_rx_queue, priv);
 			continue;
 		}
 
+		forward_request(proxy, priv);
+	}
 
 
-		if (!priv->prepare_done) {
-			if (priv->iotype == NBD_CMD_WRITE)
-				prepare_write_priv(proxy, priv);
-			else if (priv->iotype == NBD_CMD_READ || priv->iotype == NBD_CMD_CACHE)
-				prepare_read_priv(proxy, priv);
+	info("bye forwarder_tx thread");;
+	return NULL;
+}
 
-			priv->seqnum = fwd_counter;
-			fwd_counter += 1;
+/*
+ * The status of a block not yet cached is unknown. It is reported as
+ * allocated; a client never sees a hole that the remote disk does not have.
+ * A cached block is a hole if the cache disk has a hole there.
+ */
+static void make_block_status_reply(struct xnbd_proxy *proxy, struct proxy_priv *priv)
+{
+	off_t ioend = priv->iofrom + priv->iolen;
 
-			/* in retry, skip setting up forward requests */
-			priv->prepare_done = 1;
-		}
+	for (unsigned long index = priv->block_index_start; index <= priv->block_index_end; index++) {
+		off_t chunk_iofrom = MAX(priv->iofrom, (off_t) index * CBLOCKSIZE);
+		off_t chunk_ioend  = MIN(ioend, (off_t) (index + 1) * CBLOCKSIZE);
+		int full = 0;
 
+		if (bitmap_test(priv->fill_bm, index - priv->block_index_start)) {
+			if (nbd_block_status_add(&priv->bs, chunk_ioend - chunk_iofrom, 0) < 0)
+				break;
+		} else {
+			for (off_t pos = chunk_iofrom; pos < chunk_ioend; ) {
+				off_t extent_end;
+				int hole = get_file_extent(proxy->cachefd, pos, chunk_ioend, &extent_end);
 
-		/* send read request as soon as possible */
-		for (int i = 0; i < priv->nreq; i++) {
-			off_t iofrom = (off_t) priv->req[i].bindex_iofrom * CBLOCKSIZE;
-			size_t length = priv->req[i].bindex_iolen * CBLOCKSIZE;
+				if (nbd_block_status_add(&priv->bs, extent_end - pos, hole ? (NBD_STATE_HOLE | NBD_STATE_ZERO) : 0) < 0) {
+					full = 1;
+					break;
+				}
 
-			length = confine_iolen_within_disk(proxy->xnbd->disksize, iofrom, length);
+				pos = extent_end;
+			}
 
-			int ret = nbd_client_send_read_request(proxy->remotefd, iofrom, length);
-			if (ret < 0) {
-				warn("sending read request failed, seqnum %lu", priv->seqnum);
-				sending_failed = 1;
+			if (full)
 				break;
-			}
 		}
 
-		/* Once sending failed, this marking works if nreq == 0. All
-		 * the following requests are enqueued to the retry queue. */
-		if (sending_failed)
-			priv->need_retry = 1;
+		/* only one descriptor is wanted; drop the second one */
+		if ((priv->ioflags & NBD_CMD_FLAG_REQ_ONE) && priv->bs.ndescs > 1) {
+			priv->bs.ndescs -= 1;
+			priv->bs.length -= priv->bs.descs[priv->bs.ndescs].length;
+			break;
+		}
+	}
+}
+
+/*
+ * Zero-fill the blocks marked by prepare_fill_priv(). A range that is already
+ * a hole in the cache disk is skipped. If punch hole is not supported, zero
+ * is written.
+ */
+static void cache_zero_blocks(struct xnbd_proxy *proxy, struct proxy_priv *priv)
+{
+	unsigned long nblocks = priv->block_index_end - priv->block_index_start + 1;
+	off_t ioend = priv->iofrom + priv->iolen;
+
+	for (unsigned long i = 0; i < nblocks; ) {
+		if (!bitmap_test(priv->fill_bm, i)) {
+			i += 1;
+			continue;
+		}
+
+		unsigned long j = i + 1;
+		while (j < nblocks && bitmap_test(priv->fill_bm, j))
+			j += 1;
 
-		g_async_queue_push(proxy->fwd_rx_queue, (gpointer) priv);
+		off_t run_iofrom = priv->iofrom + (off_t) i * CBLOCKSIZE;
+		off_t run_ioend  = MIN(ioend, priv->iofrom + (off_t) j * CBLOCKSIZE);
+		i = j;
+
+		off_t extent_end;
+		int hole = get_file_extent(proxy->cachefd, run_iofrom, run_ioend, &extent_end);
+		if (hole && extent_end == run_ioend)
+			continue;
+
+		int ret = punch_hole(proxy->cachefd, run_iofrom, run_ioend - run_iofrom);
+		if (ret < 0) {
+			struct mmap_block_region *mbr = mmap_block_region_create(proxy->cachefd,
+					proxy->xnbd->disksize, run_iofrom, run_ioend - run_iofrom, 0);
+			memset(mbr->iobuf, 0, run_ioend - run_iofrom);
+			mmap_block_region_free(mbr);
+		}
 	}
+}
 
-out_of_loop:
 
+/*
+ * Blocks written to the cache disk which are all zero are zeroed by
+ * fallocate(), instead of being written out. buf holds the data of the
+ * range. Returns true if any block is zeroed.
+ */
+static bool cache_zero_written_blocks(struct xnbd_proxy *proxy, const char *buf, off_t iofrom, size_t iolen)
+{
+	if (proxy->cache_no_zero_range)
+		return false;
+
+	ssize_t zeroed = zero_range_of_zero_blocks(proxy->cachefd, buf, iofrom, iolen, CBLOCKSIZE);
+	if (zeroed < 0) {
+		info("the cache disk does not support zeroing a range; zero blocks are written out");
+		proxy->cache_no_zero_range = true;
+		return false;
+	}
 
-	info("bye forwarder_tx thread");;
-	return NULL;
+	proxy->zeroed_bytes += zeroed;
+
+	return (zeroed > 0);
+}
+
+
+/*
+ * FUA: write out the data of a request and its part of the bitmap, instead
+ * of the whole cache disk. If mbr is NULL, (some blocks of) the range were
+ * zeroed by fallocate(), which changes only the metadata of the file.
+ *
+ * The bitmap of the range is written out, even though the pages are still
+ * marked dirty for the next FLUSH.
+ **/
+static void sync_written_range(struct xnbd_proxy *proxy, struct proxy_priv *priv, struct mmap_block_region *mbr)
+{
+	if (mbr) {
+		if (mmap_region_msync(mbr->mr) < 0)
+			err("msync %m");
+	} else {
+		if (fdatasync(proxy->cachefd) < 0)
+			err("fdatasync %m");
+	}
+
+	bitmap_sync_file_range(proxy->cbitmap, proxy->cbitmaplen, priv->block_index_start, priv->block_index_end);
+	bitmap_sync_file_range(proxy->wbitmap, proxy->wbitmaplen, priv->block_index_start, priv->block_index_end);
 }
 
+
 static int receiving_failed = 0;
 int forwarder_rx_thread_mainloop(struct xnbd_proxy *proxy)
 {
@@ -303,7 +561,7 @@ int forwarder_rx_thread_mainloop(struct xnbd_proxy *proxy)
 	dbg("wait new queue element");
 
 
-	priv = (struct proxy_priv *) g_async_queue_pop(proxy->fwd_rx_queue);
+	priv = (struct proxy_priv *) lfqueue_pop(proxy->fwd_rx_queue);
 	dbg("--- process new queue element %p", priv);
 
 	proxy_priv_dump(priv);
@@ -315,8 +573,16 @@ int forwarder_rx_thread_mainloop(struct xnbd_proxy *proxy)
 		goto hand_to_tx_queue;
 
 
-	struct mmap_block_region *mbr = mmap_block_region_create(proxy->cachefd, proxy->xnbd->disksize, priv->iofrom, priv->iolen, 0);
-	char *iobuf = mbr->iobuf;
+	/* these requests do not touch the data of the range */
+	int need_mmap = (priv->iotype != NBD_CMD_BLOCK_STATUS && priv->iotype != NBD_CMD_CACHE_ZERO);
+
+	struct mmap_block_region *mbr = NULL;
+	char *iobuf = NULL;
+
+	if (need_mmap) {
+		mbr = mmap_block_region_create(proxy->cachefd, proxy->xnbd->disksize, priv->iofrom, priv->iolen, 0);
+		iobuf = mbr->iobuf;
+	}
 
 	for (int i = 0; i < priv->nreq; i++) {
 		dbg("priv req %d", i);
@@ -327,13 +593,29 @@ int forwarder_rx_thread_mainloop(struct xnbd_proxy *proxy)
 		char *iobuf_partial = (char *) mbr->ba_iobuf + (block_iofrom - mbr->ba_iofrom);
 
 		/* recv from server */
-		ret = nbd_client_recv_read_reply(proxy->remotefd, iobuf_partial, block_iolen);
+		if (proxy->remote_compressed_read) {
+			/* decompressed straight into the cache disk */
+			ssize_t wirelen = xnbd_codec_recv_read_reply(proxy->remotefd, iobuf_partial, block_iolen, xnbd->proxy_codec);
+			if (wirelen >= 0) {
+				proxy->fetched_bytes += block_iolen;
+				proxy->fetched_wire_bytes += wirelen;
+				ret = 0;
+			} else
+				ret = -1;
+		} else if (proxy->remote_structured_reply)
+			ret = nbd_client_recv_read_reply_structured(proxy->remotefd, iobuf_partial, block_iolen, block_iofrom);
+		else
+			ret = nbd_client_recv_read_reply(proxy->remotefd, iobuf_partial, block_iolen);
 		if (ret < 0) {
 			warn("forwarder: receiving a read reply failed, seqnum %lu", priv->seqnum);
 			receiving_failed = 1;
 			break;
 		}
 
+		cache_zero_written_blocks(proxy, iobuf_partial, block_iofrom, block_iolen);
+		if (proxy->dedup)
+			xnbd_dedup_share(proxy->dedup, 0, block_iofrom, block_iolen);
+
 		/*
 		 * Do not mark cbitmap here. Do it before. Otherwise, when the
 		 * following request covers an over-wrapped I/O region, the
@@ -351,6 +633,9 @@ int forwarder_rx_thread_mainloop(struct xnbd_proxy *proxy)
 			/* we have to serialize all io to the cache disk. */
 			memcpy(priv->read_buff, iobuf, priv->iolen);
 
+			if (proxy->dedup)
+				xnbd_dedup_index(proxy->dedup, 0, priv->iofrom, priv->iolen);
+
 		} else if (priv->iotype == NBD_CMD_WRITE) {
 			/*
 			 * This memcpy() must come before sending reply, so that xnbd-tester
@@ -360,10 +645,61 @@ int forwarder_rx_thread_mainloop(struct xnbd_proxy *proxy)
 
 			/* Do not mark cbitmap here. */
 
+			bool zeroed = cache_zero_written_blocks(proxy, priv->write_buff, priv->iofrom, priv->iolen);
+			if (proxy->dedup)
+				xnbd_dedup_share(proxy->dedup, 0, priv->iofrom, priv->iolen);
+
+			if (priv->ioflags & NBD_CMD_FLAG_FUA)
+				sync_written_range(proxy, priv, zeroed ? NULL : mbr);
+
+		} else if (priv->iotype == NBD_CMD_WRITE_ZEROES) {
+			/*
+			 * Like WRITE, only partial blocks at both the ends are
+			 * retrieved from the remote server. The other blocks
+			 * are zeroed locally.
+			 **/
+			enum zero_range_mode mode = (priv->ioflags & NBD_CMD_FLAG_NO_HOLE) ? ZERO_RANGE_ALLOCATED : ZERO_RANGE_PUNCH;
+
+			ret = zero_range(proxy->cachefd, priv->iofrom, priv->iolen, mode);
+			if (ret < 0)
+				memset(iobuf, 0, priv->iolen);
+
+			if (priv->ioflags & NBD_CMD_FLAG_FUA)
+				sync_written_range(proxy, priv, (ret < 0) ? mbr : NULL);
+
 		} else if (priv->iotype == NBD_CMD_CACHE) {
 			/* NBD_CMD_CACHE does not do nothing here */
 			;
 
+		} else if (priv->iotype == NBD_CMD_CACHE_FILL) {
+			unsigned long nblocks = priv->block_index_end - priv->block_index_start + 1;
+
+			for (unsigned long i = 0; i < nblocks; ) {
+				if (!bitmap_test(priv->fill_bm, i)) {
+					i += 1;
+					continue;
+				}
+
+				unsigned long j = i + 1;
+				while (j < nblocks && bitmap_test(priv->fill_bm, j))
+					j += 1;
+
+				off_t offset = (off_t) i * CBLOCKSIZE;
+				size_t len = MIN((size_t) (j - i) * CBLOCKSIZE, priv->iolen - offset);
+				i = j;
+
+				memcpy(iobuf + offset, priv->write_buff + offset, len);
+				cache_zero_written_blocks(proxy, priv->write_buff + offset, priv->iofrom + offset, len);
+				if (proxy->dedup)
+					xnbd_dedup_share(proxy->dedup, 0, priv->iofrom + offset, len);
+			}
+
+		} else if (priv->iotype == NBD_CMD_CACHE_ZERO) {
+			cache_zero_blocks(proxy, priv);
+
+		} else if (priv->iotype == NBD_CMD_BLOCK_STATUS) {
+			make_block_status_reply(proxy, priv);
+
 		} else if (priv->iotype == NBD_CMD_FLUSH) {
 			dbg("disk flush");
 			/* FLUSH ensure that the data of all the blocks is
@@ -388,7 +724,7 @@ int forwarder_rx_thread_mainloop(struct xnbd_proxy *proxy)
 			if (ret < 0)
 				err("fsync %m");
 
-			bitmap_sync_file(proxy->cbitmap, proxy->cbitmaplen);
+			cbitmap_sync_dirty(proxy);
 
 		} else if (priv->iotype == NBD_CMD_TRIM) {
 			/* If some blocks in the range are not yet cached, we
@@ -399,7 +735,8 @@ int forwarder_rx_thread_mainloop(struct xnbd_proxy *proxy)
 			err("bug");
 	}
 
-	mmap_block_region_free(mbr);
+	if (mbr)
+		mmap_block_region_free(mbr);
 
 
 	if (priv->need_retry) {
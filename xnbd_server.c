@@ -46,10 +46,16 @@ void xnbd_initialize(struct xnbd_info *xnbd)
 		case xnbd_cmd_cow_target:
 			g_assert(xnbd->cow_diskpath);
 
-			xnbd->cow_ds = xnbd_cow_target_create_disk_stack(xnbd->cow_diskpath);
+			if (xnbd->cow_id >= 0)
+				xnbd->cow_ds = xnbd_cow_target_open_disk_stack(xnbd->cow_diskpath, xnbd->cow_id);
+			else
+				xnbd->cow_ds = xnbd_cow_target_create_disk_stack(xnbd->cow_diskpath);
 			xnbd->disksize = xnbd->cow_ds->disksize;
 			xnbd->nblocks = get_disk_nblocks(xnbd->disksize);
 
+			if (xnbd->dedup && !xnbd->readonly)
+				xnbd->dedup_table = xnbd_dedup_table_create(xnbd->disksize);
+
 			break;
 
 		case xnbd_cmd_target:
@@ -58,6 +64,17 @@ void xnbd_initialize(struct xnbd_info *xnbd)
 			xnbd_target_open_disk(xnbd->target_diskpath, xnbd);
 			xnbd->nblocks = get_disk_nblocks(xnbd->disksize);
 
+			/* the latest data is in the layers of online snapshots */
+			if (xnbd->target_online_snapshot) {
+				xnbd->cow_ds = xnbd_target_open_disk_stack(xnbd->target_diskpath);
+				xnbd_target_merge_layers(xnbd);
+			} else if (xnbd_target_has_layers(xnbd->target_diskpath))
+				err("%s has layers of online snapshots; use --online-snapshot", xnbd->target_diskpath);
+
+			/* used after the first snapshot */
+			if (xnbd->dedup && !xnbd->readonly)
+				xnbd->dedup_table = xnbd_dedup_table_create(xnbd->disksize);
+
 			break;
 
 		case xnbd_cmd_version:
@@ -81,9 +98,23 @@ void xnbd_shutdown(struct xnbd_info *xnbd)
 {
 	info("xnbd shutting down...");
 
-	if (xnbd->cmd == xnbd_cmd_target)
+	if (xnbd->cmd == xnbd_cmd_target) {
 		close(xnbd->target_diskfd);
 
+		/* a merge is resumed at the next start */
+		if (xnbd->target_merge_pid > 0) {
+			kill(xnbd->target_merge_pid, SIGKILL);
+			waitpid(xnbd->target_merge_pid, NULL, 0);
+			xnbd->target_merge_pid = 0;
+		}
+
+		/* the layers are persistent */
+		if (xnbd->cow_ds) {
+			xnbd_cow_target_close_disk_stack(xnbd->cow_ds);
+			xnbd->cow_ds = NULL;
+		}
+	}
+
 
 	if (xnbd->cmd == xnbd_cmd_cow_target)
 		xnbd_cow_target_close_disk_stack(xnbd->cow_ds);
@@ -92,6 +123,11 @@ void xnbd_shutdown(struct xnbd_info *xnbd)
 	if (xnbd->cmd == xnbd_cmd_proxy)
 		xnbd_proxy_stop(xnbd);
 
+	if (xnbd->dedup_table) {
+		xnbd_dedup_table_destroy(xnbd->dedup_table);
+		xnbd->dedup_table = NULL;
+	}
+
 
 
 
@@ -107,7 +143,11 @@ void do_service(struct xnbd_session *ses)
 
 	switch (xnbd->cmd) {
 		case xnbd_cmd_target:
-			ret = xnbd_target_session_server(ses);
+			/* stacked by online snapshots */
+			if (xnbd->cow_ds)
+				ret = xnbd_cow_target_session_server(ses);
+			else
+				ret = xnbd_target_session_server(ses);
 			break;
 
 		case xnbd_cmd_cow_target:
@@ -213,14 +253,25 @@ static void set_sigactions()
 
 
 #define MAXLISTENSOCK 20
+#define XNBD_MAX_IO_THREADS 256
 static struct pollfd ppoll_eventfds[MAXLISTENSOCK];
 static nfds_t ppoll_neventfds = 0;
 
-void invoke_new_session(struct xnbd_info *xnbd, int csockfd)
+/* a connected socket preserved across restarting sessions */
+struct preserved_conn {
+	int clientfd;
+	struct nbd_negotiate_options opts;
+};
+
+/* no options are negotiated with a client accepted by ourselves (NBD v1) */
+static const struct nbd_negotiate_options nbd_v1_opts;
+
+void invoke_new_session(struct xnbd_info *xnbd, int csockfd, const struct nbd_negotiate_options *opts)
 {
 	struct xnbd_session *ses = g_malloc0(sizeof(struct xnbd_session));
 	ses->clientfd = csockfd;
 	ses->xnbd = xnbd;
+	ses->opts = *opts;
 
 	/* used for sending msg to the session process */
 	make_pipe(&ses->pipe_master_fd, &ses->pipe_worker_fd);
@@ -358,7 +409,7 @@ static void ppoll_add_eventfd(int fd, short events)
 	ppoll_neventfds += 1;
 }
 
-int master_server(int port, void *data, int connect_fd)
+int master_server(int port, void *data, int connect_fd, int handoff_fd)
 {
 	struct xnbd_info *xnbd = (struct xnbd_info *) data;
 	int lsock[MAXLISTENSOCK];
@@ -368,7 +419,12 @@ int master_server(int port, void *data, int connect_fd)
 	ppoll_initialize_eventfds();
 
 
-	if (connect_fd == -1) {
+	if (handoff_fd != -1) {
+		/* xnbd-wrapper hands off clients; do not listen by ourselves */
+		info("receive clients from the handoff socket %d", handoff_fd);
+		ppoll_add_eventfd(handoff_fd, POLLIN);
+
+	} else if (connect_fd == -1) {
 		ai_head = net_getaddrinfo(NULL, port, PF_UNSPEC, SOCK_STREAM, IPPROTO_TCP);
 
 		unsigned int nlistened = net_create_server_sockets(ai_head, lsock, MAXLISTENSOCK);
@@ -380,11 +436,7 @@ int master_server(int port, void *data, int connect_fd)
 
 	} else {
 		if (connect_fd == 0) {
-			int ret;
-			if (xnbd->readonly)
-				ret = nbd_negotiate_v1_server_side_readonly(connect_fd, xnbd->disksize);
-			else
-				ret = nbd_negotiate_v1_server_side(connect_fd, xnbd->disksize);
+			int ret = nbd_negotiate_v1_server_side_with_flags(connect_fd, xnbd->disksize, xnbd_get_export_flags(xnbd));
 			if (ret < 0) {
 				warn("negotiation with the client failed");
 			} else {
@@ -393,7 +445,7 @@ int master_server(int port, void *data, int connect_fd)
 		} else {
 			info("use already negotiated sockfd %d", connect_fd);
 		}
-		invoke_new_session(xnbd, connect_fd);
+		invoke_new_session(xnbd, connect_fd, &xnbd->connected_opts);
 	}
 
 
@@ -418,6 +470,9 @@ int master_server(int port, void *data, int connect_fd)
 	GList *socklist = NULL;
 	int restarting_for_mode_change = 0;
 	int restarting_for_snapshot = 0;
+	int restarting_for_merge = 0;
+	bool merge_copied = false;
+	bool handoff_closed = false;
 
 	for (;;) {
 		int nready;
@@ -481,6 +536,17 @@ int master_server(int port, void *data, int connect_fd)
 					if (pid == xnbd->proxy_pid)
 						err("detected abnormal termination of proxy_server");
 
+				if (xnbd->cmd == xnbd_cmd_target && pid == xnbd->target_merge_pid) {
+					xnbd->target_merge_pid = 0;
+
+					/* the merged layer is dropped after restarting sessions */
+					if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+						merge_copied = true;
+					else
+						warn("merging layers failed, status %d", status);
+
+					continue;
+				}
 
 
 				struct xnbd_session *ses = find_session_with_pid(xnbd, pid);
@@ -497,18 +563,21 @@ int master_server(int port, void *data, int connect_fd)
 				if (WIFSIGNALED(status))
 					info("   killed by signal=%d(%s)", WTERMSIG(status), strsignal(WTERMSIG(status)));
 			}
+		}
 
-			const bool single_client_at_most = (connect_fd != -1);
-			const bool restart_in_progress = (restarting_for_mode_change || restarting_for_snapshot);
+		{
+			/* no more clients come with connect_fd, or after xnbd-wrapper has gone */
+			const bool no_more_clients = (connect_fd != -1 || handoff_closed);
+			const bool restart_in_progress = (restarting_for_mode_change || restarting_for_snapshot || restarting_for_merge);
 			const bool sessions_running = (g_list_length(xnbd->sessions) > 0);
-			if (single_client_at_most && ! restart_in_progress && ! sessions_running) {
-				info("Using connect_fd. The only client/worker is done, starting to terminate altogether");
+			if (no_more_clients && ! restart_in_progress && ! sessions_running) {
+				info("No more clients. The last client/worker is done, starting to terminate altogether");
 				break;
 			}
 		}
 
 		/* must be after the SIGCHLD handler */
-		if ((restarting_for_mode_change || restarting_for_snapshot) && g_list_length(xnbd->sessions) == 0) {
+		if ((restarting_for_mode_change || restarting_for_snapshot || restarting_for_merge) && g_list_length(xnbd->sessions) == 0) {
 			/* All sessions are stopped. Now start new sessions with existing sockets. */
 			info("All sessions are stopped. Now restart.");
 
@@ -518,11 +587,15 @@ int master_server(int port, void *data, int connect_fd)
 				xnbd->cmd = xnbd_cmd_target;
 				xnbd->target_diskpath = xnbd->proxy_diskpath;
 				xnbd_initialize(xnbd);
-			} else {
+			} else if (restarting_for_snapshot) {
 				/* take a snapshot */
 				xnbd_target_make_snapshot(xnbd);
 			}
 
+			/* drop a merged layer; a snapshot only adds one above it */
+			if (restarting_for_merge)
+				xnbd_target_merge_done(xnbd);
+
 
 			/*
 			 * invoke_new_session() manipulates xnbd->sessions,
@@ -530,8 +603,9 @@ int master_server(int port, void *data, int connect_fd)
 			 * instead of xnbd->sessions.
 			 **/
 			for (GList *list = g_list_first(socklist); list != NULL; list = g_list_next(list)) {
-				int csockfd = (int) ((long) list->data);  /* See below */
-				invoke_new_session(xnbd, csockfd);
+				struct preserved_conn *conn = (struct preserved_conn *) list->data;
+				invoke_new_session(xnbd, conn->clientfd, &conn->opts);
+				g_free(conn);
 			}
 
 
@@ -545,10 +619,19 @@ int master_server(int port, void *data, int connect_fd)
 				restarting_for_mode_change = 0;
 			else
 				restarting_for_snapshot = 0;
+
+			restarting_for_merge = 0;
 		}
 
 
-		if (got_sigusr1 || got_sigusr2) {
+		if (got_sigusr1 || got_sigusr2 || merge_copied) {
+			if (merge_copied) {
+				merge_copied = false;
+
+				info("merging layers done, restart %d process(es)", g_list_length(xnbd->sessions));
+				restarting_for_merge = 1;
+			}
+
 			if (got_sigusr2) {
 				got_sigusr2 = 0;
 
@@ -603,13 +686,14 @@ int master_server(int port, void *data, int connect_fd)
 
 				s->notifying = 1;
 
-				/* preserve connected sockets */
-				int csockfd = dup(s->clientfd);
-				if (csockfd < 0)
-					err("dup %d, %m", csockfd);
+				/* preserve connected sockets, and the options negotiated on them */
+				struct preserved_conn *conn = g_malloc0(sizeof(struct preserved_conn));
+				conn->clientfd = dup(s->clientfd);
+				if (conn->clientfd < 0)
+					err("dup %d, %m", s->clientfd);
+				conn->opts = s->opts;
 
-				/* it's ok because sizeof(void *) >= sizeof(int); 32bit =, 64bit > */
-				socklist = g_list_append(socklist, (void *) ((long) csockfd));
+				socklist = g_list_append(socklist, conn);
 
 				info("notify worker (%d) of session termination", s->pid);
 				ssize_t ret = write(s->pipe_master_fd, "", 1);
@@ -642,10 +726,28 @@ skip_restarting:
 			if (sockfd < 0)
 				continue;
 
-			if (ppoll_eventfds[i].revents & (POLLHUP | POLLNVAL))
+			/* the handoff socket hangs up when xnbd-wrapper closes it */
+			if (sockfd != handoff_fd && (ppoll_eventfds[i].revents & (POLLHUP | POLLNVAL)))
 				err("unknown events, %x", ppoll_eventfds[i].revents);
 
-			if (ppoll_eventfds[i].revents & (POLLIN | POLLERR)) {
+			if (sockfd == handoff_fd && (ppoll_eventfds[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+				/* a client negotiated by xnbd-wrapper */
+				struct nbd_negotiate_options opts;
+				int csockfd = unix_recv_fd_with_data(handoff_fd, &opts, sizeof(opts));
+				if (csockfd < 0) {
+					/* xnbd-wrapper has gone or deregistered the image */
+					info("handoff socket closed, exit after the last client");
+					close(handoff_fd);
+					ppoll_eventfds[i].fd = -1;
+					handoff_closed = true;
+				} else {
+					info("csockfd %d (handed off)", csockfd);
+					invoke_new_session(xnbd, csockfd, &opts);
+				}
+
+				nready -= 1;
+
+			} else if (ppoll_eventfds[i].revents & (POLLIN | POLLERR)) {
 				/* if POLLERR, the next read() returns -1 */
 				/* POLLERR never occurs because we wait new connections */
 
@@ -655,18 +757,14 @@ skip_restarting:
 					continue;
 				}
 
-				int ret;
-				if (xnbd->readonly)
-					ret = nbd_negotiate_v1_server_side_readonly(csockfd, xnbd->disksize);
-				else
-					ret = nbd_negotiate_v1_server_side(csockfd, xnbd->disksize);
+				int ret = nbd_negotiate_v1_server_side_with_flags(csockfd, xnbd->disksize, xnbd_get_export_flags(xnbd));
 				if (ret < 0) {
 					warn("negotiation with the client failed");
 					continue;
 				}
 
 				info("csockfd %d", csockfd);
-				invoke_new_session(xnbd, csockfd);
+				invoke_new_session(xnbd, csockfd, &nbd_v1_opts);
 
 				/* for short cut */
 				nready -= 1;
@@ -686,6 +784,77 @@ skip_restarting:
 }
 
 
+/*
+ * Serve all the clients in this process with the reactor, instead of forking
+ * a worker process per client. Only for the target mode.
+ */
+int reactor_server(int port, struct xnbd_info *xnbd)
+{
+	int lsock[MAXLISTENSOCK];
+	struct addrinfo *ai_head;
+
+	ai_head = net_getaddrinfo(NULL, port, PF_UNSPEC, SOCK_STREAM, IPPROTO_TCP);
+
+	unsigned int nlistened = net_create_server_sockets(ai_head, lsock, MAXLISTENSOCK);
+
+	freeaddrinfo(ai_head);
+
+
+	set_sigactions();
+
+	sigset_t sigs_blocked;
+	sigset_t orig_sigmask;
+	/* the same as master_server(); only epoll_pwait() detects signals */
+	sigemptyset(&sigs_blocked);
+	sigaddset(&sigs_blocked, SIGCHLD);
+	sigaddset(&sigs_blocked, SIGINT);
+	sigaddset(&sigs_blocked, SIGTERM);
+	sigaddset(&sigs_blocked, SIGUSR1);
+	sigaddset(&sigs_blocked, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs_blocked, &orig_sigmask);
+
+	/* I/O threads are created with all the signals blocked */
+	struct xnbd_reactor *reactor = xnbd_reactor_create(xnbd);
+
+	for (unsigned int i = 0; i < nlistened; i++)
+		xnbd_reactor_add_listen_socket(reactor, lsock[i]);
+
+
+	for (;;) {
+		if (need_exit) {
+			dbg("need exit");
+			break;
+		}
+
+		/* no child process in this mode */
+		got_sigchld = 0;
+
+		if (got_sigusr2) {
+			got_sigusr2 = 0;
+			warn("ignoring SIGUSR2 (mode change) not in proxy mode");
+		}
+
+		if (got_sigusr1) {
+			got_sigusr1 = 0;
+			info("got SIGUSR1, make snapshot(s)");
+			xnbd_reactor_make_snapshot(reactor);
+		}
+
+		int ret = xnbd_reactor_poll(reactor, &orig_sigmask);
+		if (ret < 0)
+			info("polling signal catched");
+	}
+
+
+	xnbd_reactor_destroy(reactor);
+
+	for (unsigned int i = 0; i < nlistened; i++)
+		close(lsock[i]);
+
+	return 0;
+}
+
+
 static struct option longopts[] = {
 	/* commands */
 	{"target", no_argument, NULL, 't'},
@@ -705,15 +874,27 @@ static struct option longopts[] = {
 	{"clear-bitmap", no_argument, NULL, 'z'},
 	{"max-queue-size", required_argument, NULL, 'Q'},
 	{"max-buf-size", required_argument, NULL, 'B'},
+	{"io-threads", required_argument, NULL, 'I'},
+	{"structured-reply", no_argument, NULL, 'R'},
+	{"block-status", no_argument, NULL, 'A'},
+	{"handoff-fd", required_argument, NULL, 'H'},
+	{"online-snapshot", no_argument, NULL, 'O'},
+	{"cowid", required_argument, NULL, 'C'},
+	{"merge-layers", required_argument, NULL, 'M'},
+	{"merge-rate", required_argument, NULL, 'm'},
+	{"compressed-read", required_argument, NULL, 'Z'},
+	{"dedup", no_argument, NULL, 'D'},
+	{"delta-sync", no_argument, NULL, 'Y'},
 	{NULL, 0, NULL, 0},
 };
 
-static const char *opt_string = "tpchvl:G:drL:STF:inQ:B:";
+static const char *opt_string = "tpchvl:G:drL:STF:inQ:B:I:RAH:OC:M:m:Z:DY";
 
 
 static const char *help_string = "\
 Usage: \n\
   xnbd-server --target [options] DISK_IMAGE\n\
+  xnbd-server --target --io-threads NUM [options] DISK_IMAGE [DISK_IMAGE ...]\n\
   xnbd-server --cow-target [options] BASE_DISK_IMAGE\n\
   xnbd-server --proxy [options] REMOTE_HOST REMORT_PORT CACHE_DISK_PATH CACHE_BITMAP_PATH CONTROL_SOCKET_PATH\n\
   xnbd-server --help\n\
@@ -726,6 +907,25 @@ Options: \n\
   --logpath PATH use the given path for logging (default: stderr/syslog)\n\
   --syslog       use syslog for logging\n\
   --inetd        set the inetd mode (use fd 0 for TCP connection)\n\
+  --dedup        share the blocks of identical data written to the cow layers\n\
+                 or the cache disk, on a file system supporting reflinks\n\
+                 (all modes but the target mode without --online-snapshot)\n\
+\n\
+Options (Target mode):\n\
+  --io-threads NUM\n\
+                 serve all clients in one process with NUM I/O threads,\n\
+                 instead of a process per client (default: 0, fork)\n\
+  --online-snapshot\n\
+                 take a snapshot by stacking a new layer, without copying\n\
+  --merge-layers NUM\n\
+                 merge the lowest layers of online snapshots if there are\n\
+                 more than NUM (default: 0, never)\n\
+  --merge-rate SIZE (bytes/s)\n\
+                 set the limit of copying for merging (default: 32 MiB/s, 0: no limit)\n\
+\n\
+Options (Copy-on-write target mode):\n\
+  --cowid ID     keep written data in the layers of ID over restarts\n\
+                 (default: a new layer removed on shutdown)\n\
 \n\
 Options (Proxy mode):\n\
   --target-exportname\n\
@@ -735,6 +935,14 @@ Options (Proxy mode):\n\
   --max-buf-size SIZE (bytes)\n\
                  set the limit of internal buffer usage (default: 0, no limit)\n\
   --clear-bitmap clear an existing bitmap file (default: re-use previous state)\n\
+  --delta-sync   on startup, uncache the blocks changed in the remote disk\n\
+                 since they were cached, except those written by clients\n\
+                 (all the blocks cached before CACHE_BITMAP_PATH.written\n\
+                 was made count as written; the remote server must be\n\
+                 xnbd-server)\n\
+  --compressed-read CODEC[:LEVEL]\n\
+                 retrieve blocks with compressed reads of CODEC (none, lzo,\n\
+                 lz4, or zstd) if the remote server supports it\n\
 ";
 
 
@@ -815,9 +1023,20 @@ int main(int argc, char **argv) {
 	int daemonize = 0;
 	int readonly = 0;
 	int connected_fd = -1;
+	int handoff_fd = -1;
 	const char *logpath = NULL;
 	int use_syslog = 0;
 	int inetd = 0;
+	unsigned int target_nthreads = 0;
+	int online_snapshot = 0;
+	int cowid = -1;
+	int merge_layers = 0;
+	size_t merge_rate = 32 * 1024 * 1024;
+	bool merge_rate_given = false;
+	const char *compressed_read = NULL;
+	int dedup = 0;
+	int structured_reply = 0;
+	int block_status = 0;
 
 	memset(&xnbd, 0, sizeof(xnbd));
 
@@ -933,6 +1152,13 @@ int main(int argc, char **argv) {
 				info("max_buf_size %zu", proxy_max_buf_size);
 				break;
 
+			case 'I':
+				target_nthreads = strtoul(optarg, NULL, 0);
+				if (target_nthreads == 0 || target_nthreads > XNBD_MAX_IO_THREADS)
+					err("the number of I/O threads must be between 1 and %d", XNBD_MAX_IO_THREADS);
+				info("io_threads %u", target_nthreads);
+				break;
+
 			case 'r':
 				readonly = 1;
 				info("readonly enabled");
@@ -954,6 +1180,52 @@ int main(int argc, char **argv) {
 				unset_nonblock(connected_fd);
 				break;
 
+			case 'O':
+				online_snapshot = 1;
+				break;
+
+			case 'M':
+				merge_layers = atoi(optarg);
+				if (merge_layers < 1)
+					err("--merge-layers must be 1 or more");
+				info("merge_layers %d", merge_layers);
+				break;
+
+			case 'm':
+				merge_rate = strtoul(optarg, NULL, 0);
+				merge_rate_given = true;
+				info("merge_rate %zu", merge_rate);
+				break;
+
+			case 'Z':
+				compressed_read = optarg;
+				break;
+
+			case 'D':
+				dedup = 1;
+				break;
+
+			case 'C':
+				cowid = atoi(optarg);
+				if (cowid < 0)
+					err("cowid must not be negative");
+				info("cowid %d", cowid);
+				break;
+
+			case 'H':
+				/* a UNIX socket to receive clients negotiated by xnbd-wrapper */
+				handoff_fd = atoi(optarg);
+				info("handoff fd %d", handoff_fd);
+				break;
+
+			case 'R':
+				structured_reply = 1;
+				break;
+
+			case 'A':
+				block_status = 1;
+				break;
+
 			case 'd':
 			case 'L':
 			case 'S':
@@ -969,6 +1241,10 @@ int main(int argc, char **argv) {
 				xnbd.proxy_clear_bitmap = true;
 				break;
 
+			case 'Y':
+				xnbd.proxy_delta_sync = true;
+				break;
+
 			case '?':
 				cmd = xnbd_cmd_help;
 				break;
@@ -1003,10 +1279,15 @@ int main(int argc, char **argv) {
 
 	switch (cmd) {
 		case xnbd_cmd_target:
-			if (argc - optind != 1)
+			if (argc - optind < 1)
 				show_help_and_exit("argument error");
 
+			if (argc - optind > 1 && target_nthreads == 0)
+				show_help_and_exit("multiple disk images require --io-threads");
+
 			xnbd.target_diskpath   = argv[optind];
+			/* argv[argc] is NULL */
+			xnbd.target_diskpaths  = &argv[optind];
 
 			break;
 
@@ -1056,6 +1337,94 @@ int main(int argc, char **argv) {
 			err("max_buf_size option is valid only for the proxy mode");
 	}
 
+	if (compressed_read) {
+		if (xnbd.cmd != xnbd_cmd_proxy)
+			err("--compressed-read is valid only for the proxy mode");
+
+		if (xnbd_codec_parse(compressed_read, &xnbd.proxy_codec, &xnbd.proxy_codec_level) < 0)
+			err("invalid codec of --compressed-read, %s", compressed_read);
+
+		if (!xnbd_codec_supported(xnbd.proxy_codec))
+			err("codec %s is not compiled", xnbd_codec_name(xnbd.proxy_codec));
+
+		xnbd.proxy_compressed_read = true;
+		info("compressed_read %s level %d", xnbd_codec_name(xnbd.proxy_codec), xnbd.proxy_codec_level);
+	}
+
+	if (xnbd.proxy_delta_sync) {
+		if (xnbd.cmd != xnbd_cmd_proxy)
+			err("--delta-sync is valid only for the proxy mode");
+
+		/* nothing is cached to compare */
+		if (xnbd.proxy_clear_bitmap)
+			err("--delta-sync cannot be used with --clear-bitmap");
+	}
+
+	if (structured_reply) {
+		/* the client of xnbd-wrapper has negotiated structured replies */
+		if (connected_fd <= 0)
+			err("--structured-reply is valid only with --connected-fd");
+
+		xnbd.connected_opts.structured_reply = 1;
+	}
+
+	if (block_status) {
+		/* the client has also selected the metadata context base:allocation */
+		if (!structured_reply)
+			err("--block-status is valid only with --structured-reply");
+
+		xnbd.connected_opts.base_allocation = 1;
+		xnbd.connected_opts.base_allocation_id = NBD_META_ID_BASE_ALLOCATION;
+	}
+
+	if (handoff_fd != -1) {
+		if (connected_fd != -1)
+			err("--handoff-fd cannot be specified with --inetd or --connected-fd.");
+
+		if (target_nthreads > 0)
+			err("--handoff-fd cannot be specified with --io-threads.");
+	}
+
+	if (online_snapshot) {
+		if (xnbd.cmd != xnbd_cmd_target)
+			err("--online-snapshot is valid only for the target mode");
+
+		if (target_nthreads > 0)
+			err("--online-snapshot cannot be specified with --io-threads.");
+
+		xnbd.target_online_snapshot = true;
+	}
+
+	if (merge_layers > 0 || merge_rate_given) {
+		if (!xnbd.target_online_snapshot)
+			err("--merge-layers and --merge-rate are valid only with --online-snapshot");
+
+		xnbd.target_merge_layers = merge_layers;
+		xnbd.target_merge_rate = merge_rate;
+	}
+
+	if (dedup) {
+		if (xnbd.cmd == xnbd_cmd_target && !xnbd.target_online_snapshot)
+			err("--dedup is valid only with --online-snapshot in the target mode");
+
+		xnbd.dedup = true;
+	}
+
+	if (cowid >= 0 && xnbd.cmd != xnbd_cmd_cow_target)
+		err("--cowid is valid only for the cow-target mode");
+
+	xnbd.cow_id = cowid;
+
+	if (target_nthreads > 0) {
+		if (xnbd.cmd != xnbd_cmd_target)
+			err("io_threads option is valid only for the target mode");
+
+		if (connected_fd != -1)
+			err("--io-threads cannot be specified with --inetd or --connected-fd.");
+
+		xnbd.target_nthreads = target_nthreads;
+	}
+
 	/* Note: necessary options must be initialized beforehand */
 	xnbd_initialize(&xnbd);
 
@@ -1078,7 +1447,10 @@ int main(int argc, char **argv) {
 	}
 
 
-	master_server(lport, (void *) &xnbd, connected_fd);
+	if (xnbd.target_nthreads > 0)
+		reactor_server(lport, &xnbd);
+	else
+		master_server(lport, (void *) &xnbd, connected_fd, handoff_fd);
 
 	xnbd_shutdown(&xnbd);
 	cachestat_shutdown();
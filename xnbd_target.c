@@ -22,20 +22,22 @@
  */
 
 #include "xnbd.h"
+#include "config.h"
 
 
 #include <sys/ioctl.h>
 /* clone_file() is a snippet from coreutils. modified. */
-/* Perform the O(1) btrfs clone operation, if possible.
+/* Perform the O(1) clone operation of a reflink-capable file system
+ * (e.g., btrfs, XFS), if possible.
  * Upon success, return 0.  Otherwise, return -1 and set errno.  */
 static int clone_file_by_reflink(int dstfd, int srcfd)
 {
 #ifdef __linux__
-#undef BTRFS_IOCTL_MAGIC
-#define BTRFS_IOCTL_MAGIC 0x94
-#undef BTRFS_IOC_CLONE
-#define BTRFS_IOC_CLONE _IOW (BTRFS_IOCTL_MAGIC, 9, int)
-	return ioctl(dstfd, BTRFS_IOC_CLONE, srcfd);
+/* the same as BTRFS_IOC_CLONE, generalized in Linux 4.5 */
+#ifndef FICLONE
+#define FICLONE _IOW (0x94, 9, int)
+#endif
+	return ioctl(dstfd, FICLONE, srcfd);
 #else
 	(void) dstfd;
 	(void) srcfd;
@@ -44,37 +46,256 @@ static int clone_file_by_reflink(int dstfd, int srcfd)
 #endif
 }
 
-static void clone_file_by_copy(int dstfd, int srcfd)
+
+/* the size of a copy_file_range() call, or of the buffer if not available */
+#define SNAPSHOT_COPY_CHUNK  (16UL * 1024 * 1024)
+#define SNAPSHOT_COPY_BUFSIZE  (1UL * 1024 * 1024)
+
+/* each copy thread takes at least this size of the image */
+#define SNAPSHOT_MIN_BYTES_PER_THREAD  (1ULL * 1024 * 1024 * 1024)
+#define SNAPSHOT_MAX_THREADS  8
+
+static int copy_extent(int dstfd, int srcfd, off_t offset, off_t len)
 {
-	off_t total = 0;
-	char buf[1024];
-	ssize_t ret;
+#ifdef HAVE_COPY_FILE_RANGE
+	/* copied in the kernel; a file system may share or offload it */
+	while (len > 0) {
+		loff_t off_in = offset;
+		loff_t off_out = offset;
+
+		ssize_t ret = copy_file_range(srcfd, &off_in, dstfd, &off_out, MIN((size_t) len, SNAPSHOT_COPY_CHUNK), 0);
+		if (ret < 0) {
+			if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+				break;  /* fall back to normal copy */
+
+			warn("snapshot: copy_file_range, %m");
+			return -1;
+		} else if (ret == 0) {
+			warn("snapshot: unexpected eof at %ju", (uintmax_t) offset);
+			return -1;
+		}
 
-	for (;;) {
-		ret = pread(srcfd, buf, sizeof(buf), total);
-		if (ret < 0)
-			err("read, %m");
-		else if (ret == 0) {
-			/* eof */
+		offset += ret;
+		len -= ret;
+	}
+
+	if (len == 0)
+		return 0;
+#endif
+
+	char *buf = g_malloc(SNAPSHOT_COPY_BUFSIZE);
+	int error = 0;
+
+	while (len > 0) {
+		ssize_t ret = pread(srcfd, buf, MIN((size_t) len, SNAPSHOT_COPY_BUFSIZE), offset);
+		if (ret <= 0) {
+			warn("snapshot: read at %ju, %s", (uintmax_t) offset, ret ? strerror(errno) : "unexpected eof");
+			error = -1;
+			break;
+		}
+
+		for (ssize_t done = 0; done < ret; ) {
+			ssize_t written = pwrite(dstfd, buf + done, (size_t) (ret - done), offset + done);
+			if (written < 0) {
+				warn("snapshot: write at %ju, %m", (uintmax_t) (offset + done));
+				error = -1;
+				break;
+			}
+			done += written;
+		}
+
+		if (error)
 			break;
+
+		offset += ret;
+		len -= ret;
+	}
+
+	g_free(buf);
+
+	return error;
+}
+
+/*
+ * Copy the data of [start, end) of srcfd to dstfd. dstfd has been extended
+ * to the image size, so that holes of srcfd are left as holes.
+ */
+static int copy_range_sparse(int dstfd, int srcfd, off_t start, off_t end)
+{
+	off_t pos = start;
+
+	while (pos < end) {
+		off_t data = lseek(srcfd, pos, SEEK_DATA);
+		off_t hole;
+
+		if (data < 0) {
+			/* only a hole up to eof */
+			if (errno == ENXIO)
+				break;
+
+			/* SEEK_DATA is not supported; copy all */
+			data = pos;
+			hole = end;
+		} else {
+			if (data >= end)
+				break;
+
+			hole = lseek(srcfd, data, SEEK_HOLE);
+			if (hole < 0 || hole > end)
+				hole = end;
 		}
 
-		write_all(dstfd, buf, (size_t) ret);
-		total += ret;
+		if (copy_extent(dstfd, srcfd, data, hole - data) < 0)
+			return -1;
+
+		pos = hole;
 	}
 
+	return 0;
+}
+
+struct snapshot_copy_range {
+	int dstfd;
+	int srcfd;
+	off_t start;
+	off_t end;
+	int error;
+};
+
+static void *snapshot_copy_thread_main(void *arg)
+{
+	struct snapshot_copy_range *range = (struct snapshot_copy_range *) arg;
+
+	range->error = copy_range_sparse(range->dstfd, range->srcfd, range->start, range->end);
+
+	return NULL;
+}
+
+/*
+ * Copy srcfd to dstfd, skipping holes. A large image is split into ranges
+ * copied by threads in parallel. Return -1 on failure.
+ */
+static int clone_file_by_copy(int dstfd, int srcfd)
+{
 	struct stat st;
-	ret = fstat(srcfd, &st);
+	if (fstat(srcfd, &st) < 0) {
+		warn("snapshot: fstat, %m");
+		return -1;
+	}
+
+	if (ftruncate(dstfd, st.st_size) < 0) {
+		warn("snapshot: ftruncate, %m");
+		return -1;
+	}
+
+	unsigned int nthreads = 1;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus > 1)
+		nthreads = MIN((unsigned long long) ncpus, MIN(SNAPSHOT_MAX_THREADS, (unsigned long long) st.st_size / SNAPSHOT_MIN_BYTES_PER_THREAD));
+	if (nthreads < 1)
+		nthreads = 1;
+
+	struct snapshot_copy_range ranges[SNAPSHOT_MAX_THREADS];
+	pthread_t tids[SNAPSHOT_MAX_THREADS];
+
+	/* split at chunk boundaries */
+	off_t per_thread = (st.st_size / nthreads + SNAPSHOT_COPY_CHUNK - 1) & ~((off_t) SNAPSHOT_COPY_CHUNK - 1);
+
+	for (unsigned int i = 0; i < nthreads; i++) {
+		ranges[i].dstfd = dstfd;
+		ranges[i].srcfd = srcfd;
+		ranges[i].start = MIN(st.st_size, per_thread * i);
+		ranges[i].end   = (i == nthreads - 1) ? st.st_size : MIN(st.st_size, per_thread * (i + 1));
+		ranges[i].error = 0;
+	}
+
+	if (nthreads == 1) {
+		snapshot_copy_thread_main(&ranges[0]);
+		return ranges[0].error;
+	}
+
+	info("snapshot: copy with %u threads", nthreads);
+
+	unsigned int started = 0;
+	for (; started < nthreads; started++) {
+		if (pthread_create(&tids[started], NULL, snapshot_copy_thread_main, &ranges[started])) {
+			warn("snapshot: pthread_create, %m");
+			break;
+		}
+	}
+
+	/* copy the ranges of threads failed to start by ourselves */
+	for (unsigned int i = started; i < nthreads; i++)
+		snapshot_copy_thread_main(&ranges[i]);
+
+	int error = 0;
+	for (unsigned int i = 0; i < nthreads; i++) {
+		if (i < started)
+			pthread_join(tids[i], NULL);
+		if (ranges[i].error)
+			error = -1;
+	}
+
+	return error;
+}
+
+/*
+ * Freeze the current data, and redirect writes to a new layer. It takes
+ * about the same time for any size of the disk image; the sessions are
+ * stopped only briefly.
+ */
+static void make_online_snapshot(struct xnbd_info *xnbd)
+{
+	if (!xnbd->cow_ds) {
+		/* sessions have written to the disk image through the page cache */
+		int ret = fsync(xnbd->target_diskfd);
+		if (ret < 0)
+			err("fsync %m");
+	}
+
+	int ret = xnbd_target_push_layer(&xnbd->cow_ds, xnbd->target_diskpath);
 	if (ret < 0)
-		err("fstat, %m");
+		return;
+
+	info("snapshot: %s and %d layer(s) below %s frozen", xnbd->target_diskpath,
+			xnbd->cow_ds->nlayers - 2, xnbd->cow_ds->image[xnbd->cow_ds->nlayers - 1]->path);
+
+	xnbd_target_merge_layers(xnbd);
+}
+
+/* Start merging the lowest layers if there are too many frozen ones. */
+void xnbd_target_merge_layers(struct xnbd_info *xnbd)
+{
+	if (!xnbd->target_merge_layers || !xnbd->cow_ds || xnbd->target_merge_pid > 0)
+		return;
+
+	/* neither the disk image nor the top layer */
+	int nfrozen = xnbd->cow_ds->nlayers - 2;
+	if (nfrozen <= xnbd->target_merge_layers)
+		return;
+
+	xnbd->target_merge_pid = xnbd_target_start_merge(xnbd->cow_ds, xnbd->target_merge_rate);
+}
 
-	if (st.st_size != total)
-		err("size mismatch");
+/* The merging process has exited successfully, and all the sessions are stopped. */
+void xnbd_target_merge_done(struct xnbd_info *xnbd)
+{
+	xnbd_target_finish_merge(xnbd->cow_ds, xnbd->target_diskpath);
+
+	/* the layers above the merged one are renumbered */
+	if (xnbd->dedup_table)
+		xnbd_dedup_table_clear(xnbd->dedup_table);
 
+	xnbd_target_merge_layers(xnbd);
 }
 
 void xnbd_target_make_snapshot(struct xnbd_info *xnbd)
 {
+	if (xnbd->target_online_snapshot) {
+		make_online_snapshot(xnbd);
+		return;
+	}
+
 	time_t now = time(NULL);
 	/* clone_file_by_copy() is not atomic. so use hardlink */
 	char *dstpath = g_strdup_printf("%s.snapshot.%08lu", xnbd->target_diskpath, now);
@@ -90,11 +311,17 @@ void xnbd_target_make_snapshot(struct xnbd_info *xnbd)
 	if (ret) {
 		warn("snapshot: cloning %s to %s by reflink failed, %m", xnbd->target_diskpath, tmpdstpath);
 		warn("snapshot: fall back to normal copy ...");
-		clone_file_by_copy(dstfd, xnbd->target_diskfd);
+		ret = clone_file_by_copy(dstfd, xnbd->target_diskfd);
 	}
 
 	close(dstfd);
 
+	if (ret < 0) {
+		warn("snapshot: copying %s to %s failed", xnbd->target_diskpath, tmpdstpath);
+		unlink(tmpdstpath);
+		goto err;
+	}
+
 
 	ret = link(tmpdstpath, dstpath);
 	if (ret < 0)
@@ -136,44 +363,278 @@ void xnbd_target_open_disk(char *diskpath, struct xnbd_info *xnbd)
 }
 
 
-int target_mode_main_mmap(struct xnbd_session *ses)
+/*
+ * Read the disk image into buf. An I/O error is notified to the client by
+ * using reply->error. Returning -1 if the session should be closed.
+ */
+static int target_pread(struct xnbd_info *xnbd, char *buf, size_t iolen, off_t iofrom, struct nbd_reply *reply)
 {
-	struct xnbd_info *xnbd = ses->xnbd;
+	/*
+	 * The file offset of target_diskfd is shared
+	 * with the other sessions and threads. Use
+	 * pread() instead of lseek() and read().
+	 */
+	size_t done = 0;
+	while (done < iolen) {
+		ssize_t ret = pread(xnbd->target_diskfd, buf + done, iolen - done, iofrom + done);
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
 
-	struct nbd_reply reply;
-	int csock = ses->clientfd;
-	uint32_t iotype = 0;
-	off_t iofrom = 0;
-	size_t iolen  = 0;
-	int ret;
+		if (ret < 0 && errno == EINTR)
+			continue;
 
-	memset(&reply, 0, sizeof(reply));
-	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = 0;
+		/* We already confirmed the request never
+		 * exceeds the end of the file. */
+		if (ret == 0 || errno == EIO) {
+			warn("CMD_READ: pread (fd %d, iofrom %jd) failed, %m", xnbd->target_diskfd, iofrom + done);
+			reply->error = htonl(EIO);
+			return 0;
+		}
 
+		warn("CMD_READ: fatal error %m");
+		return -1;
+	}
 
-	ret = poll_request_arrival(ses);
-	if (ret < 0)
+	return 0;
+}
+
+/*
+ * Send the reply of a compressed read. The data is read into a buffer, and
+ * compressed in chunks of XNBD_CODEC_CHUNKSIZE.
+ */
+static int target_send_read_reply_compressed(struct xnbd_info *xnbd, int csock, struct nbd_reply *reply,
+		off_t iofrom, size_t iolen, enum xnbd_codec codec, int level)
+{
+	char *buf = g_malloc(iolen);
+
+	int ret = target_pread(xnbd, buf, iolen, iofrom, reply);
+	if (ret < 0) {
+		g_free(buf);
 		return -1;
+	}
+
+	ret = net_send_all_or_error(csock, reply, sizeof(*reply));
+
+	if (ret >= 0 && reply->error == 0) {
+		struct iovec iov = { .iov_base = buf, .iov_len = iolen };
+		ret = compress_iovec_and_send(csock, &iov, 1, codec, level);
+	}
+
+	g_free(buf);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/*
+ * Send a read reply in structured chunks. Holes of the disk image are found
+ * with SEEK_DATA/SEEK_HOLE, and are sent without reading them. Zero blocks
+ * read from the disk image are sent as holes, too.
+ */
+static int target_send_read_reply_structured(struct xnbd_info *xnbd, int csock, struct nbd_reply *reply, off_t iofrom, size_t iolen)
+{
+	char *buf = g_malloc(iolen);
+	off_t ioend = iofrom + iolen;
+
+	unsigned int nchunks = 0;
+	unsigned int maxchunks = 16;
+	struct nbd_read_chunk *chunks = g_new(struct nbd_read_chunk, maxchunks);
+
+	for (off_t pos = iofrom; pos < ioend; ) {
+		off_t extent_end;
+		int hole = get_file_extent(xnbd->target_diskfd, pos, ioend, &extent_end);
+		char *chunk_buf = NULL;
+
+		if (!hole) {
+			chunk_buf = buf + (pos - iofrom);
+
+			int ret = target_pread(xnbd, chunk_buf, extent_end - pos, pos, reply);
+			if (ret < 0) {
+				g_free(chunks);
+				g_free(buf);
+				return -1;
+			}
+
+			if (reply->error)
+				break;
+		}
+
+		if (nchunks == maxchunks) {
+			maxchunks *= 2;
+			chunks = g_renew(struct nbd_read_chunk, chunks, maxchunks);
+		}
+
+		chunks[nchunks].iofrom = pos;
+		chunks[nchunks].iolen  = extent_end - pos;
+		chunks[nchunks].buf    = chunk_buf;
+		nchunks += 1;
+
+		pos = extent_end;
+	}
+
+	int ret = nbd_server_send_read_reply_structured(csock, reply, chunks, nchunks, CBLOCKSIZE);
+
+	g_free(chunks);
+	g_free(buf);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+
+/*
+ * Reply to NBD_CMD_BLOCK_STATUS for the metadata context base:allocation.
+ * Holes of the disk image are found with SEEK_DATA/SEEK_HOLE.
+ */
+static int target_send_block_status_reply(struct xnbd_info *xnbd, int csock, struct nbd_reply *reply,
+		struct nbd_negotiate_options *opts, off_t iofrom, size_t iolen, uint32_t ioflags)
+{
+	struct nbd_block_status bs;
+	nbd_block_status_init(&bs);
+
+	off_t ioend = iofrom + iolen;
+
+	for (off_t pos = iofrom; pos < ioend; ) {
+		off_t extent_end;
+		int hole = get_file_extent(xnbd->target_diskfd, pos, ioend, &extent_end);
+
+		if (nbd_block_status_add(&bs, extent_end - pos, hole ? (NBD_STATE_HOLE | NBD_STATE_ZERO) : 0) < 0)
+			break;
+
+		/* only one descriptor is wanted */
+		if (ioflags & NBD_CMD_FLAG_REQ_ONE)
+			break;
+
+		pos = extent_end;
+	}
+
+	int ret = nbd_server_send_block_status_reply(csock, reply, opts->base_allocation_id, &bs);
+
+	nbd_block_status_free(&bs);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+
+/*
+ * Zero a range of the disk image without writing zero data. The range is
+ * kept allocated if possible; the disk image may be pre-allocated (see
+ * punch_hole()). If the file system does not support it, zero data is
+ * written, unless the client wants it only if fast.
+ *
+ * With FUA, fallocate() changes only the metadata of the file, which
+ * fdatasync() writes out.
+ */
+static int target_write_zeroes(struct xnbd_info *xnbd, int csock, struct nbd_reply *reply,
+		off_t iofrom, size_t iolen, uint32_t ioflags)
+{
+	enum zero_range_mode mode = (ioflags & NBD_CMD_FLAG_NO_HOLE) ? ZERO_RANGE_ALLOCATED : ZERO_RANGE_MAY_PUNCH;
+
+	int ret = zero_range(xnbd->target_diskfd, iofrom, iolen, mode);
+	if (ret < 0) {
+		if (ioflags & NBD_CMD_FLAG_FAST_ZERO) {
+			reply->error = htonl(ENOTSUP);
+			return net_send_all_or_error(csock, reply, sizeof(*reply));
+		}
 
-	ret = nbd_server_recv_request(csock, xnbd->disksize, &iotype, &iofrom, &iolen, &reply);
+		struct mmap_region *mpinfo = mmap_region_create(xnbd->target_diskfd, iofrom, iolen, 0);
+		memset(mpinfo->iobuf, 0, iolen);
+		if (ioflags & NBD_CMD_FLAG_FUA) {
+			if (mmap_region_msync(mpinfo) < 0)
+				reply->error = htonl(EIO);
+		}
+		mmap_region_free(mpinfo);
+
+	} else if (ioflags & NBD_CMD_FLAG_FUA) {
+		ret = fdatasync(xnbd->target_diskfd);
+		if (ret < 0) {
+			warn("CMD_WRITE_ZEROES: fdatasync failed, %m");
+			reply->error = htonl(EIO);
+		}
+	}
+
+	return net_send_all_or_error(csock, reply, sizeof(*reply));
+}
+
+
+/*
+ * Receive one request of a client into req. Returning -1 if the session
+ * should be closed, 0 if the request was refused (and replied to), and 1 if
+ * it is to be served by xnbd_target_serve_received_request().
+ *
+ * With recv_write_data, the data of NBD_CMD_WRITE is received here into
+ * req->write_buf, instead of straight into the disk image. The reactor
+ * does so to receive a whole request before it stops a snapshot, so that a
+ * client stalling in the middle of a request never blocks the snapshot.
+ */
+int xnbd_target_recv_request(struct xnbd_info *xnbd, struct nbd_request_reader *reader, int csock,
+		struct xnbd_target_request *req, bool recv_write_data)
+{
+	memset(req, 0, sizeof(*req));
+	req->reply.magic = htonl(NBD_REPLY_MAGIC);
+	req->reply.error = 0;
+
+
+	int ret = nbd_server_recv_request_buffered(reader, xnbd->disksize, &req->iotype, &req->ioflags,
+			&req->iofrom, &req->iolen, &req->reply);
 	if (ret == NBD_SERVER_RECV__BAD_REQUEST) {
-		net_send_all_or_abort(csock, &reply, sizeof(reply));
-		return 0;
-	} else if (ret == NBD_SERVER_RECV__MAGIC_MISMATCH)
-		err("client bug: invalid header");
-	else if (ret == NBD_SERVER_RECV__TERMINATE)
-		return ret;
+		return net_send_all_or_error(csock, &req->reply, sizeof(req->reply));
+	} else if (ret == NBD_SERVER_RECV__MAGIC_MISMATCH) {
+		warn("client bug: invalid header");
+		return -1;
+	} else if (ret == NBD_SERVER_RECV__TERMINATE)
+		return -1;
 
 	if (xnbd->readonly) {
-		if (iotype == NBD_CMD_WRITE || iotype == NBD_CMD_TRIM) {
+		if (req->iotype == NBD_CMD_WRITE || req->iotype == NBD_CMD_TRIM || req->iotype == NBD_CMD_WRITE_ZEROES) {
 			/* do not read following write data */
-			err("%s to a readonly disk. disconnect.", nbd_get_iotype_string(iotype));
+			warn("%s to a readonly disk. disconnect.", nbd_get_iotype_string(req->iotype));
+			return -1;
+		}
+	}
+
+	if (recv_write_data && req->iotype == NBD_CMD_WRITE) {
+		req->write_buf = g_malloc(req->iolen);
+
+		ret = nbd_request_reader_recv_payload(reader, req->write_buf, req->iolen);
+		if (ret < 0) {
+			warn("CMD_WRITE: fatal error %m");
+			g_free(req->write_buf);
+			req->write_buf = NULL;
+			return -1;
 		}
 	}
 
+	return 1;
+}
+
+static int target_serve_request(struct xnbd_info *xnbd, int csock, struct nbd_request_reader *reader,
+		struct nbd_negotiate_options *opts, struct xnbd_target_request *req)
+{
+	struct nbd_reply reply = req->reply;
+	uint32_t iotype = req->iotype;
+	uint32_t ioflags = req->ioflags;
+	off_t iofrom = req->iofrom;
+	size_t iolen  = req->iolen;
+	int ret;
+
 	dbg("direct mode");
 
+	int codec = xnbd_codec_from_iotype(iotype);
+	if (codec >= 0) {
+		dbg("disk compressed read (%s) iofrom %ju iolen %zu", xnbd_codec_name(codec), iofrom, iolen);
+
+		if (!xnbd_codec_supported(codec)) {
+			warn("%s: codec %s is not compiled", nbd_get_iotype_string(iotype), xnbd_codec_name(codec));
+			reply.error = htonl(ENOTSUP);
+			return net_send_all_or_error(csock, &reply, sizeof(reply));
+		}
+
+		int level = (ioflags & NBD_CMD_FLAG_LEVEL_MASK) >> NBD_CMD_FLAG_LEVEL_SHIFT;
+
+		return target_send_read_reply_compressed(xnbd, csock, &reply, iofrom, iolen, codec, level);
+	}
+
 	switch (iotype) {
 		case NBD_CMD_WRITE:
 			dbg("disk write iofrom %ju iolen %zu", iofrom, iolen);
@@ -181,62 +642,65 @@ int target_mode_main_mmap(struct xnbd_session *ses)
 			{
 				struct mmap_region *mpinfo = mmap_region_create(xnbd->target_diskfd, iofrom, iolen, xnbd->readonly);
 
-				int ret = net_recv_all_or_error(csock, mpinfo->iobuf, iolen);
-				if (ret < 0) {
-					if (errno == EIO)
-						reply.error = htonl(EIO);
-					else
-						err("CMD_WRITE: fatal error %m");
+				if (req->write_buf) {
+					memcpy(mpinfo->iobuf, req->write_buf, iolen);
+				} else {
+					int ret = nbd_request_reader_recv_payload(reader, mpinfo->iobuf, iolen);
+					if (ret < 0) {
+						if (errno == EIO)
+							reply.error = htonl(EIO);
+						else {
+							warn("CMD_WRITE: fatal error %m");
+							mmap_region_free(mpinfo);
+							return -1;
+						}
+					}
 				}
 
-				net_send_all_or_abort(csock, &reply, sizeof(reply));
+				/* FUA: write out only the range of this request, not the whole disk */
+				if (reply.error == 0 && (ioflags & NBD_CMD_FLAG_FUA)) {
+					if (mmap_region_msync(mpinfo) < 0)
+						reply.error = htonl(EIO);
+				}
 
-				/* call mmap_region_msync(mpinfo) if writeout is necessary now */
 				mmap_region_free(mpinfo);
+
+				return net_send_all_or_error(csock, &reply, sizeof(reply));
 			}
-			break;
 
 		case NBD_CMD_READ:
 			dbg("disk read iofrom %ju iolen %zu", iofrom, iolen);
 
+			if (opts->structured_reply)
+				return target_send_read_reply_structured(xnbd, csock, &reply, iofrom, iolen);
+
 			{
 				struct iovec iov[2];
 				memset(&iov, 0, sizeof(iov));
 				iov[0].iov_base = &reply;
 				iov[0].iov_len  = sizeof(reply);
 
-
-				off_t ret = lseek(xnbd->target_diskfd, iofrom, SEEK_SET);
-				if (ret < 0) {
-					/* We already confirmed the request
-					 * never exceeds the end of the file.
-					 * This lseek should never return an
-					 * error. */
-					err("CMD_READ: lseek (fd %d, iofrom %jd), %jd %m", xnbd->target_diskfd, iofrom, ret);
-				}
-
 				/* We expect a client never sends insane iolen.
 				 * In such case, the server exits (i.e., disconnect). */
 				char *buf = g_malloc(iolen);
 
-				ret = net_recv_all_or_error(xnbd->target_diskfd, buf, iolen);
+				ret = target_pread(xnbd, buf, iolen, iofrom, &reply);
 				if (ret < 0) {
-					if (errno == EIO)
-						reply.error = htonl(EIO);
-					else
-						err("CMD_READ: fatal error %m");
+					g_free(buf);
+					return -1;
 				}
 
 				if (reply.error == 0) {
 					iov[1].iov_base = buf;
 					iov[1].iov_len  = iolen;
-					net_writev_all_or_abort(csock, iov, 2);
+					ret = net_writev_all_or_error(csock, iov, 2);
 				} else
-					net_writev_all_or_abort(csock, iov, 1);
+					ret = net_writev_all_or_error(csock, iov, 1);
 
 				g_free(buf);
+
+				return (ret < 0) ? -1 : 0;
 			}
-			break;
 
 		case NBD_CMD_FLUSH:
 			dbg("disk flush");
@@ -249,37 +713,114 @@ int target_mode_main_mmap(struct xnbd_session *ses)
 						/* underlying disk might be broken */
 						reply.error = htonl(EIO);
 					} else
-						err("CMD_FLUSH: fatal error %m");
+						return -1;
 				}
 
-				net_send_all_or_abort(csock, &reply, sizeof(reply));
+				return net_send_all_or_error(csock, &reply, sizeof(reply));
 			}
-			break;
+
+		case NBD_CMD_BLOCK_STATUS:
+			dbg("disk block status iofrom %ju iolen %zu", iofrom, iolen);
+
+			if (!opts->base_allocation || iolen == 0) {
+				warn("CMD_BLOCK_STATUS: no metadata context is selected, or zero length");
+				reply.error = htonl(EINVAL);
+				return net_send_all_or_error(csock, &reply, sizeof(reply));
+			}
+
+			return target_send_block_status_reply(xnbd, csock, &reply, opts, iofrom, iolen, ioflags);
+
+		case NBD_CMD_WRITE_ZEROES:
+			dbg("disk write zeroes iofrom %ju iolen %zu flags %x", iofrom, iolen, ioflags);
+
+			return target_write_zeroes(xnbd, csock, &reply, iofrom, iolen, ioflags);
 
 		case NBD_CMD_TRIM:
 			dbg("disk trim iofrom %ju iolen %zu", iofrom, iolen);
 
 			punch_hole(xnbd->target_diskfd, iofrom, iolen);
 
+			return net_send_all_or_error(csock, &reply, sizeof(reply));
+
+		case NBD_CMD_CHECKSUM:
+			dbg("disk checksum iofrom %ju iolen %zu", iofrom, iolen);
+
+			reply.error = htonl(xnbd_checksum_check_request(xnbd->disksize, iofrom, iolen));
+			if (reply.error)
+				return net_send_all_or_error(csock, &reply, sizeof(reply));
+
+			{
+				char *buf = g_malloc(iolen);
+
+				ret = target_pread(xnbd, buf, iolen, iofrom, &reply);
+				if (ret == 0) {
+					struct iovec iov = { .iov_base = buf, .iov_len = iolen };
+					ret = xnbd_checksum_send_reply(csock, &reply, &iov, 1, iolen);
+				}
+
+				g_free(buf);
+
+				return (ret < 0) ? -1 : 0;
+			}
+
 		default:
-			err("unknown command in the target mode, %u (%s)", iotype, nbd_get_iotype_string(iotype));
+			warn("unknown command in the target mode, %u (%s)", iotype, nbd_get_iotype_string(iotype));
+			return -1;
 	}
+}
 
-	return 0;
+
+/*
+ * Serve a request received by xnbd_target_recv_request(). Returning -1 if
+ * the session should be closed. This is used by both a forked worker and an
+ * I/O thread of the reactor; an error specific to a client must not
+ * terminate the process.
+ */
+int xnbd_target_serve_received_request(struct xnbd_info *xnbd, int csock, struct nbd_request_reader *reader,
+		struct nbd_negotiate_options *opts, struct xnbd_target_request *req)
+{
+	int ret = target_serve_request(xnbd, csock, reader, opts, req);
+
+	/* the data received ahead is freed on any path */
+	g_free(req->write_buf);
+	req->write_buf = NULL;
+
+	return ret;
+}
+
+
+static int target_mode_main_mmap(struct xnbd_session *ses)
+{
+	struct xnbd_target_request req;
+
+	int ret = poll_request_arrival(ses);
+	if (ret < 0)
+		return -1;
+
+	ret = xnbd_target_recv_request(ses->xnbd, ses->reader, ses->clientfd, &req, false);
+	if (ret <= 0)
+		return ret;
+
+	return xnbd_target_serve_received_request(ses->xnbd, ses->clientfd, ses->reader, &ses->opts, &req);
 }
 
 
 
 int xnbd_target_session_server(struct xnbd_session *ses)
 {
+	int ret = 0;
+
 	set_process_name("target_wrk");
-	for (;;) {
-		int ret = 0;
+	ses->reader = nbd_request_reader_create(ses->clientfd);
 
+	for (;;) {
 		ret = target_mode_main_mmap(ses);
 		if (ret < 0)
-			return ret;
+			break;
 	}
 
-	return 0;
+	nbd_request_reader_destroy(ses->reader);
+	ses->reader = NULL;
+
+	return ret;
 }
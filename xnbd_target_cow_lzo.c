@@ -22,6 +22,7 @@
  */
 
 #include "xnbd.h"
+#include <sys/file.h>
 
 //#define DEBUG_COW 1
 
@@ -31,8 +32,6 @@ const char *check_write_path = "/tmp/check_write";
 static int has_lock = 0;
 static const int do_check_write = 0;
 
-#include <sys/file.h>
-
 void check_write(void)
 {
 	if (!do_check_write)
@@ -210,6 +209,8 @@ struct disk_stack *create_disk_stack(char *diskpath)
 
 	struct disk_stack *ds = g_malloc0(sizeof(struct disk_stack));
 	ds->nlayers = 0;
+	ds->nallocated = 4;
+	ds->image = g_new0(struct disk_image *, ds->nallocated);
 	ds->disksize = disksize;
 
 	struct disk_image *di = g_malloc0(sizeof(struct disk_image));
@@ -270,13 +271,61 @@ void destroy_disk_stack(struct disk_stack *ds)
 		g_free(di);
 	}
 
+	g_free(ds->owner);
+	g_free(ds->image);
 	g_free(ds);
 }
 
+/*
+ * Record the blocks of a layer in the owner index. The layers below the top
+ * one are never written, so the index is built only when a layer is added
+ * (for the top one below it) or removed (for all of them).
+ */
+static void disk_stack_fold_layer(struct disk_stack *ds, int layer)
+{
+	/* the base image has all the blocks */
+	if (layer == 0)
+		return;
+
+	unsigned long nblocks = get_disk_nblocks(ds->disksize);
+	const unsigned long bits_per_long = sizeof(unsigned long) * 8;
+	unsigned long *bm = ds->image[layer]->bm;
+
+	if (!ds->owner)
+		ds->owner = g_new0(guint16, nblocks);
+
+	for (unsigned long word = 0; word * bits_per_long < nblocks; word++) {
+		if (!bm[word])
+			continue;
+
+		unsigned long index_end = MIN((word + 1) * bits_per_long, nblocks);
+		for (unsigned long index = word * bits_per_long; index < index_end; index++)
+			if (bitmap_test(bm, index))
+				ds->owner[index] = (guint16) layer;
+	}
+}
+
+/* the topmost layer having the block */
+static inline int disk_stack_find_layer(struct disk_stack *ds, unsigned long index)
+{
+	int top = ds->nlayers - 1;
+
+	if (bitmap_test(ds->image[top]->bm, index))
+		return top;
+
+	return ds->owner ? ds->owner[index] : 0;
+}
+
 void disk_stack_add_layer(struct disk_stack *ds, char *diskpath, int diskfd, char *bmpath, unsigned long *bm, size_t bmlen, bool persistent)
 {
+	/* xnbd_target_push_layer() checks it before a snapshot */
 	if (ds->nlayers == MAX_DISKIMAGESTACK)
-		err("no space");
+		err("%s: too many layers (%d)", diskpath, MAX_DISKIMAGESTACK);
+
+	if (ds->nlayers == ds->nallocated) {
+		ds->nallocated *= 2;
+		ds->image = g_renew(struct disk_image *, ds->image, ds->nallocated);
+	}
 
 	off_t disksize = get_disksize(diskfd);
 	g_assert(ds->disksize == disksize);
@@ -289,7 +338,11 @@ void disk_stack_add_layer(struct disk_stack *ds, char *diskpath, int diskfd, cha
 	di->bm     = bm;
 	di->bmlen  = bmlen;
 
+	disk_stack_fold_layer(ds, ds->nlayers - 1);
+
 	di->persistent = persistent;
+	/* a volatile layer is the top one of the cow-target mode */
+	di->writable   = !persistent;
 
 	info("add disk_stack[%d] %s %s (%s)", ds->nlayers, di->path, di->bmpath,
 			di->persistent ? "persistent" : "volatile");
@@ -302,28 +355,16 @@ void disk_stack_add_layer(struct disk_stack *ds, char *diskpath, int diskfd, cha
 
 static void copy_block_to_top_layer(struct disk_stack *ds, struct disk_stack_io *io, unsigned long index, unsigned long start_index, off_t disksize)
 {
-	bool found = false;
+	int i = disk_stack_find_layer(ds, index);
 
 	size_t iolen = confine_iolen_within_disk(disksize, (off_t) index * CBLOCKSIZE, CBLOCKSIZE);
 
-	for (int i = ds->nlayers - 1; i >= 0; i--) {
-		struct disk_image *di = ds->image[i];
-
-		if (bitmap_test(di->bm, index)) {
-			dbg("index %lu found at layer %d", index, i);
-
-			char *dstptr = (char *) io->mbrs[ds->nlayers - 1]->ba_iobuf + (index - start_index) * CBLOCKSIZE;
-			char *srcptr = (char *) io->mbrs[i]->ba_iobuf + (index - start_index) * CBLOCKSIZE;
-
-			memcpy(dstptr, srcptr, iolen);
+	dbg("index %lu found at layer %d", index, i);
 
-			found = true;
-			break;
-		}
-	}
+	char *dstptr = (char *) io->mbrs[ds->nlayers - 1]->ba_iobuf + (index - start_index) * CBLOCKSIZE;
+	char *srcptr = (char *) io->mbrs[i]->ba_iobuf + (index - start_index) * CBLOCKSIZE;
 
-	if (!found)
-		err("bug");
+	memcpy(dstptr, srcptr, iolen);
 }
 
 static void dump_disk_stack(struct disk_stack *ds)
@@ -336,6 +377,47 @@ static void dump_disk_stack(struct disk_stack *ds)
 }
 
 
+static char *cow_layer_path(const char *diskpath, int cowid, int layer)
+{
+	return g_strdup_printf("%s.cow%d.layer%d", diskpath, cowid, layer);
+}
+
+static bool cow_layer_exists(const char *diskpath, int cowid, int layer)
+{
+	char *cowpath = cow_layer_path(diskpath, cowid, layer);
+	bool found = (access(cowpath, F_OK) == 0);
+	g_free(cowpath);
+
+	return found;
+}
+
+/* Stack an existing persistent layer of the cowid. Return its descriptor. */
+static int cow_add_layer(struct disk_stack *ds, char *diskpath, int cowid, int layer, bool writable)
+{
+	char *cowpath = cow_layer_path(diskpath, cowid, layer);
+	int cowfd = open(cowpath, writable ? O_RDWR : O_RDONLY);
+	if (cowfd < 0)
+		err("open %s, %m", cowpath);
+
+	off_t disksize = get_disksize(cowfd);
+	if (disksize != ds->disksize)
+		err("%s (%ju bytes) mismatches the disk stack (%ju)",
+				cowpath, disksize, ds->disksize);
+
+	char *bmpath = g_strdup_printf("%s.bm", cowpath);
+	size_t bmlen;
+	/* keep data */
+	unsigned long *bm = bitmap_open_file(bmpath, get_disk_nblocks(ds->disksize), &bmlen, !writable, 0);
+
+	disk_stack_add_layer(ds, cowpath, cowfd, bmpath, bm, bmlen, true);
+	ds->image[ds->nlayers - 1]->writable = writable;
+
+	g_free(cowpath);
+	g_free(bmpath);
+
+	return cowfd;
+}
+
 /*
  * Find all the layers of the disk image and register them as readonly.
  * For example, it stacks found layers as follows:
@@ -345,44 +427,80 @@ static void dump_disk_stack(struct disk_stack *ds)
  *    /VM/disk.img.cow0.layer1		(bitmap /VM/disk.img.cow0.layer1.bm)
  *    /VM/disk.img
  *
- * TODO: somebody may want to open the top layer for read/write?
+ * See xnbd_cow_target_open_disk_stack() to open the top layer for read/write.
  */
 struct disk_stack *xnbd_cow_target_open_disk_stack_readonly(char *diskpath, int cowid)
 {
 	struct disk_stack *ds = create_disk_stack(diskpath);
-	int layer = 1;
 
-	for (;;) {
-		char *cowpath = g_strdup_printf("%s.cow%d.layer%d", diskpath, cowid, layer);
-		int cowfd = open(cowpath, O_RDONLY);
-		if (cowfd < 0) {
-			if (errno == ENOENT)
-				break;
-			else
-				err("open %s, %m", cowpath);
-		}
+	for (int layer = 1; cow_layer_exists(diskpath, cowid, layer); layer++)
+		cow_add_layer(ds, diskpath, cowid, layer, false);
+
+	if (ds->nlayers == 1)
+		err("no layers found for cow%d of %s", cowid, diskpath);
+
+	dump_disk_stack(ds);
+
+	return ds;
+}
+
+
+/*
+ * Open the layers of the given cowid as xnbd_cow_target_open_disk_stack_readonly()
+ * does, but reopen the top layer for read/write. If there are no layers yet,
+ * the first one is created. Unlike xnbd_cow_target_create_disk_stack(), the
+ * layers are persistent; a clone of the base image keeps its written data
+ * over restarts.
+ *
+ * Only one xnbd-server can write to a cowid. The top layer is locked by
+ * flock(), which is independent of the record locks of the sessions.
+ */
+struct disk_stack *xnbd_cow_target_open_disk_stack(char *diskpath, int cowid)
+{
+	struct disk_stack *ds = create_disk_stack(diskpath);
+
+	int nlayers = 0;
+	while (cow_layer_exists(diskpath, cowid, nlayers + 1))
+		nlayers += 1;
+
+	for (int layer = 1; layer < nlayers; layer++)
+		cow_add_layer(ds, diskpath, cowid, layer, false);
+
+	int cowfd;
+	if (nlayers == 0) {
+		char *cowpath = cow_layer_path(diskpath, cowid, 1);
+		char *bmpath = g_strdup_printf("%s.bm", cowpath);
+
+		cowfd = open(cowpath, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (cowfd < 0)
+			err("open %s, %m", cowpath);
 
-		off_t disksize = get_disksize(cowfd);
-		if (disksize != ds->disksize)
-			err("%s (%ju bytes) mismatches the disk stack (%ju)",
-					diskpath, disksize, ds->disksize);
+		int ret = ftruncate(cowfd, ds->disksize);
+		if (ret < 0)
+			err("ftruncate %m");
 
-		char *bmpath = g_strdup_printf("%s.cow%d.layer%d.bm", diskpath, cowid, layer);
 		size_t bmlen;
-		/* readonly, keep data */
-		unsigned long *bm = bitmap_open_file(bmpath, get_disk_nblocks(ds->disksize), &bmlen, 1, 0);
+		/* read/write zero-clear */
+		unsigned long *bm = bitmap_open_file(bmpath, get_disk_nblocks(ds->disksize), &bmlen, 0, 1);
 
 		disk_stack_add_layer(ds, cowpath, cowfd, bmpath, bm, bmlen, true);
+		ds->image[ds->nlayers - 1]->writable = true;
+
+		info("created cow%d of %s", cowid, diskpath);
 
 		g_free(cowpath);
 		g_free(bmpath);
+	} else
+		cowfd = cow_add_layer(ds, diskpath, cowid, nlayers, true);
 
-		layer += 1;
+	int ret = flock(cowfd, LOCK_EX | LOCK_NB);
+	if (ret < 0) {
+		if (errno == EWOULDBLOCK)
+			err("cow%d of %s is used by another server", cowid, diskpath);
+		else
+			err("flock %m");
 	}
 
-	if (ds->nlayers == 1)
-		err("no layers found for cow%d of %s", cowid, diskpath);
-
 	dump_disk_stack(ds);
 
 	return ds;
@@ -394,16 +512,15 @@ struct disk_stack *xnbd_cow_target_open_disk_stack_readonly(char *diskpath, int
  *
  * Note:
  *   Written data is not persistent. The added layer is gone upon shutdown.
+ *   Give a cowid to xnbd_cow_target_open_disk_stack() to keep it.
  *
  *   Snapshoting (i.e, adding a new layer furthermore) is not yet implemented.
  *
  *   xnbd-server automatically finds an unused cowid for the base image, and
  *   creates a new cow image with it. This allows users to invoke multiple
  *   xnbd-servers using the base image, each of which saves written data
- *   indivisually.
- *
- *   If we enable xnbd-server to keep written data persistent, we should be
- *   able to give xnbd-server cowid in the command line.
+ *   indivisually. A cowid with persistent layers is never reused, because
+ *   its first layer exists.
  *
  * */
 struct disk_stack *xnbd_cow_target_create_disk_stack(char *diskpath)
@@ -415,7 +532,7 @@ struct disk_stack *xnbd_cow_target_create_disk_stack(char *diskpath)
 	char *cowpath = NULL;;
 	int cowfd;
 	for (;;) {
-		cowpath = g_strdup_printf("%s.cow%d.layer%d", diskpath, cowid, 1);
+		cowpath = cow_layer_path(diskpath, cowid, 1);
 
 		cowfd = open(cowpath, O_RDWR | O_CREAT | O_EXCL, 0600);
 		if (cowfd < 0) {
@@ -450,7 +567,7 @@ struct disk_stack *xnbd_cow_target_create_disk_stack(char *diskpath)
 	return ds;
 }
 
-/* currently, cow-target is not persistent */
+/* unlink the top layer unless it was opened with a cowid */
 void xnbd_cow_target_close_disk_stack(struct disk_stack *ds)
 {
 	info("cow disk close (base image %s)", ds->image[0]->path);
@@ -461,19 +578,51 @@ void xnbd_cow_target_close_disk_stack(struct disk_stack *ds)
 
 
 
+/*
+ * Session processes may write to the same block at once. Without the lock,
+ * a session copying a partial block from a lower layer (see
+ * disk_stack_mmap()) may overwrite the data another session has just written
+ * to the top layer. A record lock is held by the process, not by the
+ * descriptor shared among them.
+ */
+static void disk_stack_lock_blocks(struct disk_stack *ds, unsigned long index_sta, unsigned long index_end, short type)
+{
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type   = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start  = (off_t) index_sta * CBLOCKSIZE;
+	fl.l_len    = (off_t) (index_end - index_sta + 1) * CBLOCKSIZE;
+
+	int diskfd = ds->image[ds->nlayers - 1]->diskfd;
+
+	while (fcntl(diskfd, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR)
+			err("fcntl F_SETLKW %m");
+	}
+}
+
 static struct disk_stack_io *create_disk_stack_io(struct disk_stack *ds)
 {
 	struct disk_stack_io *io = g_malloc0(sizeof(struct disk_stack_io));
 	io->ds = ds;
+	io->mbrs = g_new0(struct mmap_block_region *, ds->nlayers);
 
 	return io;
 }
 
+/*
+ * Map the layers needed by a request. The owner index tells the layer of each
+ * block at once, so the cost does not grow with the depth of the stack, and
+ * a layer without any block of the region is not mapped.
+ */
 struct disk_stack_io *disk_stack_mmap(struct disk_stack *ds, off_t iofrom, size_t iolen, int reading)
 {
 	off_t ioend = iofrom + iolen;
 	unsigned long index_sta = get_bindex_sta(CBLOCKSIZE, iofrom);
 	unsigned long index_end = get_bindex_end(CBLOCKSIZE, ioend);
+	int top = ds->nlayers - 1;
+	bool *needed = g_new0(bool, ds->nlayers);
 
 	dbg("iofrom %ju ioend %ju", iofrom, ioend);
 	dbg("index_sta %lu end %lu", index_sta, index_end);
@@ -481,74 +630,38 @@ struct disk_stack_io *disk_stack_mmap(struct disk_stack *ds, off_t iofrom, size_
 
 	struct disk_stack_io *io = create_disk_stack_io(ds);
 
-	/* mmap() all layers */
-	for (int i = 0; i < ds->nlayers; i++) {
-		struct disk_image *di = ds->image[i];
-
-		int readonly = 1;
-		if (!di->persistent)
-			readonly = 0;
-
-		io->mbrs[i] = mmap_block_region_create(di->diskfd, ds->disksize, iofrom, iolen, readonly);
-	}
+	io->index_sta = index_sta;
+	io->index_end = index_end;
 
 
 	struct iovec *iov = NULL;
 	unsigned int iov_size = 0;
 
+	/* copy the start/end blocks of the region from a lower layer to the top layer */
+	bool get_sta_block = false;
+	bool get_end_block = false;
+
 	if (reading) {
 		/* the number of iovec in readv()'s args is int */
 		g_assert((index_end - index_sta + 1) <= UINT32_MAX);
 
 		iov_size = (unsigned int) (index_end - index_sta + 1);
 		iov = g_new0(struct iovec, iov_size);
+		io->iov_layer = g_new0(int, iov_size);
 
 		for (unsigned long index = index_sta; index <= index_end; index++) {
-			bool found = true;
-
-			for (int i = ds->nlayers - 1; i >= 0; i--) {
-				struct disk_image *di = ds->image[i];
-
-				if (bitmap_test(di->bm, index)) {
-					dbg("index %lu found at layer %d", index, i);
-
-					char *ba_iobuf = io->mbrs[i]->ba_iobuf;
-					char *iobuf = io->mbrs[i]->iobuf;
-
-					off_t chunk_iofrom = MAX(iofrom, (off_t) index * CBLOCKSIZE);
-					off_t chunk_ioend  = MIN(ioend, (off_t) (index + 1) * CBLOCKSIZE);
-					size_t chunk_iolen = (size_t) chunk_ioend - chunk_iofrom;
-					char *chunk_iobuf  = MAX(iobuf, (ba_iobuf + (index - index_sta) * CBLOCKSIZE));
-
-					g_assert(chunk_iolen <= CBLOCKSIZE);
-					dbg("bindex %lu [chunk_iofrom %ju chunk_ioend %ju (%zu)]",
-							index, chunk_iofrom, chunk_ioend, chunk_iolen);
-
-					iov[index - index_sta].iov_base = chunk_iobuf;
-					iov[index - index_sta].iov_len  = chunk_iolen;
+			int i = disk_stack_find_layer(ds, index);
 
-					found = 1;
-					break;
-				}
-			}
-
-			if (!found)
-				err("bug");
+			dbg("index %lu found at layer %d", index, i);
+			io->iov_layer[index - index_sta] = i;
+			needed[i] = true;
 		}
 
 	} else {
-		iov_size = 1;
-		iov = g_malloc0(sizeof(struct iovec));
-
-		iov[0].iov_base = io->mbrs[ds->nlayers-1]->iobuf;
-		iov[0].iov_len  = iolen;
-
-		/* copy the start/end blocks of the region from a lower layer to the top layer */
-		bool get_sta_block = false;
-		bool get_end_block = false;
+		disk_stack_lock_blocks(ds, index_sta, index_end, F_WRLCK);
 
 		if (iofrom % CBLOCKSIZE)
-			if (!bitmap_test(ds->image[ds->nlayers-1]->bm, index_sta))
+			if (!bitmap_test(ds->image[top]->bm, index_sta))
 				get_sta_block = true;
 
 		if (ioend % CBLOCKSIZE) {
@@ -559,12 +672,63 @@ struct disk_stack_io *disk_stack_mmap(struct disk_stack *ds, off_t iofrom, size_
 			 */
 			if ((index_end > index_sta) ||
 					((index_end == index_sta) && !get_sta_block))
-				if (!bitmap_test(ds->image[ds->nlayers-1]->bm, index_end))
+				if (!bitmap_test(ds->image[top]->bm, index_end))
 					get_end_block = true;
 
 			/* bitmap_on() is performed in the below forloop */
 		}
 
+		needed[top] = true;
+		if (get_sta_block)
+			needed[disk_stack_find_layer(ds, index_sta)] = true;
+		if (get_end_block)
+			needed[disk_stack_find_layer(ds, index_end)] = true;
+	}
+
+
+	for (int i = 0; i < ds->nlayers; i++) {
+		struct disk_image *di = ds->image[i];
+
+		if (!needed[i])
+			continue;
+
+		int readonly = 1;
+		if (di->writable)
+			readonly = 0;
+
+		io->mbrs[i] = mmap_block_region_create(di->diskfd, ds->disksize, iofrom, iolen, readonly);
+	}
+
+	g_free(needed);
+
+
+	if (reading) {
+		for (unsigned long index = index_sta; index <= index_end; index++) {
+			int i = io->iov_layer[index - index_sta];
+
+			char *ba_iobuf = io->mbrs[i]->ba_iobuf;
+			char *iobuf = io->mbrs[i]->iobuf;
+
+			off_t chunk_iofrom = MAX(iofrom, (off_t) index * CBLOCKSIZE);
+			off_t chunk_ioend  = MIN(ioend, (off_t) (index + 1) * CBLOCKSIZE);
+			size_t chunk_iolen = (size_t) chunk_ioend - chunk_iofrom;
+			char *chunk_iobuf  = MAX(iobuf, (ba_iobuf + (index - index_sta) * CBLOCKSIZE));
+
+			g_assert(chunk_iolen <= CBLOCKSIZE);
+			dbg("bindex %lu [chunk_iofrom %ju chunk_ioend %ju (%zu)]",
+					index, chunk_iofrom, chunk_ioend, chunk_iolen);
+
+			iov[index - index_sta].iov_base = chunk_iobuf;
+			iov[index - index_sta].iov_len  = chunk_iolen;
+		}
+
+	} else {
+		iov_size = 1;
+		iov = g_malloc0(sizeof(struct iovec));
+
+		iov[0].iov_base = io->mbrs[top]->iobuf;
+		iov[0].iov_len  = iolen;
+
 		if (get_sta_block)
 			copy_block_to_top_layer(ds, io, index_sta, index_sta, ds->disksize);
 
@@ -573,8 +737,10 @@ struct disk_stack_io *disk_stack_mmap(struct disk_stack *ds, off_t iofrom, size_
 
 
 		for (unsigned long index = index_sta; index <= index_end; index++) {
-			bitmap_on(ds->image[ds->nlayers-1]->bm, index);
+			bitmap_on(ds->image[top]->bm, index);
 		}
+
+		disk_stack_lock_blocks(ds, index_sta, index_end, F_UNLCK);
 	}
 
 
@@ -591,9 +757,12 @@ struct disk_stack_io *disk_stack_mmap(struct disk_stack *ds, off_t iofrom, size_
 void disk_stack_munmap(struct disk_stack_io *io)
 {
 	for (int i = 0; i < io->ds->nlayers; i++)
-		mmap_block_region_free(io->mbrs[i]);
+		if (io->mbrs[i])
+			mmap_block_region_free(io->mbrs[i]);
 
+	g_free(io->mbrs);
 	g_free(io->iov);
+	g_free(io->iov_layer);
 	g_free(io);
 }
 
@@ -605,6 +774,30 @@ void disk_stack_fsync(struct disk_stack *ds)
 	int ret = fsync(diskfd);
 	if (ret < 0)
 		err("fsync %m");
+
+	/* the data of a persistent layer is lost without its bitmap */
+	if (ds->image[top]->persistent)
+		bitmap_sync_file(ds->image[top]->bm, ds->image[top]->bmlen);
+}
+
+static void disk_stack_sync_top_bitmap(struct disk_stack_io *io)
+{
+	struct disk_image *di = io->ds->image[io->ds->nlayers - 1];
+
+	if (di->persistent)
+		bitmap_sync_file_range(di->bm, di->bmlen, io->index_sta, io->index_end);
+}
+
+/* FUA: write out only the range mapped in the top layer */
+void disk_stack_msync(struct disk_stack_io *io)
+{
+	int top = io->ds->nlayers - 1;
+
+	int ret = mmap_region_msync(io->mbrs[top]->mr);
+	if (ret < 0)
+		err("msync %m");
+
+	disk_stack_sync_top_bitmap(io);
 }
 
 void disk_stack_punch_hole(struct disk_stack *ds, off_t iofrom, size_t iolen)
@@ -615,177 +808,572 @@ void disk_stack_punch_hole(struct disk_stack *ds, off_t iofrom, size_t iolen)
 	punch_hole(diskfd, iofrom, iolen);
 }
 
-
-#ifdef XNBD_LZO
-/* See LZO.FAQ */
-static inline size_t get_max_outlen(size_t input_block_size)
+/*
+ * The blocks of a write which are all zero are zeroed by fallocate() in the
+ * top layer, instead of being written out. They are still marked in its
+ * bitmap, so they are read as zero. Returns true if any block is zeroed.
+ */
+static bool disk_stack_zero_written_blocks(struct disk_stack_io *io, off_t iofrom, size_t iolen)
 {
-	/* Algorithm LZO1, LZO1A, LZO1B, LZO1C, LZO1F, LZO1X, LZO1Y, LZO1Z */
-	size_t output_block_size = input_block_size + (input_block_size / 16) + 64 + 3;
+	int top = io->ds->nlayers - 1;
+	struct disk_image *di = io->ds->image[top];
+
+	if (di->no_zero_range)
+		return false;
+
+	/* io->iov is consumed by receiving the data */
+	ssize_t zeroed = zero_range_of_zero_blocks(di->diskfd, io->mbrs[top]->iobuf, iofrom, iolen, CBLOCKSIZE);
+	if (zeroed < 0) {
+		info("%s does not support zeroing a range; zero blocks are written out", di->path);
+		di->no_zero_range = true;
+		return false;
+	}
 
-	return output_block_size;
+	if (zeroed > 0)
+		dbg("zero blocks of %zd bytes in a write of %zu bytes", zeroed, iolen);
+
+	return (zeroed > 0);
 }
 
-static unsigned char wrkmem[LZO1X_1_MEM_COMPRESS];
+/*
+ * With --dedup, fingerprint the blocks read from each layer, so that later
+ * writes of the same data share them.
+ */
+static void disk_stack_dedup_index(struct xnbd_dedup *dd, struct disk_stack_io *io)
+{
+	unsigned long nblocks = io->index_end - io->index_sta + 1;
+
+	for (unsigned long i = 0; i < nblocks; ) {
+		int layer = io->iov_layer[i];
+		unsigned long j = i + 1;
+
+		while (j < nblocks && io->iov_layer[j] == layer)
+			j += 1;
+
+		xnbd_dedup_index(dd, layer, (off_t) (io->index_sta + i) * CBLOCKSIZE, (j - i) * CBLOCKSIZE);
+		i = j;
+	}
+}
 
-#if 0
-void compress_iovec(struct iovec *iov, int count, uint32_t rawlen, char *cmpbuf, uint32_t *out_cmplen)
+/*
+ * Zero a range mapped by disk_stack_mmap() for writing. The blocks are
+ * already marked in the bitmap of the top layer, and partial blocks at both
+ * the ends are copied to it. A hole is punched in the top layer, unless
+ * NBD_CMD_FLAG_NO_HOLE is given.
+ *
+ * With FUA, fallocate() changes only the metadata of the file, which
+ * fdatasync() writes out.
+ */
+static void disk_stack_write_zeroes(struct disk_stack_io *io, off_t iofrom, size_t iolen, uint32_t ioflags)
 {
-	unsigned char *rawbuf = g_malloc0(rawlen);
-	int offset = 0;
+	struct disk_stack *ds = io->ds;
+	int diskfd = ds->image[ds->nlayers - 1]->diskfd;
+	enum zero_range_mode mode = (ioflags & NBD_CMD_FLAG_NO_HOLE) ? ZERO_RANGE_ALLOCATED : ZERO_RANGE_PUNCH;
+
+	int ret = zero_range(diskfd, iofrom, iolen, mode);
+	if (ret < 0) {
+		memset(io->iov[0].iov_base, 0, iolen);
+		if (ioflags & NBD_CMD_FLAG_FUA)
+			disk_stack_msync(io);
+
+	} else if (ioflags & NBD_CMD_FLAG_FUA) {
+		ret = fdatasync(diskfd);
+		if (ret < 0)
+			err("fdatasync %m");
 
-	/* extract iovec to rawbuf */
-	for (int i = 0; i < count; i++) {
-		memcpy(rawbuf + offset, iov[i].iov_base, iov[i].iov_len);
-		offset += iov[i].iov_len;
+		disk_stack_sync_top_bitmap(io);
 	}
+}
+
 
-	unsigned long cmplen;
 
-	int ret = lzo1x_1_compress(rawbuf, rawlen, (unsigned char *) cmpbuf, &cmplen, wrkmem);
-	if (ret == LZO_E_OK)
-		info("compressed: %d -> %lu", rawlen, cmplen);
-	else
-		err("compression failed, %d", ret);
 
-	*out_cmplen = cmplen;
+
+/*
+ * Online snapshots of the target mode. A snapshot freezes the top layer (at
+ * first, the disk image itself), and puts a new read/write layer on it:
+ *    /VM/disk.img.layerN		(bitmap /VM/disk.img.layerN.bm)
+ *    ...
+ *    /VM/disk.img.layer1		(bitmap /VM/disk.img.layer1.bm)
+ *    /VM/disk.img
+ *
+ * Unlike the cow-target mode, the layers are persistent. They keep the
+ * latest data of the disk image.
+ */
+static char *target_layer_path(const char *diskpath, int layer)
+{
+	return g_strdup_printf("%s.layer%d", diskpath, layer);
 }
-#endif
 
-#if 0
-void compress_iovec_and_send(int csock, struct iovec *iov, unsigned int count)
+bool xnbd_target_has_layers(char *diskpath)
 {
-	for (unsigned int i = 0; i < count; i++) {
-		unsigned char *rawbuf = iov[i].iov_base;
-		size_t rawlen       = iov[i].iov_len;
+	char *cowpath = target_layer_path(diskpath, 1);
+	bool found = (access(cowpath, F_OK) == 0);
+	g_free(cowpath);
 
-		unsigned char *cmpbuf = g_malloc0(get_max_outlen(rawlen));
-		lzo_uint cmplen;
+	return found;
+}
 
-		int ret = lzo1x_1_compress(rawbuf, rawlen, cmpbuf, &cmplen, wrkmem);
-		if (ret == LZO_E_OK)
-			dbg("compressed: %d -> %lu", rawlen, cmplen);
-		else
-			err("compression failed, %d", ret);
+/*
+ * Add the layer N on the stack. Creating a new one (i.e., for a snapshot)
+ * fails with -1 if its files cannot be made, e.g., out of descriptors or disk
+ * space; the server keeps serving the current layers.
+ */
+static int target_add_layer(struct disk_stack *ds, char *diskpath, int layer, bool create)
+{
+	char *cowpath = target_layer_path(diskpath, layer);
+	char *bmpath = g_strdup_printf("%s.bm", cowpath);
+	int ret = -1;
 
-		g_assert(cmplen <= UINT32_MAX && rawlen <= UINT32_MAX);
-		unsigned long cmplen_n = htonl((uint32_t) cmplen);
-		unsigned long rawlen_n = htonl((uint32_t) rawlen);
+	int cowfd = open(cowpath, create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+	if (cowfd < 0) {
+		if (!create)
+			err("open %s, %m", cowpath);
 
-		net_send_all_or_abort(csock, &cmplen_n, sizeof(cmplen_n));
-		net_send_all_or_abort(csock, &rawlen_n, sizeof(rawlen_n));
+		warn("snapshot: open %s, %m", cowpath);
+		goto out;
+	}
 
-		net_send_all_or_abort(csock, cmpbuf, cmplen);
+	if (create) {
+		if (ftruncate(cowfd, ds->disksize) < 0) {
+			warn("snapshot: ftruncate %s, %m", cowpath);
+			goto out_unlink;
+		}
+
+		/*
+		 * bitmap_open_file() aborts on an error. Make the file here;
+		 * it then opens the file with the descriptor freed.
+		 */
+		int bmfd = open(bmpath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (bmfd < 0) {
+			warn("snapshot: open %s, %m", bmpath);
+			goto out_unlink;
+		}
 
-		g_free(cmpbuf);
+		if (ftruncate(bmfd, bitmap_size(get_disk_nblocks(ds->disksize))) < 0) {
+			warn("snapshot: ftruncate %s, %m", bmpath);
+			close(bmfd);
+			unlink(bmpath);
+			goto out_unlink;
+		}
+
+		close(bmfd);
 	}
+
+	size_t bmlen;
+	/* read/write, zero-clear if created */
+	unsigned long *bm = bitmap_open_file(bmpath, get_disk_nblocks(ds->disksize), &bmlen, 0, create);
+
+	/* the layer below is frozen */
+	ds->image[ds->nlayers - 1]->writable = false;
+
+	disk_stack_add_layer(ds, cowpath, cowfd, bmpath, bm, bmlen, true);
+	ds->image[ds->nlayers - 1]->writable = true;
+
+	ret = 0;
+	goto out;
+
+out_unlink:
+	close(cowfd);
+	unlink(cowpath);
+out:
+	g_free(cowpath);
+	g_free(bmpath);
+
+	return ret;
 }
-#endif
 
-static int is_unicolor(unsigned char *buf, size_t len)
+/*
+ * Frequent snapshots make a deep stack, which costs descriptors and memory.
+ * When there are too many frozen layers, the layer 2 is merged into the layer
+ * 1 in the background. A merging process copies the blocks of the layer 2 to
+ * the layer 1 at a limited rate, while sessions go on reading them from the
+ * layer 2. Then, with the sessions stopped, the layer 2 is dropped, and the
+ * layers above it are renamed down. The snapshots of the two layers become
+ * one. The disk image itself is never written.
+ *
+ * After a crash during the copy, the layer 2 still shadows the copied blocks.
+ * A crash during the renaming is recovered at the next open (see
+ * target_recover_layers()).
+ */
+#define MERGE_SRC_LAYER 2
+
+/* rename DISK.layer<from><suffix> to DISK.layer<to><suffix>; false if not found */
+static bool target_rename_layer_file(const char *diskpath, int from, int to, const char *suffix)
 {
-	int samebyte = 1;
-	unsigned long *array = (unsigned long *) buf;
-	unsigned long value = array[0];
+	char *srcpath = g_strdup_printf("%s.layer%d%s", diskpath, from, suffix);
+	char *dstpath = g_strdup_printf("%s.layer%d%s", diskpath, to, suffix);
+	bool moved = true;
+
+	if (rename(srcpath, dstpath) < 0) {
+		if (errno != ENOENT)
+			err("rename %s to %s, %m", srcpath, dstpath);
+		moved = false;
+	}
 
-	if (len % sizeof(unsigned long)) {
-		warn("len %zu is not a multiple of sizeof(unsigned long). is_unicolor() returns false", len);
-		return 0;
+	g_free(srcpath);
+	g_free(dstpath);
+
+	return moved;
+}
+
+static bool target_layer_file_exists(const char *diskpath, int layer, const char *suffix)
+{
+	char *path = g_strdup_printf("%s.layer%d%s", diskpath, layer, suffix);
+	bool found = (access(path, F_OK) == 0);
+	g_free(path);
+
+	return found;
+}
+
+/*
+ * Move the layers above the given one down by one, replacing it. The data
+ * file of each layer is moved before its bitmap.
+ */
+static void target_shift_layers_down(const char *diskpath, int layer)
+{
+	for (int i = layer; ; i++) {
+		bool moved = target_rename_layer_file(diskpath, i + 1, i, "");
+		bool bm_moved = target_rename_layer_file(diskpath, i + 1, i, ".bm");
+
+		if (!moved && !bm_moved)
+			break;
 	}
+}
+
+/*
+ * An interrupted target_shift_layers_down() leaves either a bitmap without
+ * its data file, which has been moved down, or a gap in the layer numbers.
+ */
+static void target_recover_layers(const char *diskpath)
+{
+	for (int layer = 1; ; layer++) {
+		bool data_found = target_layer_file_exists(diskpath, layer, "");
+		bool bm_found = target_layer_file_exists(diskpath, layer, ".bm");
 
-	for (unsigned int i = 1; i < len / sizeof(unsigned long); i++) {
-		if (value != array[i]) {
-			samebyte = 0;
+		if (data_found && bm_found)
+			continue;
+
+		if (data_found)
+			err("%s.layer%d has no bitmap", diskpath, layer);
+
+		if (bm_found) {
+			if (layer == 1)
+				err("%s.layer1 has no data file", diskpath);
+			target_rename_layer_file(diskpath, layer, layer - 1, ".bm");
+		} else if (!target_layer_file_exists(diskpath, layer + 1, ""))
 			break;
+
+		info("resume renaming the layers of %s at layer %d", diskpath, layer);
+		target_shift_layers_down(diskpath, layer);
+		break;
+	}
+}
+
+/* sleep so that copying does not exceed rate bytes per second */
+static void merge_throttle(const struct timespec *start, off_t copied, size_t rate)
+{
+	if (rate == 0)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	double elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+	double delay = (double) copied / rate - elapsed;
+	if (delay <= 0)
+		return;
+
+	struct timespec ts;
+	ts.tv_sec  = (time_t) delay;
+	ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1e9);
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/* copy the blocks of the layer to the one below it, and mark them in its bitmap */
+static void target_merge_layer(struct disk_stack *ds, int layer, size_t rate)
+{
+	struct disk_image *src = ds->image[layer];
+	struct disk_image *dst = ds->image[layer - 1];
+	unsigned long nblocks = get_disk_nblocks(ds->disksize);
+	const unsigned long bits_per_long = sizeof(unsigned long) * 8;
+	const unsigned long maxrun = 1024 * 1024 / CBLOCKSIZE;
+	char *buf = g_malloc(maxrun * CBLOCKSIZE);
+	off_t copied = 0;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (unsigned long index = 0; index < nblocks; ) {
+		if (index % bits_per_long == 0 && !src->bm[index / bits_per_long]) {
+			index += bits_per_long;
+			continue;
 		}
+
+		if (!bitmap_test(src->bm, index)) {
+			index += 1;
+			continue;
+		}
+
+		unsigned long index_end = index + 1;
+		while (index_end < nblocks && index_end - index < maxrun && bitmap_test(src->bm, index_end))
+			index_end += 1;
+
+		off_t iofrom = (off_t) index * CBLOCKSIZE;
+		size_t iolen = confine_iolen_within_disk(ds->disksize, iofrom, (index_end - index) * CBLOCKSIZE);
+
+		ssize_t ret = pread(src->diskfd, buf, iolen, iofrom);
+		if (ret != (ssize_t) iolen)
+			err("merge: reading %s failed, %m", src->path);
+
+		ret = pwrite(dst->diskfd, buf, iolen, iofrom);
+		if (ret != (ssize_t) iolen)
+			err("merge: writing %s failed, %m", dst->path);
+
+		/* zero blocks are dropped before being written back */
+		if (!dst->no_zero_range && zero_range_of_zero_blocks(dst->diskfd, buf, iofrom, iolen, CBLOCKSIZE) < 0)
+			dst->no_zero_range = true;
+
+		copied += iolen;
+		merge_throttle(&start, copied, rate);
+
+		index = index_end;
 	}
 
-	return samebyte;
+	g_free(buf);
+
+	/* the data must be durable before the bitmap says so */
+	int ret = fdatasync(dst->diskfd);
+	if (ret < 0)
+		err("fdatasync %m");
+
+	for (unsigned long index = 0; index < nblocks; index++)
+		if (bitmap_test(src->bm, index))
+			bitmap_on(dst->bm, index);
+
+	bitmap_sync_file(dst->bm, dst->bmlen);
+
+	info("merge: %ju bytes of %s copied to %s", copied, src->path, dst->path);
 }
 
-void compress_iovec_and_send_advanced(int csock, const struct iovec *iov, const unsigned int count, int lzo_enabled)
+/*
+ * Fork a process merging the layer 2 into the layer 1, at most rate bytes
+ * per second (0: no limit). After it exits successfully, the caller stops
+ * all the sessions and calls xnbd_target_finish_merge().
+ */
+pid_t xnbd_target_start_merge(struct disk_stack *ds, size_t rate)
 {
-	// uint32_t count_n = htonl(count);
-	// net_send_all_or_abort(csock, &count_n, sizeof(count_n));
+	/* the top layer is never merged */
+	g_assert(ds->nlayers > MERGE_SRC_LAYER + 1);
+
+	pid_t pid = fork_or_abort();
+	if (pid > 0) {
+		info("merge: merging %s into %s (pid %d)", ds->image[MERGE_SRC_LAYER]->path,
+				ds->image[MERGE_SRC_LAYER - 1]->path, pid);
+		return pid;
+	}
 
-	dbg("nchunks %u", count);
+	set_process_name("merge");
 
-	for (unsigned int i = 0; i < count; i++) {
-		unsigned char *rawbuf = iov[i].iov_base;
-		size_t rawlen         = iov[i].iov_len;
-		lzo_uint cmplen;
+	target_merge_layer(ds, MERGE_SRC_LAYER, rate);
 
-		if (is_unicolor(rawbuf, rawlen)) {
-			dbg("%u / %u: unicolor", i, count);
-			/* cmplen == 0 means the buffer will be filled with a uint32_t value. */
-			cmplen = 0;
+	exit(EXIT_SUCCESS);
+}
 
-			uint32_t *array = (uint32_t *) rawbuf;
-			uint32_t value = htonl(array[0]);
+/* Drop the merged layer. The caller must have stopped all the sessions. */
+void xnbd_target_finish_merge(struct disk_stack *ds, char *diskpath)
+{
+	int layer = MERGE_SRC_LAYER;
+	struct disk_image *di = ds->image[layer];
 
-			uint32_t cmplen_n = htonl((uint32_t) cmplen);
-			uint32_t rawlen_n = htonl((uint32_t) rawlen);
-			net_send_all_or_abort(csock, &cmplen_n, sizeof(cmplen_n));
-			net_send_all_or_abort(csock, &rawlen_n, sizeof(rawlen_n));
+	info("merge: drop %s", di->path);
 
-			net_send_all_or_abort(csock, &value, sizeof(value));
+	close(di->diskfd);
+	bitmap_close_file(di->bm, di->bmlen);
+	g_free(di->path);
+	g_free(di->bmpath);
+	g_free(di);
 
-		} else {
-			if (lzo_enabled) {
-				dbg("%u / %u: lzo", i, count);
-				unsigned char *cmpbuf = g_malloc0(get_max_outlen(rawlen));
+	memmove(&ds->image[layer], &ds->image[layer + 1], sizeof(struct disk_image *) * (ds->nlayers - layer - 1));
+	ds->nlayers -= 1;
 
-				int ret = lzo1x_1_compress(rawbuf, rawlen, cmpbuf, &cmplen, wrkmem);
-				if (ret == LZO_E_OK)
-					dbg("compressed: %d -> %lu", rawlen, cmplen);
-				else
-					err("compression failed, %d", ret);
+	target_shift_layers_down(diskpath, layer);
 
-				g_assert(cmplen <= UINT32_MAX && rawlen <= UINT32_MAX);
-				uint32_t cmplen_n = htonl((uint32_t) cmplen);
-				uint32_t rawlen_n = htonl((uint32_t) rawlen);
-				net_send_all_or_abort(csock, &cmplen_n, sizeof(cmplen_n));
-				net_send_all_or_abort(csock, &rawlen_n, sizeof(rawlen_n));
+	for (int i = layer; i < ds->nlayers; i++) {
+		g_free(ds->image[i]->path);
+		g_free(ds->image[i]->bmpath);
+		ds->image[i]->path = target_layer_path(diskpath, i);
+		ds->image[i]->bmpath = g_strdup_printf("%s.bm", ds->image[i]->path);
+	}
 
-				net_send_all_or_abort(csock, cmpbuf, cmplen);
+	/* rebuild the owner index */
+	g_free(ds->owner);
+	ds->owner = NULL;
+	for (int i = 1; i < ds->nlayers - 1; i++)
+		disk_stack_fold_layer(ds, i);
 
-				g_free(cmpbuf);
+	dump_disk_stack(ds);
+}
 
-			} else {
-				dbg("%u / %u: plain", i, count);
 
-				cmplen = UINT32_MAX;
+/* Stack the layers of the disk image on it. Return NULL if there are no layers. */
+struct disk_stack *xnbd_target_open_disk_stack(char *diskpath)
+{
+	target_recover_layers(diskpath);
 
-				uint32_t cmplen_n = htonl((uint32_t) cmplen);
-				uint32_t rawlen_n = htonl((uint32_t) rawlen);
-				net_send_all_or_abort(csock, &cmplen_n, sizeof(cmplen_n));
-				net_send_all_or_abort(csock, &rawlen_n, sizeof(rawlen_n));
+	if (!xnbd_target_has_layers(diskpath))
+		return NULL;
 
-				net_send_all_or_abort(csock, rawbuf, rawlen);
-			}
+	struct disk_stack *ds = create_disk_stack(diskpath);
+
+	for (int layer = 1; ; layer++) {
+		char *cowpath = target_layer_path(diskpath, layer);
+		bool found = (access(cowpath, F_OK) == 0);
+		g_free(cowpath);
+
+		if (!found)
+			break;
+
+		target_add_layer(ds, diskpath, layer, false);
+	}
+
+	dump_disk_stack(ds);
+
+	return ds;
+}
+
+/*
+ * Take an online snapshot; *pds is NULL before the first one. The caller
+ * must have stopped all the sessions. Return -1 if a new layer cannot be
+ * stacked; the current layers are kept as they are.
+ */
+int xnbd_target_push_layer(struct disk_stack **pds, char *diskpath)
+{
+	if (*pds && (*pds)->nlayers == MAX_DISKIMAGESTACK) {
+		warn("snapshot: %s has too many layers (%d)", diskpath, MAX_DISKIMAGESTACK);
+		return -1;
+	}
+
+	if (!*pds)
+		*pds = create_disk_stack(diskpath);
+	else
+		disk_stack_fsync(*pds);
+
+	int ret = target_add_layer(*pds, diskpath, (*pds)->nlayers, true);
+	if (ret < 0) {
+		/* without a layer, the disk image is still written directly */
+		if ((*pds)->nlayers == 1) {
+			destroy_disk_stack(*pds);
+			*pds = NULL;
 		}
+
+		return -1;
 	}
+
+	dump_disk_stack(*pds);
+
+	return 0;
 }
 
-#else
 
-void compress_iovec_and_send_advanced(int csock __attribute__((unused)),
-	       	const struct iovec *iov __attribute__((unused)),
-		const unsigned int count __attribute__((unused)),
-		int lzo_enabled __attribute__((unused)))
+/*
+ * Send a read reply in structured chunks. The layer bitmaps tell which disk
+ * image has each block, and the holes of the image are sent without data.
+ * A block never written to the cow layers is a hole if the base image has a
+ * hole there. Zero blocks are also sent as holes.
+ */
+static void cow_send_read_reply_structured(int csock, struct disk_stack *ds, struct disk_stack_io *io,
+		struct nbd_reply *reply, off_t iofrom)
 {
-	err("compression support was not compiled");
+	unsigned int nchunks = 0;
+	unsigned int maxchunks = io->iov_size + 1;
+	struct nbd_read_chunk *chunks = g_new(struct nbd_read_chunk, maxchunks);
+
+	off_t pos = iofrom;
+
+	for (unsigned int i = 0; i < io->iov_size; i++) {
+		struct disk_image *di = ds->image[io->iov_layer[i]];
+		off_t chunk_iofrom = pos;
+		off_t chunk_ioend  = pos + io->iov[i].iov_len;
+
+		while (pos < chunk_ioend) {
+			off_t extent_end;
+			int hole = get_file_extent(di->diskfd, pos, chunk_ioend, &extent_end);
+
+			if (nchunks == maxchunks) {
+				maxchunks *= 2;
+				chunks = g_renew(struct nbd_read_chunk, chunks, maxchunks);
+			}
+
+			chunks[nchunks].iofrom = pos;
+			chunks[nchunks].iolen  = extent_end - pos;
+			chunks[nchunks].buf    = hole ? NULL : (char *) io->iov[i].iov_base + (pos - chunk_iofrom);
+			nchunks += 1;
+
+			pos = extent_end;
+		}
+	}
+
+	int ret = nbd_server_send_read_reply_structured(csock, reply, chunks, nchunks, CBLOCKSIZE);
+	if (ret < 0)
+		err("sending a read reply failed, sockfd (%d) closed", csock);
+
+	g_free(chunks);
 }
 
-void compress_iovec_and_send(int csock __attribute__((unused)),
-	       struct iovec *iov __attribute__((unused)),
-	       int count __attribute__((unused)))
+/*
+ * Reply to NBD_CMD_BLOCK_STATUS for the metadata context base:allocation.
+ * Like reading, the owner index tells which disk image has each block, and
+ * the holes of the image are reported as holes.
+ */
+static void cow_send_block_status_reply(int csock, struct disk_stack *ds, struct nbd_reply *reply,
+		struct nbd_negotiate_options *opts, off_t iofrom, size_t iolen, uint32_t ioflags)
 {
-	err("lzo support was not compiled");
-}
-#endif
+	off_t ioend = iofrom + iolen;
+	unsigned long index_sta = get_bindex_sta(CBLOCKSIZE, iofrom);
+	unsigned long index_end = get_bindex_end(CBLOCKSIZE, ioend);
 
+	struct nbd_block_status bs;
+	nbd_block_status_init(&bs);
 
+	for (unsigned long index = index_sta; index <= index_end; index++) {
+		int layer = disk_stack_find_layer(ds, index);
+
+		off_t chunk_iofrom = MAX(iofrom, (off_t) index * CBLOCKSIZE);
+		off_t chunk_ioend  = MIN(ioend, (off_t) (index + 1) * CBLOCKSIZE);
+		int full = 0;
+
+		for (off_t pos = chunk_iofrom; pos < chunk_ioend; ) {
+			off_t extent_end;
+			int hole = get_file_extent(ds->image[layer]->diskfd, pos, chunk_ioend, &extent_end);
+
+			if (nbd_block_status_add(&bs, extent_end - pos, hole ? (NBD_STATE_HOLE | NBD_STATE_ZERO) : 0) < 0) {
+				full = 1;
+				break;
+			}
+
+			pos = extent_end;
+		}
+
+		if (full)
+			break;
+
+		/* only one descriptor is wanted; drop the second one */
+		if ((ioflags & NBD_CMD_FLAG_REQ_ONE) && bs.ndescs > 1) {
+			bs.ndescs -= 1;
+			bs.length -= bs.descs[bs.ndescs].length;
+			break;
+		}
+	}
+
+	int ret = nbd_server_send_block_status_reply(csock, reply, opts->base_allocation_id, &bs);
+	if (ret < 0)
+		err("sending a block status reply failed, sockfd (%d) closed", csock);
+
+	nbd_block_status_free(&bs);
+}
 
 
 int target_mode_main_cow(struct xnbd_session *ses)
@@ -795,6 +1383,7 @@ int target_mode_main_cow(struct xnbd_session *ses)
 	struct nbd_reply reply;
 	int csock = ses->clientfd;
 	uint32_t iotype = 0;
+	uint32_t ioflags = 0;
 	off_t iofrom = 0;
 	size_t iolen  = 0;
 	int ret;
@@ -808,7 +1397,7 @@ int target_mode_main_cow(struct xnbd_session *ses)
 	if (ret < 0)
 		return -1;
 
-	ret = nbd_server_recv_request(csock, xnbd->disksize, &iotype, &iofrom, &iolen, &reply);
+	ret = nbd_server_recv_request_buffered(ses->reader, xnbd->disksize, &iotype, &ioflags, &iofrom, &iolen, &reply);
 	if (ret == NBD_SERVER_RECV__BAD_REQUEST) {
 		net_send_all_or_abort(csock, &reply, sizeof(reply));
 		return 0;
@@ -819,22 +1408,24 @@ int target_mode_main_cow(struct xnbd_session *ses)
 
 
 	int compression_enabled = 0;
-	int compression_lzo = 0;
-	if (iotype == NBD_CMD_READ_COMPRESS || iotype == NBD_CMD_READ_COMPRESS_LZO) {
-		dbg("compression_enabled request");
-		compression_enabled = 1;
+	int codec = xnbd_codec_from_iotype(iotype);
+	if (codec >= 0) {
+		dbg("compression_enabled request, %s", xnbd_codec_name(codec));
 
-		if (iotype == NBD_CMD_READ_COMPRESS_LZO) {
-			compression_lzo = 1;
-			dbg("lzo enabled");
+		if (!xnbd_codec_supported(codec)) {
+			warn("%s: codec %s is not compiled", nbd_get_iotype_string(iotype), xnbd_codec_name(codec));
+			reply.error = htonl(ENOTSUP);
+			net_send_all_or_abort(csock, &reply, sizeof(reply));
+			return 0;
 		}
 
+		compression_enabled = 1;
 		iotype = NBD_CMD_READ;
 	}
 
 
 	if (xnbd->readonly) {
-		if (iotype == NBD_CMD_WRITE || iotype == NBD_CMD_TRIM) {
+		if (iotype == NBD_CMD_WRITE || iotype == NBD_CMD_TRIM || iotype == NBD_CMD_WRITE_ZEROES) {
 			/* do not read following write data */
 			err("%s to a readonly disk. disconnect.", nbd_get_iotype_string(iotype));
 		}
@@ -844,7 +1435,54 @@ int target_mode_main_cow(struct xnbd_session *ses)
 	dbg("direct mode");
 
 
-	struct disk_stack_io *io = disk_stack_mmap(xnbd->cow_ds, iofrom, iolen, (iotype == NBD_CMD_READ));
+	/* no need to map the layers; disk_stack_mmap() updates the top bitmap unless reading */
+	if (iotype == NBD_CMD_BLOCK_STATUS) {
+		dbg("disk block status iofrom %ju iolen %zu", iofrom, iolen);
+
+		if (!ses->opts.base_allocation || iolen == 0) {
+			warn("CMD_BLOCK_STATUS: no metadata context is selected, or zero length");
+			reply.error = htonl(EINVAL);
+			net_send_all_or_abort(csock, &reply, sizeof(reply));
+		} else
+			cow_send_block_status_reply(csock, xnbd->cow_ds, &reply, &ses->opts, iofrom, iolen, ioflags);
+
+		return 0;
+	}
+
+	/* a flush has no range to map; its zero length would wrap index_end */
+	if (iotype == NBD_CMD_FLUSH) {
+		dbg("disk flush");
+
+		disk_stack_fsync(xnbd->cow_ds);
+
+		net_send_all_or_abort(csock, &reply, sizeof(reply));
+		return 0;
+	}
+
+	/*
+	 * Not advertised; see xnbd_get_export_flags(). A client of the target
+	 * mode may still send it after an online snapshot.
+	 */
+	if (iotype == NBD_CMD_WRITE_ZEROES && (ioflags & NBD_CMD_FLAG_FAST_ZERO)) {
+		warn("CMD_WRITE_ZEROES: fast zero is not supported");
+		reply.error = htonl(ENOTSUP);
+		net_send_all_or_abort(csock, &reply, sizeof(reply));
+		return 0;
+	}
+
+
+	if (iotype == NBD_CMD_CHECKSUM) {
+		reply.error = htonl(xnbd_checksum_check_request(xnbd->disksize, iofrom, iolen));
+		if (reply.error) {
+			net_send_all_or_abort(csock, &reply, sizeof(reply));
+			return 0;
+		}
+	}
+
+
+	/* checksums read the layers like a read */
+	struct disk_stack_io *io = disk_stack_mmap(xnbd->cow_ds, iofrom, iolen,
+			(iotype == NBD_CMD_READ || iotype == NBD_CMD_CHECKSUM));
 
 
 	switch (iotype) {
@@ -857,20 +1495,45 @@ int target_mode_main_cow(struct xnbd_session *ses)
 			compare_iov_and_buf(io->iov, io->iov_size, debug_buf + iofrom, iolen);
 
 #else
-			net_readv_all_or_abort(csock, io->iov, io->iov_size);
+			ret = nbd_request_reader_recv_payload_iov(ses->reader, io->iov, io->iov_size);
+			if (ret < 0)
+				err("recv write data, sockfd (%d) closed", csock);
 #endif
+			bool zeroed = disk_stack_zero_written_blocks(io, iofrom, iolen);
+
+			if (ses->dedup)
+				xnbd_dedup_share(ses->dedup, xnbd->cow_ds->nlayers - 1, iofrom, iolen);
+
+			if (ioflags & NBD_CMD_FLAG_FUA) {
+				disk_stack_msync(io);
+
+				/* fallocate() changed the metadata of the file */
+				if (zeroed && fdatasync(xnbd->cow_ds->image[xnbd->cow_ds->nlayers - 1]->diskfd) < 0)
+					err("fdatasync %m");
+			}
+
 			net_send_all_or_abort(csock, &reply, sizeof(reply));
 			break;
 
 		case NBD_CMD_READ:
 			dbg("disk read iofrom %ju iolen %zu", iofrom, iolen);
 
+			if (ses->opts.structured_reply && !compression_enabled) {
+				cow_send_read_reply_structured(csock, xnbd->cow_ds, io, &reply, iofrom);
+				if (ses->dedup)
+					disk_stack_dedup_index(ses->dedup, io);
+				break;
+			}
+
 			/* send normal header */
 			net_send_all_or_abort(csock, &reply, sizeof(reply));
 
 			if (compression_enabled) {
 				/* send compressed data */
-				compress_iovec_and_send_advanced(csock, io->iov, io->iov_size, compression_lzo);
+				int level = (ioflags & NBD_CMD_FLAG_LEVEL_MASK) >> NBD_CMD_FLAG_LEVEL_SHIFT;
+				ret = compress_iovec_and_send(csock, io->iov, io->iov_size, codec, level);
+				if (ret < 0)
+					err("send compressed data, sockfd (%d) closed", csock);
 			} else {
 #ifdef DEBUG_COW
 				compare_iov_and_buf(io->iov, io->iov_size, debug_buf + iofrom, iolen);
@@ -878,18 +1541,33 @@ int target_mode_main_cow(struct xnbd_session *ses)
 				net_writev_all_or_abort(csock, io->iov, io->iov_size);
 			}
 
+			if (ses->dedup)
+				disk_stack_dedup_index(ses->dedup, io);
+
 			break;
 
-		case NBD_CMD_FLUSH:
-			dbg("disk flush");
+		case NBD_CMD_WRITE_ZEROES:
+			dbg("disk write zeroes iofrom %ju iolen %zu flags %x", iofrom, iolen, ioflags);
 
-			disk_stack_fsync(xnbd->cow_ds);
+			disk_stack_write_zeroes(io, iofrom, iolen, ioflags);
+
+			net_send_all_or_abort(csock, &reply, sizeof(reply));
 			break;
 
 		case NBD_CMD_TRIM:
 			dbg("disk trim iofrom %ju iolen %zu", iofrom, iolen);
 
 			disk_stack_punch_hole(xnbd->cow_ds, iofrom, iolen);
+
+			net_send_all_or_abort(csock, &reply, sizeof(reply));
+			break;
+
+		case NBD_CMD_CHECKSUM:
+			dbg("disk checksum iofrom %ju iolen %zu", iofrom, iolen);
+
+			ret = xnbd_checksum_send_reply(csock, &reply, io->iov, io->iov_size, iolen);
+			if (ret < 0)
+				err("send checksums, sockfd (%d) closed", csock);
 			break;
 
 		default:
@@ -907,16 +1585,35 @@ int target_mode_main_cow(struct xnbd_session *ses)
 
 int xnbd_cow_target_session_server(struct xnbd_session *ses)
 {
+	int ret = 0;
+
 	set_process_name("cow_wrk");
 	//setup_debug_buf(ses->xnbd->ds);
+	ses->reader = nbd_request_reader_create(ses->clientfd);
 
-	for (;;) {
-		int ret = 0;
+	if (ses->xnbd->dedup && !ses->xnbd->readonly) {
+		/* the id of a file is its layer, the same in all the sessions */
+		struct disk_stack *ds = ses->xnbd->cow_ds;
+
+		ses->dedup = xnbd_dedup_create(ses->xnbd->dedup_table);
+		for (int i = 0; i < ds->nlayers; i++)
+			xnbd_dedup_add_file(ses->dedup, ds->image[i]->diskfd, ds->image[i]->writable);
+		xnbd_dedup_start(ses->dedup);
+	}
 
+	for (;;) {
 		ret = target_mode_main_cow(ses);
 		if (ret < 0)
-			return ret;
+			break;
 	}
 
-	return 0;
+	if (ses->dedup) {
+		xnbd_dedup_destroy(ses->dedup);
+		ses->dedup = NULL;
+	}
+
+	nbd_request_reader_destroy(ses->reader);
+	ses->reader = NULL;
+
+	return ret;
 }
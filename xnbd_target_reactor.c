@@ -0,0 +1,523 @@
+/*
+ * xNBD - an enhanced Network Block Device program
+ *
+ * Copyright (C) 2008-2014 National Institute of Advanced Industrial Science
+ * and Technology
+ *
+ * Author: Takahiro Hirofuchi <t.hirofuchi _at_ aist.go.jp>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "xnbd.h"
+#include <sys/epoll.h>
+
+
+/*
+ * The reactor serves all the clients of the target mode in a single process.
+ *
+ * The master thread polls the listening sockets and the client sockets with
+ * epoll. A client socket is registered with EPOLLONESHOT; when it becomes
+ * readable, it is disabled and handed to one of a fixed number of I/O
+ * threads. The I/O thread serves the requests buffered for the connection,
+ * and then re-arms the socket. So, requests of one connection are served in
+ * order, and those of different connections are served in parallel.
+ *
+ * A connection costs a small request buffer and a few words of state,
+ * instead of a process.
+ */
+
+/* request headers are buffered; write data is received directly */
+#define XNBD_REACTOR_READER_BUFSIZE  4096
+
+#define XNBD_REACTOR_QUEUE_SIZE  4096
+#define XNBD_REACTOR_MAX_EVENTS  64
+
+/* requests served for a connection before yielding the I/O thread */
+#define XNBD_REACTOR_BURST  16
+
+/* a client must complete the negotiation in this period */
+#define XNBD_REACTOR_NEGOTIATE_TIMEOUT  10
+
+/*
+ * After the negotiation, a client stalling in the middle of a request (or
+ * not reading a reply) for this period is disconnected. An I/O thread reads
+ * a connection only when epoll notifies it, but then blocks until the whole
+ * request is received; stalled clients must not hold all the I/O threads.
+ */
+#define XNBD_REACTOR_IO_TIMEOUT  30
+
+
+struct reactor_conn {
+	int fd;
+	int listening;
+
+	/* NULL until the negotiation is done */
+	struct xnbd_info *export;
+	struct nbd_request_reader *reader;
+	struct nbd_negotiate_options opts;
+
+	/* the entry in reactor->conns */
+	GList *link;
+};
+
+struct xnbd_reactor {
+	int epoll_fd;
+
+	struct xnbd_info **exports;
+	unsigned int nexports;
+
+	/* connections to be served by I/O threads */
+	struct lfqueue *jobs;
+	pthread_t *tids;
+	unsigned int nthreads;
+
+	/* all the connections, including listening sockets */
+	GMutex conns_mutex;
+	GList *conns;
+
+	/* pause I/O threads while making snapshots */
+	GMutex pause_mutex;
+	GCond pause_cond;
+	int paused;
+	unsigned int nbusy;
+};
+
+/* pushed to the job queue to stop an I/O thread */
+static struct reactor_conn reactor_stop_job;
+
+
+
+static struct reactor_conn *reactor_add_conn(struct xnbd_reactor *reactor, int fd, int listening)
+{
+	struct reactor_conn *conn = g_slice_new0(struct reactor_conn);
+	conn->fd = fd;
+	conn->listening = listening;
+
+	g_mutex_lock(&reactor->conns_mutex);
+	reactor->conns = g_list_prepend(reactor->conns, conn);
+	conn->link = reactor->conns;
+	g_mutex_unlock(&reactor->conns_mutex);
+
+	return conn;
+}
+
+static void reactor_close_conn(struct xnbd_reactor *reactor, struct reactor_conn *conn)
+{
+	g_mutex_lock(&reactor->conns_mutex);
+	reactor->conns = g_list_delete_link(reactor->conns, conn->link);
+	g_mutex_unlock(&reactor->conns_mutex);
+
+	if (conn->reader)
+		nbd_request_reader_destroy(conn->reader);
+
+	/* this also removes the fd from the epoll set */
+	close(conn->fd);
+
+	info("connection closed (fd %d)", conn->fd);
+
+	g_slice_free(struct reactor_conn, conn);
+}
+
+/*
+ * Wait for the next request of a connection. After this, the connection may
+ * be served by another I/O thread at any time; the caller must not touch it.
+ */
+static void reactor_arm_conn(struct xnbd_reactor *reactor, struct reactor_conn *conn, int op)
+{
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	event.data.ptr = conn;
+
+	int ret = epoll_ctl(reactor->epoll_fd, op, conn->fd, &event);
+	if (ret < 0)
+		err("epoll_ctl (fd %d), %m", conn->fd);
+}
+
+
+
+static void reactor_io_begin(struct xnbd_reactor *reactor)
+{
+	g_mutex_lock(&reactor->pause_mutex);
+
+	while (reactor->paused)
+		g_cond_wait(&reactor->pause_cond, &reactor->pause_mutex);
+
+	reactor->nbusy += 1;
+
+	g_mutex_unlock(&reactor->pause_mutex);
+}
+
+static void reactor_io_end(struct xnbd_reactor *reactor)
+{
+	g_mutex_lock(&reactor->pause_mutex);
+
+	reactor->nbusy -= 1;
+	if (reactor->paused && reactor->nbusy == 0)
+		g_cond_broadcast(&reactor->pause_cond);
+
+	g_mutex_unlock(&reactor->pause_mutex);
+}
+
+
+
+/* a blocking send or recv of fd fails with EAGAIN after sec seconds */
+static void set_io_timeout(int fd, time_t sec)
+{
+	struct timeval tv = { .tv_sec = sec, .tv_usec = 0 };
+
+	int ret = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (ret < 0)
+		warn("setsockopt SO_RCVTIMEO (fd %d), %m", fd);
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (ret < 0)
+		warn("setsockopt SO_SNDTIMEO (fd %d), %m", fd);
+}
+
+static struct xnbd_info *reactor_find_export(struct xnbd_reactor *reactor, const char *name)
+{
+	for (unsigned int i = 0; i < reactor->nexports; i++) {
+		if (strcmp(reactor->exports[i]->target_diskpath, name) == 0)
+			return reactor->exports[i];
+	}
+
+	return NULL;
+}
+
+static int reactor_lookup_export(const char *name, struct nbd_export_info *einfo, void *arg)
+{
+	struct xnbd_info *xnbd = reactor_find_export(arg, name);
+	if (!xnbd)
+		return -1;
+
+	xnbd_get_export_info(xnbd, einfo);
+
+	return 0;
+}
+
+static char **reactor_list_exports(void *arg)
+{
+	struct xnbd_reactor *reactor = arg;
+	char **names = g_new0(char *, reactor->nexports + 1);
+
+	for (unsigned int i = 0; i < reactor->nexports; i++)
+		names[i] = g_strdup(reactor->exports[i]->target_diskpath);
+
+	return names;
+}
+
+/*
+ * With a single disk image, use the old negotiation as the forking server
+ * does. With several disk images, a client selects one with an export name,
+ * which is the path of the disk image given in the command line.
+ */
+static int reactor_negotiate(struct xnbd_reactor *reactor, struct reactor_conn *conn)
+{
+	struct xnbd_info *xnbd = NULL;
+	int ret;
+
+	/* a client sending nothing must not hold an I/O thread */
+	set_io_timeout(conn->fd, XNBD_REACTOR_NEGOTIATE_TIMEOUT);
+
+	if (reactor->nexports == 1) {
+		xnbd = reactor->exports[0];
+
+		ret = nbd_negotiate_v1_server_side_with_flags(conn->fd, xnbd->disksize, xnbd_get_export_flags(xnbd));
+		if (ret < 0)
+			return -1;
+
+	} else {
+		conn->opts.structured_reply = 1;
+		conn->opts.base_allocation  = 1;
+
+		struct nbd_export_ops ops = {
+			.lookup = reactor_lookup_export,
+			.list   = reactor_list_exports,
+			.arg    = reactor,
+		};
+
+		/* an unknown export name is refused inside */
+		char *name = nbd_negotiate_v2_server_side(conn->fd, &conn->opts, &ops);
+		if (!name)
+			return -1;
+
+		xnbd = reactor_find_export(reactor, name);
+		g_free(name);
+	}
+
+	set_io_timeout(conn->fd, XNBD_REACTOR_IO_TIMEOUT);
+
+	conn->export = xnbd;
+	conn->reader = nbd_request_reader_create_sized(conn->fd, XNBD_REACTOR_READER_BUFSIZE);
+
+	info("negotiation done (fd %d, %s)", conn->fd, xnbd->target_diskpath);
+
+	return 0;
+}
+
+static void reactor_serve_conn(struct xnbd_reactor *reactor, struct reactor_conn *conn)
+{
+	unsigned int nserved = 0;
+
+	for (;;) {
+		struct xnbd_target_request req;
+
+		/* a snapshot may be taken while a request is being received */
+		int ret = xnbd_target_recv_request(conn->export, conn->reader, conn->fd, &req, true);
+		if (ret > 0) {
+			reactor_io_begin(reactor);
+			ret = xnbd_target_serve_received_request(conn->export, conn->fd, conn->reader, &conn->opts, &req);
+			reactor_io_end(reactor);
+		}
+
+		if (ret < 0) {
+			reactor_close_conn(reactor, conn);
+			return;
+		}
+
+		if (nbd_request_reader_buffered(conn->reader) == 0) {
+			reactor_arm_conn(reactor, conn, EPOLL_CTL_MOD);
+			return;
+		}
+
+		/*
+		 * More requests are already buffered, for which epoll never
+		 * notifies. Requeue the connection so that the other
+		 * connections are not starved. If the queue is full, just
+		 * keep serving.
+		 */
+		nserved += 1;
+		if (nserved >= XNBD_REACTOR_BURST) {
+			if (lfqueue_try_push(reactor->jobs, conn) == 0)
+				return;
+
+			nserved = 0;
+		}
+	}
+}
+
+static void *reactor_io_thread_main(void *arg)
+{
+	struct xnbd_reactor *reactor = (struct xnbd_reactor *) arg;
+
+	set_process_name("target_io");
+
+	for (;;) {
+		struct reactor_conn *conn = lfqueue_pop(reactor->jobs);
+		if (conn == &reactor_stop_job)
+			break;
+
+		if (!conn->export) {
+			int ret = reactor_negotiate(reactor, conn);
+			if (ret < 0) {
+				warn("negotiation with the client failed");
+				reactor_close_conn(reactor, conn);
+				continue;
+			}
+
+			reactor_arm_conn(reactor, conn, EPOLL_CTL_ADD);
+			continue;
+		}
+
+		reactor_serve_conn(reactor, conn);
+	}
+
+	return NULL;
+}
+
+
+
+/* xnbd is the first export; the other disk images are opened here. */
+struct xnbd_reactor *xnbd_reactor_create(struct xnbd_info *xnbd)
+{
+	struct xnbd_reactor *reactor = g_new0(struct xnbd_reactor, 1);
+
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epoll_fd < 0)
+		err("epoll_create1, %m");
+
+	g_mutex_init(&reactor->conns_mutex);
+	g_mutex_init(&reactor->pause_mutex);
+	g_cond_init(&reactor->pause_cond);
+
+	unsigned int ndisks = g_strv_length(xnbd->target_diskpaths);
+	reactor->exports  = g_new0(struct xnbd_info *, ndisks);
+	reactor->exports[0] = xnbd;
+	reactor->nexports = 1;
+
+	for (unsigned int i = 1; i < ndisks; i++) {
+		char *diskpath = xnbd->target_diskpaths[i];
+
+		if (reactor_find_export(reactor, diskpath))
+			err("%s is given twice", diskpath);
+
+		struct xnbd_info *export = g_new0(struct xnbd_info, 1);
+		export->cmd = xnbd_cmd_target;
+		export->readonly = xnbd->readonly;
+		export->target_diskpath = diskpath;
+
+		xnbd_target_open_disk(diskpath, export);
+		export->nblocks = get_disk_nblocks(export->disksize);
+
+		/* the latest data is in the layers of online snapshots; see xnbd_initialize() */
+		if (xnbd_target_has_layers(diskpath))
+			err("%s has layers of online snapshots; use --online-snapshot", diskpath);
+
+		reactor->exports[i] = export;
+		reactor->nexports += 1;
+	}
+
+	reactor->jobs = lfqueue_new(XNBD_REACTOR_QUEUE_SIZE);
+
+	/* I/O threads inherit the signal mask of the caller */
+	reactor->nthreads = xnbd->target_nthreads;
+	reactor->tids = g_new0(pthread_t, reactor->nthreads);
+	for (unsigned int i = 0; i < reactor->nthreads; i++)
+		reactor->tids[i] = pthread_create_or_abort(reactor_io_thread_main, reactor);
+
+	info("reactor started (%u exports, %u I/O threads)", reactor->nexports, reactor->nthreads);
+
+	return reactor;
+}
+
+void xnbd_reactor_add_listen_socket(struct xnbd_reactor *reactor, int lsock)
+{
+	struct reactor_conn *conn = reactor_add_conn(reactor, lsock, 1);
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+
+	int ret = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, lsock, &event);
+	if (ret < 0)
+		err("epoll_ctl (fd %d), %m", lsock);
+}
+
+/*
+ * Wait for events, and then dispatch them. Returning -1 if interrupted by a
+ * signal; sigmask is applied during the wait as ppoll() does.
+ */
+int xnbd_reactor_poll(struct xnbd_reactor *reactor, const sigset_t *sigmask)
+{
+	struct epoll_event events[XNBD_REACTOR_MAX_EVENTS];
+
+	int nready = epoll_pwait(reactor->epoll_fd, events, XNBD_REACTOR_MAX_EVENTS, -1, sigmask);
+	if (nready < 0) {
+		if (errno == EINTR)
+			return -1;
+
+		err("epoll_pwait, %m");
+	}
+
+	for (int i = 0; i < nready; i++) {
+		struct reactor_conn *conn = (struct reactor_conn *) events[i].data.ptr;
+
+		if (conn->listening) {
+			int csockfd = net_accept(conn->fd);
+			if (csockfd < 0)
+				continue;
+
+			info("csockfd %d", csockfd);
+
+			/* negotiate in an I/O thread */
+			lfqueue_push(reactor->jobs, reactor_add_conn(reactor, csockfd, 0));
+			continue;
+		}
+
+		/* disabled by EPOLLONESHOT until an I/O thread re-arms it */
+		lfqueue_push(reactor->jobs, conn);
+	}
+
+	return 0;
+}
+
+/* Make a snapshot of each disk image while no request is in progress. */
+void xnbd_reactor_make_snapshot(struct xnbd_reactor *reactor)
+{
+	g_mutex_lock(&reactor->pause_mutex);
+
+	reactor->paused = 1;
+	while (reactor->nbusy > 0)
+		g_cond_wait(&reactor->pause_cond, &reactor->pause_mutex);
+
+	g_mutex_unlock(&reactor->pause_mutex);
+
+
+	for (unsigned int i = 0; i < reactor->nexports; i++)
+		xnbd_target_make_snapshot(reactor->exports[i]);
+
+
+	g_mutex_lock(&reactor->pause_mutex);
+
+	reactor->paused = 0;
+	g_cond_broadcast(&reactor->pause_cond);
+
+	g_mutex_unlock(&reactor->pause_mutex);
+}
+
+/* Listening sockets are closed by the caller. */
+void xnbd_reactor_destroy(struct xnbd_reactor *reactor)
+{
+	info("cleanup %u connection(s)", g_list_length(reactor->conns));
+
+	/* wake up I/O threads waiting for the rest of a request */
+	g_mutex_lock(&reactor->conns_mutex);
+	for (GList *list = g_list_first(reactor->conns); list != NULL; list = g_list_next(list)) {
+		struct reactor_conn *conn = (struct reactor_conn *) list->data;
+		if (!conn->listening)
+			shutdown(conn->fd, SHUT_RDWR);
+	}
+	g_mutex_unlock(&reactor->conns_mutex);
+
+	for (unsigned int i = 0; i < reactor->nthreads; i++)
+		lfqueue_push(reactor->jobs, &reactor_stop_job);
+
+	for (unsigned int i = 0; i < reactor->nthreads; i++)
+		pthread_join(reactor->tids[i], NULL);
+
+	/* connections waiting for events or left in the job queue */
+	for (;;) {
+		GList *list = g_list_first(reactor->conns);
+		if (!list)
+			break;
+
+		struct reactor_conn *conn = (struct reactor_conn *) list->data;
+		if (conn->listening) {
+			reactor->conns = g_list_delete_link(reactor->conns, list);
+			g_slice_free(struct reactor_conn, conn);
+		} else
+			reactor_close_conn(reactor, conn);
+	}
+
+	/* the first export is closed in xnbd_shutdown() */
+	for (unsigned int i = 1; i < reactor->nexports; i++) {
+		close(reactor->exports[i]->target_diskfd);
+		g_free(reactor->exports[i]);
+	}
+
+	lfqueue_destroy(reactor->jobs);
+	close(reactor->epoll_fd);
+
+	g_cond_clear(&reactor->pause_cond);
+	g_mutex_clear(&reactor->pause_mutex);
+	g_mutex_clear(&reactor->conns_mutex);
+
+	g_free(reactor->tids);
+	g_free(reactor->exports);
+	g_free(reactor);
+}
@@ -53,8 +53,12 @@
 
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/* wakes up metadata_refresher_main() */
+pthread_cond_t metadata_cond = PTHREAD_COND_INITIALIZER;
 GHashTable * p_disk_dict = NULL;
 GHashTable * p_server_pid_set = NULL;
+/* resident xnbd-server processes by image index, only with --resident */
+GHashTable * p_resident_dict = NULL;
 guint images_added_ever = 0;
 
 
@@ -71,9 +75,35 @@ typedef struct _t_disk_data {
 		char * target_exportname;
 	} proxy;
 
+	/*
+	 * The size of a proxied image, cached so that a client connection
+	 * does not wait for a query to the remote server. Updated by
+	 * metadata_refresher_main().
+	 */
+	struct {
+		off_t disk_size;  /* -1 if not known */
+		time_t updated;
+		guint generation;  /* incremented when invalidated */
+	} cache;
+
 	/* NOTE: Upon extension update destroy_value, copy_disk_data, mark_proxy_mode_ended and create_disk_data below, too! */
 } t_disk_data;
 
+/*
+ * With --resident, one xnbd-server per image keeps running, and receives
+ * the clients of the image through a UNIX socket (xnbd-server --handoff-fd).
+ */
+typedef struct _t_resident_server {
+	pid_t pid;
+	int handoff_fd;
+} t_resident_server;
+
+/* A client negotiated by a child, handed back to the parent with --resident */
+typedef struct _t_handback_msg {
+	guint index;
+	struct nbd_negotiate_options opts;
+} t_handback_msg;
+
 typedef struct _t_thread_data {
 	int conn_uxsock;
 	const char * xnbd_bgctl_command;
@@ -99,6 +129,12 @@ static void destroy_value(t_disk_data * p_disk_data) {
 	g_free(p_disk_data);
 }
 
+static void destroy_resident_server(t_resident_server * p_server) {
+	/* the server exits after its last client */
+	close(p_server->handoff_fd);
+	g_free(p_server);
+}
+
 #define COPY_STRING_MEMBER(FINE, MEMBER, SOURCE, TARGET)  \
 	do { \
 		if (FINE && SOURCE->MEMBER) { \
@@ -118,6 +154,7 @@ static t_disk_data * copy_disk_data(const t_disk_data * source) {
 	{
 		memset(res, 0, sizeof(t_disk_data));
 		res->index = source->index;
+		res->cache = source->cache;
 	}
 
 	COPY_STRING_MEMBER(fine, local_exportname, source, res);
@@ -192,6 +229,7 @@ static t_disk_data * create_disk_data(const char * local_exportname,
 	source.proxy.bitmap_image = (char *)bitmap_image;
 	source.proxy.control_socket_path = (char *)control_socket_path;
 	source.proxy.target_exportname = (char *)target_exportname;
+	source.cache.disk_size = -1;
 
 	return copy_disk_data(&source);
 }
@@ -215,6 +253,31 @@ static gboolean find_by_exportname(const char * key, const t_disk_data * p_disk_
 	return strcmp(p_disk_data->local_exportname, local_exportname) == 0;
 }
 
+/* Drop the cached metadata of an image, and have it queried again. The mutex must be held. */
+static void invalidate_metadata(t_disk_data * p_disk_data)
+{
+	p_disk_data->cache.disk_size = -1;
+	p_disk_data->cache.updated = 0;
+	p_disk_data->cache.generation++;
+
+	if (p_disk_data->proxy.target_host)
+		pthread_cond_signal(&metadata_cond);
+}
+
+static gboolean find_unregistered_server(gpointer key, gpointer value, gpointer user_data) {
+	(void)value;
+	(void)user_data;
+
+	return g_hash_table_find(p_disk_dict, (GHRFunc)find_by_index, key) == NULL;
+}
+
+/* Retire the resident servers of deregistered images. The mutex must be held. */
+static void retire_unregistered_servers(void)
+{
+	if (p_resident_dict)
+		g_hash_table_foreach_remove(p_resident_dict, find_unregistered_server, NULL);
+}
+
 static int add_diskimg(t_disk_data * p_disk_data)
 {
 	/* Check image access */
@@ -235,6 +298,7 @@ static int add_diskimg(t_disk_data * p_disk_data)
 	{
 		p_disk_data->index = images_added_ever++;
 		g_hash_table_insert(p_disk_dict, p_disk_data->local_exportname, p_disk_data);
+		invalidate_metadata(p_disk_data);
 	}
 	pthread_mutex_unlock(&mutex);
 	return res;
@@ -248,6 +312,7 @@ static int del_diskimg_by_index(int num)
 	if (num >= 0) {
 		pthread_mutex_lock(&mutex);
 		removed_count = g_hash_table_foreach_remove(p_disk_dict, (GHRFunc)find_by_index, GUINT_TO_POINTER((guint)num));
+		retire_unregistered_servers();
 		pthread_mutex_unlock(&mutex);
 	}
 
@@ -258,6 +323,7 @@ static int del_diskimg_by_file(const char * filename)
 {
 	pthread_mutex_lock(&mutex);
 	const guint removed_count = g_hash_table_foreach_remove(p_disk_dict, (GHRFunc)find_by_file, (gpointer)filename);
+	retire_unregistered_servers();
 	pthread_mutex_unlock(&mutex);
 
 	return (removed_count > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -267,6 +333,7 @@ static int del_diskimg_by_exportname(const char * local_exportname)
 {
 	pthread_mutex_lock(&mutex);
 	const guint removed_count = g_hash_table_foreach_remove(p_disk_dict, (GHRFunc)find_by_exportname, (gpointer)local_exportname);
+	retire_unregistered_servers();
 	pthread_mutex_unlock(&mutex);
 
 	return (removed_count > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -302,6 +369,7 @@ static void mark_proxy_mode_ended(const char * local_exportname)
 		G_FREE_SET_NULL(p_disk_data->proxy.bitmap_image);
 		G_FREE_SET_NULL(p_disk_data->proxy.control_socket_path);
 		G_FREE_SET_NULL(p_disk_data->proxy.target_exportname);
+		invalidate_metadata(p_disk_data);
 	}
 	pthread_mutex_unlock(&mutex);
 }
@@ -319,10 +387,17 @@ static void update_proxy_settings(const char * local_exportname, const char * ho
 		G_FREE_SET_DUPED(p_disk_data->proxy.target_host, host);
 		G_FREE_SET_DUPED(p_disk_data->proxy.target_port, port);
 		G_FREE_SET_DUPED(p_disk_data->proxy.target_exportname, target_exportname);
+		invalidate_metadata(p_disk_data);
 	}
 	pthread_mutex_unlock(&mutex);
 }
 
+static gboolean find_resident_server_by_pid(gpointer key, const t_resident_server * p_server, gpointer user_data) {
+	(void)key;
+
+	return p_server->pid == (pid_t)GPOINTER_TO_INT(user_data);
+}
+
 static gboolean waitpid_nohang_ghrfunc(gpointer key, gpointer value, gpointer user_data) {
 	(void)value;
 	const pid_t server_pid = (pid_t)GPOINTER_TO_INT(key);
@@ -339,6 +414,9 @@ static gboolean waitpid_nohang_ghrfunc(gpointer key, gpointer value, gpointer us
 	pthread_mutex_lock(&mutex);
 	(*p_child_process_count)--;
 	info("child_process_count-- : %d  (xnbd-server terminated)", (*p_child_process_count));
+	/* the next client of the image starts a new one */
+	if (p_resident_dict)
+		g_hash_table_foreach_remove(p_resident_dict, (GHRFunc)find_resident_server_by_pid, GINT_TO_POINTER(server_pid));
 	pthread_mutex_unlock(&mutex);
 
 	return REMOVE_FROM_SET;
@@ -1419,9 +1497,14 @@ struct exec_params {
 	const char *proxy_max_buf_size_str;
 };
 
-static void exec_xnbd_server(struct exec_params *params, char *fd_num, const t_disk_data * disk_data)
+/*
+ * fd_num is a client negotiated with opts, or a handoff socket of a
+ * resident server if opts is NULL.
+ */
+static void exec_xnbd_server(struct exec_params *params, char *fd_num, const t_disk_data * disk_data,
+		const struct nbd_negotiate_options *opts)
 {
-	char *args[8 + 4 + 2 + 4];
+	char *args[8 + 4 + 2 + 5 + 1];
 	int i = 0;
 	args[i] = (char *)params->binpath;
 
@@ -1435,8 +1518,17 @@ static void exec_xnbd_server(struct exec_params *params, char *fd_num, const t_d
 		args[++i] = (char *)"--readonly";
 	if (params->syslog)
 		args[++i] = (char *)"--syslog";
-	args[++i] = (char *)"--connected-fd";
-	args[++i] = fd_num;
+	if (opts) {
+		args[++i] = (char *)"--connected-fd";
+		args[++i] = fd_num;
+		if (opts->structured_reply)
+			args[++i] = (char *)"--structured-reply";
+		if (opts->base_allocation)
+			args[++i] = (char *)"--block-status";
+	} else {
+		args[++i] = (char *)"--handoff-fd";
+		args[++i] = fd_num;
+	}
 
 	if (disk_data->proxy.target_host)
 	{
@@ -1470,6 +1562,88 @@ static void exec_xnbd_server(struct exec_params *params, char *fd_num, const t_d
 	execvp_or_abort((const char * const *)args);
 }
 
+/* Start the resident server of an image. The mutex must be held. */
+static t_resident_server * start_resident_server(struct exec_params *params, const t_disk_data * disk_data,
+		const sigset_t * sigset, int * p_child_process_count)
+{
+	int sockfds[2];
+
+	/* a message is received at once, with the descriptor attached to it */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockfds) == -1) {
+		warn("socketpair : %m");
+		return NULL;
+	}
+
+	char *fd_num;
+	if (asprintf(&fd_num, "%d", sockfds[1]) == -1) {
+		close(sockfds[0]);
+		close(sockfds[1]);
+		return NULL;
+	}
+
+	const pid_t pid = fork();
+	if (pid == 0) {
+		/* child */
+		if (sigprocmask(SIG_UNBLOCK, sigset, NULL) == -1) {
+			warn("sigprocmask() : %m");
+			_exit(EXIT_FAILURE);
+		}
+
+		/* the listening sockets, and the handoff sockets of the other images */
+		const long open_max = sysconf(_SC_OPEN_MAX);
+		for (int fd = 3; fd < open_max; fd++)
+			if (fd != sockfds[1])
+				close(fd);
+
+		exec_xnbd_server(params, fd_num, disk_data, NULL);
+	}
+
+	free(fd_num);
+	close(sockfds[1]);
+
+	if (pid == -1) {
+		warn("fork : %m");
+		close(sockfds[0]);
+		return NULL;
+	}
+
+	g_hash_table_insert(p_server_pid_set, GINT_TO_POINTER(pid), NULL);
+	(*p_child_process_count)++;
+	info("child_process_count++ : %d  (forked to execute resident xnbd-server for %s)",
+			(*p_child_process_count), disk_data->local_exportname);
+
+	t_resident_server * const p_server = g_new0(t_resident_server, 1);
+	p_server->pid = pid;
+	p_server->handoff_fd = sockfds[0];
+	g_hash_table_insert(p_resident_dict, GUINT_TO_POINTER(disk_data->index), p_server);
+
+	return p_server;
+}
+
+/* Pass a client handed back by a child to the resident server of the image, starting one if necessary */
+static void hand_off_to_resident_server(struct exec_params *params, int conn_sockfd, const t_handback_msg * msg,
+		const sigset_t * sigset, int * p_child_process_count)
+{
+	pthread_mutex_lock(&mutex);
+
+	t_resident_server * p_server = g_hash_table_lookup(p_resident_dict, GUINT_TO_POINTER(msg->index));
+	if (! p_server) {
+		const t_disk_data * const disk_data = g_hash_table_find(p_disk_dict, (GHRFunc)find_by_index, GUINT_TO_POINTER(msg->index));
+		if (disk_data)
+			p_server = start_resident_server(params, disk_data, sigset, p_child_process_count);
+		else
+			warn("image (index %u) deregistered during negotiation", msg->index);
+	}
+
+	/* do not wait for a busy server here */
+	if (p_server) {
+		if (unix_send_fd_with_data(p_server->handoff_fd, conn_sockfd, &msg->opts, sizeof(msg->opts), MSG_DONTWAIT | MSG_NOSIGNAL) <= 0)
+			warn("cannot hand off a client to xnbd-server (pid %ld)", (long)p_server->pid);
+	}
+
+	pthread_mutex_unlock(&mutex);
+}
+
 static bool command_available(const char * command) {
 	const pid_t pid = fork();
 	if (pid == 0) {
@@ -1556,6 +1730,194 @@ static void query_remote_disk_size(off_t * p_disk_size_bytes, const char * host,
 }
 
 
+/* the cached metadata of a proxied image is queried again after this period (seconds) */
+#define XNBD_WRAPPER_METADATA_REFRESH_INTERVAL  60
+
+typedef struct _t_metadata_query {
+	guint index;
+	guint generation;
+	char * target_host;
+	char * target_port;
+	char * target_exportname;
+	off_t disk_size;
+} t_metadata_query;
+
+typedef struct _t_metadata_state {
+	time_t now;
+	GList * queries;
+} t_metadata_state;
+
+static void collect_stale_metadata_ghfunc(gpointer key, const t_disk_data * p_disk_data, t_metadata_state * p_state) {
+	(void)key;
+
+	if (! p_disk_data->proxy.target_host)
+		return;
+
+	if (p_disk_data->cache.disk_size >= 0 &&
+			p_state->now - p_disk_data->cache.updated < XNBD_WRAPPER_METADATA_REFRESH_INTERVAL)
+		return;
+
+	t_metadata_query * const query = g_new0(t_metadata_query, 1);
+	query->index = p_disk_data->index;
+	query->generation = p_disk_data->cache.generation;
+	query->target_host = g_strdup(p_disk_data->proxy.target_host);
+	query->target_port = g_strdup(p_disk_data->proxy.target_port);
+	query->target_exportname = g_strdup(p_disk_data->proxy.target_exportname);
+	query->disk_size = -1;
+
+	p_state->queries = g_list_prepend(p_state->queries, query);
+}
+
+/*
+ * Keep the sizes of proxied images cached. Remote servers are queried without
+ * the mutex held, so a slow or unreachable remote server delays neither new
+ * clients nor the control socket. If a query fails, the old size is kept.
+ */
+static void *metadata_refresher_main(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&mutex);
+
+	for (;;) {
+		t_metadata_state state = { .now = time(NULL), .queries = NULL };
+		g_hash_table_foreach(p_disk_dict, (GHFunc)collect_stale_metadata_ghfunc, &state);
+
+		pthread_mutex_unlock(&mutex);
+
+		for (GList * walker = state.queries; walker; walker = walker->next) {
+			t_metadata_query * const query = walker->data;
+			query_remote_disk_size(&query->disk_size, query->target_host, query->target_port, query->target_exportname);
+		}
+
+		pthread_mutex_lock(&mutex);
+
+		for (GList * walker = state.queries; walker; walker = walker->next) {
+			t_metadata_query * const query = walker->data;
+			t_disk_data * const p_disk_data = g_hash_table_find(p_disk_dict, (GHRFunc)find_by_index, GUINT_TO_POINTER(query->index));
+
+			/* unregistered or reconnected in the meantime */
+			if (p_disk_data && p_disk_data->cache.generation == query->generation && query->disk_size >= 0) {
+				p_disk_data->cache.disk_size = query->disk_size;
+				p_disk_data->cache.updated = state.now;
+			}
+
+			g_free(query->target_host);
+			g_free(query->target_port);
+			g_free(query->target_exportname);
+			g_free(query);
+		}
+		g_list_free(state.queries);
+
+		struct timespec deadline = { .tv_sec = time(NULL) + XNBD_WRAPPER_METADATA_REFRESH_INTERVAL, .tv_nsec = 0 };
+		pthread_cond_timedwait(&metadata_cond, &mutex, &deadline);
+	}
+
+	return NULL;
+}
+
+
+/* the exports of the wrapper, looked up in the negotiation with a client */
+struct wrapper_exports {
+	const struct exec_params *params;
+	/* xnbd-server instances run with --target */
+	int target_mode;
+};
+
+static int wrapper_lookup_export(const char *name, struct nbd_export_info *einfo, void *arg)
+{
+	const struct wrapper_exports *exports = arg;
+
+	t_disk_data * const disk_data = get_disk_data_for(name);
+	if (! disk_data)
+		return -1;
+
+	off_t disk_size_bytes = -1;
+
+	if (disk_data->proxy.target_host) {
+		/* proxy mode, forward original remote disk size */
+		disk_size_bytes = disk_data->cache.disk_size;
+
+		/* not yet cached by metadata_refresher_main() */
+		if (disk_size_bytes < 0)
+			query_remote_disk_size(&disk_size_bytes,
+					disk_data->proxy.target_host,
+					disk_data->proxy.target_port,
+					disk_data->proxy.target_exportname);
+
+		if (disk_size_bytes < 0)
+			warn("could query remote disk size for image: %s", disk_data->disk_file_name);
+	} else {
+		/* target mode, stat local file */
+		const int fd = open(disk_data->disk_file_name, O_RDONLY);
+		if (fd == -1)
+			warn("stat failed: %s", disk_data->disk_file_name);
+		else {
+			disk_size_bytes = get_disksize(fd);
+			close(fd);
+		}
+	}
+
+	if (disk_size_bytes < 0) {
+		destroy_value(disk_data);
+		return -1;
+	}
+
+	info("disk_size_bytes: %jd", disk_size_bytes);
+
+	/*
+	 * Each connection is served by a separate
+	 * xnbd-server. Target instances share the disk
+	 * image, but proxy and cow-target instances
+	 * have their own cache and cow layer.
+	 */
+	uint32_t export_flags = 0;
+	if (! disk_data->proxy.target_host && (exports->target_mode || exports->params->readonly))
+		export_flags |= NBD_FLAG_CAN_MULTI_CONN;
+
+	/* the same as xnbd_get_export_flags() of xnbd-server */
+	if (exports->params->readonly)
+		export_flags |= NBD_FLAG_READ_ONLY;
+	else {
+		export_flags |= NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_SEND_FUA;
+		if (! disk_data->proxy.target_host && exports->target_mode)
+			export_flags |= NBD_FLAG_SEND_FAST_ZERO;
+	}
+
+	einfo->size  = disk_size_bytes;
+	einfo->flags = export_flags;
+
+	/* the same as xnbd_get_export_info() of xnbd-server */
+	einfo->min_block  = 1;
+	einfo->pref_block = CBLOCKSIZE;
+	einfo->max_block  = disk_data->proxy.target_host ? XNBD_PROXY_MAX_REQUEST_SIZE : XNBD_MAX_REQUEST_SIZE;
+
+	destroy_value(disk_data);
+
+	return 0;
+}
+
+static char **wrapper_list_exports(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&mutex);
+
+	char **names = g_new0(char *, g_hash_table_size(p_disk_dict) + 1);
+	guint i = 0;
+
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, p_disk_dict);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		names[i++] = g_strdup(key);
+
+	pthread_mutex_unlock(&mutex);
+
+	return names;
+}
+
+
 static const char help_string[] =
 	"\n\n"
 	"Usage: \n"
@@ -1580,6 +1942,8 @@ static const char help_string[] =
 	"                 set the limit of the request queue size per xnbd-server process (default: 0, no limit)\n"
 	"  --max-buf-size SIZE (bytes)\n"
 	"                 set the limit of internal buffer usage per xnbd-server process (default: 0, no limit)\n"
+	"  --resident     keep one xnbd-server process per image running for all its clients,\n"
+	"                 instead of executing one per client (not with --cow)\n"
 	"\n"
 	"Examples: \n"
 	"  xnbd-wrapper --imgfile /data/disk1\n"
@@ -1603,6 +1967,8 @@ int main(int argc, char **argv) {
 	const char default_server_target[] = "--target";
 	const char *server_target = NULL;
 	int daemonize = 0;
+	int resident = 0;
+	int handback_fds[2] = { -1, -1 };
 	int syslog = 0;
 	const char *logpath = NULL;
 	const char *dbpath = "/var/lib/xnbd/xnbd.state";
@@ -1619,7 +1985,7 @@ int main(int argc, char **argv) {
 	ssize_t rbytes;
 
 	const int MAX_EVENTS = 8;
-	struct epoll_event sigfd_ev, uxfd_ev, tcpfd_ev, ep_events[MAX_EVENTS];
+	struct epoll_event sigfd_ev, uxfd_ev, tcpfd_ev, hbfd_ev, ep_events[MAX_EVENTS];
 	int epoll_fd;
 
 	set_process_name("xnbd-wrapper");
@@ -1642,6 +2008,7 @@ int main(int argc, char **argv) {
 		{"help",        no_argument,       NULL, 'h'},
 		{"max-queue-size", required_argument, NULL, 'Q'},
 		{"max-buf-size",   required_argument, NULL, 'B'},
+		{"resident",    no_argument,       NULL, 'R'},
 		{ NULL,         0,                 NULL,  0 }
 	};
 
@@ -1683,6 +2050,9 @@ int main(int argc, char **argv) {
 			case 'd':
 				daemonize = 1;
 				break;
+			case 'R':
+				resident = 1;
+				break;
 			case 'l':
 				laddr = optarg;
 				break;
@@ -1789,6 +2159,10 @@ int main(int argc, char **argv) {
 
 	exec_srv_params.target_mode = server_target;
 
+	/* a resident cow-target server would keep the changes of a client for the next one */
+	if (resident && strcmp(server_target, default_server_target) != 0)
+		err("--resident cannot be used with --cow");
+
 	load_database_file_or_abort(dbpath);
 
         if (daemonize)
@@ -1842,6 +2216,27 @@ int main(int argc, char **argv) {
 		err("epoll_ctl : %m");
 	}
 
+	/* add the socket that children hand negotiated clients back through */
+	if (resident) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, handback_fds) == -1)
+			err("socketpair : %m");
+
+		p_resident_dict = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)destroy_resident_server);
+
+		memset(&hbfd_ev, 0, sizeof(hbfd_ev));
+		hbfd_ev.events = POLLIN;
+		hbfd_ev.data.fd = handback_fds[0];
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handback_fds[0], &hbfd_ev) == -1) {
+			err("epoll_ctl : %m");
+		}
+	}
+
+	/* signals are blocked in this thread, too */
+	if (pthread_create(&thread, NULL, metadata_refresher_main, NULL))
+		err("pthread_create : %m");
+	if (pthread_detach(thread))
+		warn("pthread_detach : %m");
+
 	for (;;) {
 		int num_of_fds = epoll_wait(epoll_fd, ep_events, MAX_EVENTS, -1);
 		if (num_of_fds == -1) {
@@ -1871,6 +2266,15 @@ int main(int argc, char **argv) {
 				} else if (sfd_siginfo.ssi_signo == SIGCHLD) {
 					g_hash_table_foreach_remove(p_server_pid_set, waitpid_nohang_ghrfunc, &child_process_count);
 				}
+			} else if (resident && ep_events[c_ev].data.fd == handback_fds[0]) {
+				/* a client negotiated by a child */
+				t_handback_msg msg;
+				conn_sockfd = unix_recv_fd_with_data(handback_fds[0], &msg, sizeof(msg));
+				if (conn_sockfd == -1)
+					continue;
+
+				hand_off_to_resident_server(&exec_srv_params, conn_sockfd, &msg, &sigset, &child_process_count);
+				close(conn_sockfd);
 			} else if (ep_events[c_ev].data.fd == ux_sockfd) {
 				/* unix socket */
 				const int conn_uxsock = accept(ux_sockfd, NULL, NULL);
@@ -1917,7 +2321,10 @@ int main(int argc, char **argv) {
 				}
 
 
+				/* the child uses the mutex; do not fork while another thread holds it */
+				pthread_mutex_lock(&mutex);
 				pid = fork();
+				pthread_mutex_unlock(&mutex);
 				if (pid == 0) {
 					/* child */
 
@@ -1930,8 +2337,24 @@ int main(int argc, char **argv) {
 					close(epoll_fd);
 					close(ux_sockfd);
 					close(sigfd);
-
-					if ((requested_img = nbd_negotiate_v2_server_phase0(conn_sockfd)) == NULL) {
+					if (resident)
+						close(handback_fds[0]);
+
+					/* all the modes of xnbd-server support structured replies and block status */
+					struct nbd_negotiate_options opts = { .structured_reply = 1, .base_allocation = 1 };
+
+					struct wrapper_exports exports = {
+						.params = &exec_srv_params,
+						.target_mode = (strcmp(exec_srv_params.target_mode, default_server_target) == 0),
+					};
+					struct nbd_export_ops ops = {
+						.lookup = wrapper_lookup_export,
+						.list   = wrapper_list_exports,
+						.arg    = &exports,
+					};
+
+					/* INFO and LIST are answered here without executing xnbd-server */
+					if ((requested_img = nbd_negotiate_v2_server_side(conn_sockfd, &opts, &ops)) == NULL) {
 						warn("requested_img: NULL");
 						close(conn_sockfd);
 						_exit(EXIT_FAILURE);
@@ -1945,43 +2368,15 @@ int main(int argc, char **argv) {
 						_exit(EXIT_FAILURE);
 					}
 
-					off_t disk_size_bytes = -1;
-
-					if (disk_data->proxy.target_host) {
-						/* proxy mode, forward original remote disk size */
-						query_remote_disk_size(&disk_size_bytes,
-								disk_data->proxy.target_host,
-								disk_data->proxy.target_port,
-								disk_data->proxy.target_exportname);
-
-						if (disk_size_bytes < 0) {
-							warn("could query remote disk size for image: %s", disk_data->disk_file_name);
-							if(close(conn_sockfd))
-								warn("close(p1.1)");
+					if (resident) {
+						/* the parent passes the client to the resident server of the image */
+						const t_handback_msg msg = { .index = disk_data->index, .opts = opts };
+						if (unix_send_fd_with_data(handback_fds[1], conn_sockfd, &msg, sizeof(msg), 0) <= 0)
 							_exit(EXIT_FAILURE);
-						}
-					} else {
-						/* target mode, stat local file */
-						const int fd = open(disk_data->disk_file_name, O_RDONLY);
-						if (fd == -1) {
-							warn("stat failed: %s", disk_data->disk_file_name);
-							if(close(conn_sockfd))
-								warn("close(p1.2)");
-							_exit(EXIT_FAILURE);
-						}
-						disk_size_bytes = get_disksize(fd);
-						close(fd);
-					}
-
-					info("disk_size_bytes: %jd", disk_size_bytes);
-
-					if (nbd_negotiate_v2_server_phase1(conn_sockfd, disk_size_bytes, 0)) {
-						if(close(conn_sockfd))
-							warn("close(p2)");
-						_exit(EXIT_FAILURE);
+						_exit(EXIT_SUCCESS);
 					}
 
-					exec_xnbd_server(&exec_srv_params, fd_num, disk_data);
+					exec_xnbd_server(&exec_srv_params, fd_num, disk_data, &opts);
 
 				} else if (pid > 0) {
 					/* parent */